@@ -0,0 +1,219 @@
+/* Copyright (c) 2017, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rdns.h"
+#include "dns_private.h"
+#include "cache.h"
+#include "util.h"
+
+struct rdns_cache_entry {
+	char *key; /**< type and lowercased name */
+	unsigned int keylen;
+	time_t expire;
+	enum dns_rcode code;
+	bool authenticated;
+	struct rdns_reply_entry *entries;
+	struct rdns_cache_entry *prev, *next; /**< LRU list, the oldest is the first */
+	UT_hash_handle hh;
+};
+
+struct rdns_cache {
+	struct rdns_cache_entry *entries;
+	struct rdns_cache_entry *lru;
+	unsigned int nelts;
+	unsigned int max_elts;
+	unsigned int max_ttl;
+	unsigned int negative_ttl;
+};
+
+static void
+rdns_cache_remove (struct rdns_cache *cache, struct rdns_cache_entry *entry)
+{
+	HASH_DEL (cache->entries, entry);
+	DL_DELETE (cache->lru, entry);
+	cache->nelts --;
+	rdns_reply_entries_free (entry->entries);
+	free (entry->key);
+	free (entry);
+}
+
+struct rdns_cache *
+rdns_cache_new (unsigned int max_elts, unsigned int max_ttl,
+		unsigned int negative_ttl)
+{
+	struct rdns_cache *cache;
+
+	cache = calloc (1, sizeof (*cache));
+
+	if (cache != NULL) {
+		cache->max_elts = max_elts;
+		cache->max_ttl = max_ttl;
+		cache->negative_ttl = negative_ttl;
+	}
+
+	return cache;
+}
+
+bool
+rdns_cache_lookup (struct rdns_cache *cache, struct rdns_request *req)
+{
+	struct rdns_cache_entry *entry;
+	struct rdns_reply *rep;
+	unsigned int keylen;
+	char *key;
+	time_t now;
+
+	if (req->qcount != 1) {
+		return false;
+	}
+
+	key = rdns_request_key (req, &keylen);
+
+	if (key == NULL) {
+		return false;
+	}
+
+	HASH_FIND (hh, cache->entries, key, keylen, entry);
+	free (key);
+
+	if (entry == NULL) {
+		return false;
+	}
+
+	now = time (NULL);
+
+	if (entry->expire <= now) {
+		rdns_cache_remove (cache, entry);
+
+		return false;
+	}
+
+	rep = malloc (sizeof (*rep));
+
+	if (rep == NULL) {
+		return false;
+	}
+
+	rep->request = req;
+	rep->resolver = req->resolver;
+	rep->requested_name = NULL;
+	rep->code = entry->code;
+	rep->authenticated = entry->authenticated;
+	/* Callers should see the remaining TTL */
+	rep->entries = rdns_reply_entries_copy (entry->entries,
+			entry->expire - now);
+	req->reply = rep;
+
+	/* Move to the end of LRU list */
+	DL_DELETE (cache->lru, entry);
+	DL_APPEND (cache->lru, entry);
+
+	return true;
+}
+
+void
+rdns_cache_insert (struct rdns_cache *cache, struct rdns_request *req,
+		struct rdns_reply *rep)
+{
+	struct rdns_cache_entry *entry;
+	struct rdns_reply_entry *cur;
+	unsigned int keylen;
+	int64_t ttl;
+	char *key;
+
+	if (req->qcount != 1 || cache->max_elts == 0) {
+		return;
+	}
+
+	if (rep->code == RDNS_RC_NOERROR) {
+		ttl = cache->max_ttl;
+
+		DL_FOREACH (rep->entries, cur) {
+			if (cur->ttl < ttl) {
+				ttl = cur->ttl;
+			}
+		}
+	}
+	else if (rep->code == RDNS_RC_NXDOMAIN || rep->code == RDNS_RC_NOREC) {
+		ttl = cache->negative_ttl;
+	}
+	else {
+		/* Errors are not cached */
+		return;
+	}
+
+	if (ttl <= 0) {
+		return;
+	}
+
+	key = rdns_request_key (req, &keylen);
+
+	if (key == NULL) {
+		return;
+	}
+
+	HASH_FIND (hh, cache->entries, key, keylen, entry);
+
+	if (entry != NULL) {
+		rdns_cache_remove (cache, entry);
+	}
+	else if (cache->nelts >= cache->max_elts && cache->lru) {
+		rdns_cache_remove (cache, cache->lru);
+	}
+
+	entry = calloc (1, sizeof (*entry));
+
+	if (entry == NULL) {
+		free (key);
+		return;
+	}
+
+	entry->key = key;
+	entry->keylen = keylen;
+	entry->expire = time (NULL) + ttl;
+	entry->code = rep->code;
+	entry->authenticated = rep->authenticated;
+	entry->entries = rdns_reply_entries_copy (rep->entries, -1);
+
+	HASH_ADD_KEYPTR (hh, cache->entries, entry->key, entry->keylen, entry);
+	DL_APPEND (cache->lru, entry);
+	cache->nelts ++;
+}
+
+void
+rdns_cache_free (struct rdns_cache *cache)
+{
+	struct rdns_cache_entry *entry, *tmp;
+
+	if (cache != NULL) {
+		DL_FOREACH_SAFE (cache->lru, entry, tmp) {
+			rdns_cache_remove (cache, entry);
+		}
+
+		free (cache);
+	}
+}
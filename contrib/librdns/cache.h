@@ -0,0 +1,51 @@
+/* Copyright (c) 2017, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include "dns_private.h"
+
+/**
+ * Create cache of replies
+ * @param max_elts maximum number of cached replies
+ * @param max_ttl upper limit for TTL of positive replies
+ * @param negative_ttl TTL of NXDOMAIN and empty replies, 0 to disable
+ */
+struct rdns_cache *rdns_cache_new (unsigned int max_elts,
+		unsigned int max_ttl, unsigned int negative_ttl);
+
+/**
+ * Set a copy of the cached reply as `req->reply`
+ * @return true if a reply has been found
+ */
+bool rdns_cache_lookup (struct rdns_cache *cache, struct rdns_request *req);
+
+/**
+ * Store reply received for a request
+ */
+void rdns_cache_insert (struct rdns_cache *cache, struct rdns_request *req,
+		struct rdns_reply *rep);
+
+void rdns_cache_free (struct rdns_cache *cache);
+
+#endif /* CACHE_H_ */
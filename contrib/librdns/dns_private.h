@@ -74,7 +74,9 @@ struct rdns_request {
 		RDNS_REQUEST_REGISTERED = 1,
 		RDNS_REQUEST_WAIT_SEND,
 		RDNS_REQUEST_WAIT_REPLY,
-		RDNS_REQUEST_REPLIED
+		RDNS_REQUEST_REPLIED,
+		RDNS_REQUEST_CACHED, /**< reply from cache waits to be delivered */
+		RDNS_REQUEST_WAIT_LEADER /**< waits for reply of the same request */
 	} state;
 
 	uint8_t *packet;
@@ -85,12 +87,21 @@ struct rdns_request {
 	void *arg;
 
 	void *async_event;
+	double sent; /**< monotonic time of the last transmission */
 
 #if defined(TWEETNACL) || defined(USE_RSPAMD_CRYPTOBOX)
 	void *curve_plugin_data;
 #endif
 
+	/* Identical requests in flight are sent once */
+	char *key; /**< set while request is in resolver's inflight hash */
+	unsigned int keylen;
+	struct rdns_request *leader; /**< request sent for this one */
+	struct rdns_request *followers; /**< requests waiting for this reply */
+	struct rdns_request *prev, *next; /**< list of followers */
+
 	UT_hash_handle hh;
+	UT_hash_handle hh_inflight;
 	ref_entry_t ref;
 };
 
@@ -109,6 +120,8 @@ struct rdns_io_channel {
 };
 
 
+struct rdns_cache;
+
 struct rdns_resolver {
 	struct rdns_server *servers;
 	struct rdns_io_channel *io_channels; /**< hash of io chains indexed by socket        */
@@ -116,6 +129,8 @@ struct rdns_resolver {
 	void *periodic; /** periodic event for resolver */
 	struct rdns_upstream_context *ups;
 	struct rdns_plugin *curve_plugin;
+	struct rdns_cache *cache; /**< cache of replies, NULL if disabled */
+	struct rdns_request *inflight; /**< sent requests indexed by name and type */
 
 	rdns_log_function logger;
 	void *log_data;
@@ -165,7 +165,8 @@ struct rdns_upstream_context {
 	struct rdns_upstream_elt* (*select_retransmit)(const char *name,
 			size_t len, void *ups_data);
 	unsigned int (*count)(void *ups_data);
-	void (*ok)(struct rdns_upstream_elt *elt, void *ups_data);
+	/* latency is the time between the last transmission and the reply */
+	void (*ok)(struct rdns_upstream_elt *elt, double latency, void *ups_data);
 	void (*fail)(struct rdns_upstream_elt *elt, void *ups_data);
 };
 
@@ -306,6 +307,17 @@ void rdns_resolver_set_upstream_lib (struct rdns_resolver *resolver,
 		struct rdns_upstream_context *ups_ctx,
 		void *ups_data);
 
+/**
+ * Enable cache of replies for single name requests, positive replies are
+ * cached for their minimal TTL
+ * @param resolver resolver object
+ * @param max_elts maximum number of cached replies, 0 disables cache
+ * @param max_ttl upper limit for TTL of positive replies
+ * @param negative_ttl time to cache NXDOMAIN and empty replies
+ */
+void rdns_resolver_set_cache (struct rdns_resolver *resolver,
+		unsigned int max_elts, unsigned int max_ttl, unsigned int negative_ttl);
+
 /**
  * Set maximum number of dns requests to be sent to a socket to be refreshed
  * @param resolver resolver object
@@ -402,6 +414,21 @@ void rdns_request_release (struct rdns_request *req);
  */
 bool rdns_request_has_type (struct rdns_request *req, enum rdns_request_type type);
 
+/**
+ * Check whether a request is answered from cache, valid until callback is called
+ * @param req request object
+ * @return true if request has not been sent
+ */
+bool rdns_request_is_cached (struct rdns_request *req);
+
+/**
+ * Check whether a request waits for reply of an identical request sent before,
+ * valid until callback is called
+ * @param req request object
+ * @return true if request has not been sent
+ */
+bool rdns_request_is_coalesced (struct rdns_request *req);
+
 /**
  * Return requested name for a request
  * @param req request object
@@ -40,6 +40,7 @@
 #include "parse.h"
 #include "logger.h"
 #include "compression.h"
+#include "cache.h"
 
 static int
 rdns_send_request (struct rdns_request *req, int fd, bool new_req)
@@ -67,6 +68,8 @@ rdns_send_request (struct rdns_request *req, int fd, bool new_req)
 		}
 	}
 
+	req->sent = rdns_get_ticks ();
+
 	if (resolver->curve_plugin == NULL) {
 		r = send (fd, req->packet, req->pos, 0);
 	}
@@ -126,6 +129,171 @@ rdns_make_reply (struct rdns_request *req, enum dns_rcode rcode)
 	return rep;
 }
 
+/*
+ * Calls callback of the request and callbacks of identical requests waiting
+ * for this reply, each of them gets its own copy of reply
+ */
+static void
+rdns_request_finish (struct rdns_request *req, struct rdns_reply *rep)
+{
+	struct rdns_request *cur;
+	struct rdns_reply *frep;
+
+	req->state = RDNS_REQUEST_REPLIED;
+	rdns_request_remove_inflight (req);
+	/* Callbacks can release any of these requests */
+	REF_RETAIN (req);
+
+	if (req->func) {
+		req->func (rep, req->arg);
+	}
+
+	REF_RELEASE (req);
+
+	while ((cur = req->followers) != NULL) {
+		DL_DELETE (req->followers, cur);
+		cur->leader = NULL;
+		rdns_request_unschedule (cur);
+		frep = rdns_make_reply (cur, rep->code);
+
+		if (frep != NULL) {
+			frep->authenticated = rep->authenticated;
+			frep->entries = rdns_reply_entries_copy (rep->entries, -1);
+		}
+
+		cur->state = RDNS_REQUEST_REPLIED;
+		cur->func (frep, cur->arg);
+		REF_RELEASE (cur);
+	}
+
+	REF_RELEASE (req);
+}
+
+/*
+ * Makes packet of a request and sends it to a selected server, the request
+ * becomes a leader for identical requests
+ */
+static bool
+rdns_request_send_new (struct rdns_request *req, unsigned int tlen)
+{
+	struct rdns_resolver *resolver = req->resolver;
+	struct rdns_server *serv;
+	struct rdns_compression_entry *comp = NULL;
+	const char *cur_name;
+	unsigned int i, clen;
+	int r, type;
+
+	rdns_allocate_packet (req, tlen);
+	rdns_make_dns_header (req, req->qcount);
+
+	for (i = 0; i < req->qcount; i ++) {
+		cur_name = req->requested_names[i].name;
+		clen = req->requested_names[i].len;
+		type = req->requested_names[i].type;
+		if (req->qcount > 1) {
+			if (!rdns_add_rr (req, cur_name, clen, type, &comp)) {
+				rnds_compression_free (comp);
+				return false;
+			}
+		}
+		else {
+			if (!rdns_add_rr (req, cur_name, clen, type, NULL)) {
+				rnds_compression_free (comp);
+				return false;
+			}
+		}
+	}
+
+	rnds_compression_free (comp);
+
+	/* Add EDNS RR */
+	rdns_add_edns0 (req);
+
+	req->state = RDNS_REQUEST_NEW;
+
+	if (resolver->ups) {
+		struct rdns_upstream_elt *elt;
+
+		elt = resolver->ups->select (req->requested_names[0].name,
+				req->requested_names[0].len, resolver->ups->data);
+
+		if (elt) {
+			serv = elt->server;
+			serv->ups_elt = elt;
+		}
+		else {
+			UPSTREAM_SELECT_ROUND_ROBIN (resolver->servers, serv);
+		}
+	}
+	else {
+		UPSTREAM_SELECT_ROUND_ROBIN (resolver->servers, serv);
+	}
+
+	if (serv == NULL) {
+		rdns_warn ("cannot find suitable server for request");
+		return false;
+	}
+
+	/* Select random IO channel */
+	req->io = serv->io_channels[ottery_rand_uint32 () % serv->io_cnt];
+	req->io->uses ++;
+
+	/* Now send request to server */
+	r = rdns_send_request (req, req->io->sock, true);
+
+	if (r == -1) {
+		/* IO channel is not retained yet */
+		req->io = NULL;
+		return false;
+	}
+
+	REF_RETAIN (req->io);
+	REF_RETAIN (req->resolver);
+	rdns_request_add_inflight (req);
+
+	return true;
+}
+
+/*
+ * Request waiting for a leader that has been freed without reply is sent on
+ * its own or waits for another such request that has been sent already
+ */
+static void
+rdns_request_reissue (struct rdns_request *req)
+{
+	struct rdns_resolver *resolver = req->resolver;
+	struct rdns_request *leader;
+	struct rdns_reply *rep;
+	unsigned int i, tlen = 0;
+
+	req->async->del_timer (req->async->data, req->async_event);
+	req->async_event = NULL;
+	leader = rdns_request_find_inflight (resolver, req);
+
+	if (leader != NULL) {
+		req->leader = leader;
+		DL_APPEND (leader->followers, req);
+		req->async_event = req->async->add_timer (req->async->data,
+				req->timeout, req);
+
+		return;
+	}
+
+	for (i = 0; i < req->qcount; i ++) {
+		tlen += req->requested_names[i].len;
+	}
+
+	rdns_debug ("resend request for %s as its leader has been freed",
+			req->requested_names[0].name);
+
+	if (!rdns_request_send_new (req, tlen)) {
+		rep = rdns_make_reply (req, RDNS_RC_NETERR);
+		req->state = RDNS_REQUEST_REPLIED;
+		req->func (rep, req->arg);
+		REF_RELEASE (req);
+	}
+}
+
 static struct rdns_request *
 rdns_find_dns_request (uint8_t *in, struct rdns_io_channel *ioc)
 {
@@ -273,13 +441,17 @@ rdns_process_read (int fd, void *arg)
 
 			if (req->resolver->ups && req->io->srv->ups_elt) {
 				req->resolver->ups->ok (req->io->srv->ups_elt,
+						rdns_get_ticks () - req->sent,
 						req->resolver->ups->data);
 			}
 
 			rdns_request_unschedule (req);
-			req->state = RDNS_REQUEST_REPLIED;
-			req->func (rep, req->arg);
-			REF_RELEASE (req);
+
+			if (resolver->cache) {
+				rdns_cache_insert (resolver->cache, req, rep);
+			}
+
+			rdns_request_finish (req, rep);
 		}
 	}
 	else {
@@ -299,6 +471,35 @@ rdns_process_timer (void *arg)
 	struct rdns_server *serv = NULL;
 	unsigned cnt;
 
+	if (req->state == RDNS_REQUEST_CACHED) {
+		/* Deliver reply found in cache */
+		rdns_request_unschedule (req);
+		req->state = RDNS_REQUEST_REPLIED;
+		req->func (req->reply, req->arg);
+		REF_RELEASE (req);
+
+		return;
+	}
+
+	if (req->state == RDNS_REQUEST_WAIT_LEADER) {
+		if (req->leader == NULL) {
+			rdns_request_reissue (req);
+
+			return;
+		}
+
+		/* Timer of a request waiting for another one, leader replies later */
+		if (-- req->retransmits == 0) {
+			rdns_request_unschedule (req);
+			rep = rdns_make_reply (req, RDNS_RC_TIMEOUT);
+			req->state = RDNS_REQUEST_REPLIED;
+			req->func (rep, req->arg);
+			REF_RELEASE (req);
+		}
+
+		return;
+	}
+
 	req->retransmits --;
 	resolver = req->resolver;
 
@@ -313,9 +514,7 @@ rdns_process_timer (void *arg)
 
 		rep = rdns_make_reply (req, RDNS_RC_TIMEOUT);
 		rdns_request_unschedule (req);
-		req->state = RDNS_REQUEST_REPLIED;
-		req->func (rep, req->arg);
-		REF_RELEASE (req);
+		rdns_request_finish (req, rep);
 
 		return;
 	}
@@ -359,9 +558,7 @@ rdns_process_timer (void *arg)
 			if (serv == NULL) {
 				rdns_warn ("cannot find suitable server for request");
 				rep = rdns_make_reply (req, RDNS_RC_SERVFAIL);
-				req->state = RDNS_REQUEST_REPLIED;
-				req->func (rep, req->arg);
-				REF_RELEASE (req);
+				rdns_request_finish (req, rep);
 
 				return;
 			}
@@ -408,9 +605,7 @@ rdns_process_timer (void *arg)
 
 		/* We have not scheduled timeout actually due to send error */
 		rep = rdns_make_reply (req, RDNS_RC_NETERR);
-		req->state = RDNS_REQUEST_REPLIED;
-		req->func (rep, req->arg);
-		REF_RELEASE (req);
+		rdns_request_finish (req, rep);
 	}
 	else {
 		req->async->repeat_timer (req->async->data, req->async_event);
@@ -502,9 +697,7 @@ rdns_process_retransmit (int fd, void *arg)
 		}
 
 		rep = rdns_make_reply (req, RDNS_RC_NETERR);
-		req->state = RDNS_REQUEST_REPLIED;
-		req->func (rep, req->arg);
-		REF_RELEASE (req);
+		rdns_request_finish (req, rep);
 	}
 	else {
 		req->async_event = req->async->add_timer (req->async->data,
@@ -525,13 +718,11 @@ rdns_make_request_full (
 		)
 {
 	va_list args;
-	struct rdns_request *req;
-	struct rdns_server *serv;
-	int r, type;
+	struct rdns_request *req, *leader;
+	int type;
 	unsigned int i, tlen = 0, clen = 0, cur;
 	size_t olen;
 	const char *cur_name, *last_name = NULL;
-	struct rdns_compression_entry *comp = NULL;
 
 	if (resolver == NULL || !resolver->initialized) {
 		return NULL;
@@ -552,6 +743,12 @@ rdns_make_request_full (
 	req->packet = NULL;
 	req->requested_names = calloc (queries, sizeof (struct rdns_request_name));
 	req->async_event = NULL;
+	req->key = NULL;
+	req->keylen = 0;
+	req->leader = NULL;
+	req->followers = NULL;
+	req->prev = NULL;
+	req->next = NULL;
 
 	if (req->requested_names == NULL) {
 		free (req);
@@ -597,78 +794,39 @@ rdns_make_request_full (
 	}
 	va_end (args);
 
-	rdns_allocate_packet (req, tlen);
-	rdns_make_dns_header (req, queries);
-
-	for (i = 0; i < queries; i ++) {
-		cur_name = req->requested_names[i].name;
-		clen = req->requested_names[i].len;
-		type = req->requested_names[i].type;
-		if (queries > 1) {
-			if (!rdns_add_rr (req, cur_name, clen, type, &comp)) {
-				REF_RELEASE (req);
-				rnds_compression_free (comp);
-				return NULL;
-			}
-		}
-		else {
-			if (!rdns_add_rr (req, cur_name, clen, type, NULL)) {
-				REF_RELEASE (req);
-				rnds_compression_free (comp);
-				return NULL;
-			}
-		}
-	}
-
-	rnds_compression_free (comp);
-
-	/* Add EDNS RR */
-	rdns_add_edns0 (req);
-
+	req->async = resolver->async;
 	req->retransmits = repeats;
 	req->timeout = timeout;
-	req->state = RDNS_REQUEST_NEW;
-	req->async = resolver->async;
 
-	if (resolver->ups) {
-		struct rdns_upstream_elt *elt;
-
-		elt = resolver->ups->select (req->requested_names[0].name,
-				req->requested_names[0].len, resolver->ups->data);
+	if (resolver->cache && rdns_cache_lookup (resolver->cache, req)) {
+		/* Reply is delivered from the event loop like a normal one */
+		req->state = RDNS_REQUEST_CACHED;
+		req->async_event = resolver->async->add_timer (resolver->async->data,
+				0.0, req);
 
-		if (elt) {
-			serv = elt->server;
-			serv->ups_elt = elt;
-		}
-		else {
-			UPSTREAM_SELECT_ROUND_ROBIN (resolver->servers, serv);
-		}
-	}
-	else {
-		UPSTREAM_SELECT_ROUND_ROBIN (resolver->servers, serv);
+		return req;
 	}
 
-	if (serv == NULL) {
-		rdns_warn ("cannot find suitable server for request");
-		REF_RELEASE (req);
-		return NULL;
-	}
+	leader = rdns_request_find_inflight (resolver, req);
 
-	/* Select random IO channel */
-	req->io = serv->io_channels[ottery_rand_uint32 () % serv->io_cnt];
-	req->io->uses ++;
+	if (leader != NULL) {
+		/* Wait for the same request, timer ticks like retransmits */
+		req->state = RDNS_REQUEST_WAIT_LEADER;
+		req->leader = leader;
+		DL_APPEND (leader->followers, req);
+		req->async_event = resolver->async->add_timer (resolver->async->data,
+				timeout, req);
+		rdns_debug ("request for %s is sent already, wait for its reply",
+				req->requested_names[0].name);
 
-	/* Now send request to server */
-	r = rdns_send_request (req, req->io->sock, true);
+		return req;
+	}
 
-	if (r == -1) {
+	if (!rdns_request_send_new (req, tlen)) {
 		REF_RELEASE (req);
 		return NULL;
 	}
 
-	REF_RETAIN (req->io);
-	REF_RETAIN (req->resolver);
-
 	return req;
 }
 
@@ -803,6 +961,20 @@ rdns_resolver_set_upstream_lib (struct rdns_resolver *resolver,
 }
 
 
+void
+rdns_resolver_set_cache (struct rdns_resolver *resolver,
+		unsigned int max_elts, unsigned int max_ttl, unsigned int negative_ttl)
+{
+	if (resolver->cache != NULL) {
+		rdns_cache_free (resolver->cache);
+		resolver->cache = NULL;
+	}
+
+	if (max_elts > 0) {
+		resolver->cache = rdns_cache_new (max_elts, max_ttl, negative_ttl);
+	}
+}
+
 void
 rdns_resolver_set_max_io_uses (struct rdns_resolver *resolver,
 		uint64_t max_ioc_uses, double check_time)
@@ -852,6 +1024,7 @@ rdns_resolver_free (struct rdns_resolver *resolver)
 			free (serv);
 		}
 	}
+	rdns_cache_free (resolver->cache);
 	free (resolver->async);
 	free (resolver);
 }
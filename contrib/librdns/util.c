@@ -34,6 +34,7 @@
 #include <netdb.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "ottery.h"
 #include "util.h"
@@ -337,6 +338,16 @@ rdns_rcode_fromstr (const char *str)
 	return -1;
 }
 
+double
+rdns_get_ticks (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 uint16_t
 rdns_permutor_generate_id (void)
 {
@@ -349,11 +360,11 @@ rdns_permutor_generate_id (void)
 
 
 void
-rdns_reply_free (struct rdns_reply *rep)
+rdns_reply_entries_free (struct rdns_reply_entry *entries)
 {
 	struct rdns_reply_entry *entry, *tmp;
 
-	LL_FOREACH_SAFE (rep->entries, entry, tmp) {
+	LL_FOREACH_SAFE (entries, entry, tmp) {
 		switch (entry->type) {
 		case RDNS_REQUEST_PTR:
 			free (entry->content.ptr.name);
@@ -381,6 +392,158 @@ rdns_reply_free (struct rdns_reply *rep)
 		}
 		free (entry);
 	}
+}
+
+struct rdns_reply_entry *
+rdns_reply_entries_copy (struct rdns_reply_entry *entries, int32_t ttl)
+{
+	struct rdns_reply_entry *res = NULL, *cur, *elt;
+
+	DL_FOREACH (entries, cur) {
+		elt = malloc (sizeof (*elt));
+
+		if (elt == NULL) {
+			break;
+		}
+
+		memcpy (elt, cur, sizeof (*elt));
+		elt->prev = NULL;
+		elt->next = NULL;
+
+		if (ttl >= 0 && elt->ttl > ttl) {
+			elt->ttl = ttl;
+		}
+
+		switch (cur->type) {
+		case RDNS_REQUEST_PTR:
+			elt->content.ptr.name = strdup (cur->content.ptr.name);
+			break;
+		case RDNS_REQUEST_NS:
+			elt->content.ns.name = strdup (cur->content.ns.name);
+			break;
+		case RDNS_REQUEST_MX:
+			elt->content.mx.name = strdup (cur->content.mx.name);
+			break;
+		case RDNS_REQUEST_TXT:
+		case RDNS_REQUEST_SPF:
+			elt->content.txt.data = strdup (cur->content.txt.data);
+			break;
+		case RDNS_REQUEST_SRV:
+			elt->content.srv.target = strdup (cur->content.srv.target);
+			break;
+		case RDNS_REQUEST_TLSA:
+			elt->content.tlsa.data = malloc (cur->content.tlsa.datalen);
+
+			if (elt->content.tlsa.data) {
+				memcpy (elt->content.tlsa.data, cur->content.tlsa.data,
+						cur->content.tlsa.datalen);
+			}
+			break;
+		case RDNS_REQUEST_SOA:
+			elt->content.soa.mname = strdup (cur->content.soa.mname);
+			elt->content.soa.admin = strdup (cur->content.soa.admin);
+			break;
+		}
+
+		DL_APPEND (res, elt);
+	}
+
+	return res;
+}
+
+char *
+rdns_request_key (struct rdns_request *req, unsigned int *keylen)
+{
+	const struct rdns_request_name *name = &req->requested_names[0];
+	char *key;
+	unsigned int i;
+
+	key = malloc (name->len + 2);
+
+	if (key == NULL) {
+		return NULL;
+	}
+
+	key[0] = name->type & 0xff;
+	key[1] = (name->type >> 8) & 0xff;
+
+	for (i = 0; i < name->len; i ++) {
+		key[i + 2] = tolower ((unsigned char)name->name[i]);
+	}
+
+	*keylen = name->len + 2;
+
+	return key;
+}
+
+struct rdns_request *
+rdns_request_find_inflight (struct rdns_resolver *resolver,
+		struct rdns_request *req)
+{
+	struct rdns_request *found;
+	unsigned int keylen;
+	char *key;
+
+	if (req->qcount != 1 || resolver->inflight == NULL) {
+		return NULL;
+	}
+
+	key = rdns_request_key (req, &keylen);
+
+	if (key == NULL) {
+		return NULL;
+	}
+
+	HASH_FIND (hh_inflight, resolver->inflight, key, keylen, found);
+	free (key);
+
+	return found;
+}
+
+void
+rdns_request_add_inflight (struct rdns_request *req)
+{
+	struct rdns_resolver *resolver = req->resolver;
+	struct rdns_request *found;
+
+	if (req->qcount != 1 || req->key != NULL) {
+		return;
+	}
+
+	req->key = rdns_request_key (req, &req->keylen);
+
+	if (req->key == NULL) {
+		return;
+	}
+
+	HASH_FIND (hh_inflight, resolver->inflight, req->key, req->keylen, found);
+
+	if (found != NULL) {
+		/* Cannot be a leader */
+		free (req->key);
+		req->key = NULL;
+
+		return;
+	}
+
+	HASH_ADD_KEYPTR (hh_inflight, resolver->inflight, req->key, req->keylen,
+			req);
+}
+
+void
+rdns_request_remove_inflight (struct rdns_request *req)
+{
+	if (req->key != NULL) {
+		HASH_DELETE (hh_inflight, req->resolver->inflight, req);
+		free (req->key);
+		req->key = NULL;
+	}
+}
+
+void
+rdns_reply_free (struct rdns_reply *rep)
+{
+	rdns_reply_entries_free (rep->entries);
 	free (rep);
 }
 
@@ -388,8 +551,25 @@ void
 rdns_request_free (struct rdns_request *req)
 {
 	unsigned int i;
+	struct rdns_request *cur;
 
 	if (req != NULL) {
+		rdns_request_remove_inflight (req);
+
+		if (req->leader != NULL) {
+			DL_DELETE (req->leader->followers, req);
+			req->leader = NULL;
+		}
+
+		/* Followers are resent from the event loop as soon as possible */
+		while ((cur = req->followers) != NULL) {
+			DL_DELETE (req->followers, cur);
+			cur->leader = NULL;
+			cur->async->del_timer (cur->async->data, cur->async_event);
+			cur->async_event = cur->async->add_timer (cur->async->data,
+					0.0, cur);
+		}
+
 		if (req->packet != NULL) {
 			free (req->packet);
 		}
@@ -411,6 +591,13 @@ rdns_request_free (struct rdns_request *req)
 				HASH_DEL (req->io->requests, req);
 				req->async_event = NULL;
 			}
+			else if (req->state == RDNS_REQUEST_CACHED ||
+					req->state == RDNS_REQUEST_WAIT_LEADER) {
+				/* Request has not been sent */
+				req->async->del_timer (req->async->data,
+						req->async_event);
+				req->async_event = NULL;
+			}
 			else if (req->state == RDNS_REQUEST_WAIT_SEND) {
 				/* Remove retransmit event */
 				req->async->del_write (req->async->data,
@@ -480,12 +667,32 @@ rdns_request_unschedule (struct rdns_request *req)
 			HASH_DEL (req->io->requests, req);
 			req->async_event = NULL;
 		}
+		else if (req->state == RDNS_REQUEST_CACHED ||
+				req->state == RDNS_REQUEST_WAIT_LEADER) {
+			req->async->del_timer (req->async->data,
+					req->async_event);
+			req->async_event = NULL;
+		}
+	}
+
+	if (req->leader != NULL) {
+		DL_DELETE (req->leader->followers, req);
+		req->leader = NULL;
 	}
 }
 
 void
 rdns_request_release (struct rdns_request *req)
 {
+	if (req->followers != NULL && (req->state == RDNS_REQUEST_WAIT_REPLY ||
+			req->state == RDNS_REQUEST_WAIT_SEND)) {
+		/* Other requests wait for this reply, so keep it in flight */
+		req->func = NULL;
+
+		return;
+	}
+
+	rdns_request_remove_inflight (req);
 	rdns_request_unschedule (req);
 	REF_RELEASE (req);
 }
@@ -612,6 +819,18 @@ rdns_request_has_type (struct rdns_request *req, enum rdns_request_type type)
 	return false;
 }
 
+bool
+rdns_request_is_cached (struct rdns_request *req)
+{
+	return req->state == RDNS_REQUEST_CACHED;
+}
+
+bool
+rdns_request_is_coalesced (struct rdns_request *req)
+{
+	return req->state == RDNS_REQUEST_WAIT_LEADER;
+}
+
 const struct rdns_request_name *
 rdns_request_get_name (struct rdns_request *req, unsigned int *count)
 {
@@ -41,6 +41,11 @@ rdns_make_client_socket (const char *credits, uint16_t port,
  */
 uint16_t rdns_permutor_generate_id (void);
 
+/**
+ * Get monotonic time in seconds
+ */
+double rdns_get_ticks (void);
+
 
 /**
  * Free IO channel
@@ -59,6 +64,38 @@ void rdns_request_free (struct rdns_request *req);
  */
 void rdns_reply_free (struct rdns_reply *rep);
 
+/**
+ * Free list of reply entries
+ * @param entries
+ */
+void rdns_reply_entries_free (struct rdns_reply_entry *entries);
+
+/**
+ * Copy list of reply entries
+ * @param entries
+ * @param ttl limit TTL of copied entries if not negative
+ */
+struct rdns_reply_entry *rdns_reply_entries_copy (
+		struct rdns_reply_entry *entries, int32_t ttl);
+
 void rdns_request_unschedule (struct rdns_request *req);
 
+/**
+ * Make key from type and lowercased name of the first query
+ * @param req
+ * @param keylen
+ * @return malloced key
+ */
+char *rdns_request_key (struct rdns_request *req, unsigned int *keylen);
+
+/**
+ * Find request with the same single query sent by resolver
+ */
+struct rdns_request *rdns_request_find_inflight (struct rdns_resolver *resolver,
+		struct rdns_request *req);
+
+void rdns_request_add_inflight (struct rdns_request *req);
+
+void rdns_request_remove_inflight (struct rdns_request *req);
+
 #endif /* UTIL_H_ */
@@ -2,17 +2,13 @@ local sqlite3 = require "rspamd_sqlite3"
 local redis = require "rspamd_redis"
 local util = require "rspamd_util"
 
-local function send_redis(server, symbol, tokens, password, db, cmd)
-  local ret = true
-  local conn,err = redis.connect_sync({
+local function connect_redis(server, password, db)
+  local conn, err = redis.connect_sync({
     host = server,
   })
 
-  local err_str
-
   if not conn then
-    print('Cannot connect to ' .. server .. ' error: ' .. err)
-    return false, err
+    return nil, 'Cannot connect to ' .. server .. ' error: ' .. err
   end
 
   if password then
@@ -22,50 +18,48 @@ local function send_redis(server, symbol, tokens, password, db, cmd)
     conn:add_cmd('SELECT', {db})
   end
 
+  return conn, nil
+end
+
+-- Sends all pending commands and checks their replies
+local function exec_redis(conn)
+  local replies = {conn:exec()}
+
+  for i = 1, #replies, 2 do
+    if not replies[i] then
+      return false, tostring(replies[i + 1])
+    end
+  end
+
+  return true, nil
+end
+
+local function send_redis(conn, symbol, tokens, cmd)
   for _,t in ipairs(tokens) do
     if not conn:add_cmd(cmd, {symbol .. t[3], t[1], t[2]}) then
-      ret = false
-      err_str = 'add command failure' .. string.format('%s %s',
+      return false, 'add command failure' .. string.format('%s %s',
         cmd, table.concat({symbol .. t[3], t[1], t[2]}, ' '))
     end
   end
 
-  if ret then
-    ret,err_str = conn:exec()
-  end
-
-  return ret,err_str
+  return exec_redis(conn)
 end
 
 local function convert_learned(cache, server, password, redis_db)
   local converted = 0
   local db = sqlite3.open(cache)
-  local ret = true
-  local err_str
 
   if not db then
-    print('Cannot open cache database: ' .. cache)
-    return false
+    error('Cannot open cache database: ' .. cache)
   end
 
-  db:sql('BEGIN;')
-
-  local conn,err = redis.connect_sync({
-    host = server,
-  })
+  local conn, err = connect_redis(server, password, redis_db)
 
   if not conn then
-    print('Cannot connect to ' .. server .. ' error: ' .. err)
-    return false
-  end
-
-  if password then
-    conn:add_cmd('AUTH', {password})
-  end
-  if redis_db then
-    conn:add_cmd('SELECT', {redis_db})
+    error(err)
   end
 
+  db:sql('BEGIN;')
   for row in db:rows('SELECT * FROM learns;') do
     local is_spam
     local digest = tostring(util.encode_base32(row.digest))
@@ -77,41 +71,40 @@ local function convert_learned(cache, server, password, redis_db)
     end
 
     if not conn:add_cmd('HSET', {'learned_ids', digest, is_spam}) then
-      print('Cannot add hash: ' .. digest)
-      ret = false
-    else
-      converted = converted + 1
+      error('Cannot add hash: ' .. digest)
     end
+    converted = converted + 1
   end
   db:sql('COMMIT;')
 
-  if ret then
-    ret,err_str = conn:exec()
-  end
+  local ret, err_str = exec_redis(conn)
 
-  if ret then
-    print(string.format('Converted %d cached items from sqlite3 learned cache to redis',
-      converted))
-  else
-    print('Error occurred during sending data to redis: ' .. err_str)
+  if not ret then
+    error('Error occurred during sending learned cache to redis: ' .. err_str)
   end
 
-  return ret
+  print(string.format('Converted %d cached items from sqlite3 learned cache to redis',
+    converted))
 end
 
+-- Failures are raised as errors, so rspamadm exits with non zero status
 return function (_, res)
   local db = sqlite3.open(res['source_db'])
   local tokens = {}
   local num = 0
   local total = 0
   local nusers = 0
-  local lim = 1000 -- Update each 1000 tokens
+  -- Limited by rspamadm statconvert as all replies of a pipeline are pushed
+  -- on the lua stack
+  local lim = tonumber(res['batch'] or 2000)
+  local job = tonumber(res['job'] or 0)
+  local jobs = tonumber(res['jobs'] or 1)
   local users_map = {}
   local learns = {}
   local redis_password = res['redis_password']
   local redis_db = nil
   local cmd = 'HINCRBY'
-  local ret, err_str
+  local ret, err_str, conn
 
   if res['redis_db'] then
     redis_db = tostring(res['redis_db'])
@@ -120,17 +113,19 @@ return function (_, res)
     cmd = 'HSET'
   end
 
-  if res['cache_db'] then
-    if not convert_learned(res['cache_db'], res['redis_host'],
-      redis_password, redis_db) then
-        print('Cannot convert learned cache to redis')
-        return
-    end
+  if res['cache_db'] and job == 0 then
+    convert_learned(res['cache_db'], res['redis_host'], redis_password,
+      redis_db)
   end
 
   if not db then
-    print('Cannot open source db: ' .. res['source_db'])
-    return
+    error('Cannot open source db: ' .. res['source_db'])
+  end
+
+  conn, err_str = connect_redis(res['redis_host'], redis_password, redis_db)
+
+  if not conn then
+    error(err_str)
   end
 
   db:sql('BEGIN;')
@@ -154,8 +149,33 @@ return function (_, res)
     end
   end
 
-  -- Fill tokens, sending data to redis each `lim` records
-  for row in db:rows('SELECT token,value,user FROM tokens;') do
+  -- Each job converts its own range of rows
+  local first, last = 0, -1
+  for row in db:rows('SELECT min(rowid) AS lo, max(rowid) AS hi FROM tokens;') do
+    if row.lo and row.hi then
+      local lo, hi = tonumber(row.lo), tonumber(row.hi)
+      local span = math.floor((hi - lo) / jobs) + 1
+      first = lo + span * job
+      last = math.min(first + span - 1, hi)
+    end
+  end
+
+  local expected = 0
+  for row in db:rows('SELECT count(*) AS cnt FROM tokens WHERE rowid BETWEEN ?1 AND ?2;',
+      first, last) do
+    expected = tonumber(row.cnt)
+  end
+
+  local function report()
+    print(string.format('[%d/%d] converted %d of %d tokens (%.1f%%)',
+      job + 1, jobs, total, expected,
+      expected > 0 and total * 100.0 / expected or 100.0))
+  end
+
+  -- Stream tokens, sending data to redis each `lim` records
+  local batches = 0
+  for row in db:rows('SELECT token,value,user FROM tokens WHERE rowid BETWEEN ?1 AND ?2;',
+      first, last) do
     local user = ''
     if row.user ~= 0 and users_map[row.user] then
       user = users_map[row.user]
@@ -165,61 +185,60 @@ return function (_, res)
 
     num = num + 1
     total = total + 1
-    if num > lim then
-      ret,err_str = send_redis(res['redis_host'], res['symbol'],
-        tokens, redis_password, redis_db, cmd)
+    if num >= lim then
+      ret,err_str = send_redis(conn, res['symbol'], tokens, cmd)
       if not ret then
-        print('Cannot send tokens to the redis server: ' .. err_str)
-        return
+        error('Cannot send tokens to the redis server: ' .. err_str)
       end
 
       num = 0
       tokens = {}
+      batches = batches + 1
+
+      if batches % 100 == 0 then
+        report()
+      end
     end
   end
   if #tokens > 0 then
-    ret, err_str = send_redis(res['redis_host'], res['symbol'], tokens,
-      redis_password, redis_db, cmd)
+    ret, err_str = send_redis(conn, res['symbol'], tokens, cmd)
 
     if not ret then
-      print('Cannot send tokens to the redis server: ' .. err_str)
-      return
+      error('Cannot send tokens to the redis server: ' .. err_str)
     end
   end
-  -- Now update all users
-  local conn,err = redis.connect_sync({
-    host = res['redis_host'],
-  })
-
-  if not conn then
-    print('Cannot connect to ' .. res['redis_host'] .. ' error: ' .. err)
-    return false
-  end
+  report()
 
-  if redis_password then
-    conn:add_cmd('AUTH', {redis_password})
-  end
-  if redis_db then
-    conn:add_cmd('SELECT', {redis_db})
+  if job ~= 0 then
+    db:sql('COMMIT;')
+    print(string.format('[%d/%d] migrated %d tokens for symbol %s',
+      job + 1, jobs, total, res['symbol']))
+    return
   end
 
+  -- Now update all users
   for id,learned in pairs(learns) do
     local user = users_map[id]
     if not conn:add_cmd(cmd, {res['symbol'] .. user, 'learns', learned}) then
-      print('Cannot update learns for user: ' .. user)
+      error('Cannot update learns for user: ' .. user)
     end
     if not conn:add_cmd('SADD', {res['symbol'] .. '_keys', res['symbol'] .. user}) then
-      print('Cannot update learns for user: ' .. user)
+      error('Cannot update learns for user: ' .. user)
     end
   end
   db:sql('COMMIT;')
 
-  ret = conn:exec()
+  ret, err_str = exec_redis(conn)
 
-  if ret then
-    print(string.format('Migrated %d tokens for %d users for symbol %s',
-     total, nusers, res['symbol']))
+  if not ret then
+    error('Error occurred during sending learns to redis: ' .. err_str)
+  end
+
+  if jobs > 1 then
+    print(string.format('[%d/%d] migrated %d tokens and learns of %d users for symbol %s',
+      job + 1, jobs, total, nusers, res['symbol']))
   else
-    print('Error occurred during sending data to redis')
+    print(string.format('Migrated %d tokens for %d users for symbol %s',
+      total, nusers, res['symbol']))
   end
 end
@@ -2607,6 +2607,13 @@ rspamd_controller_handle_stat_common (
 	ucl_object_insert_key (top,
 		ucl_object_fromint (stat->control_connections_count),
 		"control_connections", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->dns_cache_hits), "dns_cache_hits", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->dns_cache_misses), "dns_cache_misses", 0,
+		false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->dns_coalesced), "dns_coalesced", 0, false);
 
 	ucl_object_insert_key (top,
 		ucl_object_fromint (mem_st.pools_allocated), "pools_allocated", 0,
@@ -2635,6 +2642,9 @@ rspamd_controller_handle_stat_common (
 		session->ctx->srv->stat->messages_learned = 0;
 		session->ctx->srv->stat->connections_count = 0;
 		session->ctx->srv->stat->control_connections_count = 0;
+		session->ctx->srv->stat->dns_cache_hits = 0;
+		session->ctx->srv->stat->dns_cache_misses = 0;
+		session->ctx->srv->stat->dns_coalesced = 0;
 		rspamd_mempool_stat_reset ();
 	}
 
@@ -25,6 +25,8 @@
 #include "map.h"
 #include "fuzzy_wire.h"
 #include "fuzzy_backend.h"
+#include "fuzzy_filter.h"
+#include "fuzzy_updates_log.h"
 #include "ottery.h"
 #include "libserver/worker_util.h"
 #include "libserver/rspamd_control.h"
@@ -42,6 +44,16 @@
 #define DEFAULT_KEYPAIR_CACHE_SIZE 512
 #define DEFAULT_MASTER_TIMEOUT 10.0
 #define DEFAULT_UPDATES_MAXFAIL 3
+#define DEFAULT_FILTER_REBUILD 86400.0
+/* Negative filter is rebuilt by small steps to keep worker responsive */
+#define FILTER_REBUILD_STEP_ELTS 65536
+#define FILTER_REBUILD_STEP_TIMEOUT 0.01
+/* Digests exported to a snapshot per one iteration */
+#define SNAPSHOT_STEP_ELTS 16384
+#define SNAPSHOT_STEP_TIMEOUT 0.01
+#define DEFAULT_UPDATES_LOG_SEGMENT_SIZE (64 * 1024 * 1024)
+#define DEFAULT_UPDATES_LOG_SEGMENTS 16
+#define DEFAULT_UPDATES_LOG_MAX_DELTA (8 * 1024 * 1024)
 #define COOKIE_SIZE 128
 
 static const gchar *local_db_name = "local";
@@ -104,6 +116,8 @@ struct fuzzy_global_stat {
 	guint64 fuzzy_hashes_found[RSPAMD_FUZZY_EPOCH_MAX];
 	/**< amount of hashes found by epoch				*/
 	guint64 invalid_requests;
+	guint64 filtered_requests;
+	/**< check requests answered by negative filter		*/
 };
 
 struct fuzzy_key_stat {
@@ -171,6 +185,16 @@ struct rspamd_fuzzy_storage_ctx {
 	struct rspamd_http_connection_router *collection_rt;
 	const ucl_object_t *skip_map;
 	GHashTable *skip_hashes;
+	struct rspamd_fuzzy_filter *filter;
+	gdouble filter_rebuild;
+	struct event filter_ev;
+	gchar *updates_log_path;
+	gsize updates_log_segment_size;
+	guint updates_log_segments;
+	gsize updates_log_max_delta;
+	struct rspamd_fuzzy_updates_log *updates_log;
+	struct event snapshot_ev;
+	GPtrArray *snapshot_waiters;    /**< mirrors waiting for a snapshot	*/
 	guchar cookie[COOKIE_SIZE];
 };
 
@@ -203,6 +227,28 @@ struct fuzzy_session {
 	struct event io;
 	ref_entry_t ref;
 	struct fuzzy_key_stat *key_stat;
+	struct fuzzy_batch *batch;
+	guint batch_idx;
+	guchar nm[rspamd_cryptobox_MAX_NMBYTES];
+};
+
+/*
+ * Several commands received in a single datagram, each command is processed
+ * by its own session and the batch is replied when all of them are finished
+ */
+struct fuzzy_batch {
+	struct rspamd_worker *worker;
+	struct rspamd_fuzzy_storage_ctx *ctx;
+	rspamd_inet_addr_t *addr;
+	struct rspamd_fuzzy_reply *replies;
+	guchar *out;
+	gsize outlen;
+	guint ncmds;
+	guint pending;
+	gint fd;
+	gboolean encrypted;
+	struct event io;
+	ref_entry_t ref;
 	guchar nm[rspamd_cryptobox_MAX_NMBYTES];
 };
 
@@ -228,9 +274,25 @@ struct fuzzy_master_update_session {
 	rspamd_inet_addr_t *addr;
 	gboolean replied;
 	gint sock;
+	/* Records from the updates log which are being applied */
+	GQueue *records;
+	struct fuzzy_mirror_record *cur_record;
+	guint64 rev;
+	gboolean snapshot;          /**< applying snapshot chunk		*/
+	gboolean applying;
+	gboolean failed;
+};
+
+struct fuzzy_mirror_record {
+	guint64 rev;
+	GArray *cmds;
 };
 
 static void rspamd_fuzzy_write_reply (struct fuzzy_session *session);
+static void fuzzy_session_destroy (gpointer d);
+static void fuzzy_batch_destroy (gpointer d);
+static void rspamd_fuzzy_batch_add_reply (struct fuzzy_batch *batch,
+		guint idx, const struct rspamd_fuzzy_reply *rep);
 
 static gboolean
 rspamd_fuzzy_check_client (struct fuzzy_session *session)
@@ -282,6 +344,9 @@ struct fuzzy_slave_connection {
 	struct upstream *up;
 	struct rspamd_http_connection *http_conn;
 	struct rspamd_fuzzy_mirror *mirror;
+	struct rspamd_fuzzy_storage_ctx *ctx;
+	guint64 catchup_from;       /**< revision sent from, G_MAXUINT64 if none	*/
+	guint64 snapshot_rev;
 	gint sock;
 };
 
@@ -408,21 +473,87 @@ fuzzy_mirror_error_handler (struct rspamd_http_connection *conn, GError *err)
 	fuzzy_mirror_close_connection (bk_conn);
 }
 
+static void fuzzy_mirror_catch_up (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct rspamd_fuzzy_mirror *m, guint64 rev);
+static void fuzzy_mirror_send_snapshot (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct rspamd_fuzzy_mirror *m, guint64 snapshot_rev, goffset offset);
+static void rspamd_fuzzy_process_updates_queue (
+		struct rspamd_fuzzy_storage_ctx *ctx,
+		const gchar *source, gboolean forced);
+
+static gboolean
+fuzzy_mirror_get_header_u64 (struct rspamd_http_message *msg,
+		const gchar *name, guint64 *res)
+{
+	const rspamd_ftok_t *tok;
+	gchar numbuf[32], *end;
+	guint64 val;
+
+	tok = rspamd_http_message_find_header (msg, name);
+
+	/* gulong is 32 bits on some platforms, so do not use rspamd_strtoul */
+	if (tok == NULL || tok->len == 0 || tok->len >= sizeof (numbuf) ||
+			!g_ascii_isdigit (tok->begin[0])) {
+		return FALSE;
+	}
+
+	rspamd_strlcpy (numbuf, tok->begin, tok->len + 1);
+	errno = 0;
+	val = g_ascii_strtoull (numbuf, &end, 10);
+
+	if (errno != 0 || *end != '\0') {
+		return FALSE;
+	}
+
+	*res = val;
+
+	return TRUE;
+}
+
 static gint
 fuzzy_mirror_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
 {
 	struct fuzzy_slave_connection *bk_conn = conn->ud;
+	struct rspamd_fuzzy_storage_ctx *ctx = bk_conn->ctx;
+	struct rspamd_fuzzy_mirror *m = bk_conn->mirror;
+	guint64 rev = 0, offset = 0, catchup_from, snapshot_rev;
+	gboolean has_rev = FALSE, has_offset = FALSE;
+
+	msg_info ("finished mirror connection to %s", m->name);
+	catchup_from = bk_conn->catchup_from;
+	snapshot_rev = bk_conn->snapshot_rev;
+
+	if (ctx->updates_log && (msg->code == 200 || msg->code == 409)) {
+		/* Mirror reports its revision so we can send missing updates */
+		has_offset = fuzzy_mirror_get_header_u64 (msg, "Snapshot-Offset",
+				&offset);
+		has_rev = fuzzy_mirror_get_header_u64 (msg, "Revision", &rev);
+	}
 
-	msg_info ("finished mirror connection to %s", bk_conn->mirror->name);
 	fuzzy_mirror_close_connection (bk_conn);
 
+	if (has_offset) {
+		fuzzy_mirror_send_snapshot (ctx, m, snapshot_rev, offset);
+	}
+	else if (has_rev) {
+		if (catchup_from != G_MAXUINT64 && rev <= catchup_from) {
+			msg_err ("mirror %s has not applied updates after revision %L, "
+					"stop sending updates log", m->name, rev);
+		}
+		else {
+			fuzzy_mirror_catch_up (ctx, m, rev);
+		}
+	}
+
 	return 0;
 }
 
-static void
-rspamd_fuzzy_send_update_mirror (struct rspamd_fuzzy_storage_ctx *ctx,
-		struct rspamd_fuzzy_mirror *m)
+static struct fuzzy_slave_connection *
+fuzzy_mirror_connect (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct rspamd_fuzzy_mirror *m,
+		const gchar *path,
+		struct rspamd_http_message **pmsg)
 {
 	struct fuzzy_slave_connection *conn;
 	struct rspamd_http_message *msg;
@@ -431,10 +562,14 @@ rspamd_fuzzy_send_update_mirror (struct rspamd_fuzzy_storage_ctx *ctx,
 	conn->up = rspamd_upstream_get (m->u,
 			RSPAMD_UPSTREAM_MASTER_SLAVE, NULL, 0);
 	conn->mirror = m;
+	conn->ctx = ctx;
+	conn->catchup_from = G_MAXUINT64;
 
 	if (conn->up == NULL) {
 		msg_err ("cannot select upstream for %s", m->name);
-		return;
+		g_free (conn);
+
+		return NULL;
 	}
 
 	conn->sock = rspamd_inet_address_connect (
@@ -444,11 +579,13 @@ rspamd_fuzzy_send_update_mirror (struct rspamd_fuzzy_storage_ctx *ctx,
 	if (conn->sock == -1) {
 		msg_err ("cannot connect upstream for %s", m->name);
 		rspamd_upstream_fail (conn->up);
-		return;
+		g_free (conn);
+
+		return NULL;
 	}
 
 	msg = rspamd_http_new_message (HTTP_REQUEST);
-	rspamd_printf_fstring (&msg->url, "/update_v1/%s", m->name);
+	rspamd_printf_fstring (&msg->url, "%s%s", path, m->name);
 
 	conn->http_conn = rspamd_http_connection_new (NULL,
 			fuzzy_mirror_error_handler,
@@ -461,9 +598,248 @@ rspamd_fuzzy_send_update_mirror (struct rspamd_fuzzy_storage_ctx *ctx,
 	rspamd_http_connection_set_key (conn->http_conn,
 			ctx->sync_keypair);
 	msg->peer_key = rspamd_pubkey_ref (m->key);
+
+	if (ctx->updates_log) {
+		/* Mirror can ask for missing updates instead of applying with gaps */
+		rspamd_http_message_add_header (msg, "Updates-Log", "yes");
+	}
+
+	*pmsg = msg;
+
+	return conn;
+}
+
+static void
+fuzzy_mirror_write_message (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct fuzzy_slave_connection *conn,
+		struct rspamd_http_message *msg)
+{
+	struct timeval tv;
+
+	double_to_tv (ctx->sync_timeout, &tv);
+	rspamd_http_connection_write_message (conn->http_conn,
+			msg, NULL, NULL, conn,
+			conn->sock,
+			&tv, ctx->ev_base);
+}
+
+static void
+rspamd_fuzzy_send_update_mirror (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct rspamd_fuzzy_mirror *m)
+{
+	struct fuzzy_slave_connection *conn;
+	struct rspamd_http_message *msg;
+
+	conn = fuzzy_mirror_connect (ctx, m, "/update_v1/", &msg);
+
+	if (conn == NULL) {
+		return;
+	}
+
 	fuzzy_mirror_updates_to_http (m, conn, ctx, msg);
 }
 
+/*
+ * Sends updates log records after the revision reported by mirror
+ */
+static void
+fuzzy_mirror_catch_up (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct rspamd_fuzzy_mirror *m, guint64 rev)
+{
+	struct fuzzy_slave_connection *conn;
+	struct rspamd_http_message *msg;
+	rspamd_fstring_t *body;
+	guint64 last = 0;
+
+	body = rspamd_fstring_new ();
+
+	switch (rspamd_fuzzy_updates_log_read (ctx->updates_log, rev,
+			ctx->updates_log_max_delta, &body, &last)) {
+	case RSPAMD_FUZZY_LOG_OK:
+		conn = fuzzy_mirror_connect (ctx, m, "/delta_v1/", &msg);
+
+		if (conn == NULL) {
+			rspamd_fstring_free (body);
+			return;
+		}
+
+		conn->catchup_from = rev;
+		msg_info ("send updates log to %s: revisions %L-%L, %z bytes",
+				m->name, rev + 1, last, body->len);
+		rspamd_http_message_set_body_from_fstring_steal (msg, body);
+		fuzzy_mirror_write_message (ctx, conn, msg);
+		break;
+	case RSPAMD_FUZZY_LOG_TOO_OLD:
+		rspamd_fstring_free (body);
+
+		if (rev == 0) {
+			fuzzy_mirror_send_snapshot (ctx, m, 0, 0);
+		}
+		else {
+			msg_err ("mirror %s has revision %L which is older than the "
+					"updates log (%L), cold sync is required", m->name, rev,
+					rspamd_fuzzy_updates_log_first (ctx->updates_log));
+		}
+		break;
+	case RSPAMD_FUZZY_LOG_EMPTY:
+		rspamd_fstring_free (body);
+		break;
+	default:
+		rspamd_fstring_free (body);
+		msg_err ("cannot read updates log for %s", m->name);
+		break;
+	}
+}
+
+static void
+fuzzy_mirror_snapshot_step_cb (gint fd, gshort what, gpointer ud)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = ud;
+	struct rspamd_fuzzy_mirror *m;
+	struct timeval tv;
+	GPtrArray *waiters;
+	GError *err = NULL;
+	gboolean done;
+	guint i;
+
+	if (!rspamd_fuzzy_updates_log_snapshot_step (ctx->updates_log,
+			ctx->backend, SNAPSHOT_STEP_ELTS, &done, &err)) {
+		msg_err ("cannot create snapshot: %e", err);
+		g_error_free (err);
+		g_ptr_array_set_size (ctx->snapshot_waiters, 0);
+	}
+	else if (!done) {
+		double_to_tv (SNAPSHOT_STEP_TIMEOUT, &tv);
+		event_add (&ctx->snapshot_ev, &tv);
+
+		return;
+	}
+	else {
+		waiters = ctx->snapshot_waiters;
+		ctx->snapshot_waiters = g_ptr_array_new ();
+
+		for (i = 0; i < waiters->len; i ++) {
+			m = g_ptr_array_index (waiters, i);
+			fuzzy_mirror_send_snapshot (ctx, m, 0, 0);
+		}
+
+		g_ptr_array_free (waiters, TRUE);
+	}
+}
+
+static void
+fuzzy_mirror_snapshot_version_cb (guint64 rev, void *ud)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = ud;
+	GError *err = NULL;
+
+	if (rev == 0) {
+		msg_info ("storage is empty, no snapshot is needed");
+		g_ptr_array_set_size (ctx->snapshot_waiters, 0);
+	}
+	else if (!rspamd_fuzzy_updates_log_snapshot_start (ctx->updates_log,
+			rev, &err)) {
+		msg_err ("cannot create snapshot: %e", err);
+		g_error_free (err);
+		g_ptr_array_set_size (ctx->snapshot_waiters, 0);
+	}
+	else {
+		msg_info ("start building snapshot, revision %L", rev);
+		fuzzy_mirror_snapshot_step_cb (-1, EV_TIMEOUT, ctx);
+	}
+}
+
+/*
+ * Bootstraps empty mirror from snapshot: snapshot is sent by chunks, mirror
+ * replies with the next offset; the final request has no body and commits
+ * snapshot revision on mirror
+ */
+static void
+fuzzy_mirror_send_snapshot (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct rspamd_fuzzy_mirror *m, guint64 snapshot_rev, goffset offset)
+{
+	struct fuzzy_slave_connection *conn;
+	struct rspamd_http_message *msg;
+	rspamd_fstring_t *body;
+	guint64 cur, first, last;
+	goffset next = offset;
+	enum rspamd_fuzzy_updates_log_result r;
+	gchar numbuf[64];
+	guint i;
+
+	cur = rspamd_fuzzy_updates_log_snapshot_rev (ctx->updates_log);
+
+	if (snapshot_rev == 0) {
+		first = rspamd_fuzzy_updates_log_first (ctx->updates_log);
+		last = rspamd_fuzzy_updates_log_last (ctx->updates_log);
+
+		/* Snapshot must be continued by the updates log */
+		if (cur == 0 || (first != 0 && (cur + 1 < first || cur > last))) {
+			/* Mirrors share a single snapshot being built */
+			for (i = 0; i < ctx->snapshot_waiters->len; i ++) {
+				if (g_ptr_array_index (ctx->snapshot_waiters, i) == m) {
+					return;
+				}
+			}
+
+			g_ptr_array_add (ctx->snapshot_waiters, m);
+
+			if (ctx->snapshot_waiters->len == 1) {
+				/* Sqlite backend calls us back immediately */
+				rspamd_fuzzy_backend_version (ctx->backend, local_db_name,
+						fuzzy_mirror_snapshot_version_cb, ctx);
+			}
+
+			return;
+		}
+
+		snapshot_rev = cur;
+	}
+	else if (cur != snapshot_rev) {
+		msg_err ("snapshot has been replaced while sending it to %s, "
+				"cold sync is required", m->name);
+
+		return;
+	}
+
+	body = rspamd_fstring_new ();
+	r = rspamd_fuzzy_updates_log_read_snapshot (ctx->updates_log, offset,
+			ctx->updates_log_max_delta, &body, &next);
+
+	if (r != RSPAMD_FUZZY_LOG_OK && r != RSPAMD_FUZZY_LOG_EMPTY) {
+		rspamd_fstring_free (body);
+		msg_err ("cannot read snapshot for %s", m->name);
+
+		return;
+	}
+
+	conn = fuzzy_mirror_connect (ctx, m, "/snapshot_v1/", &msg);
+
+	if (conn == NULL) {
+		rspamd_fstring_free (body);
+
+		return;
+	}
+
+	conn->snapshot_rev = snapshot_rev;
+	rspamd_snprintf (numbuf, sizeof (numbuf), "%uL", snapshot_rev);
+	rspamd_http_message_add_header (msg, "Snapshot-Revision", numbuf);
+
+	if (r == RSPAMD_FUZZY_LOG_OK) {
+		rspamd_snprintf (numbuf, sizeof (numbuf), "%uL", (guint64)next);
+		rspamd_http_message_add_header (msg, "Snapshot-Offset", numbuf);
+		msg_info ("send snapshot %L to %s: offset %L, %z bytes",
+				snapshot_rev, m->name, (gint64)offset, body->len);
+		rspamd_http_message_set_body_from_fstring_steal (msg, body);
+	}
+	else {
+		msg_info ("finished sending snapshot %L to %s", snapshot_rev, m->name);
+		rspamd_fstring_free (body);
+	}
+
+	fuzzy_mirror_write_message (ctx, conn, msg);
+}
+
 struct rspamd_updates_cbdata {
 	struct rspamd_fuzzy_storage_ctx *ctx;
 	gchar *source;
@@ -495,6 +871,43 @@ rspamd_fuzzy_stat_callback (gint fd, gshort what, gpointer ud)
 	rspamd_fuzzy_backend_count (ctx->backend, fuzzy_stat_count_callback, ctx);
 }
 
+struct rspamd_updates_log_cbdata {
+	struct rspamd_fuzzy_storage_ctx *ctx;
+	GArray *updates;
+};
+
+static void
+fuzzy_updates_log_version_cb (guint64 rev, void *ud)
+{
+	struct rspamd_updates_log_cbdata *cbdata = ud;
+	GError *err = NULL;
+
+	if (!rspamd_fuzzy_updates_log_append (cbdata->ctx->updates_log, rev,
+			cbdata->updates, &err)) {
+		msg_err ("cannot store revision %L in updates log: %e", rev, err);
+		g_error_free (err);
+	}
+
+	g_array_free (cbdata->updates, TRUE);
+	g_free (cbdata);
+}
+
+static void
+rspamd_fuzzy_updates_log_store (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	struct rspamd_updates_log_cbdata *cbdata;
+
+	/* Pending updates are cleared before version is returned by async backends */
+	cbdata = g_malloc (sizeof (*cbdata));
+	cbdata->ctx = ctx;
+	cbdata->updates = g_array_sized_new (FALSE, FALSE,
+			sizeof (struct fuzzy_peer_cmd), ctx->updates_pending->len);
+	g_array_append_vals (cbdata->updates, ctx->updates_pending->data,
+			ctx->updates_pending->len);
+	rspamd_fuzzy_backend_version (ctx->backend, local_db_name,
+			fuzzy_updates_log_version_cb, cbdata);
+}
+
 static void
 rspamd_fuzzy_updates_cb (gboolean success, void *ud)
 {
@@ -510,6 +923,11 @@ rspamd_fuzzy_updates_cb (gboolean success, void *ud)
 	if (success) {
 		rspamd_fuzzy_backend_count (ctx->backend, fuzzy_count_callback, ctx);
 
+		if (ctx->updates_log && ctx->updates_pending->len > 0 &&
+				strcmp (source, local_db_name) == 0) {
+			rspamd_fuzzy_updates_log_store (ctx);
+		}
+
 		if (ctx->updates_pending->len > 0) {
 			for (i = 0; i < ctx->mirrors->len; i ++) {
 				m = g_ptr_array_index (ctx->mirrors, i);
@@ -555,6 +973,27 @@ rspamd_fuzzy_updates_cb (gboolean success, void *ud)
 	g_free (cbdata);
 }
 
+static void
+rspamd_fuzzy_filter_updates (struct rspamd_fuzzy_storage_ctx *ctx,
+		GArray *updates)
+{
+	struct fuzzy_peer_cmd *io_cmd;
+	struct rspamd_fuzzy_cmd *cmd;
+	guint i;
+
+	if (ctx->filter) {
+		for (i = 0; i < updates->len; i ++) {
+			io_cmd = &g_array_index (updates, struct fuzzy_peer_cmd, i);
+			cmd = io_cmd->is_shingle ? &io_cmd->cmd.shingle.basic :
+					&io_cmd->cmd.normal;
+
+			if (cmd->cmd == FUZZY_WRITE) {
+				rspamd_fuzzy_filter_add (ctx->filter, cmd);
+			}
+		}
+	}
+}
+
 static void
 rspamd_fuzzy_process_updates_queue (struct rspamd_fuzzy_storage_ctx *ctx,
 		const gchar *source, gboolean forced)
@@ -562,6 +1001,8 @@ rspamd_fuzzy_process_updates_queue (struct rspamd_fuzzy_storage_ctx *ctx,
 
 	struct rspamd_updates_cbdata *cbdata;
 
+	rspamd_fuzzy_filter_updates (ctx, ctx->updates_pending);
+
 	if ((forced ||ctx->updates_pending->len > 0)) {
 		cbdata = g_malloc (sizeof (*cbdata));
 		cbdata->ctx = ctx;
@@ -628,6 +1069,92 @@ rspamd_fuzzy_write_reply (struct fuzzy_session *session)
 	}
 }
 
+static void
+rspamd_fuzzy_batch_write_reply (struct fuzzy_batch *batch);
+
+static void
+rspamd_fuzzy_batch_reply_io (gint fd, gshort what, gpointer d)
+{
+	struct fuzzy_batch *batch = d;
+
+	rspamd_fuzzy_batch_write_reply (batch);
+	REF_RELEASE (batch);
+}
+
+static void
+rspamd_fuzzy_batch_write_reply (struct fuzzy_batch *batch)
+{
+	gssize r;
+
+	r = rspamd_inet_address_sendto (batch->fd, batch->out, batch->outlen, 0,
+			batch->addr);
+
+	if (r == -1) {
+		if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) {
+			/* Grab reference to avoid early destruction */
+			REF_RETAIN (batch);
+			event_set (&batch->io, batch->fd, EV_WRITE,
+					rspamd_fuzzy_batch_reply_io, batch);
+			event_base_set (batch->ctx->ev_base, &batch->io);
+			event_add (&batch->io, NULL);
+		}
+		else {
+			msg_err ("error while writing reply: %s", strerror (errno));
+		}
+	}
+}
+
+static void
+rspamd_fuzzy_batch_add_reply (struct fuzzy_batch *batch,
+		guint idx, const struct rspamd_fuzzy_reply *rep)
+{
+	struct rspamd_fuzzy_encrypted_rep_hdr *ehdr = NULL;
+	struct rspamd_fuzzy_batch_hdr *bhdr;
+	guchar *p;
+
+	g_assert (idx < batch->ncmds && batch->pending > 0);
+	memcpy (&batch->replies[idx], rep, sizeof (*rep));
+
+	if (--batch->pending > 0) {
+		return;
+	}
+
+	/* All commands are finished, so we can form the reply */
+	batch->outlen = sizeof (*bhdr) + sizeof (*rep) * batch->ncmds;
+
+	if (batch->encrypted) {
+		batch->outlen += sizeof (*ehdr);
+	}
+
+	p = g_malloc (batch->outlen);
+	batch->out = p;
+
+	if (batch->encrypted) {
+		ehdr = (struct rspamd_fuzzy_encrypted_rep_hdr *)p;
+		p += sizeof (*ehdr);
+	}
+
+	bhdr = (struct rspamd_fuzzy_batch_hdr *)p;
+	memcpy (bhdr->magic, fuzzy_batch_magic, sizeof (bhdr->magic));
+	bhdr->version = RSPAMD_FUZZY_BATCH_VERSION;
+	bhdr->ncmds = batch->ncmds;
+	bhdr->reserved = 0;
+	memcpy (p + sizeof (*bhdr), batch->replies,
+			sizeof (*rep) * batch->ncmds);
+
+	if (ehdr) {
+		ottery_rand_bytes (ehdr->nonce, sizeof (ehdr->nonce));
+		rspamd_cryptobox_encrypt_nm_inplace (p,
+				sizeof (*bhdr) + sizeof (*rep) * batch->ncmds,
+				ehdr->nonce,
+				batch->nm,
+				ehdr->mac,
+				RSPAMD_CRYPTOBOX_MODE_25519);
+	}
+
+	rspamd_fuzzy_batch_write_reply (batch);
+}
+
 static void
 fuzzy_peer_send_io (gint fd, gshort what, gpointer d)
 {
@@ -716,6 +1243,8 @@ rspamd_fuzzy_make_reply (struct rspamd_fuzzy_cmd *cmd,
 	if (cmd) {
 		result->v1.tag = cmd->tag;
 		memcpy (&session->reply.rep, result, sizeof (*result));
+		/* Advertise batches support for clients with extended replies */
+		session->reply.rep.flags = RSPAMD_FUZZY_REPLY_FLAG_BATCH;
 
 		rspamd_fuzzy_update_stats (session->ctx,
 				session->epoch,
@@ -726,6 +1255,14 @@ rspamd_fuzzy_make_reply (struct rspamd_fuzzy_cmd *cmd,
 				cmd->cmd,
 				result->v1.value);
 
+		if (session->batch) {
+			/* Batch is replied and encrypted as a whole */
+			rspamd_fuzzy_batch_add_reply (session->batch, session->batch_idx,
+					&session->reply.rep);
+
+			return;
+		}
+
 		if (encrypted) {
 			/* We need also to encrypt reply */
 			ottery_rand_bytes (session->reply.hdr.nonce,
@@ -825,6 +1362,11 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 		return;
 	}
 
+	if (session->batch) {
+		/* Batch is decrypted and encrypted as a whole */
+		encrypted = session->batch->encrypted;
+	}
+
 	memset (&result, 0, sizeof (result));
 	memcpy (result.digest, cmd->digest, sizeof (result.digest));
 	result.v1.flag = cmd->flag;
@@ -866,7 +1408,16 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 			result.v1.flag = 0;
 			rspamd_fuzzy_make_reply (cmd, &result, session, encrypted, is_shingle);
 		}
-		else {
+		else if (session->ctx->filter &&
+				rspamd_fuzzy_filter_is_missing (session->ctx->filter, cmd)) {
+			/* Definite miss, do not bother backend */
+			session->ctx->stat.filtered_requests ++;
+			result.v1.prob = 0;
+			result.v1.value = 0;
+			result.v1.flag = 0;
+			rspamd_fuzzy_make_reply (cmd, &result, session, encrypted, is_shingle);
+		}
+		else {
 			REF_RETAIN (session);
 			rspamd_fuzzy_backend_check (session->ctx->backend, cmd,
 					rspamd_fuzzy_check_callback, session);
@@ -990,45 +1541,36 @@ rspamd_fuzzy_command_valid (struct rspamd_fuzzy_cmd *cmd, gint r)
 }
 
 static gboolean
-rspamd_fuzzy_decrypt_command (struct fuzzy_session *s)
+rspamd_fuzzy_decrypt_payload (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct rspamd_fuzzy_encrypted_req_hdr *hdr,
+		const guchar *magic,
+		guchar *payload, gsize payload_len,
+		guchar *nm,
+		struct fuzzy_key_stat **key_stat)
 {
-	struct rspamd_fuzzy_encrypted_req_hdr *hdr;
-	guchar *payload;
-	gsize payload_len;
 	struct rspamd_cryptobox_pubkey *rk;
 	struct fuzzy_key *key;
 
-	if (s->ctx->default_key == NULL) {
+	if (ctx->default_key == NULL) {
 		msg_warn ("received encrypted request when encryption is not enabled");
 		return FALSE;
 	}
 
-	if (s->cmd_type == CMD_ENCRYPTED_NORMAL) {
-		hdr = &s->cmd.enc_normal.hdr;
-		payload = (guchar *)&s->cmd.enc_normal.cmd;
-		payload_len = sizeof (s->cmd.enc_normal.cmd);
-	}
-	else {
-		hdr = &s->cmd.enc_shingle.hdr;
-		payload = (guchar *) &s->cmd.enc_shingle.cmd;
-		payload_len = sizeof (s->cmd.enc_shingle.cmd);
-	}
-
 	/* Compare magic */
-	if (memcmp (hdr->magic, fuzzy_encrypted_magic, sizeof (hdr->magic)) != 0) {
+	if (memcmp (hdr->magic, magic, sizeof (hdr->magic)) != 0) {
 		msg_debug ("invalid magic for the encrypted packet");
 		return FALSE;
 	}
 
 	/* Try to find the desired key */
-	key = g_hash_table_lookup (s->ctx->keys, hdr->key_id);
+	key = g_hash_table_lookup (ctx->keys, hdr->key_id);
 
 	if (key == NULL) {
 		/* Unknown key, assume default one */
-		key = s->ctx->default_key;
+		key = ctx->default_key;
 	}
 
-	s->key_stat = key->stat;
+	*key_stat = key->stat;
 
 	/* Now process keypair */
 	rk = rspamd_pubkey_from_bin (hdr->pubkey, sizeof (hdr->pubkey),
@@ -1039,7 +1581,7 @@ rspamd_fuzzy_decrypt_command (struct fuzzy_session *s)
 		return FALSE;
 	}
 
-	rspamd_keypair_cache_process (s->ctx->keypair_cache, key->key, rk);
+	rspamd_keypair_cache_process (ctx->keypair_cache, key->key, rk);
 
 	/* Now decrypt request */
 	if (!rspamd_cryptobox_decrypt_nm_inplace (payload, payload_len, hdr->nonce,
@@ -1051,12 +1593,34 @@ rspamd_fuzzy_decrypt_command (struct fuzzy_session *s)
 		return FALSE;
 	}
 
-	memcpy (s->nm, rspamd_pubkey_get_nm (rk), sizeof (s->nm));
+	memcpy (nm, rspamd_pubkey_get_nm (rk), rspamd_cryptobox_MAX_NMBYTES);
 	rspamd_pubkey_unref (rk);
 
 	return TRUE;
 }
 
+static gboolean
+rspamd_fuzzy_decrypt_command (struct fuzzy_session *s)
+{
+	struct rspamd_fuzzy_encrypted_req_hdr *hdr;
+	guchar *payload;
+	gsize payload_len;
+
+	if (s->cmd_type == CMD_ENCRYPTED_NORMAL) {
+		hdr = &s->cmd.enc_normal.hdr;
+		payload = (guchar *)&s->cmd.enc_normal.cmd;
+		payload_len = sizeof (s->cmd.enc_normal.cmd);
+	}
+	else {
+		hdr = &s->cmd.enc_shingle.hdr;
+		payload = (guchar *) &s->cmd.enc_shingle.cmd;
+		payload_len = sizeof (s->cmd.enc_shingle.cmd);
+	}
+
+	return rspamd_fuzzy_decrypt_payload (s->ctx, hdr, fuzzy_encrypted_magic,
+			payload, payload_len, s->nm, &s->key_stat);
+}
+
 static gboolean
 rspamd_fuzzy_cmd_from_wire (guchar *buf, guint buflen, struct fuzzy_session *s)
 {
@@ -1128,7 +1692,179 @@ rspamd_fuzzy_cmd_from_wire (guchar *buf, guint buflen, struct fuzzy_session *s)
 	return TRUE;
 }
 
+static inline gboolean
+rspamd_fuzzy_is_batch (const guchar *buf, gsize buflen)
+{
+	if (buflen < sizeof (struct rspamd_fuzzy_batch_hdr)) {
+		return FALSE;
+	}
+
+	return memcmp (buf, fuzzy_batch_magic, sizeof (fuzzy_batch_magic)) == 0 ||
+			memcmp (buf, fuzzy_encrypted_batch_magic,
+					sizeof (fuzzy_encrypted_batch_magic)) == 0;
+}
+
+/*
+ * Decrypts and validates batch of commands and processes each of them in
+ * a separate session. Takes ownership of `addr` on success
+ */
+static gboolean
+rspamd_fuzzy_process_batch (struct rspamd_worker *worker, gint fd,
+		rspamd_inet_addr_t *addr, guchar *buf, gsize buflen)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = worker->ctx;
+	struct rspamd_fuzzy_encrypted_req_hdr *ehdr;
+	struct rspamd_fuzzy_batch_hdr *bhdr;
+	struct rspamd_fuzzy_cmd *cmd;
+	struct fuzzy_key_stat *key_stat = NULL;
+	struct fuzzy_session *session;
+	struct fuzzy_batch *batch;
+	guchar nm[rspamd_cryptobox_MAX_NMBYTES], *p;
+	gboolean encrypted = FALSE;
+	gsize remain, cmdlen;
+	guint i, ncmds;
+
+	p = buf;
+	remain = buflen;
+
+	if (memcmp (buf, fuzzy_encrypted_batch_magic,
+			sizeof (fuzzy_encrypted_batch_magic)) == 0) {
+		if (remain < sizeof (*ehdr) + sizeof (*bhdr)) {
+			return FALSE;
+		}
+
+		ehdr = (struct rspamd_fuzzy_encrypted_req_hdr *)p;
+		p += sizeof (*ehdr);
+		remain -= sizeof (*ehdr);
+
+		if (!rspamd_fuzzy_decrypt_payload (ctx, ehdr,
+				fuzzy_encrypted_batch_magic, p, remain, nm, &key_stat)) {
+			return FALSE;
+		}
+
+		encrypted = TRUE;
+	}
+
+	bhdr = (struct rspamd_fuzzy_batch_hdr *)p;
+
+	if (memcmp (bhdr->magic, fuzzy_batch_magic, sizeof (bhdr->magic)) != 0 ||
+			bhdr->version != RSPAMD_FUZZY_BATCH_VERSION ||
+			bhdr->ncmds == 0 || bhdr->ncmds > RSPAMD_FUZZY_BATCH_MAX_CMDS) {
+		msg_debug ("invalid fuzzy batch header");
+		return FALSE;
+	}
+
+	ncmds = bhdr->ncmds;
+	p += sizeof (*bhdr);
+	remain -= sizeof (*bhdr);
+
+	/* Validate all commands before processing any of them */
+	buf = p;
+
+	for (i = 0; i < ncmds; i ++) {
+		if (remain < sizeof (*cmd)) {
+			return FALSE;
+		}
+
+		cmd = (struct rspamd_fuzzy_cmd *)p;
+		cmdlen = cmd->shingles_count > 0 ?
+				sizeof (struct rspamd_fuzzy_shingle_cmd) : sizeof (*cmd);
+
+		if (remain < cmdlen ||
+				rspamd_fuzzy_command_valid (cmd, cmdlen) != RSPAMD_FUZZY_EPOCH11) {
+			msg_debug ("invalid fuzzy command %d in batch", i);
+			return FALSE;
+		}
+
+		p += cmdlen;
+		remain -= cmdlen;
+	}
+
+	if (remain != 0) {
+		msg_debug ("garbage after fuzzy batch: %z bytes", remain);
+		return FALSE;
+	}
+
+	batch = g_malloc0 (sizeof (*batch));
+	REF_INIT_RETAIN (batch, fuzzy_batch_destroy);
+	batch->worker = worker;
+	batch->ctx = ctx;
+	batch->fd = fd;
+	batch->addr = addr;
+	batch->encrypted = encrypted;
+	batch->ncmds = ncmds;
+	batch->pending = ncmds;
+	batch->replies = g_malloc0 (sizeof (*batch->replies) * ncmds);
+
+	if (encrypted) {
+		memcpy (batch->nm, nm, sizeof (batch->nm));
+		rspamd_explicit_memzero (nm, sizeof (nm));
+	}
+
+	for (i = 0, p = buf; i < ncmds; i ++) {
+		cmd = (struct rspamd_fuzzy_cmd *)p;
+
+		session = g_malloc0 (sizeof (*session));
+		REF_INIT_RETAIN (session, fuzzy_session_destroy);
+		worker->nconns ++;
+		session->worker = worker;
+		session->fd = fd;
+		session->ctx = ctx;
+		session->time = (guint64) time (NULL);
+		session->addr = rspamd_inet_address_copy (addr);
+		session->epoch = RSPAMD_FUZZY_EPOCH12;
+		session->key_stat = key_stat;
+		REF_RETAIN (batch);
+		session->batch = batch;
+		session->batch_idx = i;
+
+		if (cmd->shingles_count > 0) {
+			session->cmd_type = CMD_SHINGLE;
+			memcpy (&session->cmd.shingle, p, sizeof (session->cmd.shingle));
+			p += sizeof (session->cmd.shingle);
+		}
+		else {
+			session->cmd_type = CMD_NORMAL;
+			memcpy (&session->cmd.normal, p, sizeof (session->cmd.normal));
+			p += sizeof (session->cmd.normal);
+		}
+
+		rspamd_fuzzy_process_command (session);
+		REF_RELEASE (session);
+	}
+
+	REF_RELEASE (batch);
+
+	return TRUE;
+}
+
+enum rspamd_fuzzy_mirror_update_result {
+	FUZZY_MIRROR_UPDATE_REFUSED = 0,
+	FUZZY_MIRROR_UPDATE_APPLIED,
+	FUZZY_MIRROR_UPDATE_BEHIND, /* missing updates are requested from master */
+};
+
 static void
+rspamd_fuzzy_mirror_remap_flag (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct fuzzy_peer_cmd *cmd)
+{
+	gpointer flag_ptr;
+
+	if (cmd->is_shingle) {
+		if ((flag_ptr = g_hash_table_lookup (ctx->master_flags,
+				GUINT_TO_POINTER (cmd->cmd.shingle.basic.flag))) != NULL) {
+			cmd->cmd.shingle.basic.flag = GPOINTER_TO_UINT (flag_ptr);
+		}
+	}
+	else {
+		if ((flag_ptr = g_hash_table_lookup (ctx->master_flags,
+				GUINT_TO_POINTER (cmd->cmd.normal.flag))) != NULL) {
+			cmd->cmd.normal.flag = GPOINTER_TO_UINT (flag_ptr);
+		}
+	}
+}
+
+static enum rspamd_fuzzy_mirror_update_result
 rspamd_fuzzy_mirror_process_update (struct fuzzy_master_update_session *session,
 		struct rspamd_http_message *msg, guint our_rev)
 {
@@ -1143,8 +1879,6 @@ rspamd_fuzzy_mirror_process_update (struct fuzzy_master_update_session *session,
 		finish_processing
 	} state = read_len;
 
-	gpointer flag_ptr;
-
 	/*
 	 * Message format:
 	 * <uint32_le> - revision
@@ -1165,7 +1899,15 @@ rspamd_fuzzy_mirror_process_update (struct fuzzy_master_update_session *session,
 					"refusing update",
 					revision, our_rev);
 
-			return;
+			return FUZZY_MIRROR_UPDATE_REFUSED;
+		}
+		else if (revision - our_rev > 1 &&
+				rspamd_http_message_find_header (msg, "Updates-Log") != NULL) {
+			msg_info_fuzzy_update ("remote revision: %d is newer more than one "
+					"revision than ours: %d, request missing updates from "
+					"the master", revision, our_rev);
+
+			return FUZZY_MIRROR_UPDATE_BEHIND;
 		}
 		else if (revision - our_rev > 1) {
 			msg_warn_fuzzy_update ("remote revision: %d is newer more than one revision "
@@ -1208,130 +1950,430 @@ rspamd_fuzzy_mirror_process_update (struct fuzzy_master_update_session *session,
 				msg_err_fuzzy_update ("short update message while reading data, "
 						"not processing"
 						" (%zd is available, %d is required)", remain, len);
-				return;
+				return FUZZY_MIRROR_UPDATE_REFUSED;
+			}
+
+			if (len < sizeof (struct rspamd_fuzzy_cmd) + sizeof (guint32) ||
+					len > sizeof (cmd)) {
+				/* Bad size command */
+				msg_err_fuzzy_update ("incorrect element size: %d, at least "
+						"%d expected", len,
+						(gint)(sizeof (struct rspamd_fuzzy_cmd) + sizeof (guint32)));
+				goto err;
+			}
+
+			memcpy (&cmd, p, len);
+			if (cmd.is_shingle && len != sizeof (cmd)) {
+				/* Short command */
+				msg_err_fuzzy_update ("incorrect element size: %d, at least "
+						"%d expected", len,
+						(gint)(sizeof (cmd)));
+				goto err;
+			}
+
+			rspamd_fuzzy_mirror_remap_flag (session->ctx, &cmd);
+			g_array_append_val (session->ctx->updates_pending, cmd);
+
+			p += len;
+			remain -= len;
+			len = 0;
+			state = read_len;
+			cnt ++;
+			break;
+		case finish_processing:
+			/* Do nothing */
+			remain = 0;
+			break;
+		}
+	}
+
+
+	rspamd_fuzzy_process_updates_queue (session->ctx, session->src, TRUE);
+	msg_info_fuzzy_update ("processed updates from the master %s, "
+			"%ud operations processed,"
+			" revision: %d (local revision: %d)",
+			rspamd_inet_address_to_string (session->addr),
+			cnt, revision, our_rev);
+
+	return FUZZY_MIRROR_UPDATE_APPLIED;
+
+err:
+	return FUZZY_MIRROR_UPDATE_REFUSED;
+}
+
+
+static void
+fuzzy_batch_destroy (gpointer d)
+{
+	struct fuzzy_batch *batch = d;
+
+	rspamd_inet_address_free (batch->addr);
+	rspamd_explicit_memzero (batch->nm, sizeof (batch->nm));
+	batch->worker->nconns--;
+	g_free (batch->replies);
+	g_free (batch->out);
+	g_free (batch);
+}
+
+static void
+fuzzy_session_destroy (gpointer d)
+{
+	struct fuzzy_session *session = d;
+
+	if (session->batch) {
+		REF_RELEASE (session->batch);
+	}
+
+	rspamd_inet_address_free (session->addr);
+	rspamd_explicit_memzero (session->nm, sizeof (session->nm));
+	session->worker->nconns--;
+	g_free (session);
+}
+
+static void
+rspamd_fuzzy_mirror_record_free (struct fuzzy_mirror_record *rec)
+{
+	g_array_unref (rec->cmds);
+	g_free (rec);
+}
+
+static void
+rspamd_fuzzy_mirror_session_destroy (struct fuzzy_master_update_session *session)
+{
+	struct fuzzy_mirror_record *rec;
+
+	if (session) {
+		rspamd_http_connection_reset (session->conn);
+		rspamd_http_connection_unref (session->conn);
+		rspamd_inet_address_free (session->addr);
+		close (session->sock);
+
+		if (session->psrc) {
+			g_free (session->psrc);
+		}
+
+		if (session->records) {
+			while ((rec = g_queue_pop_head (session->records)) != NULL) {
+				rspamd_fuzzy_mirror_record_free (rec);
 			}
 
-			if (len < sizeof (struct rspamd_fuzzy_cmd) + sizeof (guint32) ||
-					len > sizeof (cmd)) {
-				/* Bad size command */
-				msg_err_fuzzy_update ("incorrect element size: %d, at least "
-						"%d expected", len,
-						(gint)(sizeof (struct rspamd_fuzzy_cmd) + sizeof (guint32)));
-				goto err;
-			}
+			g_queue_free (session->records);
+		}
+
+		g_free (session);
+	}
+}
+
+static void
+rspamd_fuzzy_mirror_error_handler (struct rspamd_http_connection *conn, GError *err)
+{
+	struct fuzzy_master_update_session *session = conn->ud;
+
+	msg_err_fuzzy_update ("abnormally closing connection from: %s, error: %e",
+		rspamd_inet_address_to_string (session->addr), err);
+	/* Terminate session immediately */
+	rspamd_fuzzy_mirror_session_destroy (session);
+}
+
+static struct rspamd_http_message *
+rspamd_fuzzy_mirror_new_reply (guint code, const gchar *str)
+{
+	struct rspamd_http_message *msg;
+
+	msg = rspamd_http_new_message (HTTP_RESPONSE);
+	msg->url = rspamd_fstring_new_init (str, strlen (str));
+	msg->code = code;
+
+	return msg;
+}
+
+static void
+rspamd_fuzzy_mirror_write_reply (struct fuzzy_master_update_session *session,
+		struct rspamd_http_message *msg)
+{
+	session->replied = TRUE;
+
+	rspamd_http_connection_reset (session->conn);
+	rspamd_http_connection_write_message (session->conn, msg, NULL, "text/plain",
+			session, session->sock, &session->ctx->master_io_tv,
+			session->ctx->ev_base);
+}
+
+static void
+rspamd_fuzzy_mirror_send_reply (struct fuzzy_master_update_session *session,
+		guint code, const gchar *str)
+{
+	rspamd_fuzzy_mirror_write_reply (session,
+			rspamd_fuzzy_mirror_new_reply (code, str));
+}
+
+/*
+ * Reply with our revision, so master can send updates we are missing
+ */
+static void
+rspamd_fuzzy_mirror_send_revision (struct fuzzy_master_update_session *session,
+		guint code, const gchar *str, guint64 rev)
+{
+	struct rspamd_http_message *msg;
+	gchar numbuf[64];
+
+	msg = rspamd_fuzzy_mirror_new_reply (code, str);
+	rspamd_snprintf (numbuf, sizeof (numbuf), "%uL", rev);
+	rspamd_http_message_add_header (msg, "Revision", numbuf);
+	rspamd_fuzzy_mirror_write_reply (session, msg);
+}
+
+static void
+rspamd_fuzzy_update_version_callback (guint64 version, void *ud)
+{
+	struct fuzzy_master_update_session *session = ud;
+
+	switch (rspamd_fuzzy_mirror_process_update (session, session->msg,
+			version)) {
+	case FUZZY_MIRROR_UPDATE_APPLIED:
+		rspamd_fuzzy_mirror_send_revision (session, 200, "OK", version + 1);
+		break;
+	case FUZZY_MIRROR_UPDATE_BEHIND:
+		rspamd_fuzzy_mirror_send_revision (session, 409, "Missing updates",
+				version);
+		break;
+	default:
+		rspamd_fuzzy_mirror_send_revision (session, 200, "OK", version);
+		break;
+	}
+}
+
+static gboolean
+rspamd_fuzzy_mirror_record_cb (guint64 rev, GArray *cmds, void *ud)
+{
+	struct fuzzy_master_update_session *session = ud;
+	struct fuzzy_mirror_record *rec;
+	guint i;
+
+	for (i = 0; i < cmds->len; i ++) {
+		rspamd_fuzzy_mirror_remap_flag (session->ctx,
+				&g_array_index (cmds, struct fuzzy_peer_cmd, i));
+	}
 
-			memcpy (&cmd, p, len);
-			if (cmd.is_shingle && len != sizeof (cmd)) {
-				/* Short command */
-				msg_err_fuzzy_update ("incorrect element size: %d, at least "
-						"%d expected", len,
-						(gint)(sizeof (cmd)));
-				goto err;
-			}
+	rec = g_malloc (sizeof (*rec));
+	rec->rev = rev;
+	rec->cmds = g_array_ref (cmds);
+	g_queue_push_tail (session->records, rec);
 
-			if (cmd.is_shingle) {
-				if ((flag_ptr = g_hash_table_lookup (session->ctx->master_flags,
-						GUINT_TO_POINTER (cmd.cmd.shingle.basic.flag))) != NULL) {
-					cmd.cmd.shingle.basic.flag = GPOINTER_TO_UINT (flag_ptr);
-				}
-			}
-			else {
-				if ((flag_ptr = g_hash_table_lookup (session->ctx->master_flags,
-						GUINT_TO_POINTER (cmd.cmd.normal.flag))) != NULL) {
-					cmd.cmd.normal.flag = GPOINTER_TO_UINT (flag_ptr);
-				}
-			}
+	return TRUE;
+}
 
-			g_array_append_val (session->ctx->updates_pending, cmd);
+static gboolean
+rspamd_fuzzy_mirror_decode_records (struct fuzzy_master_update_session *session)
+{
+	const guchar *p;
+	gsize len;
+	GError *err = NULL;
 
-			p += len;
-			remain -= len;
-			len = 0;
-			state = read_len;
-			cnt ++;
-			break;
-		case finish_processing:
-			/* Do nothing */
-			remain = 0;
-			break;
-		}
-	}
+	p = rspamd_http_message_get_body (session->msg, &len);
+	session->records = g_queue_new ();
 
+	if (!rspamd_fuzzy_updates_log_decode (p, len,
+			rspamd_fuzzy_mirror_record_cb, session, &err)) {
+		msg_err_fuzzy_update ("cannot decode updates from the master %s: %e",
+				rspamd_inet_address_to_string (session->addr), err);
+		g_error_free (err);
 
-	rspamd_fuzzy_process_updates_queue (session->ctx, session->src, TRUE);
-	msg_info_fuzzy_update ("processed updates from the master %s, "
-			"%ud operations processed,"
-			" revision: %d (local revision: %d)",
-			rspamd_inet_address_to_string (session->addr),
-			cnt, revision, our_rev);
+		return FALSE;
+	}
 
-err:
-	return;
+	return TRUE;
 }
 
+static void rspamd_fuzzy_mirror_apply_records (
+		struct fuzzy_master_update_session *session);
 
 static void
-fuzzy_session_destroy (gpointer d)
+rspamd_fuzzy_mirror_apply_cb (gboolean success, void *ud)
 {
-	struct fuzzy_session *session = d;
+	struct fuzzy_master_update_session *session = ud;
+	struct fuzzy_mirror_record *rec = session->cur_record;
 
-	rspamd_inet_address_free (session->addr);
-	rspamd_explicit_memzero (session->nm, sizeof (session->nm));
-	session->worker->nconns--;
-	g_free (session);
+	session->cur_record = NULL;
+
+	if (success) {
+		if (!session->snapshot) {
+			session->rev = rec->rev;
+		}
+	}
+	else {
+		msg_err_fuzzy_update ("cannot apply revision %L from the master %s",
+				rec->rev, rspamd_inet_address_to_string (session->addr));
+		session->failed = TRUE;
+	}
+
+	rspamd_fuzzy_mirror_record_free (rec);
+
+	if (!session->applying) {
+		/* Asynchronous backend */
+		rspamd_fuzzy_mirror_apply_records (session);
+	}
 }
 
 static void
-rspamd_fuzzy_mirror_session_destroy (struct fuzzy_master_update_session *session)
+rspamd_fuzzy_mirror_finish_records (struct fuzzy_master_update_session *session)
 {
-	if (session) {
-		rspamd_http_connection_reset (session->conn);
-		rspamd_http_connection_unref (session->conn);
-		rspamd_inet_address_free (session->addr);
-		close (session->sock);
+	struct rspamd_http_message *msg;
+	const rspamd_ftok_t *tok;
 
-		if (session->psrc) {
-			g_free (session->psrc);
+	if (session->snapshot) {
+		if (session->failed) {
+			rspamd_fuzzy_mirror_send_reply (session, 500,
+					"Cannot apply snapshot");
+
+			return;
 		}
-		g_free (session);
+
+		/* Ask for the next chunk */
+		msg = rspamd_fuzzy_mirror_new_reply (200, "OK");
+		tok = rspamd_http_message_find_header (session->msg, "Snapshot-Offset");
+
+		if (tok) {
+			rspamd_http_message_add_header_len (msg, "Snapshot-Offset",
+					tok->begin, tok->len);
+		}
+
+		rspamd_fuzzy_mirror_write_reply (session, msg);
+	}
+	else {
+		msg_info_fuzzy_update ("processed updates log from the master %s, "
+				"revision: %L", rspamd_inet_address_to_string (session->addr),
+				session->rev);
+		rspamd_fuzzy_mirror_send_revision (session,
+				session->failed ? 500 : 200,
+				session->failed ? "Cannot apply updates" : "OK",
+				session->rev);
 	}
 }
 
 static void
-rspamd_fuzzy_mirror_error_handler (struct rspamd_http_connection *conn, GError *err)
+rspamd_fuzzy_mirror_apply_records (struct fuzzy_master_update_session *session)
 {
-	struct fuzzy_master_update_session *session = conn->ud;
+	struct fuzzy_mirror_record *rec;
+
+	/* Synchronous backends call us back immediately, so avoid recursion */
+	session->applying = TRUE;
+
+	while (!session->failed &&
+			(rec = g_queue_pop_head (session->records)) != NULL) {
+		if (!session->snapshot) {
+			if (rec->rev <= session->rev) {
+				/* Already applied */
+				rspamd_fuzzy_mirror_record_free (rec);
+				continue;
+			}
+			else if (rec->rev != session->rev + 1) {
+				msg_err_fuzzy_update ("gap in updates log from the master %s: "
+						"got revision %L, %L expected",
+						rspamd_inet_address_to_string (session->addr),
+						rec->rev, session->rev + 1);
+				rspamd_fuzzy_mirror_record_free (rec);
+				session->failed = TRUE;
+				break;
+			}
+		}
 
-	msg_err_fuzzy_update ("abnormally closing connection from: %s, error: %e",
-		rspamd_inet_address_to_string (session->addr), err);
-	/* Terminate session immediately */
-	rspamd_fuzzy_mirror_session_destroy (session);
+		session->cur_record = rec;
+		rspamd_fuzzy_filter_updates (session->ctx, rec->cmds);
+		/* Revision is committed once the whole snapshot is applied */
+		rspamd_fuzzy_backend_process_updates (session->ctx->backend, rec->cmds,
+				session->snapshot ? NULL : session->src,
+				rspamd_fuzzy_mirror_apply_cb, session);
+
+		if (session->cur_record != NULL) {
+			/* Wait for callback */
+			session->applying = FALSE;
+
+			return;
+		}
+	}
+
+	session->applying = FALSE;
+	rspamd_fuzzy_mirror_finish_records (session);
 }
 
 static void
-rspamd_fuzzy_mirror_send_reply (struct fuzzy_master_update_session *session,
-		guint code, const gchar *str)
+rspamd_fuzzy_delta_version_callback (guint64 version, void *ud)
 {
-	struct rspamd_http_message *msg;
+	struct fuzzy_master_update_session *session = ud;
 
-	msg = rspamd_http_new_message (HTTP_RESPONSE);
-	msg->url = rspamd_fstring_new_init (str, strlen (str));
-	msg->code = code;
-	session->replied = TRUE;
+	session->rev = version;
 
-	rspamd_http_connection_reset (session->conn);
-	rspamd_http_connection_write_message (session->conn, msg, NULL, "text/plain",
-			session, session->sock, &session->ctx->master_io_tv,
-			session->ctx->ev_base);
+	if (!rspamd_fuzzy_mirror_decode_records (session)) {
+		rspamd_fuzzy_mirror_send_reply (session, 400, "Bad updates");
+
+		return;
+	}
+
+	rspamd_fuzzy_mirror_apply_records (session);
 }
 
 static void
-rspamd_fuzzy_update_version_callback (guint64 version, void *ud)
+rspamd_fuzzy_snapshot_version_callback (guint64 version, void *ud)
 {
 	struct fuzzy_master_update_session *session = ud;
+	guint64 snapshot_rev;
+	gsize len;
+
+	if (version != 0) {
+		/* Snapshot is applied to empty storage only */
+		rspamd_fuzzy_mirror_send_revision (session, 409, "Storage is not empty",
+				version);
+
+		return;
+	}
+
+	if (!fuzzy_mirror_get_header_u64 (session->msg, "Snapshot-Revision",
+			&snapshot_rev) || snapshot_rev == 0) {
+		rspamd_fuzzy_mirror_send_reply (session, 400, "Bad snapshot revision");
+
+		return;
+	}
+
+	rspamd_http_message_get_body (session->msg, &len);
+
+	if (len == 0) {
+		/* All chunks are applied, commit revision */
+		if (!rspamd_fuzzy_backend_set_version (session->ctx->backend,
+				session->src, snapshot_rev)) {
+			rspamd_fuzzy_mirror_send_reply (session, 500,
+					"Cannot set revision");
+
+			return;
+		}
+
+		msg_info_fuzzy_update ("loaded snapshot from the master %s, "
+				"revision: %L", rspamd_inet_address_to_string (session->addr),
+				snapshot_rev);
+		rspamd_fuzzy_mirror_send_revision (session, 200, "OK", snapshot_rev);
+
+		return;
+	}
+
+	/* Keep our revision zero until the whole snapshot is applied */
+	session->snapshot = TRUE;
+
+	if (!rspamd_fuzzy_mirror_decode_records (session)) {
+		rspamd_fuzzy_mirror_send_reply (session, 400, "Bad snapshot");
+
+		return;
+	}
+
+	rspamd_fuzzy_mirror_apply_records (session);
+}
+
+static gboolean
+rspamd_fuzzy_mirror_url_match (struct rspamd_http_message *msg,
+		const gchar *path)
+{
+	gsize len = strlen (path);
 
-	rspamd_fuzzy_mirror_process_update (session, session->msg, version);
-	rspamd_fuzzy_mirror_send_reply (session, 200, "OK");
+	return msg->url->len > len && memcmp (msg->url->str, path, len) == 0;
 }
 
 static gint
@@ -1344,6 +2386,7 @@ rspamd_fuzzy_mirror_finish_handler (struct rspamd_http_connection *conn,
 	gchar *psrc;
 	const gchar *src = NULL;
 	gsize remain;
+	gboolean snapshot;
 
 	if (session->replied) {
 		rspamd_fuzzy_mirror_session_destroy (session);
@@ -1375,7 +2418,12 @@ rspamd_fuzzy_mirror_finish_handler (struct rspamd_http_connection *conn,
 			msg_warn_fuzzy_update ("no trusted key specified, accept any update from %s",
 					rspamd_inet_address_to_string (session->addr));
 		}
-		if (!rspamd_http_message_get_body (msg, NULL) || !msg->url
+
+		/* The final snapshot request has no body */
+		snapshot = msg->url && rspamd_fuzzy_mirror_url_match (msg,
+				"/snapshot_v1/");
+
+		if ((!snapshot && !rspamd_http_message_get_body (msg, NULL)) || !msg->url
 				|| msg->url->len == 0) {
 			msg_err_fuzzy_update ("empty update message, not processing");
 			err_str = "Empty update";
@@ -1398,8 +2446,19 @@ rspamd_fuzzy_mirror_finish_handler (struct rspamd_http_connection *conn,
 		session->src = src;
 		session->psrc = psrc;
 		session->msg = msg;
-		rspamd_fuzzy_backend_version (session->ctx->backend, src,
-				rspamd_fuzzy_update_version_callback, session);
+
+		if (snapshot) {
+			rspamd_fuzzy_backend_version (session->ctx->backend, src,
+					rspamd_fuzzy_snapshot_version_callback, session);
+		}
+		else if (rspamd_fuzzy_mirror_url_match (msg, "/delta_v1/")) {
+			rspamd_fuzzy_backend_version (session->ctx->backend, src,
+					rspamd_fuzzy_delta_version_callback, session);
+		}
+		else {
+			rspamd_fuzzy_backend_version (session->ctx->backend, src,
+					rspamd_fuzzy_update_version_callback, session);
+		}
 
 		return 0;
 	}
@@ -1774,11 +2833,13 @@ static void
 accept_fuzzy_socket (gint fd, short what, void *arg)
 {
 	struct rspamd_worker *worker = (struct rspamd_worker *)arg;
+	struct rspamd_fuzzy_storage_ctx *ctx = worker->ctx;
 	struct fuzzy_session *session;
 	rspamd_inet_addr_t *addr;
 	gssize r;
-	guint8 buf[512];
+	guint8 buf[RSPAMD_FUZZY_BATCH_MAX_SIZE * 2];
 	guint64 *nerrors;
+	gboolean valid;
 
 	/* Got some data */
 	if (what == EV_READ) {
@@ -1807,30 +2868,39 @@ accept_fuzzy_socket (gint fd, short what, void *arg)
 				return;
 			}
 
-			session = g_malloc0 (sizeof (*session));
-			REF_INIT_RETAIN (session, fuzzy_session_destroy);
-			session->worker = worker;
-			session->fd = fd;
-			session->ctx = worker->ctx;
-			session->time = (guint64) time (NULL);
-			session->addr = addr;
-
-			if (rspamd_fuzzy_cmd_from_wire (buf, r, session)) {
-				/* Check shingles count sanity */
-				rspamd_fuzzy_process_command (session);
+			if (rspamd_fuzzy_is_batch (buf, r)) {
+				session = NULL;
+				valid = rspamd_fuzzy_process_batch (worker, fd, addr, buf, r);
 			}
 			else {
+				session = g_malloc0 (sizeof (*session));
+				REF_INIT_RETAIN (session, fuzzy_session_destroy);
+				session->worker = worker;
+				session->fd = fd;
+				session->ctx = ctx;
+				session->time = (guint64) time (NULL);
+				session->addr = addr;
+
+				valid = rspamd_fuzzy_cmd_from_wire (buf, r, session);
+
+				if (valid) {
+					/* Check shingles count sanity */
+					rspamd_fuzzy_process_command (session);
+				}
+			}
+
+			if (!valid) {
 				/* Discard input */
-				session->ctx->stat.invalid_requests ++;
+				ctx->stat.invalid_requests ++;
 				msg_debug ("invalid fuzzy command of size %z received", r);
 
-				nerrors = rspamd_lru_hash_lookup (session->ctx->errors_ips,
+				nerrors = rspamd_lru_hash_lookup (ctx->errors_ips,
 						addr, -1);
 
 				if (nerrors == NULL) {
 					nerrors = g_malloc (sizeof (*nerrors));
 					*nerrors = 1;
-					rspamd_lru_hash_insert (session->ctx->errors_ips,
+					rspamd_lru_hash_insert (ctx->errors_ips,
 							rspamd_inet_address_copy (addr),
 							nerrors, -1, -1);
 				}
@@ -1839,7 +2909,14 @@ accept_fuzzy_socket (gint fd, short what, void *arg)
 				}
 			}
 
-			REF_RELEASE (session);
+			if (session) {
+				REF_RELEASE (session);
+			}
+			else if (!valid) {
+				/* Batch has not taken ownership */
+				rspamd_inet_address_free (addr);
+				worker->nconns --;
+			}
 		}
 	}
 }
@@ -1852,7 +2929,9 @@ rspamd_fuzzy_storage_periodic_callback (void *ud)
 	if (ctx->updates_pending->len > 0) {
 		rspamd_fuzzy_process_updates_queue (ctx, local_db_name, FALSE);
 
-		return TRUE;
+		/* Expiration is not logged and may rebuild storage, so wait for export */
+		return !(ctx->updates_log &&
+				rspamd_fuzzy_updates_log_snapshot_active (ctx->updates_log));
 	}
 
 	return FALSE;
@@ -2018,6 +3097,11 @@ rspamd_fuzzy_stat_to_ucl (struct rspamd_fuzzy_storage_ctx *ctx, gboolean ip_stat
 			"invalid_requests",
 			0,
 			false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromint (ctx->stat.filtered_requests),
+			"filtered_requests",
+			0,
+			false);
 
 	if (ctx->errors_ips && ip_stat) {
 		ip_hash = rspamd_lru_hash_get_htable (ctx->errors_ips);
@@ -2341,6 +3425,57 @@ fuzzy_parse_keypair (rspamd_mempool_t *pool,
 	return TRUE;
 }
 
+static gboolean
+fuzzy_storage_parse_filter (rspamd_mempool_t *pool,
+	const ucl_object_t *obj,
+	gpointer ud,
+	struct rspamd_rcl_section *section,
+	GError **err)
+{
+	struct rspamd_rcl_struct_parser *pd = ud;
+	struct rspamd_fuzzy_storage_ctx *ctx;
+	gint64 nelts;
+
+	ctx = pd->user_struct;
+
+	if (!ucl_object_toint_safe (obj, &nelts) || nelts < 0) {
+		g_set_error (err, g_quark_try_string ("fuzzy"), 100,
+				"negative_filter option must be a number of elements");
+
+		return FALSE;
+	}
+
+	if (ctx->filter) {
+		rspamd_fuzzy_filter_destroy (ctx->filter);
+		ctx->filter = NULL;
+	}
+
+	if (nelts > 0) {
+		/*
+		 * Filter must be allocated before workers are forked, as it is
+		 * shared between all of them
+		 */
+		ctx->filter = rspamd_fuzzy_filter_new (nelts, err);
+
+		if (ctx->filter == NULL) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static void
+fuzzy_storage_filter_dtor (gpointer p)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = p;
+
+	if (ctx->filter) {
+		rspamd_fuzzy_filter_destroy (ctx->filter);
+		ctx->filter = NULL;
+	}
+}
+
 static guint
 fuzzy_kp_hash (gconstpointer p)
 {
@@ -2388,6 +3523,12 @@ init_fuzzy (struct rspamd_config *cfg)
 			(rspamd_mempool_destruct_t)rspamd_ptr_array_free_hard, ctx->mirrors);
 	ctx->updates_maxfail = DEFAULT_UPDATES_MAXFAIL;
 	ctx->collection_id_file = RSPAMD_DBDIR "/fuzzy_collection.id";
+	ctx->filter_rebuild = DEFAULT_FILTER_REBUILD;
+	ctx->updates_log_segment_size = DEFAULT_UPDATES_LOG_SEGMENT_SIZE;
+	ctx->updates_log_segments = DEFAULT_UPDATES_LOG_SEGMENTS;
+	ctx->updates_log_max_delta = DEFAULT_UPDATES_LOG_MAX_DELTA;
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+			fuzzy_storage_filter_dtor, ctx);
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -2595,10 +3736,93 @@ init_fuzzy (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, skip_map),
 			0,
 			"Skip specific hashes from the map");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"negative_filter",
+			fuzzy_storage_parse_filter,
+			ctx,
+			0,
+			0,
+			"Number of digests and shingles in the shared filter used to "
+			"answer definite misses without backend lookups, 0 to disable");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"negative_filter_rebuild",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, filter_rebuild),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Rebuild negative filter from the backend to drop deleted and "
+			"expired hashes, default: "
+			G_STRINGIFY (DEFAULT_FILTER_REBUILD) " seconds");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"updates_log",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, updates_log_path),
+			RSPAMD_CL_FLAG_STRING_PATH,
+			"Directory for the compressed updates log used to send missing "
+			"updates and snapshots to mirrors");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"updates_log_segment_size",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+					updates_log_segment_size),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Size of a single updates log segment, default: 64Mb");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"updates_log_segments",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+					updates_log_segments),
+			RSPAMD_CL_FLAG_UINT,
+			"Number of updates log segments to keep, default: "
+			G_STRINGIFY (DEFAULT_UPDATES_LOG_SEGMENTS));
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"updates_log_max_delta",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+					updates_log_max_delta),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Maximum size of updates log data sent to a mirror in a single "
+			"request, default: 8Mb");
 
 	return ctx;
 }
 
+static void
+rspamd_fuzzy_filter_rebuild_cb (gint fd, gshort what, gpointer d)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = d;
+	struct timeval tv;
+	gboolean done;
+
+	if (!rspamd_fuzzy_filter_rebuild (ctx->filter, ctx->backend,
+			FILTER_REBUILD_STEP_ELTS, &done)) {
+		msg_warn ("cannot rebuild negative filter: backend does not "
+				"support enumeration, filter is disabled");
+
+		return;
+	}
+
+	if (!done) {
+		double_to_tv (FILTER_REBUILD_STEP_TIMEOUT, &tv);
+		event_add (&ctx->filter_ev, &tv);
+	}
+	else if (ctx->filter_rebuild > 0) {
+		double_to_tv (rspamd_time_jitter (ctx->filter_rebuild,
+				ctx->filter_rebuild / 10.0), &tv);
+		event_add (&ctx->filter_ev, &tv);
+	}
+}
+
 static void
 rspamd_fuzzy_peer_io (gint fd, gshort what, gpointer d)
 {
@@ -2738,6 +3962,34 @@ start_fuzzy (struct rspamd_worker *worker)
 					sizeof (struct fuzzy_peer_cmd), 1024);
 			rspamd_fuzzy_backend_start_update (ctx->backend, ctx->sync_timeout,
 					rspamd_fuzzy_storage_periodic_callback, ctx);
+
+			if (ctx->updates_log_path) {
+				ctx->updates_log = rspamd_fuzzy_updates_log_open (
+						ctx->updates_log_path,
+						ctx->updates_log_segment_size,
+						ctx->updates_log_segments,
+						&err);
+
+				if (ctx->updates_log == NULL) {
+					msg_err ("cannot open updates log: %e", err);
+					g_error_free (err);
+					err = NULL;
+				}
+				else {
+					ctx->snapshot_waiters = g_ptr_array_new ();
+					event_set (&ctx->snapshot_ev, -1, EV_TIMEOUT,
+							fuzzy_mirror_snapshot_step_cb, ctx);
+					event_base_set (ctx->ev_base, &ctx->snapshot_ev);
+				}
+			}
+
+			if (ctx->filter) {
+				/* Other workers use filter once it becomes ready */
+				event_set (&ctx->filter_ev, -1, EV_TIMEOUT,
+						rspamd_fuzzy_filter_rebuild_cb, ctx);
+				event_base_set (ctx->ev_base, &ctx->filter_ev);
+				rspamd_fuzzy_filter_rebuild_cb (-1, EV_TIMEOUT, ctx);
+			}
 		}
 
 		double_to_tv (ctx->sync_timeout, &ctx->stat_tv);
@@ -2877,6 +4129,13 @@ start_fuzzy (struct rspamd_worker *worker)
 	event_base_loop (ctx->ev_base, 0);
 	rspamd_worker_block_signals ();
 
+	if (worker->index == 0 && ctx->updates_log &&
+			rspamd_fuzzy_updates_log_snapshot_active (ctx->updates_log)) {
+		/* Unfinished snapshot cannot be resumed by another process */
+		event_del (&ctx->snapshot_ev);
+		rspamd_fuzzy_updates_log_snapshot_abort (ctx->updates_log);
+	}
+
 	if (worker->index == 0 && ctx->updates_pending->len > 0) {
 		if (!ctx->collection_mode) {
 			rspamd_fuzzy_process_updates_queue (ctx, local_db_name, FALSE);
@@ -2885,6 +4144,15 @@ start_fuzzy (struct rspamd_worker *worker)
 	}
 
 	if (!ctx->collection_mode) {
+		if (worker->index == 0 && ctx->filter) {
+			event_del (&ctx->filter_ev);
+		}
+
+		if (ctx->updates_log) {
+			rspamd_fuzzy_updates_log_close (ctx->updates_log);
+			g_ptr_array_free (ctx->snapshot_waiters, TRUE);
+		}
+
 		rspamd_fuzzy_backend_close (ctx->backend);
 	}
 	else if (worker->index == 0) {
@@ -297,6 +297,7 @@ struct rspamd_config {
 	gboolean allow_raw_input;                       /**< scan messages with invalid mime					*/
 	gboolean disable_hyperscan;                     /**< disable hyperscan usage							*/
 	gboolean vectorized_hyperscan;                  /**< use vectorized hyperscan matching					*/
+	gboolean redis_pipelining;                      /**< share redis connections between tasks			*/
 	gboolean enable_shutdown_workaround;            /**< enable workaround for legacy SA clients (exim)		*/
 	gboolean ignore_received;                       /**< Ignore data from the first received header			*/
 	gboolean check_local;				/** Don't disable any checks for local networks */
@@ -394,6 +395,9 @@ struct rspamd_config {
 	const ucl_object_t *nameservers;                /**< list of nameservers or NULL to parse resolv.conf	*/
 	guint32 dns_max_requests;                       /**< limit of DNS requests per task 					*/
 	gboolean enable_dnssec;                         /**< enable dnssec stub resolver						*/
+	guint32 dns_cache_size;                         /**< number of replies cached by each worker			*/
+	gdouble dns_cache_max_ttl;                      /**< maximum time to cache positive replies				*/
+	gdouble dns_cache_negative_ttl;                 /**< time to cache NXDOMAIN and empty replies			*/
 
 	guint upstream_max_errors;						/**< upstream max errors before shutting off			*/
 	gdouble upstream_error_time;					/**< rate of upstream errors							*/
@@ -2066,6 +2066,12 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, vectorized_hyperscan),
 			0,
 			"Use hyperscan in vectorized mode (experimental)");
+	rspamd_rcl_add_default_handler (sub,
+			"redis_pipelining",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_config, redis_pipelining),
+			0,
+			"Pipeline single redis commands from different tasks over shared connections");
 	rspamd_rcl_add_default_handler (sub,
 			"cores_dir",
 			rspamd_rcl_parse_struct_string,
@@ -2241,6 +2247,24 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, enable_dnssec),
 			0,
 			"Enable DNSSEC support in Rspamd");
+	rspamd_rcl_add_default_handler (ssub,
+			"cache_size",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, dns_cache_size),
+			RSPAMD_CL_FLAG_INT_32,
+			"Number of DNS replies cached by each worker (0 to disable)");
+	rspamd_rcl_add_default_handler (ssub,
+			"cache_max_ttl",
+			rspamd_rcl_parse_struct_time,
+			G_STRUCT_OFFSET (struct rspamd_config, dns_cache_max_ttl),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Maximum time to cache positive DNS replies");
+	rspamd_rcl_add_default_handler (ssub,
+			"cache_negative_ttl",
+			rspamd_rcl_parse_struct_time,
+			G_STRUCT_OFFSET (struct rspamd_config, dns_cache_negative_ttl),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Time to cache NXDOMAIN and empty DNS replies");
 
 
 	/* New upstreams configuration */
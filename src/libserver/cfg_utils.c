@@ -119,6 +119,10 @@ rspamd_config_new (void)
 	cfg->dns_throttling_time = 10000;
 	/* 16 sockets per DNS server */
 	cfg->dns_io_per_server = 16;
+	cfg->dns_cache_size = 4096;
+	cfg->dns_cache_max_ttl = 3600;
+	cfg->dns_cache_negative_ttl = 60;
+	cfg->redis_pipelining = TRUE;
 
 	/* 20 Kb */
 	cfg->max_diff = 20480;
@@ -27,6 +27,7 @@ static struct rdns_upstream_elt* rspamd_dns_select_upstream_retransmit (
 		const char *name,
 		size_t len, void *ups_data);
 static void rspamd_dns_upstream_ok (struct rdns_upstream_elt *elt,
+		double latency,
 		void *ups_data);
 static void rspamd_dns_upstream_fail (struct rdns_upstream_elt *elt,
 		void *ups_data);
@@ -81,8 +82,8 @@ rspamd_dns_callback (struct rdns_reply *reply, gpointer ud)
 	}
 }
 
-gboolean
-make_dns_request (struct rspamd_dns_resolver *resolver,
+static struct rdns_request *
+rspamd_dns_make_request_common (struct rspamd_dns_resolver *resolver,
 	struct rspamd_async_session *session,
 	rspamd_mempool_t *pool,
 	dns_callback_type cb,
@@ -96,7 +97,7 @@ make_dns_request (struct rspamd_dns_resolver *resolver,
 	g_assert (resolver != NULL);
 
 	if (resolver->r == NULL) {
-		return FALSE;
+		return NULL;
 	}
 
 	if (pool != NULL) {
@@ -129,10 +130,22 @@ make_dns_request (struct rspamd_dns_resolver *resolver,
 		if (pool == NULL) {
 			g_free (reqdata);
 		}
-		return FALSE;
 	}
 
-	return TRUE;
+	return req;
+}
+
+gboolean
+make_dns_request (struct rspamd_dns_resolver *resolver,
+	struct rspamd_async_session *session,
+	rspamd_mempool_t *pool,
+	dns_callback_type cb,
+	gpointer ud,
+	enum rdns_request_type type,
+	const char *name)
+{
+	return rspamd_dns_make_request_common (resolver, session, pool, cb, ud,
+			type, name) != NULL;
 }
 
 static gboolean
@@ -143,25 +156,43 @@ make_dns_request_task_common (struct rspamd_task *task,
 	const char *name,
 	gboolean forced)
 {
-	gboolean ret;
+	struct rdns_request *req;
+	struct rspamd_stat *stat;
 
 	if (!forced && task->dns_requests >= task->cfg->dns_max_requests) {
 		return FALSE;
 	}
 
-	ret = make_dns_request (task->resolver, task->s, task->task_pool, cb, ud,
-			type, name);
+	req = rspamd_dns_make_request_common (task->resolver, task->s,
+			task->task_pool, cb, ud, type, name);
 
-	if (ret) {
+	if (req) {
 		task->dns_requests ++;
 
+		if (task->worker) {
+			stat = task->worker->srv->stat;
+
+			if (rdns_request_is_coalesced (req)) {
+				/* Not sent, but not answered from cache either */
+				g_atomic_int_inc (&stat->dns_coalesced);
+			}
+			else if (task->cfg->dns_cache_size > 0) {
+				if (rdns_request_is_cached (req)) {
+					g_atomic_int_inc (&stat->dns_cache_hits);
+				}
+				else {
+					g_atomic_int_inc (&stat->dns_cache_misses);
+				}
+			}
+		}
+
 		if (!forced && task->dns_requests >= task->cfg->dns_max_requests) {
 			msg_info_task ("<%s> stop resolving on reaching %ud requests",
 					task->message_id, task->dns_requests);
 		}
 	}
 
-	return ret;
+	return req != NULL;
 }
 
 gboolean
@@ -270,6 +301,8 @@ dns_resolver_init (rspamd_logger_t *logger,
 		rdns_resolver_set_log_level (dns_resolver->r, cfg->log_level);
 		dns_resolver->cfg = cfg;
 		rdns_resolver_set_dnssec (dns_resolver->r, cfg->enable_dnssec);
+		rdns_resolver_set_cache (dns_resolver->r, cfg->dns_cache_size,
+				cfg->dns_cache_max_ttl, cfg->dns_cache_negative_ttl);
 
 		if (cfg->nameservers == NULL) {
 			/* Parse resolv.conf */
@@ -363,11 +396,12 @@ rspamd_dns_select_upstream_retransmit (
 
 static void
 rspamd_dns_upstream_ok (struct rdns_upstream_elt *elt,
+		double latency,
 		void *ups_data)
 {
 	struct upstream *up = elt->lib_data;
 
-	rspamd_upstream_ok (up);
+	rspamd_upstream_ok_latency (up, latency);
 }
 
 static void
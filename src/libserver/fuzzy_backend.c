@@ -18,6 +18,7 @@
 #include "fuzzy_backend.h"
 #include "fuzzy_backend_sqlite.h"
 #include "fuzzy_backend_redis.h"
+#include "fuzzy_backend_mmap.h"
 #include "cfg_file.h"
 
 #define DEFAULT_EXPIRE 172800L
@@ -25,6 +26,7 @@
 enum rspamd_fuzzy_backend_type {
 	RSPAMD_FUZZY_BACKEND_SQLITE = 0,
 	RSPAMD_FUZZY_BACKEND_REDIS = 1,
+	RSPAMD_FUZZY_BACKEND_MMAP = 2,
 };
 
 static void* rspamd_fuzzy_backend_init_sqlite (struct rspamd_fuzzy_backend *bk,
@@ -48,6 +50,29 @@ static const gchar* rspamd_fuzzy_backend_id_sqlite (struct rspamd_fuzzy_backend
 		void *subr_ud);
 static void rspamd_fuzzy_backend_expire_sqlite (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud);
+static gboolean rspamd_fuzzy_backend_iterate_sqlite (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_digest_iter_cb dcb,
+		rspamd_fuzzy_shingle_iter_cb scb,
+		void *ud,
+		guint64 *cursor,
+		guint limit,
+		void *subr_ud);
+static gboolean rspamd_fuzzy_backend_export_sqlite (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_export_cb cb,
+		void *ud,
+		guint64 *cursor,
+		guint limit,
+		void *subr_ud);
+static gboolean rspamd_fuzzy_backend_export_digests_sqlite (
+		struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_export_cb cb,
+		void *ud,
+		GPtrArray *digests,
+		void *subr_ud);
+static gboolean rspamd_fuzzy_backend_set_version_sqlite (struct rspamd_fuzzy_backend *bk,
+		const gchar *src,
+		guint64 version,
+		void *subr_ud);
 static void rspamd_fuzzy_backend_close_sqlite (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud);
 
@@ -72,6 +97,28 @@ struct rspamd_fuzzy_backend_subr {
 			void *subr_ud);
 	const gchar* (*id) (struct rspamd_fuzzy_backend *bk, void *subr_ud);
 	void (*periodic) (struct rspamd_fuzzy_backend *bk, void *subr_ud);
+	gboolean (*iterate) (struct rspamd_fuzzy_backend *bk,
+			rspamd_fuzzy_digest_iter_cb dcb,
+			rspamd_fuzzy_shingle_iter_cb scb,
+			void *ud,
+			guint64 *cursor,
+			guint limit,
+			void *subr_ud);
+	gboolean (*export) (struct rspamd_fuzzy_backend *bk,
+			rspamd_fuzzy_export_cb cb,
+			void *ud,
+			guint64 *cursor,
+			guint limit,
+			void *subr_ud);
+	gboolean (*export_digests) (struct rspamd_fuzzy_backend *bk,
+			rspamd_fuzzy_export_cb cb,
+			void *ud,
+			GPtrArray *digests,
+			void *subr_ud);
+	gboolean (*set_version) (struct rspamd_fuzzy_backend *bk,
+			const gchar *src,
+			guint64 version,
+			void *subr_ud);
 	void (*close) (struct rspamd_fuzzy_backend *bk, void *subr_ud);
 };
 
@@ -84,6 +131,10 @@ static const struct rspamd_fuzzy_backend_subr fuzzy_subrs[] = {
 		.version = rspamd_fuzzy_backend_version_sqlite,
 		.id = rspamd_fuzzy_backend_id_sqlite,
 		.periodic = rspamd_fuzzy_backend_expire_sqlite,
+		.iterate = rspamd_fuzzy_backend_iterate_sqlite,
+		.export = rspamd_fuzzy_backend_export_sqlite,
+		.export_digests = rspamd_fuzzy_backend_export_digests_sqlite,
+		.set_version = rspamd_fuzzy_backend_set_version_sqlite,
 		.close = rspamd_fuzzy_backend_close_sqlite,
 	},
 #ifdef WITH_HIREDIS
@@ -96,8 +147,22 @@ static const struct rspamd_fuzzy_backend_subr fuzzy_subrs[] = {
 		.id = rspamd_fuzzy_backend_id_redis,
 		.periodic = rspamd_fuzzy_backend_expire_redis,
 		.close = rspamd_fuzzy_backend_close_redis,
-	}
+	},
 #endif
+	[RSPAMD_FUZZY_BACKEND_MMAP] = {
+		.init = rspamd_fuzzy_backend_init_mmap,
+		.check = rspamd_fuzzy_backend_check_mmap,
+		.update = rspamd_fuzzy_backend_update_mmap,
+		.count = rspamd_fuzzy_backend_count_mmap,
+		.version = rspamd_fuzzy_backend_version_mmap,
+		.id = rspamd_fuzzy_backend_id_mmap,
+		.periodic = rspamd_fuzzy_backend_expire_mmap,
+		.iterate = rspamd_fuzzy_backend_iterate_mmap,
+		.export = rspamd_fuzzy_backend_export_mmap,
+		.export_digests = rspamd_fuzzy_backend_export_digests_mmap,
+		.set_version = rspamd_fuzzy_backend_set_version_mmap,
+		.close = rspamd_fuzzy_backend_close_mmap,
+	},
 };
 
 struct rspamd_fuzzy_backend {
@@ -191,7 +256,7 @@ rspamd_fuzzy_backend_update_sqlite (struct rspamd_fuzzy_backend *bk,
 		}
 
 		if (rspamd_fuzzy_backend_sqlite_finish_update (sq, src,
-				nupdates > 0)) {
+				nupdates > 0 && src != NULL)) {
 			success = TRUE;
 		}
 	}
@@ -249,6 +314,56 @@ rspamd_fuzzy_backend_expire_sqlite (struct rspamd_fuzzy_backend *bk,
 	rspamd_fuzzy_backend_sqlite_sync (sq, bk->expire, TRUE);
 }
 
+static gboolean
+rspamd_fuzzy_backend_iterate_sqlite (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_digest_iter_cb dcb,
+		rspamd_fuzzy_shingle_iter_cb scb,
+		void *ud,
+		guint64 *cursor,
+		guint limit,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_sqlite *sq = subr_ud;
+
+	return rspamd_fuzzy_backend_sqlite_iterate (sq, dcb, scb, ud, cursor, limit);
+}
+
+static gboolean
+rspamd_fuzzy_backend_export_sqlite (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_export_cb cb,
+		void *ud,
+		guint64 *cursor,
+		guint limit,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_sqlite *sq = subr_ud;
+
+	return rspamd_fuzzy_backend_sqlite_export (sq, cb, ud, cursor, limit);
+}
+
+static gboolean
+rspamd_fuzzy_backend_export_digests_sqlite (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_export_cb cb,
+		void *ud,
+		GPtrArray *digests,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_sqlite *sq = subr_ud;
+
+	return rspamd_fuzzy_backend_sqlite_export_digests (sq, cb, ud, digests);
+}
+
+static gboolean
+rspamd_fuzzy_backend_set_version_sqlite (struct rspamd_fuzzy_backend *bk,
+		const gchar *src,
+		guint64 version,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_sqlite *sq = subr_ud;
+
+	return rspamd_fuzzy_backend_sqlite_set_version (sq, src, version);
+}
+
 static void
 rspamd_fuzzy_backend_close_sqlite (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud)
@@ -280,6 +395,10 @@ rspamd_fuzzy_backend_create (struct event_base *ev_base,
 			else if (strcmp (ucl_object_tostring (elt), "redis") == 0) {
 				type = RSPAMD_FUZZY_BACKEND_REDIS;
 			}
+			else if (strcmp (ucl_object_tostring (elt), "mmap") == 0 ||
+					strcmp (ucl_object_tostring (elt), "native") == 0) {
+				type = RSPAMD_FUZZY_BACKEND_MMAP;
+			}
 			else {
 				g_set_error (err, rspamd_fuzzy_backend_quark (),
 						EINVAL, "invalid backend type: %s",
@@ -370,6 +489,71 @@ rspamd_fuzzy_backend_id (struct rspamd_fuzzy_backend *bk)
 	return NULL;
 }
 
+gboolean
+rspamd_fuzzy_backend_iterate (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_digest_iter_cb dcb,
+		rspamd_fuzzy_shingle_iter_cb scb,
+		void *ud,
+		guint64 *cursor,
+		guint limit)
+{
+	g_assert (bk != NULL);
+	g_assert (limit > 0);
+
+	if (bk->subr->iterate) {
+		return bk->subr->iterate (bk, dcb, scb, ud, cursor, limit,
+				bk->subr_ud);
+	}
+
+	return FALSE;
+}
+
+gboolean
+rspamd_fuzzy_backend_export (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_export_cb cb,
+		void *ud,
+		guint64 *cursor,
+		guint limit)
+{
+	g_assert (bk != NULL);
+	g_assert (limit > 0);
+
+	if (bk->subr->export) {
+		return bk->subr->export (bk, cb, ud, cursor, limit, bk->subr_ud);
+	}
+
+	return FALSE;
+}
+
+gboolean
+rspamd_fuzzy_backend_export_digests (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_export_cb cb,
+		void *ud,
+		GPtrArray *digests)
+{
+	g_assert (bk != NULL);
+
+	if (bk->subr->export_digests) {
+		return bk->subr->export_digests (bk, cb, ud, digests, bk->subr_ud);
+	}
+
+	return FALSE;
+}
+
+gboolean
+rspamd_fuzzy_backend_set_version (struct rspamd_fuzzy_backend *bk,
+		const gchar *src,
+		guint64 version)
+{
+	g_assert (bk != NULL);
+
+	if (bk->subr->set_version) {
+		return bk->subr->set_version (bk, src, version, bk->subr_ud);
+	}
+
+	return FALSE;
+}
+
 static inline void
 rspamd_fuzzy_backend_periodic_sync (struct rspamd_fuzzy_backend *bk)
 {
@@ -31,6 +31,11 @@ typedef void (*rspamd_fuzzy_update_cb) (gboolean success, void *ud);
 typedef void (*rspamd_fuzzy_version_cb) (guint64 rev, void *ud);
 typedef void (*rspamd_fuzzy_count_cb) (guint64 count, void *ud);
 typedef gboolean (*rspamd_fuzzy_periodic_cb) (void *ud);
+typedef void (*rspamd_fuzzy_digest_iter_cb) (const guchar *digest, void *ud);
+typedef void (*rspamd_fuzzy_shingle_iter_cb) (guint64 value, guint number,
+		void *ud);
+typedef void (*rspamd_fuzzy_export_cb) (const struct fuzzy_peer_cmd *cmd,
+		void *ud);
 
 /**
  * Open fuzzy backend
@@ -59,7 +64,7 @@ void rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *bk,
  * Process updates for a specific queue
  * @param bk
  * @param updates queue of struct fuzzy_peer_cmd
- * @param src
+ * @param src source which revision is incremented, NULL to keep revisions
  */
 void rspamd_fuzzy_backend_process_updates (struct rspamd_fuzzy_backend *bk,
 		GArray *updates, const gchar *src, rspamd_fuzzy_update_cb cb,
@@ -85,6 +90,70 @@ void rspamd_fuzzy_backend_version (struct rspamd_fuzzy_backend *bk,
 		const gchar *src,
 		rspamd_fuzzy_version_cb cb, void *ud);
 
+/**
+ * Enumerates digests and shingles stored in the backend by pages: each call
+ * examines at most `limit` elements starting from `cursor`. Enumeration
+ * starts with zero cursor and is finished when cursor is set to zero again.
+ * Elements that exist during the whole enumeration are returned at least once
+ * @param bk
+ * @param dcb called for each digest
+ * @param scb called for each shingle with its number (0 based)
+ * @param ud
+ * @param cursor
+ * @param limit
+ * @return FALSE if backend does not support enumeration
+ */
+gboolean rspamd_fuzzy_backend_iterate (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_digest_iter_cb dcb,
+		rspamd_fuzzy_shingle_iter_cb scb,
+		void *ud,
+		guint64 *cursor,
+		guint limit);
+
+/**
+ * Exports stored hashes as FUZZY_WRITE commands by pages: each call exports
+ * at most `limit` digests starting from `cursor` like
+ * rspamd_fuzzy_backend_iterate does. Digests with a full set of shingles are
+ * exported as shingle commands
+ * @param bk
+ * @param cb
+ * @param ud
+ * @param cursor
+ * @param limit
+ * @return FALSE if backend does not support export or export has failed,
+ * e.g. when storage has been rebuilt since the previous page
+ */
+gboolean rspamd_fuzzy_backend_export (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_export_cb cb,
+		void *ud,
+		guint64 *cursor,
+		guint limit);
+
+/**
+ * Exports the current state of the specified digests like
+ * rspamd_fuzzy_backend_export does, digests that are not stored are skipped
+ * @param bk
+ * @param cb
+ * @param ud
+ * @param digests array of pointers to rspamd_cryptobox_HASHBYTES digests
+ * @return FALSE if backend does not support export or export has failed
+ */
+gboolean rspamd_fuzzy_backend_export_digests (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_export_cb cb,
+		void *ud,
+		GPtrArray *digests);
+
+/**
+ * Sets revision for a specific source synchronously
+ * @param bk
+ * @param src
+ * @param version
+ * @return FALSE if backend cannot set revision
+ */
+gboolean rspamd_fuzzy_backend_set_version (struct rspamd_fuzzy_backend *bk,
+		const gchar *src,
+		guint64 version);
+
 /**
  * Returns unique id for backend
  * @param backend
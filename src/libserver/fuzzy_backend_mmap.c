@@ -0,0 +1,2120 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Native fuzzy storage backend.
+ *
+ * The whole storage is a single memory mapped file with the following layout:
+ *
+ * [header][digests table][shingles table]
+ *
+ * Digests table is an open addressing (linear probing) hash keyed by the
+ * 64 bytes digest. Shingles table is another open addressing hash keyed by
+ * pair (shingle value, shingle number) that refers to a slot in the digests
+ * table. Each digest slot has a generation counter, so shingles of the removed
+ * digests are invalidated without scanning the shingles table.
+ *
+ * Only one process (fuzzy worker with index 0) writes to the storage, others
+ * are readers. Writer holds an exclusive lock on `<file>.lock` for its whole
+ * life, so a new writer can tell whether the previous one has died. Writer
+ * wraps each modification of a single hash in a sequence lock stored in the
+ * header, so readers can detect and retry torn reads. Readers never modify
+ * the mapped file.
+ *
+ * Tables are never rebuilt in place: writer copies live elements to a new
+ * file, renames it over the storage and sets `moved` flag in the old header,
+ * so readers remap the storage when they notice the flag. The new file is
+ * large enough for the configured capacity, hence the storage grows when
+ * capacity is increased.
+ *
+ * Shingles are also indexed by bands (LSH): each band is a composite key of
+ * `band_size` consequent shingles stored in the shingles table with numbers
+ * starting from RSPAMD_SHINGLE_SIZE. A fuzzy lookup probes bands first and
+ * scores all shingles merely if some band matches, so misses cost
+ * RSPAMD_SHINGLE_SIZE / band_size probes. With the default band size of 2, any
+ * digest with more than half of shingles matched has at least one band
+ * matched, so the band filter does not lose anything.
+ *
+ * Shingles of a digest are chained via slot links starting from the digest
+ * slot, so export can enumerate digests with their shingles page by page.
+ * Near duplicates share shingles, so a shingle slot that belongs to another
+ * live digest is not reused: the same shingle is stored once per digest (up
+ * to MAX_SHINGLE_OWNERS digests) and a lookup votes for all of them.
+ *
+ * Digests are also linked into time buckets (a ring of double linked lists),
+ * hence expiration touches merely the buckets that are old enough instead of
+ * scanning the whole table.
+ *
+ * Live file is always up-to-date as it is mapped shared. In addition, writer
+ * periodically saves copy-on-write snapshots to `<file>.snap`: each page is
+ * copied to the snapshot either by an incremental background copier or right
+ * before the writer modifies it for the first time after the snapshot start.
+ * Snapshot is used to recover the storage if writer has died in the middle
+ * of an update.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "fuzzy_backend.h"
+#include "fuzzy_backend_mmap.h"
+#include "cryptobox.h"
+#include "str_util.h"
+#include "unix-std.h"
+
+#define RSPAMD_FUZZY_MMAP_VERSION 1
+#define RSPAMD_FUZZY_MMAP_HDR_SIZE 8192
+#define RSPAMD_FUZZY_MMAP_MAX_SOURCES 64
+#define RSPAMD_FUZZY_MMAP_SOURCE_LEN 64
+#define RSPAMD_FUZZY_MMAP_TIME_BUCKETS 256
+#define DEFAULT_CAPACITY (1024 * 1024)
+#define DEFAULT_SNAPSHOT_INTERVAL 3600.0
+#define DEFAULT_BAND_SIZE 2
+/* Pages copied to a snapshot per one iteration of the background copier */
+#define SNAPSHOT_PAGES_PER_STEP 1024
+#define SNAPSHOT_STEP_TIMEOUT 0.01
+/* Live digests that may share a single shingle */
+#define MAX_SHINGLE_OWNERS 16
+/*
+ * How many times reader spins when writer is active, reader never sleeps as
+ * it runs in the event loop of a worker
+ */
+#define MAX_READ_RETRIES 4096
+/* Delay between attempts to rebuild tables after a failure */
+#define REHASH_RETRY_TIMEOUT 60.0
+/* Iteration cursor is a slot index with the storage generation on top */
+#define ITERATE_POS_BITS 40
+#define ITERATE_POS_MASK ((1ULL << ITERATE_POS_BITS) - 1)
+
+#define msg_err_fuzzy_mmap(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
+        "fuzzy_mmap", backend->id, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_warn_fuzzy_mmap(...)   rspamd_default_log_function (G_LOG_LEVEL_WARNING, \
+        "fuzzy_mmap", backend->id, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_info_fuzzy_mmap(...)   rspamd_default_log_function (G_LOG_LEVEL_INFO, \
+        "fuzzy_mmap", backend->id, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_debug_fuzzy_mmap(...)  rspamd_default_log_function (G_LOG_LEVEL_DEBUG, \
+        "fuzzy_mmap", backend->id, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+
+static const guchar fuzzy_mmap_magic[4] = {'r', 's', 'f', 'm'};
+
+enum rspamd_fuzzy_mmap_slot_state {
+	RSPAMD_FUZZY_MMAP_SLOT_EMPTY = 0,
+	RSPAMD_FUZZY_MMAP_SLOT_USED,
+	RSPAMD_FUZZY_MMAP_SLOT_DELETED,
+};
+
+struct rspamd_fuzzy_mmap_source {
+	gchar name[RSPAMD_FUZZY_MMAP_SOURCE_LEN];
+	guint64 version;
+	guint64 last;
+};
+
+struct rspamd_fuzzy_mmap_header {
+	guchar magic[4];
+	guint32 version;
+	guint64 digests_len;        /**< number of digest slots (power of 2)	*/
+	guint64 shingles_len;       /**< number of shingle slots (power of 2)	*/
+	guint64 digests_used;       /**< used + deleted digest slots			*/
+	guint64 shingles_used;      /**< non empty shingle slots				*/
+	guint64 count;              /**< number of live digests				*/
+	guint64 expired;            /**< number of expired digests				*/
+	guint64 bucket_width;       /**< seconds covered by a time bucket		*/
+	guint64 last_expired_bucket;
+	gint seq;                   /**< sequence lock, odd when writing		*/
+	guint32 band_size;          /**< shingles per LSH band, 0 - no bands	*/
+	gint moved;                 /**< file has been replaced by writer		*/
+	guint32 unused;
+	guint32 buckets[RSPAMD_FUZZY_MMAP_TIME_BUCKETS]; /**< slot + 1, 0 is end */
+	struct rspamd_fuzzy_mmap_source sources[RSPAMD_FUZZY_MMAP_MAX_SOURCES];
+};
+
+struct rspamd_fuzzy_mmap_digest {
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+	gint64 value;
+	guint64 time;
+	guint32 flag;
+	guint32 state;
+	guint32 gen;                /**< incremented on each slot reuse		*/
+	guint32 tprev;              /**< time bucket list links, slot + 1		*/
+	guint32 tnext;
+	guint32 shingles;           /**< first shingle slot + 1, 0 - none		*/
+};
+
+struct rspamd_fuzzy_mmap_shingle {
+	guint64 value;
+	guint32 number;             /**< shingle number + 1, 0 for empty slot	*/
+	guint32 digest_idx;
+	guint32 gen;                /**< generation of the referred digest		*/
+	guint32 next;               /**< next shingle of the digest, slot + 1	*/
+};
+
+struct rspamd_fuzzy_mmap_snapshot {
+	gint fd;
+	gchar *tmp_path;
+	guint8 *copied;
+	gsize npages;
+	gsize cur_page;
+	struct event ev;
+	gboolean active;
+};
+
+struct rspamd_fuzzy_backend_mmap {
+	gchar *path;
+	gchar *id;
+	gint fd;
+	gint lock_fd;
+	gboolean writer;
+	guchar *map;
+	gsize len;
+	gsize page_size;
+	guint64 capacity;
+	guint64 min_digests_len;
+	guint64 min_shingles_len;
+	guint band_size;
+	struct rspamd_fuzzy_mmap_header *hdr;
+	struct rspamd_fuzzy_mmap_digest *digests;
+	struct rspamd_fuzzy_mmap_shingle *shingles;
+	struct event_base *ev_base;
+	gdouble snapshot_interval;
+	gdouble last_snapshot;
+	gdouble last_rehash_error;
+	gdouble expire;
+	guint generation;           /**< incremented when storage is replaced	*/
+	struct rspamd_fuzzy_mmap_snapshot snap;
+};
+
+G_STATIC_ASSERT (sizeof (struct rspamd_fuzzy_mmap_header) <=
+		RSPAMD_FUZZY_MMAP_HDR_SIZE);
+
+static void rspamd_fuzzy_mmap_snapshot_finish (
+		struct rspamd_fuzzy_backend_mmap *backend);
+
+static GQuark
+rspamd_fuzzy_backend_mmap_quark (void)
+{
+	return g_quark_from_static_string ("fuzzy-mmap");
+}
+
+static inline guint64
+rspamd_fuzzy_mmap_next_pow2 (guint64 n)
+{
+	guint64 r = 1;
+
+	while (r < n) {
+		r <<= 1;
+	}
+
+	return r;
+}
+
+static inline gsize
+rspamd_fuzzy_mmap_file_len (guint64 digests_len, guint64 shingles_len)
+{
+	return RSPAMD_FUZZY_MMAP_HDR_SIZE +
+			digests_len * sizeof (struct rspamd_fuzzy_mmap_digest) +
+			shingles_len * sizeof (struct rspamd_fuzzy_mmap_shingle);
+}
+
+/*
+ * Tables sizes to store `capacity` hashes with load factor below 0.75
+ */
+static void
+rspamd_fuzzy_mmap_tables_len (guint64 capacity, guint band_size,
+		guint64 *digests_len, guint64 *shingles_len)
+{
+	guint64 nshingles = RSPAMD_SHINGLE_SIZE;
+
+	if (band_size > 0) {
+		nshingles += rspamd_shingles_bands_count (band_size);
+	}
+
+	*digests_len = rspamd_fuzzy_mmap_next_pow2 (capacity / 3 * 4 + 1);
+	*shingles_len = rspamd_fuzzy_mmap_next_pow2 (capacity * nshingles / 3 * 4 + 1);
+}
+
+static inline guint64
+rspamd_fuzzy_mmap_digest_hash (const guchar *digest)
+{
+	guint64 h;
+
+	/* Digest is a cryptographic hash itself */
+	memcpy (&h, digest, sizeof (h));
+
+	return h;
+}
+
+static inline guint64
+rspamd_fuzzy_mmap_shingle_hash (guint64 value, guint number)
+{
+	/* We need platform independent hash as it is stored on disk */
+	return rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+			&value, sizeof (value), number);
+}
+
+/*
+ * Copy-on-write snapshot routines
+ */
+static inline gboolean
+rspamd_fuzzy_mmap_page_is_zero (const guchar *p, gsize len)
+{
+	const guint64 *w = (const guint64 *)p;
+	gsize i;
+
+	for (i = 0; i < len / sizeof (*w); i ++) {
+		if (w[i] != 0) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_fuzzy_mmap_snapshot_abort (struct rspamd_fuzzy_backend_mmap *backend)
+{
+	struct rspamd_fuzzy_mmap_snapshot *snap = &backend->snap;
+
+	if (snap->active) {
+		if (event_get_base (&snap->ev)) {
+			event_del (&snap->ev);
+		}
+
+		close (snap->fd);
+		unlink (snap->tmp_path);
+		g_free (snap->tmp_path);
+		g_free (snap->copied);
+		memset (snap, 0, sizeof (*snap));
+		snap->fd = -1;
+	}
+}
+
+static gboolean
+rspamd_fuzzy_mmap_snapshot_copy_page (struct rspamd_fuzzy_backend_mmap *backend,
+		gsize page)
+{
+	struct rspamd_fuzzy_mmap_snapshot *snap = &backend->snap;
+	gsize off, len;
+
+	if (isset (snap->copied, page)) {
+		return TRUE;
+	}
+
+	off = page * backend->page_size;
+	len = MIN (backend->page_size, backend->len - off);
+
+	/* Snapshot file is sparse, so we can skip empty pages */
+	if (!rspamd_fuzzy_mmap_page_is_zero (backend->map + off, len)) {
+		if (pwrite (snap->fd, backend->map + off, len, off) != (gssize)len) {
+			msg_err_fuzzy_mmap ("cannot write snapshot %s: %s",
+					snap->tmp_path, strerror (errno));
+			rspamd_fuzzy_mmap_snapshot_abort (backend);
+
+			return FALSE;
+		}
+	}
+
+	setbit (snap->copied, page);
+
+	return TRUE;
+}
+
+/*
+ * Must be called before any modification of the mapped memory
+ */
+static inline void
+rspamd_fuzzy_mmap_cow (struct rspamd_fuzzy_backend_mmap *backend,
+		const void *p, gsize len)
+{
+	gsize first, last, i;
+
+	if (G_LIKELY (!backend->snap.active)) {
+		return;
+	}
+
+	first = ((const guchar *)p - backend->map) / backend->page_size;
+	last = ((const guchar *)p + len - 1 - backend->map) / backend->page_size;
+
+	for (i = first; i <= last; i ++) {
+		if (!rspamd_fuzzy_mmap_snapshot_copy_page (backend, i)) {
+			break;
+		}
+	}
+}
+
+#define FUZZY_MMAP_TOUCH(backend, p) rspamd_fuzzy_mmap_cow ((backend), (p), \
+		sizeof (*(p)))
+
+static void
+rspamd_fuzzy_mmap_snapshot_step (gint fd, short what, gpointer ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = ud;
+	struct rspamd_fuzzy_mmap_snapshot *snap = &backend->snap;
+	struct timeval tv;
+	guint i;
+
+	for (i = 0; i < SNAPSHOT_PAGES_PER_STEP && snap->cur_page < snap->npages;
+			i ++, snap->cur_page ++) {
+		if (!rspamd_fuzzy_mmap_snapshot_copy_page (backend, snap->cur_page)) {
+			/* Snapshot has been aborted */
+			return;
+		}
+	}
+
+	if (snap->cur_page >= snap->npages) {
+		rspamd_fuzzy_mmap_snapshot_finish (backend);
+	}
+	else {
+		double_to_tv (SNAPSHOT_STEP_TIMEOUT, &tv);
+		event_add (&snap->ev, &tv);
+	}
+}
+
+static void
+rspamd_fuzzy_mmap_snapshot_start (struct rspamd_fuzzy_backend_mmap *backend)
+{
+	struct rspamd_fuzzy_mmap_snapshot *snap = &backend->snap;
+	struct timeval tv;
+
+	g_assert (!snap->active);
+
+	snap->tmp_path = g_strconcat (backend->path, ".snap.tmp", NULL);
+	snap->fd = open (snap->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 00600);
+
+	if (snap->fd == -1) {
+		msg_err_fuzzy_mmap ("cannot create snapshot %s: %s", snap->tmp_path,
+				strerror (errno));
+		g_free (snap->tmp_path);
+		snap->tmp_path = NULL;
+
+		return;
+	}
+
+	if (ftruncate (snap->fd, backend->len) == -1) {
+		msg_err_fuzzy_mmap ("cannot allocate snapshot %s: %s", snap->tmp_path,
+				strerror (errno));
+		close (snap->fd);
+		unlink (snap->tmp_path);
+		g_free (snap->tmp_path);
+		snap->tmp_path = NULL;
+		snap->fd = -1;
+
+		return;
+	}
+
+	snap->npages = (backend->len + backend->page_size - 1) / backend->page_size;
+	snap->copied = g_malloc0 (howmany (snap->npages, NBBY));
+	snap->cur_page = 0;
+	snap->active = TRUE;
+	backend->last_snapshot = rspamd_get_calendar_ticks ();
+
+	msg_info_fuzzy_mmap ("start snapshot of %s, %z pages", backend->path,
+			snap->npages);
+
+	if (backend->ev_base) {
+		event_set (&snap->ev, -1, EV_TIMEOUT, rspamd_fuzzy_mmap_snapshot_step,
+				backend);
+		event_base_set (backend->ev_base, &snap->ev);
+		double_to_tv (SNAPSHOT_STEP_TIMEOUT, &tv);
+		event_add (&snap->ev, &tv);
+	}
+}
+
+static void
+rspamd_fuzzy_mmap_snapshot_finish (struct rspamd_fuzzy_backend_mmap *backend)
+{
+	struct rspamd_fuzzy_mmap_snapshot *snap = &backend->snap;
+	gchar *snap_path;
+
+	if (!snap->active) {
+		return;
+	}
+
+	/* Copy all pages left */
+	for (; snap->cur_page < snap->npages; snap->cur_page ++) {
+		if (!rspamd_fuzzy_mmap_snapshot_copy_page (backend, snap->cur_page)) {
+			return;
+		}
+	}
+
+	if (fsync (snap->fd) == -1) {
+		msg_err_fuzzy_mmap ("cannot sync snapshot %s: %s", snap->tmp_path,
+				strerror (errno));
+		rspamd_fuzzy_mmap_snapshot_abort (backend);
+
+		return;
+	}
+
+	snap_path = g_strconcat (backend->path, ".snap", NULL);
+
+	if (rename (snap->tmp_path, snap_path) == -1) {
+		msg_err_fuzzy_mmap ("cannot rename snapshot %s to %s: %s",
+				snap->tmp_path, snap_path, strerror (errno));
+		g_free (snap_path);
+		rspamd_fuzzy_mmap_snapshot_abort (backend);
+
+		return;
+	}
+
+	msg_info_fuzzy_mmap ("saved snapshot %s", snap_path);
+	g_free (snap_path);
+
+	if (event_get_base (&snap->ev)) {
+		event_del (&snap->ev);
+	}
+
+	close (snap->fd);
+	g_free (snap->tmp_path);
+	g_free (snap->copied);
+	memset (snap, 0, sizeof (*snap));
+	snap->fd = -1;
+}
+
+/*
+ * Sequence lock
+ */
+static inline void
+rspamd_fuzzy_mmap_write_begin (struct rspamd_fuzzy_backend_mmap *backend)
+{
+	rspamd_fuzzy_mmap_cow (backend, backend->hdr, RSPAMD_FUZZY_MMAP_HDR_SIZE);
+	g_atomic_int_inc (&backend->hdr->seq);
+}
+
+static inline void
+rspamd_fuzzy_mmap_write_end (struct rspamd_fuzzy_backend_mmap *backend)
+{
+	g_atomic_int_inc (&backend->hdr->seq);
+}
+
+/*
+ * Time buckets
+ */
+static inline guint
+rspamd_fuzzy_mmap_time_bucket (struct rspamd_fuzzy_backend_mmap *backend,
+		guint64 t)
+{
+	return (t / backend->hdr->bucket_width) % RSPAMD_FUZZY_MMAP_TIME_BUCKETS;
+}
+
+static void
+rspamd_fuzzy_mmap_time_link (struct rspamd_fuzzy_backend_mmap *backend,
+		guint32 idx)
+{
+	struct rspamd_fuzzy_mmap_digest *d = &backend->digests[idx], *next;
+	guint b;
+
+	b = rspamd_fuzzy_mmap_time_bucket (backend, d->time);
+	FUZZY_MMAP_TOUCH (backend, d);
+	d->tprev = 0;
+	d->tnext = backend->hdr->buckets[b];
+
+	if (d->tnext) {
+		next = &backend->digests[d->tnext - 1];
+		FUZZY_MMAP_TOUCH (backend, next);
+		next->tprev = idx + 1;
+	}
+
+	backend->hdr->buckets[b] = idx + 1;
+}
+
+static void
+rspamd_fuzzy_mmap_time_unlink (struct rspamd_fuzzy_backend_mmap *backend,
+		guint32 idx)
+{
+	struct rspamd_fuzzy_mmap_digest *d = &backend->digests[idx], *nb;
+	guint b;
+
+	if (d->tprev) {
+		nb = &backend->digests[d->tprev - 1];
+		FUZZY_MMAP_TOUCH (backend, nb);
+		nb->tnext = d->tnext;
+	}
+	else {
+		b = rspamd_fuzzy_mmap_time_bucket (backend, d->time);
+
+		if (backend->hdr->buckets[b] == idx + 1) {
+			backend->hdr->buckets[b] = d->tnext;
+		}
+	}
+
+	if (d->tnext) {
+		nb = &backend->digests[d->tnext - 1];
+		FUZZY_MMAP_TOUCH (backend, nb);
+		nb->tprev = d->tprev;
+	}
+
+	FUZZY_MMAP_TOUCH (backend, d);
+	d->tprev = 0;
+	d->tnext = 0;
+}
+
+/*
+ * Hash tables
+ */
+static gint64
+rspamd_fuzzy_mmap_find_digest (struct rspamd_fuzzy_backend_mmap *backend,
+		const guchar *digest, gint64 *free_slot)
+{
+	guint64 mask = backend->hdr->digests_len - 1, i, idx;
+	struct rspamd_fuzzy_mmap_digest *d;
+
+	idx = rspamd_fuzzy_mmap_digest_hash (digest) & mask;
+
+	if (free_slot) {
+		*free_slot = -1;
+	}
+
+	for (i = 0; i <= mask; i ++, idx = (idx + 1) & mask) {
+		d = &backend->digests[idx];
+
+		if (d->state == RSPAMD_FUZZY_MMAP_SLOT_EMPTY) {
+			if (free_slot && *free_slot == -1) {
+				*free_slot = idx;
+			}
+
+			return -1;
+		}
+		else if (d->state == RSPAMD_FUZZY_MMAP_SLOT_DELETED) {
+			if (free_slot && *free_slot == -1) {
+				*free_slot = idx;
+			}
+		}
+		else if (memcmp (d->digest, digest, sizeof (d->digest)) == 0) {
+			return idx;
+		}
+	}
+
+	return -1;
+}
+
+static inline gboolean
+rspamd_fuzzy_mmap_shingle_valid (struct rspamd_fuzzy_backend_mmap *backend,
+		const struct rspamd_fuzzy_mmap_shingle *sh)
+{
+	const struct rspamd_fuzzy_mmap_digest *d;
+
+	if (sh->digest_idx >= backend->hdr->digests_len) {
+		return FALSE;
+	}
+
+	d = &backend->digests[sh->digest_idx];
+
+	return d->state == RSPAMD_FUZZY_MMAP_SLOT_USED && d->gen == sh->gen;
+}
+
+/*
+ * Finds digests that own the shingle, returns their number. Near duplicates
+ * share shingles, so a shingle may have up to MAX_SHINGLE_OWNERS owners
+ */
+static guint
+rspamd_fuzzy_mmap_find_shingle (struct rspamd_fuzzy_backend_mmap *backend,
+		guint64 value, guint number, gint64 *owners, guint max_owners)
+{
+	guint64 mask = backend->hdr->shingles_len - 1, i, idx;
+	struct rspamd_fuzzy_mmap_shingle *sh;
+	guint nowners = 0;
+
+	idx = rspamd_fuzzy_mmap_shingle_hash (value, number) & mask;
+
+	for (i = 0; i <= mask && nowners < max_owners;
+			i ++, idx = (idx + 1) & mask) {
+		sh = &backend->shingles[idx];
+
+		if (sh->number == 0) {
+			break;
+		}
+
+		if (sh->value == value && sh->number == number + 1 &&
+				rspamd_fuzzy_mmap_shingle_valid (backend, sh)) {
+			owners[nowners ++] = sh->digest_idx;
+		}
+	}
+
+	return nowners;
+}
+
+/*
+ * Removes a shingle slot from the chain of its digest, slot must be valid
+ */
+static void
+rspamd_fuzzy_mmap_unlink_shingle (struct rspamd_fuzzy_backend_mmap *backend,
+		struct rspamd_fuzzy_mmap_shingle *sh)
+{
+	struct rspamd_fuzzy_mmap_digest *d = &backend->digests[sh->digest_idx];
+	struct rspamd_fuzzy_mmap_shingle *prev = NULL, *cur;
+	guint32 link = d->shingles, sidx = sh - backend->shingles + 1;
+	guint i;
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE && link != 0 &&
+			link <= backend->hdr->shingles_len; i ++) {
+		cur = &backend->shingles[link - 1];
+
+		if (link == sidx) {
+			if (prev) {
+				FUZZY_MMAP_TOUCH (backend, prev);
+				prev->next = cur->next;
+			}
+			else {
+				FUZZY_MMAP_TOUCH (backend, d);
+				d->shingles = cur->next;
+			}
+
+			return;
+		}
+
+		prev = cur;
+		link = cur->next;
+	}
+}
+
+/*
+ * Slots of other live digests are never reused unless the shingle has
+ * MAX_SHINGLE_OWNERS owners already, then the first owner found loses it
+ */
+static gint64
+rspamd_fuzzy_mmap_insert_shingle (struct rspamd_fuzzy_backend_mmap *backend,
+		guint64 value, guint number, guint32 digest_idx, guint32 gen)
+{
+	guint64 mask = backend->hdr->shingles_len - 1, i, idx;
+	struct rspamd_fuzzy_mmap_shingle *sh, *stale = NULL, *first_owner = NULL;
+	guint nowners = 0;
+
+	idx = rspamd_fuzzy_mmap_shingle_hash (value, number) & mask;
+
+	for (i = 0; i <= mask; i ++, idx = (idx + 1) & mask) {
+		sh = &backend->shingles[idx];
+
+		if (sh->number == 0) {
+			if (stale == NULL) {
+				stale = sh;
+				backend->hdr->shingles_used ++;
+			}
+
+			break;
+		}
+
+		if (!rspamd_fuzzy_mmap_shingle_valid (backend, sh)) {
+			if (stale == NULL) {
+				stale = sh;
+			}
+		}
+		else if (sh->value == value && sh->number == number + 1) {
+			if (first_owner == NULL) {
+				first_owner = sh;
+			}
+
+			nowners ++;
+		}
+	}
+
+	if (nowners >= MAX_SHINGLE_OWNERS) {
+		if (stale && stale->number == 0) {
+			backend->hdr->shingles_used --;
+		}
+
+		rspamd_fuzzy_mmap_unlink_shingle (backend, first_owner);
+		stale = first_owner;
+	}
+
+	if (stale) {
+		FUZZY_MMAP_TOUCH (backend, stale);
+		stale->value = value;
+		stale->number = number + 1;
+		stale->digest_idx = digest_idx;
+		stale->gen = gen;
+		stale->next = 0;
+
+		return stale - backend->shingles;
+	}
+
+	return -1;
+}
+
+/*
+ * Prepends a shingle slot to the chain of the digest, digest slot must be
+ * touched by the caller
+ */
+static inline void
+rspamd_fuzzy_mmap_link_shingle (struct rspamd_fuzzy_backend_mmap *backend,
+		struct rspamd_fuzzy_mmap_digest *d, gint64 sidx)
+{
+	if (sidx != -1) {
+		backend->shingles[sidx].next = d->shingles;
+		d->shingles = sidx + 1;
+	}
+}
+
+static void
+rspamd_fuzzy_mmap_set_map (struct rspamd_fuzzy_backend_mmap *backend,
+		guchar *map, gsize len)
+{
+	backend->map = map;
+	backend->len = len;
+	backend->hdr = (struct rspamd_fuzzy_mmap_header *)map;
+	backend->digests = (struct rspamd_fuzzy_mmap_digest *)
+			(map + RSPAMD_FUZZY_MMAP_HDR_SIZE);
+	backend->shingles = (struct rspamd_fuzzy_mmap_shingle *)
+			(map + RSPAMD_FUZZY_MMAP_HDR_SIZE +
+			backend->hdr->digests_len * sizeof (struct rspamd_fuzzy_mmap_digest));
+}
+
+/*
+ * Copies all live elements to a new file dropping deleted and stale elements
+ * and replaces the storage with it. Old file is not modified except `moved`
+ * flag, so readers are not blocked while tables are rebuilt. Writer only
+ */
+static gboolean
+rspamd_fuzzy_mmap_rehash (struct rspamd_fuzzy_backend_mmap *backend)
+{
+	struct rspamd_fuzzy_mmap_header *hdr = backend->hdr;
+	struct rspamd_fuzzy_backend_mmap nbk;
+	struct rspamd_fuzzy_mmap_digest *d;
+	struct rspamd_fuzzy_mmap_shingle *sh;
+	guint64 digests_len, shingles_len, i;
+	guint32 *remap = NULL;
+	gint64 free_slot, sidx;
+	gchar *tmp_path, *snap_path;
+	guchar *map;
+	gsize len;
+	gint fd;
+
+	g_assert (backend->writer);
+
+	digests_len = MAX (hdr->digests_len, backend->min_digests_len);
+	shingles_len = MAX (hdr->shingles_len, backend->min_shingles_len);
+	len = rspamd_fuzzy_mmap_file_len (digests_len, shingles_len);
+	tmp_path = g_strconcat (backend->path, ".new", NULL);
+	fd = rspamd_file_xopen (tmp_path, O_RDWR | O_CREAT | O_TRUNC, 00600, FALSE);
+
+	if (fd == -1) {
+		msg_err_fuzzy_mmap ("cannot create %s: %s", tmp_path, strerror (errno));
+		goto err;
+	}
+
+	/* File is sparse, so pages are allocated on demand */
+	if (ftruncate (fd, len) == -1) {
+		msg_err_fuzzy_mmap ("cannot allocate %s: %s", tmp_path, strerror (errno));
+		goto err;
+	}
+
+	map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (map == MAP_FAILED) {
+		msg_err_fuzzy_mmap ("cannot mmap %s: %s", tmp_path, strerror (errno));
+		goto err;
+	}
+
+	/* Copy header except tables and counters */
+	memcpy (map, hdr, sizeof (*hdr));
+	memset (&nbk, 0, sizeof (nbk));
+	nbk.id = backend->id;
+	nbk.page_size = backend->page_size;
+	nbk.snap.fd = -1;
+	((struct rspamd_fuzzy_mmap_header *)map)->digests_len = digests_len;
+	rspamd_fuzzy_mmap_set_map (&nbk, map, len);
+	nbk.hdr->shingles_len = shingles_len;
+	nbk.hdr->digests_used = 0;
+	nbk.hdr->shingles_used = 0;
+	nbk.hdr->count = 0;
+	nbk.hdr->seq = 0;
+	nbk.hdr->moved = 0;
+	memset (nbk.hdr->buckets, 0, sizeof (nbk.hdr->buckets));
+
+	remap = g_malloc0 (sizeof (guint32) * hdr->digests_len);
+
+	for (i = 0; i < hdr->digests_len; i ++) {
+		d = &backend->digests[i];
+
+		if (d->state == RSPAMD_FUZZY_MMAP_SLOT_USED) {
+			rspamd_fuzzy_mmap_find_digest (&nbk, d->digest, &free_slot);
+			g_assert (free_slot != -1);
+			memcpy (&nbk.digests[free_slot], d, sizeof (*d));
+			nbk.digests[free_slot].shingles = 0;
+			rspamd_fuzzy_mmap_time_link (&nbk, free_slot);
+			remap[i] = free_slot + 1;
+			nbk.hdr->digests_used ++;
+			nbk.hdr->count ++;
+		}
+	}
+
+	for (i = 0; i < hdr->shingles_len; i ++) {
+		sh = &backend->shingles[i];
+
+		if (sh->number != 0 && rspamd_fuzzy_mmap_shingle_valid (backend, sh) &&
+				remap[sh->digest_idx] != 0) {
+			sidx = rspamd_fuzzy_mmap_insert_shingle (&nbk, sh->value,
+					sh->number - 1, remap[sh->digest_idx] - 1, sh->gen);
+
+			/* LSH band keys are not chained */
+			if (sh->number <= RSPAMD_SHINGLE_SIZE) {
+				rspamd_fuzzy_mmap_link_shingle (&nbk,
+						&nbk.digests[remap[sh->digest_idx] - 1], sidx);
+			}
+		}
+	}
+
+	g_free (remap);
+	remap = NULL;
+
+	/* New file must be complete on disk before it replaces the storage */
+	if (msync (map, len, MS_SYNC) == -1 || fsync (fd) == -1 ||
+			rename (tmp_path, backend->path) == -1) {
+		msg_err_fuzzy_mmap ("cannot replace %s with %s: %s", backend->path,
+				tmp_path, strerror (errno));
+		munmap (map, len);
+		goto err;
+	}
+
+	/* Snapshot of the old file is useless now */
+	rspamd_fuzzy_mmap_snapshot_abort (backend);
+	snap_path = g_strconcat (backend->path, ".snap", NULL);
+	unlink (snap_path);
+	g_free (snap_path);
+
+	g_atomic_int_set (&hdr->moved, 1);
+	munmap (backend->map, backend->len);
+	close (backend->fd);
+	backend->fd = fd;
+	rspamd_fuzzy_mmap_set_map (backend, map, len);
+	backend->generation ++;
+
+	msg_info_fuzzy_mmap ("rehashed storage: %L digests, %L shingles, "
+			"%L digests slots, %L shingles slots",
+			backend->hdr->digests_used, backend->hdr->shingles_used,
+			digests_len, shingles_len);
+	g_free (tmp_path);
+
+	if (backend->snapshot_interval > 0) {
+		rspamd_fuzzy_mmap_snapshot_start (backend);
+	}
+
+	return TRUE;
+
+err:
+	if (fd != -1) {
+		close (fd);
+		unlink (tmp_path);
+	}
+
+	g_free (remap);
+	g_free (tmp_path);
+	backend->last_rehash_error = rspamd_get_calendar_ticks ();
+
+	return FALSE;
+}
+
+static inline gboolean
+rspamd_fuzzy_mmap_need_rehash (struct rspamd_fuzzy_backend_mmap *backend)
+{
+	struct rspamd_fuzzy_mmap_header *hdr = backend->hdr;
+
+	if (hdr->digests_used < hdr->digests_len / 4 * 3 &&
+			hdr->shingles_used < hdr->shingles_len / 4 * 3 &&
+			hdr->digests_len >= backend->min_digests_len &&
+			hdr->shingles_len >= backend->min_shingles_len) {
+		return FALSE;
+	}
+
+	/* Do not retry failed rehash on each update */
+	return backend->last_rehash_error == 0 ||
+			rspamd_get_calendar_ticks () - backend->last_rehash_error >
+			REHASH_RETRY_TIMEOUT;
+}
+
+static void
+rspamd_fuzzy_mmap_delete_slot (struct rspamd_fuzzy_backend_mmap *backend,
+		guint32 idx)
+{
+	struct rspamd_fuzzy_mmap_digest *d = &backend->digests[idx];
+
+	rspamd_fuzzy_mmap_time_unlink (backend, idx);
+	FUZZY_MMAP_TOUCH (backend, d);
+	d->state = RSPAMD_FUZZY_MMAP_SLOT_DELETED;
+
+	if (backend->hdr->count > 0) {
+		backend->hdr->count --;
+	}
+}
+
+static gboolean
+rspamd_fuzzy_mmap_add (struct rspamd_fuzzy_backend_mmap *backend,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	struct rspamd_fuzzy_mmap_header *hdr = backend->hdr;
+	struct rspamd_fuzzy_mmap_digest *d;
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	gint64 idx, free_slot, sidx;
+	guint64 now = time (NULL);
+	guint i, nbands;
+
+	idx = rspamd_fuzzy_mmap_find_digest (backend, cmd->digest, &free_slot);
+
+	if (idx != -1) {
+		d = &backend->digests[idx];
+		rspamd_fuzzy_mmap_time_unlink (backend, idx);
+		FUZZY_MMAP_TOUCH (backend, d);
+
+		if (d->flag == cmd->flag) {
+			/* We need to increase weight */
+			d->value += cmd->value;
+		}
+		else {
+			/* We need to relearn actually */
+			d->value = cmd->value;
+			d->flag = cmd->flag;
+		}
+
+		d->time = now;
+		rspamd_fuzzy_mmap_time_link (backend, idx);
+
+		return TRUE;
+	}
+
+	if (hdr->count >= backend->capacity) {
+		msg_warn_fuzzy_mmap ("cannot add hash to %d -> %*xs: storage is full "
+				"(%L hashes), increase capacity", (gint)cmd->flag,
+				(gint)sizeof (cmd->digest), cmd->digest, hdr->count);
+
+		return FALSE;
+	}
+
+	if (free_slot == -1) {
+		msg_warn_fuzzy_mmap ("cannot add hash to %d -> %*xs: no free slots",
+				(gint)cmd->flag,
+				(gint)sizeof (cmd->digest), cmd->digest);
+
+		return FALSE;
+	}
+
+	d = &backend->digests[free_slot];
+	FUZZY_MMAP_TOUCH (backend, d);
+
+	if (d->state == RSPAMD_FUZZY_MMAP_SLOT_EMPTY) {
+		hdr->digests_used ++;
+	}
+
+	memcpy (d->digest, cmd->digest, sizeof (d->digest));
+	d->value = cmd->value;
+	d->flag = cmd->flag;
+	d->time = now;
+	d->state = RSPAMD_FUZZY_MMAP_SLOT_USED;
+	/* Invalidate all shingles that refer to the previous slot owner */
+	d->gen ++;
+	d->shingles = 0;
+	rspamd_fuzzy_mmap_time_link (backend, free_slot);
+	hdr->count ++;
+
+	if (cmd->shingles_count > 0) {
+		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			sidx = rspamd_fuzzy_mmap_insert_shingle (backend,
+					shcmd->sgl.hashes[i], i, free_slot, d->gen);
+			rspamd_fuzzy_mmap_link_shingle (backend, d, sidx);
+			msg_debug_fuzzy_mmap ("add shingle %d -> %L: %L",
+					i,
+					shcmd->sgl.hashes[i],
+					free_slot);
+		}
+
+		if (hdr->band_size > 0) {
+			nbands = rspamd_shingles_bands_count (hdr->band_size);
+
+			for (i = 0; i < nbands; i ++) {
+				rspamd_fuzzy_mmap_insert_shingle (backend,
+						rspamd_shingles_band_key (&shcmd->sgl, i, hdr->band_size),
+						RSPAMD_SHINGLE_SIZE + i, free_slot, d->gen);
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_fuzzy_mmap_del (struct rspamd_fuzzy_backend_mmap *backend,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	gint64 idx;
+
+	idx = rspamd_fuzzy_mmap_find_digest (backend, cmd->digest, NULL);
+
+	if (idx == -1) {
+		/* Hash is missing */
+		return FALSE;
+	}
+
+	rspamd_fuzzy_mmap_delete_slot (backend, idx);
+
+	return TRUE;
+}
+
+static struct rspamd_fuzzy_mmap_source *
+rspamd_fuzzy_mmap_find_source (struct rspamd_fuzzy_backend_mmap *backend,
+		const gchar *src, gboolean create)
+{
+	struct rspamd_fuzzy_mmap_source *s;
+	guint i;
+
+	for (i = 0; i < RSPAMD_FUZZY_MMAP_MAX_SOURCES; i ++) {
+		s = &backend->hdr->sources[i];
+
+		if (s->name[0] == '\0') {
+			if (create) {
+				rspamd_strlcpy (s->name, src, sizeof (s->name));
+
+				return s;
+			}
+
+			break;
+		}
+
+		if (strncmp (s->name, src, sizeof (s->name) - 1) == 0) {
+			return s;
+		}
+	}
+
+	return NULL;
+}
+
+static gint
+rspamd_fuzzy_mmap_int64_cmp (const void *a, const void *b)
+{
+	gint64 ia = *(gint64 *)a, ib = *(gint64 *)b;
+
+	if (ia < ib) {
+		return -1;
+	}
+	else if (ia > ib) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+rspamd_fuzzy_mmap_check_unlocked (struct rspamd_fuzzy_backend_mmap *backend,
+		const struct rspamd_fuzzy_cmd *cmd, gint64 expire,
+		struct rspamd_fuzzy_reply *rep)
+{
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	const struct rspamd_fuzzy_mmap_digest *d;
+	gint64 shingle_values[RSPAMD_SHINGLE_SIZE * MAX_SHINGLE_OWNERS], owner;
+	gint64 idx, sel_id, cur_id;
+	guint i, n, nvalues, cur_cnt, max_cnt, nbands;
+	gboolean band_found;
+	guint64 now = time (NULL);
+
+	memset (rep, 0, sizeof (*rep));
+	memcpy (rep->digest, cmd->digest, sizeof (rep->digest));
+
+	/* Try direct match first of all */
+	idx = rspamd_fuzzy_mmap_find_digest (backend, cmd->digest, NULL);
+
+	if (idx != -1) {
+		d = &backend->digests[idx];
+
+		if (now > d->time && (gint64)(now - d->time) > expire) {
+			/* Expire element */
+			msg_debug_fuzzy_mmap ("requested hash has been expired");
+		}
+		else {
+			rep->v1.value = d->value;
+			rep->v1.prob = 1.0;
+			rep->v1.flag = d->flag;
+			rep->ts = d->time;
+		}
+	}
+	else if (cmd->shingles_count > 0) {
+		/* Fuzzy match */
+		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+
+		if (backend->hdr->band_size > 0) {
+			nbands = rspamd_shingles_bands_count (backend->hdr->band_size);
+			band_found = FALSE;
+
+			for (i = 0; i < nbands; i ++) {
+				if (rspamd_fuzzy_mmap_find_shingle (backend,
+						rspamd_shingles_band_key (&shcmd->sgl, i,
+								backend->hdr->band_size),
+						RSPAMD_SHINGLE_SIZE + i, &owner, 1) > 0) {
+					band_found = TRUE;
+					break;
+				}
+			}
+
+			if (!band_found) {
+				msg_debug_fuzzy_mmap ("no LSH bands matched");
+
+				return;
+			}
+		}
+
+		/* Each owner of a shingle gets a vote */
+		nvalues = 0;
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			n = rspamd_fuzzy_mmap_find_shingle (backend,
+					shcmd->sgl.hashes[i], i, &shingle_values[nvalues],
+					MAX_SHINGLE_OWNERS);
+			msg_debug_fuzzy_mmap ("looking for shingle %d -> %L: %d owners", i,
+					shcmd->sgl.hashes[i], n);
+			nvalues += n;
+		}
+
+		qsort (shingle_values, nvalues, sizeof (gint64),
+				rspamd_fuzzy_mmap_int64_cmp);
+		sel_id = -1;
+		cur_id = -1;
+		cur_cnt = 0;
+		max_cnt = 0;
+
+		for (i = 0; i < nvalues; i ++) {
+			if (shingle_values[i] == cur_id) {
+				cur_cnt ++;
+			}
+			else {
+				cur_id = shingle_values[i];
+				cur_cnt = 1;
+			}
+
+			if (cur_cnt > max_cnt) {
+				max_cnt = cur_cnt;
+				sel_id = cur_id;
+			}
+		}
+
+		if (sel_id != -1) {
+			rep->v1.prob = (float)max_cnt / (float)RSPAMD_SHINGLE_SIZE;
+
+			if (rep->v1.prob > 0.5) {
+				msg_debug_fuzzy_mmap (
+						"found fuzzy hash with probability %.2f",
+						rep->v1.prob);
+				d = &backend->digests[sel_id];
+
+				if (now > d->time && (gint64)(now - d->time) > expire) {
+					/* Expire element */
+					msg_debug_fuzzy_mmap ("requested hash has been expired");
+					rep->v1.prob = 0.0;
+				}
+				else {
+					rep->ts = d->time;
+					memcpy (rep->digest, d->digest, sizeof (rep->digest));
+					rep->v1.value = d->value;
+					rep->v1.flag = d->flag;
+				}
+			}
+			else {
+				/* Otherwise we assume that as error */
+				rep->v1.value = 0;
+			}
+		}
+	}
+}
+
+static guint64
+rspamd_fuzzy_mmap_expire (struct rspamd_fuzzy_backend_mmap *backend,
+		gint64 expire)
+{
+	struct rspamd_fuzzy_mmap_header *hdr = backend->hdr;
+	struct rspamd_fuzzy_mmap_digest *d;
+	guint64 lim, last_bucket, b, expired = 0;
+	guint32 cur, next;
+
+	if (expire <= 0 || (gint64)time (NULL) <= expire) {
+		return 0;
+	}
+
+	lim = time (NULL) - expire;
+	last_bucket = lim / hdr->bucket_width;
+	b = hdr->last_expired_bucket + 1;
+
+	if (b > last_bucket) {
+		/* Recheck the last bucket as it is expired partially */
+		b = last_bucket;
+	}
+	else if (last_bucket - b >= RSPAMD_FUZZY_MMAP_TIME_BUCKETS) {
+		/* Each ring element should be visited once */
+		b = last_bucket - RSPAMD_FUZZY_MMAP_TIME_BUCKETS + 1;
+	}
+
+	for (; b <= last_bucket; b ++) {
+		cur = hdr->buckets[b % RSPAMD_FUZZY_MMAP_TIME_BUCKETS];
+
+		while (cur) {
+			d = &backend->digests[cur - 1];
+			next = d->tnext;
+
+			/* Ring element might contain newer elements as well */
+			if (d->time < lim) {
+				rspamd_fuzzy_mmap_write_begin (backend);
+				rspamd_fuzzy_mmap_delete_slot (backend, cur - 1);
+				rspamd_fuzzy_mmap_write_end (backend);
+				expired ++;
+			}
+
+			cur = next;
+		}
+	}
+
+	rspamd_fuzzy_mmap_write_begin (backend);
+	hdr->last_expired_bucket = last_bucket - 1;
+	hdr->expired += expired;
+	rspamd_fuzzy_mmap_write_end (backend);
+
+	return expired;
+}
+
+static gboolean
+rspamd_fuzzy_mmap_restore_snapshot (struct rspamd_fuzzy_backend_mmap *backend)
+{
+	struct rspamd_fuzzy_mmap_header shdr;
+	gchar *snap_path;
+	struct stat st;
+	gsize off = RSPAMD_FUZZY_MMAP_HDR_SIZE;
+	gssize r;
+	gint fd, seq;
+
+	snap_path = g_strconcat (backend->path, ".snap", NULL);
+	fd = open (snap_path, O_RDONLY);
+
+	if (fd == -1) {
+		g_free (snap_path);
+
+		return FALSE;
+	}
+
+	if (fstat (fd, &st) == -1 || st.st_size != (off_t)backend->len ||
+			read (fd, &shdr, sizeof (shdr)) != sizeof (shdr) ||
+			memcmp (shdr.magic, fuzzy_mmap_magic, sizeof (shdr.magic)) != 0 ||
+			shdr.digests_len != backend->hdr->digests_len ||
+			shdr.shingles_len != backend->hdr->shingles_len ||
+			(shdr.seq & 1)) {
+		msg_err_fuzzy_mmap ("snapshot %s is invalid", snap_path);
+		close (fd);
+		g_free (snap_path);
+
+		return FALSE;
+	}
+
+	while (off < backend->len) {
+		r = pread (fd, backend->map + off, backend->len - off, off);
+
+		if (r <= 0) {
+			msg_err_fuzzy_mmap ("cannot read snapshot %s: %s", snap_path,
+					strerror (errno));
+			close (fd);
+			g_free (snap_path);
+
+			return FALSE;
+		}
+
+		off += r;
+	}
+
+	/*
+	 * Header is restored the last: sequence lock stays odd until the whole
+	 * storage is consistent and then grows, so readers cannot confuse it
+	 * with the value they have seen before the restore
+	 */
+	seq = g_atomic_int_get (&backend->hdr->seq);
+	shdr.seq = seq;
+	shdr.moved = 0;
+	memcpy (backend->hdr, &shdr, sizeof (shdr));
+	g_atomic_int_set (&backend->hdr->seq, seq + 1);
+
+	msg_info_fuzzy_mmap ("restored storage from snapshot %s", snap_path);
+	close (fd);
+	g_free (snap_path);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_fuzzy_mmap_open (struct rspamd_fuzzy_backend_mmap *backend,
+		gdouble expire, GError **err)
+{
+	struct rspamd_fuzzy_mmap_header hdr;
+	guint64 digests_len, shingles_len;
+	struct stat st;
+	gboolean created = FALSE;
+	guchar *map;
+
+	backend->fd = rspamd_file_xopen (backend->path, O_RDWR | O_CREAT, 00600,
+			FALSE);
+
+	if (backend->fd == -1) {
+		g_set_error (err, rspamd_fuzzy_backend_mmap_quark (), errno,
+				"cannot open %s: %s", backend->path, strerror (errno));
+		return FALSE;
+	}
+
+	/* Serialize initialization between workers */
+	if (!rspamd_file_lock (backend->fd, FALSE)) {
+		g_set_error (err, rspamd_fuzzy_backend_mmap_quark (), errno,
+				"cannot lock %s: %s", backend->path, strerror (errno));
+		close (backend->fd);
+		backend->fd = -1;
+
+		return FALSE;
+	}
+
+	if (fstat (backend->fd, &st) == -1) {
+		g_set_error (err, rspamd_fuzzy_backend_mmap_quark (), errno,
+				"cannot stat %s: %s", backend->path, strerror (errno));
+		goto err;
+	}
+
+	if (st.st_size == 0) {
+		digests_len = backend->min_digests_len;
+		shingles_len = backend->min_shingles_len;
+		backend->len = rspamd_fuzzy_mmap_file_len (digests_len, shingles_len);
+
+		/* File is sparse, so pages are allocated on demand */
+		if (ftruncate (backend->fd, backend->len) == -1) {
+			g_set_error (err, rspamd_fuzzy_backend_mmap_quark (), errno,
+					"cannot allocate %s: %s", backend->path, strerror (errno));
+			goto err;
+		}
+
+		created = TRUE;
+	}
+	else {
+		if (pread (backend->fd, &hdr, sizeof (hdr), 0) != sizeof (hdr) ||
+				memcmp (hdr.magic, fuzzy_mmap_magic, sizeof (hdr.magic)) != 0) {
+			g_set_error (err, rspamd_fuzzy_backend_mmap_quark (), EINVAL,
+					"%s is not a fuzzy storage file", backend->path);
+			goto err;
+		}
+
+		if (hdr.version != RSPAMD_FUZZY_MMAP_VERSION) {
+			g_set_error (err, rspamd_fuzzy_backend_mmap_quark (), EINVAL,
+					"%s has unsupported version %d", backend->path,
+					(gint)hdr.version);
+			goto err;
+		}
+
+		digests_len = hdr.digests_len;
+		shingles_len = hdr.shingles_len;
+		backend->len = rspamd_fuzzy_mmap_file_len (digests_len, shingles_len);
+
+		if (backend->len != (gsize)st.st_size ||
+				digests_len == 0 || (digests_len & (digests_len - 1)) ||
+				shingles_len == 0 || (shingles_len & (shingles_len - 1)) ||
+				hdr.band_size > RSPAMD_SHINGLE_SIZE) {
+			g_set_error (err, rspamd_fuzzy_backend_mmap_quark (), EINVAL,
+					"%s is truncated or corrupted", backend->path);
+			goto err;
+		}
+
+		if (digests_len < backend->min_digests_len ||
+				shingles_len < backend->min_shingles_len) {
+			msg_info_fuzzy_mmap ("storage %s is too small for capacity %L: "
+					"%L digests slots, %L shingles slots; it will be grown "
+					"by writer to %L digests slots, %L shingles slots",
+					backend->path, backend->capacity, digests_len, shingles_len,
+					MAX (digests_len, backend->min_digests_len),
+					MAX (shingles_len, backend->min_shingles_len));
+		}
+	}
+
+	map = mmap (NULL, backend->len, PROT_READ | PROT_WRITE,
+			MAP_SHARED, backend->fd, 0);
+
+	if (map == MAP_FAILED) {
+		g_set_error (err, rspamd_fuzzy_backend_mmap_quark (), errno,
+				"cannot mmap %s: %s", backend->path, strerror (errno));
+		goto err;
+	}
+
+	if (created) {
+		/* Tables offsets depend on the header */
+		((struct rspamd_fuzzy_mmap_header *)map)->digests_len = digests_len;
+	}
+
+	rspamd_fuzzy_mmap_set_map (backend, map, backend->len);
+
+	if (created) {
+		memcpy (backend->hdr->magic, fuzzy_mmap_magic,
+				sizeof (backend->hdr->magic));
+		backend->hdr->version = RSPAMD_FUZZY_MMAP_VERSION;
+		backend->hdr->digests_len = digests_len;
+		backend->hdr->shingles_len = shingles_len;
+		backend->hdr->band_size = backend->band_size;
+		/* Time buckets ring covers twice expire time */
+		backend->hdr->bucket_width = MAX (1,
+				(guint64)expire / (RSPAMD_FUZZY_MMAP_TIME_BUCKETS / 2));
+		msg_info_fuzzy_mmap ("created fuzzy storage %s: %L digests slots, "
+				"%L shingles slots", backend->path, digests_len, shingles_len);
+	}
+
+	rspamd_file_unlock (backend->fd, FALSE);
+
+	return TRUE;
+
+err:
+	rspamd_file_unlock (backend->fd, FALSE);
+	close (backend->fd);
+	backend->fd = -1;
+
+	return FALSE;
+}
+
+/*
+ * Remaps storage if it has been replaced by writer
+ */
+static gboolean
+rspamd_fuzzy_mmap_refresh (struct rspamd_fuzzy_backend_mmap *backend)
+{
+	guchar *old_map = backend->map;
+	gsize old_len = backend->len;
+	gint old_fd = backend->fd;
+	GError *err = NULL;
+
+	if (G_LIKELY (!g_atomic_int_get (&backend->hdr->moved))) {
+		return TRUE;
+	}
+
+	if (!rspamd_fuzzy_mmap_open (backend, backend->expire, &err)) {
+		msg_err_fuzzy_mmap ("cannot reopen storage %s: %e", backend->path, err);
+		g_error_free (err);
+		/* Old file is still consistent, so continue to use it */
+		backend->fd = old_fd;
+		rspamd_fuzzy_mmap_set_map (backend, old_map, old_len);
+
+		return FALSE;
+	}
+
+	munmap (old_map, old_len);
+	close (old_fd);
+	backend->generation ++;
+	msg_info_fuzzy_mmap ("remapped storage %s", backend->path);
+
+	return TRUE;
+}
+
+/*
+ * Only a process that holds the lock file might modify the storage. Lock is
+ * held until the process exits, so if it is acquired and sequence lock is
+ * odd then the previous writer has died in the middle of update
+ */
+static gboolean
+rspamd_fuzzy_mmap_become_writer (struct rspamd_fuzzy_backend_mmap *backend)
+{
+	gchar *lock_path;
+	gint seq;
+
+	if (G_LIKELY (backend->writer)) {
+		return TRUE;
+	}
+
+	if (backend->lock_fd == -1) {
+		lock_path = g_strconcat (backend->path, ".lock", NULL);
+		backend->lock_fd = rspamd_file_xopen (lock_path, O_RDWR | O_CREAT,
+				00600, FALSE);
+
+		if (backend->lock_fd == -1) {
+			msg_err_fuzzy_mmap ("cannot open %s: %s", lock_path,
+					strerror (errno));
+			g_free (lock_path);
+
+			return FALSE;
+		}
+
+		g_free (lock_path);
+	}
+
+	if (!rspamd_file_lock (backend->lock_fd, TRUE)) {
+		msg_warn_fuzzy_mmap ("cannot modify storage %s: it is locked by "
+				"another writer", backend->path);
+
+		return FALSE;
+	}
+
+	backend->writer = TRUE;
+	rspamd_fuzzy_mmap_refresh (backend);
+	seq = g_atomic_int_get (&backend->hdr->seq);
+
+	if (seq & 1) {
+		/* Writer has died in the middle of update */
+		msg_warn_fuzzy_mmap ("storage %s has not been closed properly",
+				backend->path);
+
+		if (!rspamd_fuzzy_mmap_restore_snapshot (backend)) {
+			msg_warn_fuzzy_mmap ("cannot restore snapshot, use storage as is");
+			g_atomic_int_set (&backend->hdr->seq, seq + 1);
+		}
+	}
+
+	return TRUE;
+}
+
+void*
+rspamd_fuzzy_backend_init_mmap (struct rspamd_fuzzy_backend *bk,
+		const ucl_object_t *obj, struct rspamd_config *cfg, GError **err)
+{
+	struct rspamd_fuzzy_backend_mmap *backend;
+	const ucl_object_t *elt;
+	guchar id_hash[rspamd_cryptobox_HASHBYTES];
+
+	elt = ucl_object_lookup_any (obj, "hashfile", "hash_file", "file",
+			"database", NULL);
+
+	if (elt == NULL || ucl_object_type (elt) != UCL_STRING) {
+		g_set_error (err, rspamd_fuzzy_backend_mmap_quark (),
+				EINVAL, "missing fuzzy storage path");
+		return NULL;
+	}
+
+	backend = g_malloc0 (sizeof (*backend));
+	backend->fd = -1;
+	backend->lock_fd = -1;
+	backend->snap.fd = -1;
+	backend->path = g_strdup (ucl_object_tostring (elt));
+	backend->ev_base = rspamd_fuzzy_backend_event_base (bk);
+	backend->capacity = DEFAULT_CAPACITY;
+	backend->snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+	backend->band_size = DEFAULT_BAND_SIZE;
+#ifdef HAVE_GETPAGESIZE
+	backend->page_size = getpagesize ();
+#else
+	backend->page_size = sysconf (_SC_PAGESIZE);
+#endif
+
+	rspamd_cryptobox_hash (id_hash, (const guchar *)backend->path, strlen (backend->path),
+			NULL, 0);
+	backend->id = rspamd_encode_base32 (id_hash, sizeof (id_hash));
+
+	elt = ucl_object_lookup_any (obj, "capacity", "max_hashes", NULL);
+
+	if (elt && ucl_object_toint (elt) > 0) {
+		backend->capacity = ucl_object_toint (elt);
+	}
+
+	elt = ucl_object_lookup (obj, "lsh_band_size");
+
+	if (elt) {
+		if (ucl_object_toint (elt) <= 0 ||
+				ucl_object_toint (elt) > RSPAMD_SHINGLE_SIZE) {
+			g_set_error (err, rspamd_fuzzy_backend_mmap_quark (), EINVAL,
+					"invalid lsh_band_size %" G_GINT64_FORMAT
+					", must be from 1 to %d",
+					(gint64)ucl_object_toint (elt), RSPAMD_SHINGLE_SIZE);
+			rspamd_fuzzy_backend_close_mmap (bk, backend);
+
+			return NULL;
+		}
+
+		backend->band_size = ucl_object_toint (elt);
+	}
+
+	elt = ucl_object_lookup (obj, "snapshot_interval");
+
+	if (elt) {
+		backend->snapshot_interval = ucl_object_todouble (elt);
+	}
+
+	backend->expire = rspamd_fuzzy_backend_get_expire (bk);
+	rspamd_fuzzy_mmap_tables_len (backend->capacity, backend->band_size,
+			&backend->min_digests_len, &backend->min_shingles_len);
+
+	if (!rspamd_fuzzy_mmap_open (backend, backend->expire, err)) {
+		rspamd_fuzzy_backend_close_mmap (bk, backend);
+
+		return NULL;
+	}
+
+	return backend;
+}
+
+void
+rspamd_fuzzy_backend_check_mmap (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd *cmd,
+		rspamd_fuzzy_check_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+	struct rspamd_fuzzy_reply rep;
+	gboolean found = FALSE;
+	gint seq;
+	guint i;
+
+	rspamd_fuzzy_mmap_refresh (backend);
+
+	for (i = 0; i < MAX_READ_RETRIES; i ++) {
+		seq = g_atomic_int_get (&backend->hdr->seq);
+
+		/* Odd sequence means that writer is active */
+		if (!(seq & 1)) {
+			rspamd_fuzzy_mmap_check_unlocked (backend, cmd,
+					rspamd_fuzzy_backend_get_expire (bk), &rep);
+
+			if (g_atomic_int_get (&backend->hdr->seq) == seq) {
+				found = TRUE;
+				break;
+			}
+		}
+	}
+
+	if (!found) {
+		/* Contention must not look like a missing hash */
+		msg_warn_fuzzy_mmap ("cannot check hash: storage is locked by writer "
+				"for too long");
+		memset (&rep, 0, sizeof (rep));
+		memcpy (rep.digest, cmd->digest, sizeof (rep.digest));
+		rep.v1.value = 500;
+		rep.v1.prob = 0.0f;
+	}
+
+	if (cb) {
+		cb (&rep, ud);
+	}
+}
+
+void
+rspamd_fuzzy_backend_update_mmap (struct rspamd_fuzzy_backend *bk,
+		GArray *updates, const gchar *src,
+		rspamd_fuzzy_update_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+	struct rspamd_fuzzy_mmap_source *source;
+	struct fuzzy_peer_cmd *io_cmd;
+	struct rspamd_fuzzy_cmd *cmd;
+	gpointer ptr;
+	guint64 nnew = 0, room;
+	guint i, nupdates = 0;
+	gboolean success = TRUE;
+
+	if (!rspamd_fuzzy_mmap_become_writer (backend)) {
+		/* Updates are kept and retried by the caller */
+		if (cb) {
+			cb (FALSE, ud);
+		}
+
+		return;
+	}
+
+	/*
+	 * Failed updates are retried as a whole, so reject the batch before
+	 * writing anything if new hashes might not fit
+	 */
+	for (i = 0; i < updates->len; i ++) {
+		io_cmd = &g_array_index (updates, struct fuzzy_peer_cmd, i);
+		cmd = io_cmd->is_shingle ? &io_cmd->cmd.shingle.basic :
+				&io_cmd->cmd.normal;
+
+		if (cmd->cmd == FUZZY_WRITE &&
+				rspamd_fuzzy_mmap_find_digest (backend, cmd->digest, NULL) == -1) {
+			nnew ++;
+		}
+	}
+
+	room = MIN (backend->capacity, backend->hdr->digests_len);
+	room = room > backend->hdr->count ? room - backend->hdr->count : 0;
+
+	if (nnew > room) {
+		msg_err_fuzzy_mmap ("cannot apply %ud updates: %L new hashes do not "
+				"fit the storage (%L hashes, capacity %L), increase capacity",
+				updates->len, nnew, backend->hdr->count, backend->capacity);
+
+		if (cb) {
+			cb (FALSE, ud);
+		}
+
+		return;
+	}
+
+	for (i = 0; i < updates->len && success; i ++) {
+		io_cmd = &g_array_index (updates, struct fuzzy_peer_cmd, i);
+
+		if (io_cmd->is_shingle) {
+			cmd = &io_cmd->cmd.shingle.basic;
+			ptr = &io_cmd->cmd.shingle;
+		}
+		else {
+			cmd = &io_cmd->cmd.normal;
+			ptr = &io_cmd->cmd.normal;
+		}
+
+		/* Tables are rebuilt outside of the write sections */
+		if (rspamd_fuzzy_mmap_need_rehash (backend)) {
+			rspamd_fuzzy_mmap_rehash (backend);
+		}
+
+		/* Each command is a separate write section to keep readers going */
+		rspamd_fuzzy_mmap_write_begin (backend);
+
+		if (cmd->cmd == FUZZY_WRITE) {
+			success = rspamd_fuzzy_mmap_add (backend, ptr);
+		}
+		else {
+			rspamd_fuzzy_mmap_del (backend, ptr);
+		}
+
+		rspamd_fuzzy_mmap_write_end (backend);
+
+		if (success) {
+			nupdates ++;
+		}
+		else {
+			msg_err_fuzzy_mmap ("stop updates after %ud of %ud commands",
+					nupdates, updates->len);
+		}
+	}
+
+	if (success && nupdates > 0 && src != NULL) {
+		rspamd_fuzzy_mmap_write_begin (backend);
+		source = rspamd_fuzzy_mmap_find_source (backend, src, TRUE);
+
+		if (source) {
+			source->version ++;
+			source->last = time (NULL);
+		}
+		else {
+			msg_warn_fuzzy_mmap ("cannot update version for %s: too many "
+					"sources", src);
+		}
+
+		rspamd_fuzzy_mmap_write_end (backend);
+	}
+
+	if (cb) {
+		cb (success, ud);
+	}
+}
+
+void
+rspamd_fuzzy_backend_count_mmap (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_count_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+
+	rspamd_fuzzy_mmap_refresh (backend);
+
+	if (cb) {
+		cb (backend->hdr->count, ud);
+	}
+}
+
+void
+rspamd_fuzzy_backend_version_mmap (struct rspamd_fuzzy_backend *bk,
+		const gchar *src,
+		rspamd_fuzzy_version_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+	struct rspamd_fuzzy_mmap_source *source;
+	guint64 rev = 0;
+
+	rspamd_fuzzy_mmap_refresh (backend);
+	source = rspamd_fuzzy_mmap_find_source (backend, src, FALSE);
+
+	if (source) {
+		rev = source->version;
+	}
+
+	if (cb) {
+		cb (rev, ud);
+	}
+}
+
+const gchar*
+rspamd_fuzzy_backend_id_mmap (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+
+	return backend->id;
+}
+
+void
+rspamd_fuzzy_backend_expire_mmap (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+	guint64 expired;
+
+	if (!rspamd_fuzzy_mmap_become_writer (backend)) {
+		return;
+	}
+
+	expired = rspamd_fuzzy_mmap_expire (backend,
+			rspamd_fuzzy_backend_get_expire (bk));
+
+	if (rspamd_fuzzy_mmap_need_rehash (backend)) {
+		rspamd_fuzzy_mmap_rehash (backend);
+	}
+
+	if (expired > 0) {
+		msg_info_fuzzy_mmap ("expired %L hashes", expired);
+	}
+
+	if (msync (backend->map, backend->len, MS_ASYNC) == -1) {
+		msg_warn_fuzzy_mmap ("cannot sync %s: %s", backend->path,
+				strerror (errno));
+	}
+
+	if (!backend->snap.active && backend->snapshot_interval > 0 &&
+			rspamd_get_calendar_ticks () - backend->last_snapshot >
+			backend->snapshot_interval) {
+		rspamd_fuzzy_mmap_snapshot_start (backend);
+	}
+}
+
+gboolean
+rspamd_fuzzy_backend_iterate_mmap (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_digest_iter_cb dcb,
+		rspamd_fuzzy_shingle_iter_cb scb,
+		void *ud,
+		guint64 *cursor,
+		guint limit,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+	struct rspamd_fuzzy_mmap_digest *d;
+	struct rspamd_fuzzy_mmap_shingle *sh;
+	guint64 pos, end, total;
+	guint gen;
+
+	rspamd_fuzzy_mmap_refresh (backend);
+	gen = backend->generation & (G_MAXUINT64 >> ITERATE_POS_BITS);
+	pos = *cursor & ITERATE_POS_MASK;
+
+	if (*cursor != 0 && (*cursor >> ITERATE_POS_BITS) != gen) {
+		/* Elements have been moved, so we need to start over */
+		msg_info_fuzzy_mmap ("storage has been rebuilt, restart enumeration");
+		pos = 0;
+	}
+
+	/* Slots are enumerated sequentially: digests and then shingles */
+	total = backend->hdr->digests_len + backend->hdr->shingles_len;
+	end = MIN (pos + limit, total);
+
+	/* Called from the writer process only, so no locking is needed */
+	for (; pos < end; pos ++) {
+		if (pos < backend->hdr->digests_len) {
+			d = &backend->digests[pos];
+
+			if (dcb && d->state == RSPAMD_FUZZY_MMAP_SLOT_USED) {
+				dcb (d->digest, ud);
+			}
+		}
+		else {
+			sh = &backend->shingles[pos - backend->hdr->digests_len];
+
+			/* Skip LSH band keys */
+			if (scb && sh->number != 0 && sh->number <= RSPAMD_SHINGLE_SIZE &&
+					rspamd_fuzzy_mmap_shingle_valid (backend, sh)) {
+				scb (sh->value, sh->number - 1, ud);
+			}
+		}
+	}
+
+	if (pos >= total) {
+		*cursor = 0;
+	}
+	else {
+		*cursor = ((guint64)gen << ITERATE_POS_BITS) | pos;
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_fuzzy_mmap_export_digest (struct rspamd_fuzzy_backend_mmap *backend,
+		guint64 pos,
+		rspamd_fuzzy_export_cb cb,
+		void *ud)
+{
+	struct rspamd_fuzzy_mmap_digest *d = &backend->digests[pos];
+	struct rspamd_fuzzy_mmap_shingle *sh;
+	struct fuzzy_peer_cmd io_cmd;
+	struct rspamd_fuzzy_cmd *cmd;
+	guint64 mask;
+	guint32 link;
+	guint i;
+
+	memset (&io_cmd, 0, sizeof (io_cmd));
+	cmd = &io_cmd.cmd.normal;
+	cmd->version = RSPAMD_FUZZY_VERSION;
+	cmd->cmd = FUZZY_WRITE;
+	cmd->flag = d->flag;
+	cmd->value = CLAMP (d->value, G_MININT32, G_MAXINT32);
+	memcpy (cmd->digest, d->digest, sizeof (cmd->digest));
+
+	/* The last element is a bitmask of the shingles found */
+	mask = 0;
+	link = d->shingles;
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE && link != 0 &&
+			link <= backend->hdr->shingles_len; i ++) {
+		sh = &backend->shingles[link - 1];
+
+		if (sh->digest_idx != pos || sh->gen != d->gen ||
+				sh->number == 0 || sh->number > RSPAMD_SHINGLE_SIZE) {
+			break;
+		}
+
+		io_cmd.cmd.shingle.sgl.hashes[sh->number - 1] = sh->value;
+		mask |= 1ULL << (sh->number - 1);
+		link = sh->next;
+	}
+
+	if (mask == (1ULL << RSPAMD_SHINGLE_SIZE) - 1) {
+		io_cmd.is_shingle = TRUE;
+		cmd->shingles_count = RSPAMD_SHINGLE_SIZE;
+	}
+	else {
+		memset (io_cmd.cmd.shingle.sgl.hashes, 0,
+				sizeof (io_cmd.cmd.shingle.sgl.hashes));
+	}
+
+	cb (&io_cmd, ud);
+}
+
+gboolean
+rspamd_fuzzy_backend_export_mmap (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_export_cb cb,
+		void *ud,
+		guint64 *cursor,
+		guint limit,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+	guint64 pos, end;
+	guint gen;
+
+	rspamd_fuzzy_mmap_refresh (backend);
+	gen = backend->generation & (G_MAXUINT64 >> ITERATE_POS_BITS);
+	pos = *cursor & ITERATE_POS_MASK;
+
+	if (*cursor != 0 && (*cursor >> ITERATE_POS_BITS) != gen) {
+		/* Pages exported before are meaningless now */
+		msg_info_fuzzy_mmap ("storage has been rebuilt, export is aborted");
+
+		return FALSE;
+	}
+
+	end = MIN (pos + limit, backend->hdr->digests_len);
+
+	for (; pos < end; pos ++) {
+		if (backend->digests[pos].state == RSPAMD_FUZZY_MMAP_SLOT_USED) {
+			rspamd_fuzzy_mmap_export_digest (backend, pos, cb, ud);
+		}
+	}
+
+	if (pos >= backend->hdr->digests_len) {
+		*cursor = 0;
+	}
+	else {
+		*cursor = ((guint64)gen << ITERATE_POS_BITS) | pos;
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_fuzzy_backend_export_digests_mmap (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_export_cb cb,
+		void *ud,
+		GPtrArray *digests,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+	gint64 idx;
+	guint i;
+
+	rspamd_fuzzy_mmap_refresh (backend);
+
+	for (i = 0; i < digests->len; i ++) {
+		idx = rspamd_fuzzy_mmap_find_digest (backend,
+				g_ptr_array_index (digests, i), NULL);
+
+		if (idx != -1) {
+			rspamd_fuzzy_mmap_export_digest (backend, idx, cb, ud);
+		}
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_fuzzy_backend_set_version_mmap (struct rspamd_fuzzy_backend *bk,
+		const gchar *src,
+		guint64 version,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+	struct rspamd_fuzzy_mmap_source *source;
+
+	if (!rspamd_fuzzy_mmap_become_writer (backend)) {
+		return FALSE;
+	}
+
+	rspamd_fuzzy_mmap_write_begin (backend);
+	source = rspamd_fuzzy_mmap_find_source (backend, src, TRUE);
+
+	if (source) {
+		source->version = version;
+		source->last = time (NULL);
+	}
+
+	rspamd_fuzzy_mmap_write_end (backend);
+
+	if (source == NULL) {
+		msg_warn_fuzzy_mmap ("cannot set version for %s: too many "
+				"sources", src);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+void
+rspamd_fuzzy_backend_close_mmap (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+
+	if (backend->map) {
+		rspamd_fuzzy_mmap_snapshot_finish (backend);
+		msync (backend->map, backend->len, MS_ASYNC);
+		munmap (backend->map, backend->len);
+	}
+
+	if (backend->fd != -1) {
+		close (backend->fd);
+	}
+
+	if (backend->lock_fd != -1) {
+		/* Releases writer lock */
+		close (backend->lock_fd);
+	}
+
+	g_free (backend->path);
+	g_free (backend->id);
+	g_free (backend);
+}
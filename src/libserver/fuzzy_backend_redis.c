@@ -55,6 +55,7 @@ struct rspamd_fuzzy_backend_redis {
 	gchar *id;
 	struct rspamd_redis_pool *pool;
 	gdouble timeout;
+	guint band_size;
 	ref_entry_t ref;
 };
 
@@ -66,6 +67,7 @@ struct rspamd_fuzzy_redis_session {
 	struct event_base *ev_base;
 	float prob;
 	gboolean shingles_checked;
+	guint nbands;
 
 	enum {
 		RSPAMD_FUZZY_REDIS_COMMAND_COUNT,
@@ -86,6 +88,7 @@ struct rspamd_fuzzy_redis_session {
 	gchar **argv;
 	gsize *argv_lens;
 	struct upstream *up;
+	gdouble start;
 	guchar found_digest[rspamd_cryptobox_HASHBYTES];
 };
 
@@ -186,6 +189,21 @@ rspamd_fuzzy_backend_redis_try_ucl (struct rspamd_fuzzy_backend_redis *backend,
 		backend->timeout = REDIS_DEFAULT_TIMEOUT;
 	}
 
+	elt = ucl_object_lookup (obj, "lsh_band_size");
+	if (elt) {
+		if (ucl_object_toint (elt) <= 0 ||
+				ucl_object_toint (elt) > RSPAMD_SHINGLE_SIZE) {
+			msg_err_config ("invalid lsh_band_size %L, must be from 1 to %d",
+					(gint64)ucl_object_toint (elt), RSPAMD_SHINGLE_SIZE);
+			return FALSE;
+		}
+
+		backend->band_size = ucl_object_toint (elt);
+	}
+	else {
+		backend->band_size = 0;
+	}
+
 	elt = ucl_object_lookup (obj, "password");
 	if (elt) {
 		backend->password = ucl_object_tostring (elt);
@@ -342,20 +360,31 @@ rspamd_fuzzy_redis_shingles_callback (redisAsyncContext *c, gpointer r,
 	GString *key;
 	struct _rspamd_fuzzy_shingles_helper *shingles, *prev = NULL, *sel = NULL;
 	guint i, found = 0, max_found = 0, cur_found = 0;
+	gboolean band_found;
 
 	event_del (&session->timeout);
 	memset (&rep, 0, sizeof (rep));
 
 	if (c->err == 0) {
-		rspamd_upstream_ok (session->up);
+		rspamd_upstream_ok_latency (session->up,
+				rspamd_get_ticks (FALSE) - session->start);
 
 		if (reply->type == REDIS_REPLY_ARRAY &&
-				reply->elements == RSPAMD_SHINGLE_SIZE) {
+				reply->elements == session->nbands + RSPAMD_SHINGLE_SIZE) {
+			/* Band keys go first: if none of them matches, skip scoring */
+			band_found = (session->nbands == 0);
+
+			for (i = 0; i < session->nbands && !band_found; i ++) {
+				if (reply->element[i]->type == REDIS_REPLY_STRING) {
+					band_found = TRUE;
+				}
+			}
+
 			shingles = g_alloca (sizeof (struct _rspamd_fuzzy_shingles_helper) *
 					RSPAMD_SHINGLE_SIZE);
 
-			for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-				cur = reply->element[i];
+			for (i = 0; i < RSPAMD_SHINGLE_SIZE && band_found; i ++) {
+				cur = reply->element[session->nbands + i];
 
 				if (cur->type == REDIS_REPLY_STRING) {
 					shingles[i].found = 1;
@@ -471,6 +500,24 @@ rspamd_fuzzy_redis_shingles_callback (redisAsyncContext *c, gpointer r,
 	rspamd_fuzzy_redis_session_dtor (session, FALSE);
 }
 
+static inline gchar *
+rspamd_fuzzy_redis_band_key (struct rspamd_fuzzy_backend_redis *backend,
+		const struct rspamd_shingle *sgl, guint band, gsize *len)
+{
+	GString *key;
+	gchar *ret;
+
+	key = g_string_sized_new (strlen (backend->redis_object) +
+			sizeof ("_b00_18446744073709551616"));
+	rspamd_printf_gstring (key, "%s_b%d_%uL", backend->redis_object,
+			band, rspamd_shingles_band_key (sgl, band, backend->band_size));
+	*len = key->len;
+	ret = key->str;
+	g_string_free (key, FALSE); /* Do not free underlying array */
+
+	return ret;
+}
+
 static void
 rspamd_fuzzy_backend_check_shingles (struct rspamd_fuzzy_redis_session *session)
 {
@@ -478,11 +525,16 @@ rspamd_fuzzy_backend_check_shingles (struct rspamd_fuzzy_redis_session *session)
 	struct rspamd_fuzzy_reply rep;
 	const struct rspamd_fuzzy_shingle_cmd *shcmd;
 	GString *key;
-	guint i, init_len;
+	guint i, init_len, off;
 
 	rspamd_fuzzy_redis_session_free_args (session);
-	/* First of all check digest */
-	session->nargs = RSPAMD_SHINGLE_SIZE + 1;
+	/*
+	 * LSH band keys are fetched in the same MGET as shingles, so the bands
+	 * filter costs no extra round trip
+	 */
+	session->nbands = session->backend->band_size > 0 ?
+			rspamd_shingles_bands_count (session->backend->band_size) : 0;
+	session->nargs = session->nbands + RSPAMD_SHINGLE_SIZE + 1;
 	session->argv = g_malloc (sizeof (gchar *) * session->nargs);
 	session->argv_lens = g_malloc (sizeof (gsize) * session->nargs);
 	shcmd = (const struct rspamd_fuzzy_shingle_cmd *)session->cmd;
@@ -491,13 +543,20 @@ rspamd_fuzzy_backend_check_shingles (struct rspamd_fuzzy_redis_session *session)
 	session->argv_lens[0] = 4;
 	init_len = strlen (session->backend->redis_object);
 
+	for (i = 0; i < session->nbands; i ++) {
+		session->argv[i + 1] = rspamd_fuzzy_redis_band_key (session->backend,
+				&shcmd->sgl, i, &session->argv_lens[i + 1]);
+	}
+
+	off = session->nbands + 1;
+
 	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
 
 		key = g_string_sized_new (init_len + 2 + 2 + sizeof ("18446744073709551616"));
 		rspamd_printf_gstring (key, "%s_%d_%uL", session->backend->redis_object,
 				i, shcmd->sgl.hashes[i]);
-		session->argv[i + 1] = key->str;
-		session->argv_lens[i + 1] = key->len;
+		session->argv[off + i] = key->str;
+		session->argv_lens[off + i] = key->len;
 		g_string_free (key, FALSE); /* Do not free underlying array */
 	}
 
@@ -541,7 +600,8 @@ rspamd_fuzzy_redis_check_callback (redisAsyncContext *c, gpointer r,
 	memset (&rep, 0, sizeof (rep));
 
 	if (c->err == 0) {
-		rspamd_upstream_ok (session->up);
+		rspamd_upstream_ok_latency (session->up,
+				rspamd_get_ticks (FALSE) - session->start);
 
 		if (reply->type == REDIS_REPLY_ARRAY && reply->elements >= 2) {
 			cur = reply->element[0];
@@ -664,6 +724,7 @@ rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
 			0);
 
 	session->up = up;
+	session->start = rspamd_get_ticks (FALSE);
 	addr = rspamd_upstream_addr (up);
 	g_assert (addr != NULL);
 	session->ctx = rspamd_redis_pool_connect (backend->pool,
@@ -713,7 +774,8 @@ rspamd_fuzzy_redis_count_callback (redisAsyncContext *c, gpointer r,
 	event_del (&session->timeout);
 
 	if (c->err == 0) {
-		rspamd_upstream_ok (session->up);
+		rspamd_upstream_ok_latency (session->up,
+				rspamd_get_ticks (FALSE) - session->start);
 
 		if (reply->type == REDIS_REPLY_INTEGER) {
 			if (session->callback.cb_count) {
@@ -788,6 +850,7 @@ rspamd_fuzzy_backend_count_redis (struct rspamd_fuzzy_backend *bk,
 			0);
 
 	session->up = up;
+	session->start = rspamd_get_ticks (FALSE);
 	addr = rspamd_upstream_addr (up);
 	g_assert (addr != NULL);
 	session->ctx = rspamd_redis_pool_connect (backend->pool,
@@ -835,7 +898,8 @@ rspamd_fuzzy_redis_version_callback (redisAsyncContext *c, gpointer r,
 	event_del (&session->timeout);
 
 	if (c->err == 0) {
-		rspamd_upstream_ok (session->up);
+		rspamd_upstream_ok_latency (session->up,
+				rspamd_get_ticks (FALSE) - session->start);
 
 		if (reply->type == REDIS_REPLY_INTEGER) {
 			if (session->callback.cb_version) {
@@ -911,6 +975,7 @@ rspamd_fuzzy_backend_version_redis (struct rspamd_fuzzy_backend *bk,
 			0);
 
 	session->up = up;
+	session->start = rspamd_get_ticks (FALSE);
 	addr = rspamd_upstream_addr (up);
 	g_assert (addr != NULL);
 	session->ctx = rspamd_redis_pool_connect (backend->pool,
@@ -973,7 +1038,7 @@ rspamd_fuzzy_update_append_command (struct rspamd_fuzzy_backend *bk,
 {
 	GString *key, *value;
 	guint cur_shift = *shift;
-	guint i, klen;
+	guint i, klen, nbands;
 	struct rspamd_fuzzy_cmd *cmd;
 
 	if (io_cmd->is_shingle) {
@@ -1202,6 +1267,42 @@ rspamd_fuzzy_update_append_command (struct rspamd_fuzzy_backend *bk,
 					return FALSE;
 				}
 			}
+
+			if (session->backend->band_size > 0) {
+				nbands = rspamd_shingles_bands_count (session->backend->band_size);
+
+				for (i = 0; i < nbands; i ++) {
+					guchar *hval;
+					/*
+					 * SETEX <prefix>_b<band>_<band_key> <expire> <digest>
+					 */
+					value = g_string_sized_new (30);
+					rspamd_printf_gstring (value, "%d",
+							(gint)rspamd_fuzzy_backend_get_expire (bk));
+					hval = g_malloc (sizeof (io_cmd->cmd.shingle.basic.digest));
+					memcpy (hval, io_cmd->cmd.shingle.basic.digest,
+							sizeof (io_cmd->cmd.shingle.basic.digest));
+					session->argv[cur_shift] = g_strdup ("SETEX");
+					session->argv_lens[cur_shift++] = sizeof ("SETEX") - 1;
+					session->argv[cur_shift] = rspamd_fuzzy_redis_band_key (
+							session->backend, &io_cmd->cmd.shingle.sgl, i,
+							&session->argv_lens[cur_shift]);
+					cur_shift ++;
+					session->argv[cur_shift] = value->str;
+					session->argv_lens[cur_shift++] = value->len;
+					session->argv[cur_shift] = hval;
+					session->argv_lens[cur_shift++] = sizeof (io_cmd->cmd.shingle.basic.digest);
+					g_string_free (value, FALSE);
+
+					if (redisAsyncCommandArgv (session->ctx, NULL, NULL,
+							4,
+							(const gchar **)&session->argv[cur_shift - 4],
+							&session->argv_lens[cur_shift - 4]) != REDIS_OK) {
+
+						return FALSE;
+					}
+				}
+			}
 		}
 		else if (cmd->cmd == FUZZY_DEL) {
 			klen = strlen (session->backend->redis_object) +
@@ -1227,6 +1328,27 @@ rspamd_fuzzy_update_append_command (struct rspamd_fuzzy_backend *bk,
 					return FALSE;
 				}
 			}
+
+			if (session->backend->band_size > 0) {
+				nbands = rspamd_shingles_bands_count (session->backend->band_size);
+
+				for (i = 0; i < nbands; i ++) {
+					session->argv[cur_shift] = g_strdup ("DEL");
+					session->argv_lens[cur_shift++] = sizeof ("DEL") - 1;
+					session->argv[cur_shift] = rspamd_fuzzy_redis_band_key (
+							session->backend, &io_cmd->cmd.shingle.sgl, i,
+							&session->argv_lens[cur_shift]);
+					cur_shift ++;
+
+					if (redisAsyncCommandArgv (session->ctx, NULL, NULL,
+							2,
+							(const gchar **)&session->argv[cur_shift - 2],
+							&session->argv_lens[cur_shift - 2]) != REDIS_OK) {
+
+						return FALSE;
+					}
+				}
+			}
 		}
 		else {
 			g_assert_not_reached ();
@@ -1247,7 +1369,8 @@ rspamd_fuzzy_redis_update_callback (redisAsyncContext *c, gpointer r,
 	event_del (&session->timeout);
 
 	if (c->err == 0) {
-		rspamd_upstream_ok (session->up);
+		rspamd_upstream_ok_latency (session->up,
+				rspamd_get_ticks (FALSE) - session->start);
 
 		if (reply->type == REDIS_REPLY_ARRAY) {
 			/* TODO: check all replies somehow */
@@ -1291,10 +1414,14 @@ rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
 	GString *key;
 	struct fuzzy_peer_cmd *io_cmd;
 	struct rspamd_fuzzy_cmd *cmd;
-	guint nargs, ncommands, cur_shift;
+	guint nargs, ncommands, cur_shift, nbands = 0;
 
 	g_assert (backend != NULL);
 
+	if (backend->band_size > 0) {
+		nbands = rspamd_shingles_bands_count (backend->band_size);
+	}
+
 	session = g_malloc0 (sizeof (*session));
 	session->backend = backend;
 	REF_RETAIN (session->backend);
@@ -1310,6 +1437,8 @@ rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
 	 *
 	 * For each command with shingles we additionally emit 32 commands:
 	 * SETEX <prefix>_<number>_<value> <expire> <digest>
+	 * and, if LSH bands are enabled, a command per band:
+	 * SETEX <prefix>_b<band>_<band_key> <expire> <digest>
 	 *
 	 * For each delete command we emit:
 	 * DEL <key>
@@ -1337,8 +1466,8 @@ rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
 			nargs += 17;
 
 			if (io_cmd->is_shingle) {
-				ncommands += RSPAMD_SHINGLE_SIZE;
-				nargs += RSPAMD_SHINGLE_SIZE * 4;
+				ncommands += RSPAMD_SHINGLE_SIZE + nbands;
+				nargs += (RSPAMD_SHINGLE_SIZE + nbands) * 4;
 			}
 
 		}
@@ -1347,8 +1476,8 @@ rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
 			nargs += 4;
 
 			if (io_cmd->is_shingle) {
-				ncommands += RSPAMD_SHINGLE_SIZE;
-				nargs += RSPAMD_SHINGLE_SIZE * 2;
+				ncommands += RSPAMD_SHINGLE_SIZE + nbands;
+				nargs += (RSPAMD_SHINGLE_SIZE + nbands) * 2;
 			}
 		}
 	}
@@ -1372,6 +1501,7 @@ rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
 			0);
 
 	session->up = up;
+	session->start = rspamd_get_ticks (FALSE);
 	addr = rspamd_upstream_addr (up);
 	g_assert (addr != NULL);
 	session->ctx = rspamd_redis_pool_connect (backend->pool,
@@ -1423,25 +1553,27 @@ rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
 		}
 
 		/* Now INCR command for the source */
-		key = g_string_new (backend->redis_object);
-		g_string_append (key, src);
-		session->argv[cur_shift] = g_strdup ("INCR");
-		session->argv_lens[cur_shift ++] = 4;
-		session->argv[cur_shift] = key->str;
-		session->argv_lens[cur_shift ++] = key->len;
-		g_string_free (key, FALSE);
+		if (src != NULL) {
+			key = g_string_new (backend->redis_object);
+			g_string_append (key, src);
+			session->argv[cur_shift] = g_strdup ("INCR");
+			session->argv_lens[cur_shift ++] = 4;
+			session->argv[cur_shift] = key->str;
+			session->argv_lens[cur_shift ++] = key->len;
+			g_string_free (key, FALSE);
+
+			if (redisAsyncCommandArgv (session->ctx, NULL, NULL,
+					2,
+					(const gchar **)&session->argv[cur_shift - 2],
+					&session->argv_lens[cur_shift - 2]) != REDIS_OK) {
 
-		if (redisAsyncCommandArgv (session->ctx, NULL, NULL,
-				2,
-				(const gchar **)&session->argv[cur_shift - 2],
-				&session->argv_lens[cur_shift - 2]) != REDIS_OK) {
+				if (cb) {
+					cb (FALSE, ud);
+				}
+				rspamd_fuzzy_redis_session_dtor (session, TRUE);
 
-			if (cb) {
-				cb (FALSE, ud);
+				return;
 			}
-			rspamd_fuzzy_redis_session_dtor (session, TRUE);
-
-			return;
 		}
 
 		/* Finally we call EXEC with a specific callback */
@@ -989,6 +989,331 @@ rspamd_fuzzy_backend_sqlite_sync (struct rspamd_fuzzy_backend_sqlite *backend,
 	return ret;
 }
 
+/* Cursor has this bit set when digests are enumerated and rowid in others */
+#define ITERATE_SHINGLES_BIT (1ULL << 63)
+
+gboolean
+rspamd_fuzzy_backend_sqlite_iterate (
+		struct rspamd_fuzzy_backend_sqlite *backend,
+		void (*dcb) (const guchar *digest, void *ud),
+		void (*scb) (guint64 value, guint number, void *ud),
+		void *ud,
+		guint64 *cursor,
+		guint limit)
+{
+	static const gchar digests_page[] = "SELECT id,digest FROM digests "
+			"WHERE id > ?1 ORDER BY id LIMIT ?2;";
+	static const gchar shingles_page[] = "SELECT rowid,value,number FROM shingles "
+			"WHERE rowid > ?1 ORDER BY rowid LIMIT ?2;";
+	sqlite3_stmt *stmt;
+	const guchar *digest;
+	gboolean shingles;
+	gint64 last;
+	guint nrows = 0;
+	gint rc;
+
+	if (backend == NULL) {
+		return FALSE;
+	}
+
+	shingles = (*cursor & ITERATE_SHINGLES_BIT) || dcb == NULL;
+	last = shingles ? (gint64)(*cursor & ~ITERATE_SHINGLES_BIT) : (gint64)*cursor;
+
+	if (shingles && scb == NULL) {
+		*cursor = 0;
+
+		return TRUE;
+	}
+
+	if ((rc = sqlite3_prepare_v2 (backend->db,
+			shingles ? shingles_page : digests_page, -1,
+			&stmt, NULL)) != SQLITE_OK) {
+		msg_warn_fuzzy_backend ("cannot enumerate %s: %s",
+				shingles ? "shingles" : "digests",
+				sqlite3_errmsg (backend->db));
+
+		return FALSE;
+	}
+
+	/* Rowids are stable, so pages are not affected by updates in between */
+	sqlite3_bind_int64 (stmt, 1, last);
+	sqlite3_bind_int64 (stmt, 2, limit);
+
+	while ((rc = sqlite3_step (stmt)) == SQLITE_ROW) {
+		last = sqlite3_column_int64 (stmt, 0);
+		nrows ++;
+
+		if (shingles) {
+			scb (sqlite3_column_int64 (stmt, 1),
+					sqlite3_column_int64 (stmt, 2), ud);
+		}
+		else if (sqlite3_column_bytes (stmt, 1) == rspamd_cryptobox_HASHBYTES) {
+			digest = sqlite3_column_blob (stmt, 1);
+			dcb (digest, ud);
+		}
+	}
+
+	sqlite3_finalize (stmt);
+
+	if (rc != SQLITE_DONE) {
+		msg_warn_fuzzy_backend ("cannot enumerate %s: %s",
+				shingles ? "shingles" : "digests",
+				sqlite3_errmsg (backend->db));
+
+		return FALSE;
+	}
+
+	if (nrows < limit) {
+		/* Current table is finished */
+		if (!shingles && scb) {
+			*cursor = ITERATE_SHINGLES_BIT;
+		}
+		else {
+			*cursor = 0;
+		}
+	}
+	else {
+		*cursor = shingles ? ((guint64)last | ITERATE_SHINGLES_BIT) :
+				(guint64)last;
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_fuzzy_backend_sqlite_export_digest (sqlite3_stmt *stmt,
+		struct fuzzy_peer_cmd *io_cmd)
+{
+	struct rspamd_fuzzy_cmd *cmd;
+
+	memset (io_cmd, 0, sizeof (*io_cmd));
+	cmd = &io_cmd->cmd.normal;
+	cmd->version = RSPAMD_FUZZY_VERSION;
+	cmd->cmd = FUZZY_WRITE;
+	cmd->flag = sqlite3_column_int64 (stmt, 2);
+	cmd->value = sqlite3_column_int64 (stmt, 3);
+	memcpy (cmd->digest, sqlite3_column_blob (stmt, 1),
+			sizeof (cmd->digest));
+}
+
+gboolean
+rspamd_fuzzy_backend_sqlite_export (
+		struct rspamd_fuzzy_backend_sqlite *backend,
+		void (*cb) (const struct fuzzy_peer_cmd *cmd, void *ud),
+		void *ud,
+		guint64 *cursor,
+		guint limit)
+{
+	/* Both queries are ordered by digest id, so we can merge them */
+	static const gchar digests_page[] = "SELECT id,digest,flag,value "
+			"FROM digests WHERE id > ?1 ORDER BY id LIMIT ?2;";
+	static const gchar shingles_page[] = "SELECT digest_id,number,value "
+			"FROM shingles WHERE digest_id > ?1 AND digest_id <= "
+			"(SELECT max(id) FROM (SELECT id FROM digests WHERE id > ?1 "
+			"ORDER BY id LIMIT ?2)) ORDER BY digest_id;";
+	sqlite3_stmt *dstmt = NULL, *sstmt = NULL;
+	struct fuzzy_peer_cmd io_cmd;
+	gint64 id, last, sid = G_MAXINT64;
+	guint number, nshingles, nrows = 0;
+	gint rc = SQLITE_DONE, src = SQLITE_DONE;
+	gboolean ret = FALSE;
+
+	if (backend == NULL) {
+		return FALSE;
+	}
+
+	if (sqlite3_prepare_v2 (backend->db, digests_page, -1,
+			&dstmt, NULL) != SQLITE_OK ||
+			sqlite3_prepare_v2 (backend->db, shingles_page, -1,
+			&sstmt, NULL) != SQLITE_OK) {
+		msg_warn_fuzzy_backend ("cannot export storage: %s",
+				sqlite3_errmsg (backend->db));
+		goto end;
+	}
+
+	last = *cursor;
+	sqlite3_bind_int64 (dstmt, 1, last);
+	sqlite3_bind_int64 (dstmt, 2, limit);
+	sqlite3_bind_int64 (sstmt, 1, last);
+	sqlite3_bind_int64 (sstmt, 2, limit);
+
+	if ((src = sqlite3_step (sstmt)) == SQLITE_ROW) {
+		sid = sqlite3_column_int64 (sstmt, 0);
+	}
+
+	while ((rc = sqlite3_step (dstmt)) == SQLITE_ROW) {
+		id = sqlite3_column_int64 (dstmt, 0);
+		last = id;
+		nrows ++;
+
+		if (sqlite3_column_bytes (dstmt, 1) != rspamd_cryptobox_HASHBYTES) {
+			continue;
+		}
+
+		rspamd_fuzzy_backend_sqlite_export_digest (dstmt, &io_cmd);
+		nshingles = 0;
+
+		/* Skip orphaned shingles */
+		while (src == SQLITE_ROW && sid < id) {
+			if ((src = sqlite3_step (sstmt)) == SQLITE_ROW) {
+				sid = sqlite3_column_int64 (sstmt, 0);
+			}
+		}
+
+		while (src == SQLITE_ROW && sid == id) {
+			number = sqlite3_column_int64 (sstmt, 1);
+
+			if (number < RSPAMD_SHINGLE_SIZE) {
+				io_cmd.cmd.shingle.sgl.hashes[number] =
+						sqlite3_column_int64 (sstmt, 2);
+				nshingles ++;
+			}
+
+			if ((src = sqlite3_step (sstmt)) == SQLITE_ROW) {
+				sid = sqlite3_column_int64 (sstmt, 0);
+			}
+		}
+
+		if (nshingles == RSPAMD_SHINGLE_SIZE) {
+			io_cmd.is_shingle = TRUE;
+			io_cmd.cmd.shingle.basic.shingles_count = RSPAMD_SHINGLE_SIZE;
+		}
+
+		cb (&io_cmd, ud);
+	}
+
+	if (rc != SQLITE_DONE || (src != SQLITE_ROW && src != SQLITE_DONE)) {
+		msg_warn_fuzzy_backend ("cannot export storage: %s",
+				sqlite3_errmsg (backend->db));
+	}
+	else {
+		/* Rowids are stable, so pages are not affected by updates in between */
+		*cursor = nrows < limit ? 0 : (guint64)last;
+		ret = TRUE;
+	}
+
+end:
+	if (dstmt) {
+		sqlite3_finalize (dstmt);
+	}
+	if (sstmt) {
+		sqlite3_finalize (sstmt);
+	}
+
+	return ret;
+}
+
+gboolean
+rspamd_fuzzy_backend_sqlite_export_digests (
+		struct rspamd_fuzzy_backend_sqlite *backend,
+		void (*cb) (const struct fuzzy_peer_cmd *cmd, void *ud),
+		void *ud,
+		GPtrArray *digests)
+{
+	static const gchar digest_sql[] = "SELECT id,digest,flag,value "
+			"FROM digests WHERE digest=?1;";
+	static const gchar shingles_sql[] = "SELECT number,value "
+			"FROM shingles WHERE digest_id=?1;";
+	sqlite3_stmt *dstmt = NULL, *sstmt = NULL;
+	struct fuzzy_peer_cmd io_cmd;
+	guint i, number, nshingles;
+	gint rc = SQLITE_DONE, src = SQLITE_DONE;
+	gboolean ret = FALSE;
+
+	if (backend == NULL) {
+		return FALSE;
+	}
+
+	if (sqlite3_prepare_v2 (backend->db, digest_sql, -1,
+			&dstmt, NULL) != SQLITE_OK ||
+			sqlite3_prepare_v2 (backend->db, shingles_sql, -1,
+			&sstmt, NULL) != SQLITE_OK) {
+		msg_warn_fuzzy_backend ("cannot export digests: %s",
+				sqlite3_errmsg (backend->db));
+		goto end;
+	}
+
+	for (i = 0; i < digests->len; i ++) {
+		sqlite3_reset (dstmt);
+		sqlite3_bind_blob (dstmt, 1, g_ptr_array_index (digests, i),
+				rspamd_cryptobox_HASHBYTES, SQLITE_STATIC);
+
+		if ((rc = sqlite3_step (dstmt)) != SQLITE_ROW) {
+			if (rc != SQLITE_DONE) {
+				break;
+			}
+
+			/* Digest is not stored */
+			continue;
+		}
+
+		rspamd_fuzzy_backend_sqlite_export_digest (dstmt, &io_cmd);
+		nshingles = 0;
+		sqlite3_reset (sstmt);
+		sqlite3_bind_int64 (sstmt, 1, sqlite3_column_int64 (dstmt, 0));
+
+		while ((src = sqlite3_step (sstmt)) == SQLITE_ROW) {
+			number = sqlite3_column_int64 (sstmt, 0);
+
+			if (number < RSPAMD_SHINGLE_SIZE) {
+				io_cmd.cmd.shingle.sgl.hashes[number] =
+						sqlite3_column_int64 (sstmt, 1);
+				nshingles ++;
+			}
+		}
+
+		if (src != SQLITE_DONE) {
+			break;
+		}
+
+		if (nshingles == RSPAMD_SHINGLE_SIZE) {
+			io_cmd.is_shingle = TRUE;
+			io_cmd.cmd.shingle.basic.shingles_count = RSPAMD_SHINGLE_SIZE;
+		}
+
+		cb (&io_cmd, ud);
+		rc = SQLITE_DONE;
+	}
+
+	if ((rc != SQLITE_DONE && rc != SQLITE_ROW) || src != SQLITE_DONE) {
+		msg_warn_fuzzy_backend ("cannot export digests: %s",
+				sqlite3_errmsg (backend->db));
+	}
+	else {
+		ret = TRUE;
+	}
+
+end:
+	if (dstmt) {
+		sqlite3_finalize (dstmt);
+	}
+	if (sstmt) {
+		sqlite3_finalize (sstmt);
+	}
+
+	return ret;
+}
+
+gboolean
+rspamd_fuzzy_backend_sqlite_set_version (
+		struct rspamd_fuzzy_backend_sqlite *backend,
+		const gchar *source, guint64 version)
+{
+	if (backend == NULL) {
+		return FALSE;
+	}
+
+	if (rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
+			RSPAMD_FUZZY_BACKEND_SET_VERSION,
+			(gint64)version, (gint64)time (NULL), source) != SQLITE_OK) {
+		msg_warn_fuzzy_backend ("cannot set version for %s: %s", source,
+				sqlite3_errmsg (backend->db));
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
 
 void
 rspamd_fuzzy_backend_sqlite_close (struct rspamd_fuzzy_backend_sqlite *backend)
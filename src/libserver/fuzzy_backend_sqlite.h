@@ -83,6 +83,55 @@ gboolean rspamd_fuzzy_backend_sqlite_sync (struct rspamd_fuzzy_backend_sqlite *b
 		gint64 expire,
 		gboolean clean_orphaned);
 
+/**
+ * Enumerate up to `limit` digests or shingles in storage starting from
+ * `cursor`, cursor is set to zero when enumeration is finished
+ * @param backend
+ * @return
+ */
+gboolean rspamd_fuzzy_backend_sqlite_iterate (
+		struct rspamd_fuzzy_backend_sqlite *backend,
+		void (*dcb) (const guchar *digest, void *ud),
+		void (*scb) (guint64 value, guint number, void *ud),
+		void *ud,
+		guint64 *cursor,
+		guint limit);
+
+/**
+ * Export up to `limit` digests as FUZZY_WRITE commands starting from
+ * `cursor`, digests with a full set of shingles are exported as shingle
+ * commands. Cursor is set to zero when export is finished
+ * @param backend
+ * @return
+ */
+gboolean rspamd_fuzzy_backend_sqlite_export (
+		struct rspamd_fuzzy_backend_sqlite *backend,
+		void (*cb) (const struct fuzzy_peer_cmd *cmd, void *ud),
+		void *ud,
+		guint64 *cursor,
+		guint limit);
+
+/**
+ * Export the current state of `digests` like rspamd_fuzzy_backend_sqlite_export
+ * does, digests that are not stored are skipped
+ * @param backend
+ * @return
+ */
+gboolean rspamd_fuzzy_backend_sqlite_export_digests (
+		struct rspamd_fuzzy_backend_sqlite *backend,
+		void (*cb) (const struct fuzzy_peer_cmd *cmd, void *ud),
+		void *ud,
+		GPtrArray *digests);
+
+/**
+ * Set revision for a specific source
+ * @param backend
+ * @return
+ */
+gboolean rspamd_fuzzy_backend_sqlite_set_version (
+		struct rspamd_fuzzy_backend_sqlite *backend,
+		const gchar *source, guint64 version);
+
 /**
  * Close storage
  * @param backend
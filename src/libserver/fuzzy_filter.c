@@ -0,0 +1,379 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Blocked bloom filter: each key sets FUZZY_FILTER_HASHES bits within a single
+ * 512 bits block, so a lookup touches exactly one cache line.
+ *
+ * Shared memory contains a small header and two buffers: the active one is
+ * used for lookups and incremental inserts, the spare one is filled during
+ * rebuilds and then atomically becomes active. Rebuild is split into steps
+ * to avoid blocking the event loop, so new elements are inserted into both
+ * buffers while it is in progress. Bits are set with atomic
+ * operations, so readers in other processes might get false positives
+ * but never false negatives for inserted keys.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "fuzzy_backend.h"
+#include "fuzzy_filter.h"
+#include "cryptobox.h"
+#include "unix-std.h"
+
+#define FUZZY_FILTER_BLOCK_WORDS 16
+#define FUZZY_FILTER_BLOCK_BITS (FUZZY_FILTER_BLOCK_WORDS * 32)
+#define FUZZY_FILTER_HASHES 7
+/* Gives about 1% of false positives with 7 hashes */
+#define FUZZY_FILTER_BITS_PER_ELT 10
+
+#define msg_err_fuzzy_filter(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
+        "fuzzy_filter", NULL, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_warn_fuzzy_filter(...)   rspamd_default_log_function (G_LOG_LEVEL_WARNING, \
+        "fuzzy_filter", NULL, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_info_fuzzy_filter(...)   rspamd_default_log_function (G_LOG_LEVEL_INFO, \
+        "fuzzy_filter", NULL, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+
+struct rspamd_fuzzy_filter_hdr {
+	gint active;                /**< active buffer, -1 if not built yet	*/
+	guint32 unused;
+	guint64 nelts[2];           /**< elements inserted in each buffer		*/
+	guchar pad[40];             /**< buffers are cache line aligned		*/
+};
+
+G_STATIC_ASSERT (sizeof (struct rspamd_fuzzy_filter_hdr) == 64);
+
+struct rspamd_fuzzy_filter {
+	struct rspamd_fuzzy_filter_hdr *hdr;
+	guint32 *bufs[2];
+	guint64 nblocks;            /**< blocks per buffer (power of 2)		*/
+	guint64 capacity;
+	gpointer map;
+	gsize len;
+	gint building;              /**< buffer being rebuilt, -1 if none		*/
+	guint64 cursor;             /**< backend enumeration cursor			*/
+};
+
+static GQuark
+rspamd_fuzzy_filter_quark (void)
+{
+	return g_quark_from_static_string ("fuzzy-filter");
+}
+
+static inline guint64
+rspamd_fuzzy_filter_mix (guint64 h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static inline guint64
+rspamd_fuzzy_filter_digest_key (const guchar *digest)
+{
+	guint64 key;
+
+	/* Digest is a cryptographic hash itself */
+	memcpy (&key, digest, sizeof (key));
+
+	return key;
+}
+
+static inline guint64
+rspamd_fuzzy_filter_shingle_key (guint64 value, guint number)
+{
+	return rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+			&value, sizeof (value), number);
+}
+
+static void
+rspamd_fuzzy_filter_set (struct rspamd_fuzzy_filter *filter,
+		guint32 *buf, guint64 key)
+{
+	guint64 h, bits;
+	guint32 *block;
+	guint i, pos;
+
+	h = rspamd_fuzzy_filter_mix (key);
+	block = buf + (h & (filter->nblocks - 1)) * FUZZY_FILTER_BLOCK_WORDS;
+	bits = rspamd_fuzzy_filter_mix (h);
+
+	for (i = 0; i < FUZZY_FILTER_HASHES; i ++) {
+		pos = bits & (FUZZY_FILTER_BLOCK_BITS - 1);
+		bits >>= 9;
+		g_atomic_int_or (&block[pos >> 5], 1u << (pos & 31));
+	}
+}
+
+static gboolean
+rspamd_fuzzy_filter_test (struct rspamd_fuzzy_filter *filter,
+		const guint32 *buf, guint64 key)
+{
+	guint64 h, bits;
+	const guint32 *block;
+	guint i, pos;
+
+	h = rspamd_fuzzy_filter_mix (key);
+	block = buf + (h & (filter->nblocks - 1)) * FUZZY_FILTER_BLOCK_WORDS;
+	bits = rspamd_fuzzy_filter_mix (h);
+
+	for (i = 0; i < FUZZY_FILTER_HASHES; i ++) {
+		pos = bits & (FUZZY_FILTER_BLOCK_BITS - 1);
+		bits >>= 9;
+
+		if (!(block[pos >> 5] & (1u << (pos & 31)))) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+struct rspamd_fuzzy_filter *
+rspamd_fuzzy_filter_new (guint64 nelts, GError **err)
+{
+	struct rspamd_fuzzy_filter *filter;
+	guint64 nblocks = 1, need;
+	gsize len;
+	gpointer map;
+
+	need = (nelts * FUZZY_FILTER_BITS_PER_ELT + FUZZY_FILTER_BLOCK_BITS - 1) /
+			FUZZY_FILTER_BLOCK_BITS;
+
+	while (nblocks < need) {
+		nblocks <<= 1;
+	}
+
+	len = sizeof (struct rspamd_fuzzy_filter_hdr) +
+			2 * nblocks * FUZZY_FILTER_BLOCK_WORDS * sizeof (guint32);
+
+#if defined(HAVE_MMAP_ANON)
+	map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED,
+			-1, 0);
+#elif defined(HAVE_MMAP_ZERO)
+	gint fd;
+
+	fd = open ("/dev/zero", O_RDWR);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_fuzzy_filter_quark (), errno,
+				"cannot open /dev/zero: %s", strerror (errno));
+
+		return NULL;
+	}
+
+	map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+#else
+#error No mmap methods are defined
+#endif
+
+	if (map == MAP_FAILED) {
+		g_set_error (err, rspamd_fuzzy_filter_quark (), errno,
+				"cannot allocate %" G_GSIZE_FORMAT " bytes of shared memory: %s",
+				len, strerror (errno));
+
+		return NULL;
+	}
+
+	filter = g_malloc0 (sizeof (*filter));
+	filter->map = map;
+	filter->len = len;
+	filter->nblocks = nblocks;
+	filter->capacity = nelts;
+	filter->hdr = map;
+	filter->hdr->active = -1;
+	filter->building = -1;
+	filter->bufs[0] = (guint32 *)((guchar *)map +
+			sizeof (struct rspamd_fuzzy_filter_hdr));
+	filter->bufs[1] = filter->bufs[0] + nblocks * FUZZY_FILTER_BLOCK_WORDS;
+
+	return filter;
+}
+
+gboolean
+rspamd_fuzzy_filter_ready (struct rspamd_fuzzy_filter *filter)
+{
+	return filter != NULL && g_atomic_int_get (&filter->hdr->active) >= 0;
+}
+
+static void
+rspamd_fuzzy_filter_add_digest_cb (const guchar *digest, void *ud)
+{
+	struct rspamd_fuzzy_filter *filter = ud;
+
+	rspamd_fuzzy_filter_set (filter, filter->bufs[filter->building],
+			rspamd_fuzzy_filter_digest_key (digest));
+	filter->hdr->nelts[filter->building] ++;
+}
+
+static void
+rspamd_fuzzy_filter_add_shingle_cb (guint64 value, guint number, void *ud)
+{
+	struct rspamd_fuzzy_filter *filter = ud;
+
+	rspamd_fuzzy_filter_set (filter, filter->bufs[filter->building],
+			rspamd_fuzzy_filter_shingle_key (value, number));
+	filter->hdr->nelts[filter->building] ++;
+}
+
+static void
+rspamd_fuzzy_filter_add_buf (struct rspamd_fuzzy_filter *filter,
+		gint buf, const struct rspamd_fuzzy_cmd *cmd)
+{
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	guint i;
+
+	rspamd_fuzzy_filter_set (filter, filter->bufs[buf],
+			rspamd_fuzzy_filter_digest_key (cmd->digest));
+	filter->hdr->nelts[buf] ++;
+
+	if (cmd->shingles_count > 0) {
+		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			rspamd_fuzzy_filter_set (filter, filter->bufs[buf],
+					rspamd_fuzzy_filter_shingle_key (shcmd->sgl.hashes[i], i));
+		}
+
+		filter->hdr->nelts[buf] += RSPAMD_SHINGLE_SIZE;
+	}
+}
+
+void
+rspamd_fuzzy_filter_add (struct rspamd_fuzzy_filter *filter,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	gint active;
+
+	active = g_atomic_int_get (&filter->hdr->active);
+
+	if (active >= 0) {
+		rspamd_fuzzy_filter_add_buf (filter, active, cmd);
+	}
+
+	/* Backend might have been enumerated past this element already */
+	if (filter->building >= 0) {
+		rspamd_fuzzy_filter_add_buf (filter, filter->building, cmd);
+	}
+}
+
+gboolean
+rspamd_fuzzy_filter_is_missing (struct rspamd_fuzzy_filter *filter,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	const guint32 *buf;
+	gint active;
+	guint i, found = 0;
+
+	active = g_atomic_int_get (&filter->hdr->active);
+
+	if (active < 0) {
+		return FALSE;
+	}
+
+	buf = filter->bufs[active];
+
+	if (rspamd_fuzzy_filter_test (filter, buf,
+			rspamd_fuzzy_filter_digest_key (cmd->digest))) {
+		return FALSE;
+	}
+
+	if (cmd->shingles_count > 0) {
+		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+
+		/* Backends require more than a half of shingles to match */
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			if (rspamd_fuzzy_filter_test (filter, buf,
+					rspamd_fuzzy_filter_shingle_key (shcmd->sgl.hashes[i], i))) {
+				found ++;
+
+				if (found > RSPAMD_SHINGLE_SIZE / 2) {
+					return FALSE;
+				}
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_fuzzy_filter_rebuild (struct rspamd_fuzzy_filter *filter,
+		struct rspamd_fuzzy_backend *bk, guint limit, gboolean *done)
+{
+	gint building;
+
+	*done = FALSE;
+
+	if (filter->building < 0) {
+		filter->building = 1 - MAX (g_atomic_int_get (&filter->hdr->active), 0);
+		filter->cursor = 0;
+		memset (filter->bufs[filter->building], 0,
+				filter->nblocks * FUZZY_FILTER_BLOCK_WORDS * sizeof (guint32));
+		filter->hdr->nelts[filter->building] = 0;
+	}
+
+	if (!rspamd_fuzzy_backend_iterate (bk, rspamd_fuzzy_filter_add_digest_cb,
+			rspamd_fuzzy_filter_add_shingle_cb, filter, &filter->cursor,
+			limit)) {
+		filter->building = -1;
+
+		return FALSE;
+	}
+
+	if (filter->cursor != 0) {
+		/* More elements to go */
+		return TRUE;
+	}
+
+	building = filter->building;
+	filter->building = -1;
+	g_atomic_int_set (&filter->hdr->active, building);
+	*done = TRUE;
+
+	if (filter->hdr->nelts[building] > filter->capacity) {
+		msg_warn_fuzzy_filter ("negative filter is overfilled: %L elements "
+				"inserted, %L expected; false positives rate grows",
+				filter->hdr->nelts[building], filter->capacity);
+	}
+	else {
+		msg_info_fuzzy_filter ("rebuilt negative filter: %L elements, "
+				"%L capacity",
+				filter->hdr->nelts[building], filter->capacity);
+	}
+
+	return TRUE;
+}
+
+void
+rspamd_fuzzy_filter_destroy (struct rspamd_fuzzy_filter *filter)
+{
+	if (filter) {
+		munmap (filter->map, filter->len);
+		g_free (filter);
+	}
+}
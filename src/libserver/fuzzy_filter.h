@@ -0,0 +1,87 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBSERVER_FUZZY_FILTER_H_
+#define SRC_LIBSERVER_FUZZY_FILTER_H_
+
+#include "config.h"
+#include "fuzzy_wire.h"
+
+struct rspamd_fuzzy_backend;
+
+/*
+ * Negative lookup filter for fuzzy storage: blocked bloom filter of digests
+ * and shingles placed in shared memory, so all fuzzy workers can answer
+ * definite misses without touching the backend. The filter is insert only,
+ * deleted and expired hashes are dropped by periodic rebuilds from the backend.
+ */
+struct rspamd_fuzzy_filter;
+
+/**
+ * Allocates shared filter suitable for `nelts` elements (digests + shingles).
+ * Must be called before workers are forked
+ * @param nelts
+ * @param err
+ * @return
+ */
+struct rspamd_fuzzy_filter * rspamd_fuzzy_filter_new (guint64 nelts,
+		GError **err);
+
+/**
+ * Returns TRUE if filter has been built and can be used for lookups
+ * @param filter
+ * @return
+ */
+gboolean rspamd_fuzzy_filter_ready (struct rspamd_fuzzy_filter *filter);
+
+/**
+ * Adds digest and shingles (if any) of the command to the active filter
+ * @param filter
+ * @param cmd
+ */
+void rspamd_fuzzy_filter_add (struct rspamd_fuzzy_filter *filter,
+		const struct rspamd_fuzzy_cmd *cmd);
+
+/**
+ * Returns TRUE if the command can never match anything in the storage:
+ * digest is not in the filter and no more than a half of shingles is there
+ * @param filter
+ * @param cmd
+ * @return
+ */
+gboolean rspamd_fuzzy_filter_is_missing (struct rspamd_fuzzy_filter *filter,
+		const struct rspamd_fuzzy_cmd *cmd);
+
+/**
+ * Fills the spare filter buffer from the backend by at most `limit` elements
+ * per call. Once the whole backend is enumerated, the spare buffer becomes
+ * active and `done` is set to TRUE. Elements added during the rebuild are
+ * inserted in both buffers
+ * @param filter
+ * @param bk
+ * @param limit
+ * @param done
+ * @return FALSE if backend cannot be enumerated
+ */
+gboolean rspamd_fuzzy_filter_rebuild (struct rspamd_fuzzy_filter *filter,
+		struct rspamd_fuzzy_backend *bk, guint limit, gboolean *done);
+
+/**
+ * Unmaps shared memory and frees filter
+ * @param filter
+ */
+void rspamd_fuzzy_filter_destroy (struct rspamd_fuzzy_filter *filter);
+
+#endif /* SRC_LIBSERVER_FUZZY_FILTER_H_ */
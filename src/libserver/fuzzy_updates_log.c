@@ -0,0 +1,1056 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Record format (all numbers are little endian):
+ * <magic:4><ncmds:4><revision:8><raw length:4><compressed length:4>
+ * <zstd frame>
+ *
+ * Decompressed frame contains commands encoded just like in the plain mirror
+ * updates: <uint32_le length><fuzzy_peer_cmd truncated to length>
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "fuzzy_backend.h"
+#include "fuzzy_updates_log.h"
+#include "unix-std.h"
+#include "contrib/zstd/zstd.h"
+
+#include <glob.h>
+
+#define RSPAMD_FUZZY_LOG_SUFFIX ".fzlog"
+#define RSPAMD_FUZZY_LOG_SNAPSHOT "snapshot.fzsnap"
+/* Commands per snapshot record */
+#define RSPAMD_FUZZY_LOG_SNAPSHOT_CMDS 4096
+#define RSPAMD_FUZZY_LOG_ZSTD_LEVEL 3
+/* Sanity limit for a decompressed record */
+#define RSPAMD_FUZZY_LOG_MAX_RECORD (64 * 1024 * 1024)
+
+#define msg_err_fuzzy_log(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
+        "fuzzy_log", NULL, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_warn_fuzzy_log(...)   rspamd_default_log_function (G_LOG_LEVEL_WARNING, \
+        "fuzzy_log", NULL, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_info_fuzzy_log(...)   rspamd_default_log_function (G_LOG_LEVEL_INFO, \
+        "fuzzy_log", NULL, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+
+static const guchar fuzzy_log_magic[4] = {'r', 's', 'f', 'l'};
+
+static void rspamd_fuzzy_log_snapshot_mark (struct rspamd_fuzzy_updates_log *log,
+		guint64 rev, GArray *updates);
+
+RSPAMD_PACKED(rspamd_fuzzy_log_record_hdr) {
+	guchar magic[4];
+	guint32 ncmds;
+	guint64 rev;
+	guint32 rawlen;
+	guint32 clen;
+};
+
+struct rspamd_fuzzy_log_segment {
+	guint64 first;
+	guint64 last;
+	gsize size;
+	gchar *path;
+};
+
+struct rspamd_fuzzy_updates_log {
+	gchar *dir;
+	gchar *snapshot_path;
+	gsize segment_size;
+	guint max_segments;
+	GPtrArray *segments;        /**< sorted by the first revision		*/
+	gint fd;                    /**< the last segment opened for append	*/
+	guint64 snapshot_rev;
+	struct rspamd_fuzzy_log_snapshot_cbdata *building;
+};
+
+static GQuark
+rspamd_fuzzy_updates_log_quark (void)
+{
+	return g_quark_from_static_string ("fuzzy-updates-log");
+}
+
+static void
+rspamd_fuzzy_log_segment_free (gpointer p)
+{
+	struct rspamd_fuzzy_log_segment *seg = p;
+
+	g_free (seg->path);
+	g_free (seg);
+}
+
+static gint
+rspamd_fuzzy_log_segment_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_fuzzy_log_segment *s1 = *(const gpointer *)a,
+			*s2 = *(const gpointer *)b;
+
+	if (s1->first < s2->first) {
+		return -1;
+	}
+	else if (s1->first > s2->first) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static inline gsize
+rspamd_fuzzy_log_cmd_len (const struct fuzzy_peer_cmd *cmd)
+{
+	if (cmd->is_shingle) {
+		return sizeof (guint32) + sizeof (struct rspamd_fuzzy_shingle_cmd);
+	}
+
+	return sizeof (guint32) + sizeof (struct rspamd_fuzzy_cmd);
+}
+
+/*
+ * Reads and validates header at the specified offset, converts it to the
+ * host byte order
+ */
+static gboolean
+rspamd_fuzzy_log_read_hdr (gint fd, goffset off, gsize size,
+		struct rspamd_fuzzy_log_record_hdr *hdr)
+{
+	if (off + sizeof (*hdr) > size) {
+		return FALSE;
+	}
+
+	if (pread (fd, hdr, sizeof (*hdr), off) != sizeof (*hdr)) {
+		return FALSE;
+	}
+
+	if (memcmp (hdr->magic, fuzzy_log_magic, sizeof (hdr->magic)) != 0) {
+		return FALSE;
+	}
+
+	hdr->ncmds = GUINT32_FROM_LE (hdr->ncmds);
+	hdr->rev = GUINT64_FROM_LE (hdr->rev);
+	hdr->rawlen = GUINT32_FROM_LE (hdr->rawlen);
+	hdr->clen = GUINT32_FROM_LE (hdr->clen);
+
+	return off + sizeof (*hdr) + hdr->clen <= size;
+}
+
+static rspamd_fstring_t *
+rspamd_fuzzy_log_encode (guint64 rev, const struct fuzzy_peer_cmd *cmds,
+		guint ncmds, GError **err)
+{
+	struct rspamd_fuzzy_log_record_hdr hdr;
+	rspamd_fstring_t *raw, *out;
+	guint32 len;
+	gsize r;
+	guint i;
+
+	raw = rspamd_fstring_sized_new (ncmds * (sizeof (len) +
+			sizeof (struct fuzzy_peer_cmd)) + 1);
+
+	for (i = 0; i < ncmds; i ++) {
+		len = rspamd_fuzzy_log_cmd_len (&cmds[i]);
+		len = GUINT32_TO_LE (len);
+		raw = rspamd_fstring_append (raw, (const gchar *)&len, sizeof (len));
+		raw = rspamd_fstring_append (raw, (const gchar *)&cmds[i],
+				GUINT32_FROM_LE (len));
+	}
+
+	if (raw->len > RSPAMD_FUZZY_LOG_MAX_RECORD) {
+		g_set_error (err, rspamd_fuzzy_updates_log_quark (), E2BIG,
+				"record is too large: %" G_GSIZE_FORMAT " bytes", raw->len);
+		rspamd_fstring_free (raw);
+
+		return NULL;
+	}
+
+	out = rspamd_fstring_sized_new (sizeof (hdr) + ZSTD_compressBound (raw->len));
+	r = ZSTD_compress (out->str + sizeof (hdr), out->allocated - sizeof (hdr),
+			raw->str, raw->len, RSPAMD_FUZZY_LOG_ZSTD_LEVEL);
+
+	if (ZSTD_isError (r)) {
+		g_set_error (err, rspamd_fuzzy_updates_log_quark (), EINVAL,
+				"cannot compress record: %s", ZSTD_getErrorName (r));
+		rspamd_fstring_free (raw);
+		rspamd_fstring_free (out);
+
+		return NULL;
+	}
+
+	memcpy (hdr.magic, fuzzy_log_magic, sizeof (hdr.magic));
+	hdr.ncmds = GUINT32_TO_LE (ncmds);
+	hdr.rev = GUINT64_TO_LE (rev);
+	hdr.rawlen = GUINT32_TO_LE (raw->len);
+	hdr.clen = GUINT32_TO_LE (r);
+	memcpy (out->str, &hdr, sizeof (hdr));
+	out->len = sizeof (hdr) + r;
+	rspamd_fstring_free (raw);
+
+	return out;
+}
+
+static gboolean
+rspamd_fuzzy_log_write (gint fd, const rspamd_fstring_t *buf, GError **err)
+{
+	gsize written = 0;
+	gssize r;
+
+	while (written < buf->len) {
+		r = write (fd, buf->str + written, buf->len - written);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			g_set_error (err, rspamd_fuzzy_updates_log_quark (), errno,
+					"cannot write record: %s", strerror (errno));
+
+			return FALSE;
+		}
+
+		written += r;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Finds the last valid record in segment and truncates garbage left after
+ * an unclean shutdown
+ */
+static gboolean
+rspamd_fuzzy_log_scan_segment (struct rspamd_fuzzy_log_segment *seg,
+		GError **err)
+{
+	struct rspamd_fuzzy_log_record_hdr hdr;
+	struct stat st;
+	goffset off = 0;
+	gint fd;
+
+	fd = open (seg->path, O_RDWR);
+
+	if (fd == -1 || fstat (fd, &st) == -1) {
+		g_set_error (err, rspamd_fuzzy_updates_log_quark (), errno,
+				"cannot open %s: %s", seg->path, strerror (errno));
+
+		if (fd != -1) {
+			close (fd);
+		}
+
+		return FALSE;
+	}
+
+	while (rspamd_fuzzy_log_read_hdr (fd, off, st.st_size, &hdr)) {
+		seg->last = hdr.rev;
+		off += sizeof (hdr) + hdr.clen;
+	}
+
+	if (off != st.st_size) {
+		msg_warn_fuzzy_log ("%s has %z bytes of incomplete data, truncate it",
+				seg->path, (gsize)(st.st_size - off));
+
+		if (ftruncate (fd, off) == -1) {
+			msg_err_fuzzy_log ("cannot truncate %s: %s", seg->path,
+					strerror (errno));
+		}
+	}
+
+	seg->size = off;
+	close (fd);
+
+	return TRUE;
+}
+
+static guint64
+rspamd_fuzzy_log_read_snapshot_rev (const gchar *path)
+{
+	struct rspamd_fuzzy_log_record_hdr hdr;
+	struct stat st;
+	guint64 rev = 0;
+	goffset off = 0;
+	gint fd;
+
+	fd = open (path, O_RDONLY);
+
+	if (fd != -1) {
+		/* The last record has the revision of the whole snapshot */
+		if (fstat (fd, &st) != -1) {
+			while (rspamd_fuzzy_log_read_hdr (fd, off, st.st_size, &hdr)) {
+				rev = hdr.rev;
+				off += sizeof (hdr) + hdr.clen;
+			}
+		}
+
+		close (fd);
+	}
+
+	return rev;
+}
+
+struct rspamd_fuzzy_updates_log *
+rspamd_fuzzy_updates_log_open (const gchar *dir,
+		gsize segment_size,
+		guint max_segments,
+		GError **err)
+{
+	struct rspamd_fuzzy_updates_log *log;
+	struct rspamd_fuzzy_log_segment *seg;
+	const gchar *base;
+	gchar *pattern, *end;
+	glob_t globbuf;
+	guint i;
+	gint rc;
+
+	if (mkdir (dir, 0700) == -1 && errno != EEXIST) {
+		g_set_error (err, rspamd_fuzzy_updates_log_quark (), errno,
+				"cannot create %s: %s", dir, strerror (errno));
+
+		return NULL;
+	}
+
+	log = g_malloc0 (sizeof (*log));
+	log->dir = g_strdup (dir);
+	log->snapshot_path = g_strdup_printf ("%s%c%s", dir, G_DIR_SEPARATOR,
+			RSPAMD_FUZZY_LOG_SNAPSHOT);
+	log->segment_size = segment_size;
+	log->max_segments = MAX (max_segments, 1);
+	log->segments = g_ptr_array_new_with_free_func (rspamd_fuzzy_log_segment_free);
+	log->fd = -1;
+
+	memset (&globbuf, 0, sizeof (globbuf));
+	pattern = g_strdup_printf ("%s%c*%s", dir, G_DIR_SEPARATOR,
+			RSPAMD_FUZZY_LOG_SUFFIX);
+
+	if ((rc = glob (pattern, 0, NULL, &globbuf)) == 0) {
+		for (i = 0; i < globbuf.gl_pathc; i ++) {
+			base = strrchr (globbuf.gl_pathv[i], G_DIR_SEPARATOR);
+			base = base ? base + 1 : globbuf.gl_pathv[i];
+			seg = g_malloc0 (sizeof (*seg));
+			seg->first = g_ascii_strtoull (base, &end, 10);
+			seg->path = g_strdup (globbuf.gl_pathv[i]);
+
+			if (seg->first == 0 || strcmp (end, RSPAMD_FUZZY_LOG_SUFFIX) != 0) {
+				msg_warn_fuzzy_log ("skip bad segment name: %s", seg->path);
+				rspamd_fuzzy_log_segment_free (seg);
+				continue;
+			}
+
+			if (!rspamd_fuzzy_log_scan_segment (seg, err)) {
+				rspamd_fuzzy_log_segment_free (seg);
+				globfree (&globbuf);
+				g_free (pattern);
+				rspamd_fuzzy_updates_log_close (log);
+
+				return NULL;
+			}
+
+			if (seg->size == 0) {
+				/* Nothing has been written to this segment */
+				unlink (seg->path);
+				rspamd_fuzzy_log_segment_free (seg);
+				continue;
+			}
+
+			g_ptr_array_add (log->segments, seg);
+		}
+	}
+	else if (rc != GLOB_NOMATCH) {
+		msg_err_fuzzy_log ("glob %s failed: %s", pattern, strerror (errno));
+	}
+
+	globfree (&globbuf);
+	g_free (pattern);
+	g_ptr_array_sort (log->segments, rspamd_fuzzy_log_segment_cmp);
+	log->snapshot_rev = rspamd_fuzzy_log_read_snapshot_rev (log->snapshot_path);
+
+	msg_info_fuzzy_log ("opened updates log %s: %ud segments, revisions %L-%L",
+			dir, log->segments->len,
+			rspamd_fuzzy_updates_log_first (log),
+			rspamd_fuzzy_updates_log_last (log));
+
+	return log;
+}
+
+static void
+rspamd_fuzzy_log_remove_segment (struct rspamd_fuzzy_updates_log *log,
+		guint idx)
+{
+	struct rspamd_fuzzy_log_segment *seg;
+
+	seg = g_ptr_array_index (log->segments, idx);
+
+	if (unlink (seg->path) == -1) {
+		msg_err_fuzzy_log ("cannot unlink %s: %s", seg->path, strerror (errno));
+	}
+
+	g_ptr_array_remove_index (log->segments, idx);
+}
+
+gboolean
+rspamd_fuzzy_updates_log_append (struct rspamd_fuzzy_updates_log *log,
+		guint64 rev,
+		GArray *updates,
+		GError **err)
+{
+	struct rspamd_fuzzy_log_segment *seg = NULL;
+	rspamd_fstring_t *buf;
+	guint64 last;
+
+	g_assert (log != NULL);
+
+	if (log->building) {
+		rspamd_fuzzy_log_snapshot_mark (log, rev, updates);
+	}
+
+	last = rspamd_fuzzy_updates_log_last (log);
+
+	if (rev <= last) {
+		/* Storage has been replaced, old records are meaningless now */
+		msg_warn_fuzzy_log ("revision %L is not newer than the last logged "
+				"revision %L, drop all log segments", rev, last);
+
+		if (log->fd != -1) {
+			close (log->fd);
+			log->fd = -1;
+		}
+
+		while (log->segments->len > 0) {
+			rspamd_fuzzy_log_remove_segment (log, 0);
+		}
+	}
+
+	if (log->segments->len > 0) {
+		seg = g_ptr_array_index (log->segments, log->segments->len - 1);
+
+		if (seg->size >= log->segment_size) {
+			seg = NULL;
+		}
+	}
+
+	if (seg == NULL) {
+		if (log->fd != -1) {
+			close (log->fd);
+			log->fd = -1;
+		}
+
+		seg = g_malloc0 (sizeof (*seg));
+		seg->first = rev;
+		seg->path = g_strdup_printf ("%s%c%020" G_GUINT64_FORMAT "%s",
+				log->dir, G_DIR_SEPARATOR, rev, RSPAMD_FUZZY_LOG_SUFFIX);
+		g_ptr_array_add (log->segments, seg);
+
+		while (log->segments->len > log->max_segments) {
+			rspamd_fuzzy_log_remove_segment (log, 0);
+		}
+
+		log->fd = open (seg->path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+				00600);
+	}
+	else if (log->fd == -1) {
+		log->fd = open (seg->path, O_WRONLY | O_APPEND);
+	}
+
+	if (log->fd == -1) {
+		g_set_error (err, rspamd_fuzzy_updates_log_quark (), errno,
+				"cannot open %s: %s", seg->path, strerror (errno));
+		goto err;
+	}
+
+	buf = rspamd_fuzzy_log_encode (rev, (struct fuzzy_peer_cmd *)updates->data,
+			updates->len, err);
+
+	if (buf == NULL) {
+		goto err;
+	}
+
+	if (!rspamd_fuzzy_log_write (log->fd, buf, err)) {
+		/* Remove partial record */
+		if (ftruncate (log->fd, seg->size) == -1) {
+			msg_err_fuzzy_log ("cannot truncate %s: %s", seg->path,
+					strerror (errno));
+		}
+
+		rspamd_fstring_free (buf);
+		goto err;
+	}
+
+	seg->size += buf->len;
+	seg->last = rev;
+	rspamd_fstring_free (buf);
+
+	return TRUE;
+
+err:
+	if (seg->size == 0) {
+		if (log->fd != -1) {
+			close (log->fd);
+			log->fd = -1;
+		}
+
+		rspamd_fuzzy_log_remove_segment (log, log->segments->len - 1);
+	}
+
+	return FALSE;
+}
+
+guint64
+rspamd_fuzzy_updates_log_first (struct rspamd_fuzzy_updates_log *log)
+{
+	struct rspamd_fuzzy_log_segment *seg;
+
+	if (log->segments->len == 0) {
+		return 0;
+	}
+
+	seg = g_ptr_array_index (log->segments, 0);
+
+	return seg->first;
+}
+
+guint64
+rspamd_fuzzy_updates_log_last (struct rspamd_fuzzy_updates_log *log)
+{
+	struct rspamd_fuzzy_log_segment *seg;
+
+	if (log->segments->len == 0) {
+		return 0;
+	}
+
+	seg = g_ptr_array_index (log->segments, log->segments->len - 1);
+
+	return seg->last;
+}
+
+/*
+ * Copies records starting from `off` to `out` until `max_len` is reached,
+ * returns offset after the last record copied
+ */
+static goffset
+rspamd_fuzzy_log_copy_records (gint fd, goffset off, gsize size,
+		guint64 from, gsize max_len, rspamd_fstring_t **out,
+		guint64 *last, gboolean *full)
+{
+	struct rspamd_fuzzy_log_record_hdr hdr;
+	gsize reclen;
+
+	while (rspamd_fuzzy_log_read_hdr (fd, off, size, &hdr)) {
+		reclen = sizeof (hdr) + hdr.clen;
+
+		if (hdr.rev > from) {
+			if ((*out)->len > 0 && (*out)->len + reclen > max_len) {
+				*full = TRUE;
+				break;
+			}
+
+			*out = rspamd_fstring_grow (*out, reclen);
+
+			if (pread (fd, (*out)->str + (*out)->len, reclen, off) !=
+					(gssize)reclen) {
+				break;
+			}
+
+			(*out)->len += reclen;
+			*last = hdr.rev;
+		}
+
+		off += reclen;
+	}
+
+	return off;
+}
+
+enum rspamd_fuzzy_updates_log_result
+rspamd_fuzzy_updates_log_read (struct rspamd_fuzzy_updates_log *log,
+		guint64 from,
+		gsize max_len,
+		rspamd_fstring_t **out,
+		guint64 *last)
+{
+	struct rspamd_fuzzy_log_segment *seg;
+	gboolean full = FALSE;
+	guint i;
+	gint fd;
+
+	g_assert (log != NULL);
+
+	if (log->segments->len == 0 || from >= rspamd_fuzzy_updates_log_last (log)) {
+		return RSPAMD_FUZZY_LOG_EMPTY;
+	}
+
+	if (from + 1 < rspamd_fuzzy_updates_log_first (log)) {
+		return RSPAMD_FUZZY_LOG_TOO_OLD;
+	}
+
+	/* Find the segment that contains the next revision */
+	for (i = log->segments->len - 1; i > 0; i --) {
+		seg = g_ptr_array_index (log->segments, i);
+
+		if (seg->first <= from + 1) {
+			break;
+		}
+	}
+
+	for (; i < log->segments->len && !full; i ++) {
+		seg = g_ptr_array_index (log->segments, i);
+		fd = open (seg->path, O_RDONLY);
+
+		if (fd == -1) {
+			msg_err_fuzzy_log ("cannot open %s: %s", seg->path, strerror (errno));
+
+			return RSPAMD_FUZZY_LOG_ERROR;
+		}
+
+		rspamd_fuzzy_log_copy_records (fd, 0, seg->size, from, max_len,
+				out, last, &full);
+		close (fd);
+	}
+
+	return (*out)->len > 0 ? RSPAMD_FUZZY_LOG_OK : RSPAMD_FUZZY_LOG_ERROR;
+}
+
+struct rspamd_fuzzy_log_snapshot_cbdata {
+	struct rspamd_fuzzy_updates_log *log;
+	GArray *cmds;
+	GHashTable *dirty;          /**< digests updated during export		*/
+	guint64 rev;
+	guint64 cursor;
+	gchar *tmp_path;
+	gint fd;
+	gboolean error;
+	GError **err;
+};
+
+static guint
+rspamd_fuzzy_log_digest_hash (gconstpointer p)
+{
+	guint h;
+
+	memcpy (&h, p, sizeof (h));
+
+	return h;
+}
+
+static gboolean
+rspamd_fuzzy_log_digest_equal (gconstpointer a, gconstpointer b)
+{
+	return memcmp (a, b, rspamd_cryptobox_HASHBYTES) == 0;
+}
+
+/*
+ * Storage is not locked while a snapshot is exported, so digests updated
+ * in between are exported once more when the export is finished and the
+ * snapshot gets the revision of the last update
+ */
+static void
+rspamd_fuzzy_log_snapshot_mark (struct rspamd_fuzzy_updates_log *log,
+		guint64 rev, GArray *updates)
+{
+	struct rspamd_fuzzy_log_snapshot_cbdata *cbd = log->building;
+	struct fuzzy_peer_cmd *io_cmd;
+	const guchar *digest;
+	guchar *k;
+	guint i;
+
+	for (i = 0; i < updates->len; i ++) {
+		io_cmd = &g_array_index (updates, struct fuzzy_peer_cmd, i);
+		digest = io_cmd->is_shingle ? io_cmd->cmd.shingle.basic.digest :
+				io_cmd->cmd.normal.digest;
+
+		if (g_hash_table_lookup (cbd->dirty, digest) == NULL) {
+			k = g_memdup (digest, rspamd_cryptobox_HASHBYTES);
+			g_hash_table_insert (cbd->dirty, k, k);
+		}
+	}
+
+	cbd->rev = MAX (cbd->rev, rev);
+}
+
+static gboolean
+rspamd_fuzzy_log_snapshot_flush (struct rspamd_fuzzy_log_snapshot_cbdata *cbd)
+{
+	rspamd_fstring_t *buf;
+	gboolean ret;
+
+	buf = rspamd_fuzzy_log_encode (cbd->rev,
+			(struct fuzzy_peer_cmd *)cbd->cmds->data, cbd->cmds->len, cbd->err);
+
+	if (buf == NULL) {
+		return FALSE;
+	}
+
+	ret = rspamd_fuzzy_log_write (cbd->fd, buf, cbd->err);
+	rspamd_fstring_free (buf);
+	g_array_set_size (cbd->cmds, 0);
+
+	return ret;
+}
+
+static void
+rspamd_fuzzy_log_snapshot_cb (const struct fuzzy_peer_cmd *cmd, void *ud)
+{
+	struct rspamd_fuzzy_log_snapshot_cbdata *cbd = ud;
+
+	if (cbd->error) {
+		return;
+	}
+
+	g_array_append_val (cbd->cmds, *cmd);
+
+	if (cbd->cmds->len >= RSPAMD_FUZZY_LOG_SNAPSHOT_CMDS) {
+		cbd->error = !rspamd_fuzzy_log_snapshot_flush (cbd);
+	}
+}
+
+static gboolean
+rspamd_fuzzy_log_snapshot_export_dirty (struct rspamd_fuzzy_log_snapshot_cbdata *cbd,
+		struct rspamd_fuzzy_backend *bk)
+{
+	struct fuzzy_peer_cmd io_cmd;
+	GHashTableIter it;
+	GPtrArray *digests;
+	gpointer k;
+	gboolean ret;
+
+	if (g_hash_table_size (cbd->dirty) == 0) {
+		return TRUE;
+	}
+
+	digests = g_ptr_array_sized_new (g_hash_table_size (cbd->dirty));
+	memset (&io_cmd, 0, sizeof (io_cmd));
+	io_cmd.cmd.normal.version = RSPAMD_FUZZY_VERSION;
+	io_cmd.cmd.normal.cmd = FUZZY_DEL;
+	g_hash_table_iter_init (&it, cbd->dirty);
+
+	/* Pages could have exported any state of these digests, so drop it */
+	while (g_hash_table_iter_next (&it, &k, NULL)) {
+		memcpy (io_cmd.cmd.normal.digest, k, sizeof (io_cmd.cmd.normal.digest));
+		rspamd_fuzzy_log_snapshot_cb (&io_cmd, cbd);
+		g_ptr_array_add (digests, k);
+	}
+
+	ret = rspamd_fuzzy_backend_export_digests (bk, rspamd_fuzzy_log_snapshot_cb,
+			cbd, digests);
+	g_ptr_array_free (digests, TRUE);
+
+	if (!ret && !cbd->error) {
+		g_set_error (cbd->err, rspamd_fuzzy_updates_log_quark (), EINVAL,
+				"cannot export %ud digests updated during snapshot",
+				g_hash_table_size (cbd->dirty));
+	}
+
+	return ret;
+}
+
+void
+rspamd_fuzzy_updates_log_snapshot_abort (struct rspamd_fuzzy_updates_log *log)
+{
+	struct rspamd_fuzzy_log_snapshot_cbdata *cbd;
+
+	g_assert (log != NULL);
+
+	if ((cbd = log->building) != NULL) {
+		close (cbd->fd);
+		unlink (cbd->tmp_path);
+		g_free (cbd->tmp_path);
+		g_array_free (cbd->cmds, TRUE);
+		g_hash_table_unref (cbd->dirty);
+		g_free (cbd);
+		log->building = NULL;
+	}
+}
+
+gboolean
+rspamd_fuzzy_updates_log_snapshot_start (struct rspamd_fuzzy_updates_log *log,
+		guint64 rev,
+		GError **err)
+{
+	struct rspamd_fuzzy_log_snapshot_cbdata *cbd;
+	gchar *tmp_path;
+	gint fd;
+
+	g_assert (log != NULL);
+	g_assert (log->building == NULL);
+
+	tmp_path = g_strdup_printf ("%s.tmp", log->snapshot_path);
+	fd = open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 00600);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_fuzzy_updates_log_quark (), errno,
+				"cannot open %s: %s", tmp_path, strerror (errno));
+		g_free (tmp_path);
+
+		return FALSE;
+	}
+
+	cbd = g_malloc0 (sizeof (*cbd));
+	cbd->log = log;
+	cbd->rev = rev;
+	cbd->fd = fd;
+	cbd->tmp_path = tmp_path;
+	cbd->cmds = g_array_sized_new (FALSE, FALSE, sizeof (struct fuzzy_peer_cmd),
+			RSPAMD_FUZZY_LOG_SNAPSHOT_CMDS);
+	cbd->dirty = g_hash_table_new_full (rspamd_fuzzy_log_digest_hash,
+			rspamd_fuzzy_log_digest_equal, g_free, NULL);
+	log->building = cbd;
+
+	return TRUE;
+}
+
+gboolean
+rspamd_fuzzy_updates_log_snapshot_step (struct rspamd_fuzzy_updates_log *log,
+		struct rspamd_fuzzy_backend *bk,
+		guint limit,
+		gboolean *done,
+		GError **err)
+{
+	struct rspamd_fuzzy_log_snapshot_cbdata *cbd;
+	gboolean ret = FALSE;
+
+	g_assert (log != NULL && log->building != NULL);
+
+	cbd = log->building;
+	cbd->err = err;
+	*done = FALSE;
+
+	if (!rspamd_fuzzy_backend_export (bk, rspamd_fuzzy_log_snapshot_cb, cbd,
+			&cbd->cursor, limit)) {
+		if (!cbd->error) {
+			g_set_error (err, rspamd_fuzzy_updates_log_quark (), EINVAL,
+					"cannot export backend %s",
+					rspamd_fuzzy_backend_id (bk) ?
+					rspamd_fuzzy_backend_id (bk) : "unknown");
+		}
+	}
+	else if (!cbd->error) {
+		if (cbd->cursor != 0) {
+			/* More pages to go */
+			cbd->err = NULL;
+
+			return TRUE;
+		}
+
+		/* The last record is written even if empty to keep revision */
+		if (rspamd_fuzzy_log_snapshot_export_dirty (cbd, bk) && !cbd->error &&
+				rspamd_fuzzy_log_snapshot_flush (cbd)) {
+			if (fsync (cbd->fd) == -1 || rename (cbd->tmp_path,
+					log->snapshot_path) == -1) {
+				g_set_error (err, rspamd_fuzzy_updates_log_quark (), errno,
+						"cannot store snapshot %s: %s", log->snapshot_path,
+						strerror (errno));
+			}
+			else {
+				log->snapshot_rev = cbd->rev;
+				*done = TRUE;
+				ret = TRUE;
+				msg_info_fuzzy_log ("stored snapshot %s, revision %L",
+						log->snapshot_path, cbd->rev);
+			}
+		}
+	}
+
+	/* Both finished and failed snapshots release the state */
+	rspamd_fuzzy_updates_log_snapshot_abort (log);
+
+	return ret;
+}
+
+gboolean
+rspamd_fuzzy_updates_log_snapshot_active (struct rspamd_fuzzy_updates_log *log)
+{
+	return log->building != NULL;
+}
+
+guint64
+rspamd_fuzzy_updates_log_snapshot_rev (struct rspamd_fuzzy_updates_log *log)
+{
+	return log->snapshot_rev;
+}
+
+enum rspamd_fuzzy_updates_log_result
+rspamd_fuzzy_updates_log_read_snapshot (struct rspamd_fuzzy_updates_log *log,
+		goffset offset,
+		gsize max_len,
+		rspamd_fstring_t **out,
+		goffset *next)
+{
+	struct stat st;
+	guint64 last = 0;
+	gboolean full = FALSE;
+	gint fd;
+
+	g_assert (log != NULL);
+
+	if (log->snapshot_rev == 0) {
+		return RSPAMD_FUZZY_LOG_TOO_OLD;
+	}
+
+	fd = open (log->snapshot_path, O_RDONLY);
+
+	if (fd == -1 || fstat (fd, &st) == -1) {
+		msg_err_fuzzy_log ("cannot open %s: %s", log->snapshot_path,
+				strerror (errno));
+
+		if (fd != -1) {
+			close (fd);
+		}
+
+		return RSPAMD_FUZZY_LOG_ERROR;
+	}
+
+	if (offset >= st.st_size) {
+		close (fd);
+
+		return RSPAMD_FUZZY_LOG_EMPTY;
+	}
+
+	/* Snapshot is applied as a whole, so copy records of any revision */
+	*next = rspamd_fuzzy_log_copy_records (fd, offset, st.st_size,
+			0, max_len, out, &last, &full);
+	close (fd);
+
+	return (*out)->len > 0 ? RSPAMD_FUZZY_LOG_OK : RSPAMD_FUZZY_LOG_ERROR;
+}
+
+gboolean
+rspamd_fuzzy_updates_log_decode (const guchar *data, gsize len,
+		rspamd_fuzzy_updates_log_cb cb,
+		void *ud,
+		GError **err)
+{
+	struct rspamd_fuzzy_log_record_hdr hdr;
+	struct fuzzy_peer_cmd cmd;
+	const guchar *p;
+	guchar *raw = NULL;
+	gsize r, remain, rawlen = 0;
+	guint32 cmdlen;
+	GArray *cmds;
+	gboolean ret = FALSE;
+
+	while (len > 0) {
+		if (len < sizeof (hdr)) {
+			g_set_error (err, rspamd_fuzzy_updates_log_quark (), EINVAL,
+					"truncated record header");
+			goto end;
+		}
+
+		memcpy (&hdr, data, sizeof (hdr));
+		hdr.ncmds = GUINT32_FROM_LE (hdr.ncmds);
+		hdr.rev = GUINT64_FROM_LE (hdr.rev);
+		hdr.rawlen = GUINT32_FROM_LE (hdr.rawlen);
+		hdr.clen = GUINT32_FROM_LE (hdr.clen);
+
+		if (memcmp (hdr.magic, fuzzy_log_magic, sizeof (hdr.magic)) != 0 ||
+				hdr.clen > len - sizeof (hdr) ||
+				hdr.rawlen > RSPAMD_FUZZY_LOG_MAX_RECORD) {
+			g_set_error (err, rspamd_fuzzy_updates_log_quark (), EINVAL,
+					"bad record header");
+			goto end;
+		}
+
+		if (hdr.rawlen > rawlen) {
+			raw = g_realloc (raw, hdr.rawlen);
+			rawlen = hdr.rawlen;
+		}
+
+		r = ZSTD_decompress (raw, hdr.rawlen, data + sizeof (hdr), hdr.clen);
+
+		if (ZSTD_isError (r) || r != hdr.rawlen) {
+			g_set_error (err, rspamd_fuzzy_updates_log_quark (), EINVAL,
+					"cannot decompress record %" G_GUINT64_FORMAT ": %s",
+					hdr.rev, ZSTD_isError (r) ? ZSTD_getErrorName (r) :
+					"bad length");
+			goto end;
+		}
+
+		cmds = g_array_sized_new (FALSE, FALSE, sizeof (cmd), hdr.ncmds);
+		p = raw;
+		remain = r;
+
+		while (remain > 0) {
+			if (remain < sizeof (cmdlen)) {
+				break;
+			}
+
+			memcpy (&cmdlen, p, sizeof (cmdlen));
+			cmdlen = GUINT32_FROM_LE (cmdlen);
+			p += sizeof (cmdlen);
+			remain -= sizeof (cmdlen);
+
+			if (cmdlen > remain ||
+					cmdlen < sizeof (struct rspamd_fuzzy_cmd) + sizeof (guint32) ||
+					cmdlen > sizeof (cmd)) {
+				break;
+			}
+
+			memset (&cmd, 0, sizeof (cmd));
+			memcpy (&cmd, p, cmdlen);
+
+			if (cmd.is_shingle && cmdlen != sizeof (cmd)) {
+				break;
+			}
+
+			g_array_append_val (cmds, cmd);
+			p += cmdlen;
+			remain -= cmdlen;
+		}
+
+		if (remain > 0 || cmds->len != hdr.ncmds) {
+			g_set_error (err, rspamd_fuzzy_updates_log_quark (), EINVAL,
+					"bad commands in record %" G_GUINT64_FORMAT, hdr.rev);
+			g_array_unref (cmds);
+			goto end;
+		}
+
+		data += sizeof (hdr) + hdr.clen;
+		len -= sizeof (hdr) + hdr.clen;
+
+		if (!cb (hdr.rev, cmds, ud)) {
+			g_array_unref (cmds);
+			break;
+		}
+
+		g_array_unref (cmds);
+	}
+
+	ret = TRUE;
+
+end:
+	g_free (raw);
+
+	return ret;
+}
+
+void
+rspamd_fuzzy_updates_log_close (struct rspamd_fuzzy_updates_log *log)
+{
+	if (log) {
+		rspamd_fuzzy_updates_log_snapshot_abort (log);
+
+		if (log->fd != -1) {
+			close (log->fd);
+		}
+
+		g_ptr_array_free (log->segments, TRUE);
+		g_free (log->snapshot_path);
+		g_free (log->dir);
+		g_free (log);
+	}
+}
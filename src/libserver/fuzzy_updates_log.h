@@ -0,0 +1,194 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBSERVER_FUZZY_UPDATES_LOG_H_
+#define SRC_LIBSERVER_FUZZY_UPDATES_LOG_H_
+
+#include "config.h"
+#include "fuzzy_wire.h"
+#include "fstring.h"
+
+struct rspamd_fuzzy_backend;
+
+/*
+ * Append only log of fuzzy updates used to replicate storage to mirrors.
+ * Each committed update transaction is stored as a record with its revision
+ * and zstd compressed commands. Records are appended to segment files, old
+ * segments are removed when their number exceeds the limit.
+ *
+ * Records are sent to mirrors as is, so the same format is used on disk and
+ * over the wire. Snapshot is a separate file in the same format, its last
+ * record has the revision the whole snapshot is consistent with.
+ */
+struct rspamd_fuzzy_updates_log;
+
+enum rspamd_fuzzy_updates_log_result {
+	RSPAMD_FUZZY_LOG_OK = 0,
+	RSPAMD_FUZZY_LOG_EMPTY,     /**< no records after the requested position */
+	RSPAMD_FUZZY_LOG_TOO_OLD,   /**< requested revision is not in the log */
+	RSPAMD_FUZZY_LOG_ERROR,
+};
+
+/**
+ * Called for each decoded record, `cmds` is an array of fuzzy_peer_cmd which
+ * is unreferenced after callback returns (use g_array_ref to keep it)
+ */
+typedef gboolean (*rspamd_fuzzy_updates_log_cb) (guint64 rev, GArray *cmds,
+		void *ud);
+
+/**
+ * Opens (or creates) updates log in the specified directory
+ * @param dir
+ * @param segment_size segment is rotated when it grows larger
+ * @param max_segments maximum number of segments to keep
+ * @param err
+ * @return
+ */
+struct rspamd_fuzzy_updates_log * rspamd_fuzzy_updates_log_open (
+		const gchar *dir,
+		gsize segment_size,
+		guint max_segments,
+		GError **err);
+
+/**
+ * Appends updates committed with revision `rev`
+ * @param log
+ * @param rev
+ * @param updates array of fuzzy_peer_cmd
+ * @param err
+ * @return
+ */
+gboolean rspamd_fuzzy_updates_log_append (struct rspamd_fuzzy_updates_log *log,
+		guint64 rev,
+		GArray *updates,
+		GError **err);
+
+/**
+ * Returns the first and the last revisions stored, 0 if the log is empty
+ */
+guint64 rspamd_fuzzy_updates_log_first (struct rspamd_fuzzy_updates_log *log);
+guint64 rspamd_fuzzy_updates_log_last (struct rspamd_fuzzy_updates_log *log);
+
+/**
+ * Reads records with revisions greater than `from`, at least one record
+ * is returned if there are any and no more than `max_len` bytes otherwise
+ * @param log
+ * @param from
+ * @param max_len
+ * @param out records are appended here
+ * @param last the last revision read
+ * @return
+ */
+enum rspamd_fuzzy_updates_log_result rspamd_fuzzy_updates_log_read (
+		struct rspamd_fuzzy_updates_log *log,
+		guint64 from,
+		gsize max_len,
+		rspamd_fstring_t **out,
+		guint64 *last);
+
+/**
+ * Starts a new snapshot with revision `rev`, the snapshot is filled by
+ * rspamd_fuzzy_updates_log_snapshot_step. Only one snapshot can be built
+ * at a time
+ * @param log
+ * @param rev
+ * @param err
+ * @return
+ */
+gboolean rspamd_fuzzy_updates_log_snapshot_start (
+		struct rspamd_fuzzy_updates_log *log,
+		guint64 rev,
+		GError **err);
+
+/**
+ * Exports up to `limit` digests from the backend to the snapshot being built.
+ * When the backend is exported, the snapshot replaces the existing one and
+ * `done` is set. Backend can be updated in between: digests appended to the
+ * log meanwhile are exported again at the end and the snapshot gets the
+ * revision of the last appended update
+ * @param log
+ * @param bk
+ * @param limit
+ * @param done
+ * @param err
+ * @return FALSE on error, the snapshot is aborted then
+ */
+gboolean rspamd_fuzzy_updates_log_snapshot_step (
+		struct rspamd_fuzzy_updates_log *log,
+		struct rspamd_fuzzy_backend *bk,
+		guint limit,
+		gboolean *done,
+		GError **err);
+
+/**
+ * Aborts the snapshot being built if any
+ * @param log
+ */
+void rspamd_fuzzy_updates_log_snapshot_abort (
+		struct rspamd_fuzzy_updates_log *log);
+
+/**
+ * Returns TRUE if a snapshot is being built
+ * @param log
+ * @return
+ */
+gboolean rspamd_fuzzy_updates_log_snapshot_active (
+		struct rspamd_fuzzy_updates_log *log);
+
+/**
+ * Returns revision of the current snapshot, 0 if there is no snapshot
+ * @param log
+ * @return
+ */
+guint64 rspamd_fuzzy_updates_log_snapshot_rev (
+		struct rspamd_fuzzy_updates_log *log);
+
+/**
+ * Reads snapshot records starting from `offset`
+ * @param log
+ * @param offset
+ * @param max_len
+ * @param out records are appended here
+ * @param next offset of the next record
+ * @return
+ */
+enum rspamd_fuzzy_updates_log_result rspamd_fuzzy_updates_log_read_snapshot (
+		struct rspamd_fuzzy_updates_log *log,
+		goffset offset,
+		gsize max_len,
+		rspamd_fstring_t **out,
+		goffset *next);
+
+/**
+ * Decodes records received from the master
+ * @param data
+ * @param len
+ * @param cb stops decoding if returns FALSE
+ * @param ud
+ * @param err
+ * @return
+ */
+gboolean rspamd_fuzzy_updates_log_decode (const guchar *data, gsize len,
+		rspamd_fuzzy_updates_log_cb cb,
+		void *ud,
+		GError **err);
+
+/**
+ * Closes log
+ * @param log
+ */
+void rspamd_fuzzy_updates_log_close (struct rspamd_fuzzy_updates_log *log);
+
+#endif /* SRC_LIBSERVER_FUZZY_UPDATES_LOG_H_ */
@@ -25,6 +25,7 @@ enum rspamd_fuzzy_epoch {
 	RSPAMD_FUZZY_EPOCH9, /**< 0.9 + */
 	RSPAMD_FUZZY_EPOCH10, /**< 1.0+ encryption */
 	RSPAMD_FUZZY_EPOCH11, /**< 1.7+ extended reply */
+	RSPAMD_FUZZY_EPOCH12, /**< 1.7+ batched commands */
 	RSPAMD_FUZZY_EPOCH_MAX
 };
 
@@ -54,7 +55,33 @@ RSPAMD_PACKED(rspamd_fuzzy_reply) {
 	struct rspamd_fuzzy_reply_v1 v1;
 	gchar digest[rspamd_cryptobox_HASHBYTES];
 	guint32 ts;
-	guchar reserved[12];
+	guchar flags;
+	guchar reserved[11];
+};
+
+/* Reply flags */
+#define RSPAMD_FUZZY_REPLY_FLAG_BATCH (1u << 0) /**< server accepts batches */
+
+/*
+ * Batched commands (epoch 12): a single datagram contains a header followed
+ * by `ncmds` commands, each is either rspamd_fuzzy_cmd or
+ * rspamd_fuzzy_shingle_cmd depending on its shingles_count. Encrypted batch
+ * has rspamd_fuzzy_encrypted_req_hdr with the batch magic and then header
+ * and commands encrypted as a whole.
+ *
+ * Storage replies with a single datagram: header followed by `ncmds`
+ * rspamd_fuzzy_reply (prepended by rspamd_fuzzy_encrypted_rep_hdr and
+ * encrypted as a whole for encrypted batches).
+ */
+#define RSPAMD_FUZZY_BATCH_VERSION 1
+/* Fits in a single unfragmented datagram for ethernet MTU and IPv6 */
+#define RSPAMD_FUZZY_BATCH_MAX_SIZE 1452
+
+RSPAMD_PACKED(rspamd_fuzzy_batch_hdr) {
+	guchar magic[4];
+	guint8 version;
+	guint8 ncmds;
+	guint16 reserved;
 };
 
 RSPAMD_PACKED(rspamd_fuzzy_encrypted_req_hdr) {
@@ -85,7 +112,18 @@ RSPAMD_PACKED(rspamd_fuzzy_encrypted_reply) {
 	struct rspamd_fuzzy_reply rep;
 };
 
+/*
+ * Replies are larger than plain commands, so the number of commands in a batch
+ * is limited by the size of the encrypted reply
+ */
+#define RSPAMD_FUZZY_BATCH_MAX_CMDS \
+	((RSPAMD_FUZZY_BATCH_MAX_SIZE - sizeof (struct rspamd_fuzzy_batch_hdr) - \
+	sizeof (struct rspamd_fuzzy_encrypted_rep_hdr)) / \
+	sizeof (struct rspamd_fuzzy_reply))
+
 static const guchar fuzzy_encrypted_magic[4] = {'r', 's', 'f', 'e'};
+static const guchar fuzzy_batch_magic[4] = {'r', 's', 'f', 'b'};
+static const guchar fuzzy_encrypted_batch_magic[4] = {'r', 's', 'f', 'B'};
 
 struct rspamd_fuzzy_stat_entry {
 	const gchar *name;
@@ -37,5 +37,6 @@
 #define RSPAMD_MEMPOOL_ARC_SIGN_KEY "arc_key"
 #define RSPAMD_MEMPOOL_ARC_SIGN_SELECTOR "arc_selector"
 #define RSPAMD_MEMPOOL_STAT_SIGNATURE "stat_signature"
+#define RSPAMD_MEMPOOL_BAYES_AGGREGATES "bayes_aggregates"
 
 #endif
@@ -23,8 +23,17 @@
 #include "contrib/hiredis/adapters/libevent.h"
 #include "cryptobox.h"
 #include "logger.h"
+#include "utlist.h"
 
 struct rspamd_redis_pool_elt;
+struct rspamd_redis_pool_connection;
+
+struct rspamd_redis_pool_request {
+	struct rspamd_redis_pool_connection *conn;
+	rspamd_redis_pool_cb cb;
+	gpointer ud;
+	struct rspamd_redis_pool_request *prev, *next;
+};
 
 struct rspamd_redis_pool_connection {
 	struct redisAsyncContext *ctx;
@@ -33,6 +42,11 @@ struct rspamd_redis_pool_connection {
 	struct event timeout;
 	gboolean active;
 	gchar tag[MEMPOOL_UID_LEN];
+	/* Pipelined requests */
+	struct rspamd_redis_pool_request *requests;
+	guint pending;
+	guint cancelled;
+	gboolean fatal;
 	ref_entry_t ref;
 };
 
@@ -41,6 +55,12 @@ struct rspamd_redis_pool_elt {
 	guint64 key;
 	GQueue *active;
 	GQueue *inactive;
+	/* Connection shared by pipelined commands */
+	struct rspamd_redis_pool_connection *pipeline;
+	gchar *db;
+	gchar *password;
+	gchar *ip;
+	gint port;
 };
 
 struct rspamd_redis_pool {
@@ -50,11 +70,34 @@ struct rspamd_redis_pool {
 	GHashTable *elts_by_ctx;
 	gdouble timeout;
 	guint max_conns;
+	gboolean pipelining;
 };
 
 static const gdouble default_timeout = 10.0;
 static const guint default_max_conns = 100;
 
+/*
+ * Commands that neither block nor change state of a connection, anything
+ * else (including XREAD with BLOCK argument) gets a dedicated connection
+ */
+static const gchar *pipelined_commands[] = {
+	"PING", "ECHO", "EXISTS", "TYPE", "DEL", "UNLINK",
+	"EXPIRE", "PEXPIRE", "EXPIREAT", "PEXPIREAT", "PERSIST", "TTL", "PTTL",
+	"GET", "SET", "SETEX", "PSETEX", "SETNX", "GETSET", "MGET", "MSET",
+	"APPEND", "STRLEN", "INCR", "INCRBY", "INCRBYFLOAT", "DECR", "DECRBY",
+	"HGET", "HSET", "HSETNX", "HMGET", "HMSET", "HDEL", "HEXISTS", "HLEN",
+	"HGETALL", "HKEYS", "HVALS", "HINCRBY", "HINCRBYFLOAT",
+	"LPUSH", "RPUSH", "LPOP", "RPOP", "LLEN", "LINDEX", "LRANGE", "LREM",
+	"LTRIM",
+	"SADD", "SREM", "SCARD", "SISMEMBER", "SMEMBERS",
+	"ZADD", "ZREM", "ZCARD", "ZCOUNT", "ZSCORE", "ZRANK", "ZREVRANK",
+	"ZINCRBY", "ZRANGE", "ZREVRANGE", "ZRANGEBYSCORE", "ZREVRANGEBYSCORE",
+	"ZREMRANGEBYRANK", "ZREMRANGEBYSCORE",
+	"PFADD", "PFCOUNT", "XADD", "XLEN", "XRANGE", "XREVRANGE", "XTRIM",
+	"EVAL", "EVALSHA",
+	NULL
+};
+
 #define msg_err_rpool(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
 		"redis_pool", conn->tag, \
         G_STRFUNC, \
@@ -167,6 +210,9 @@ rspamd_redis_pool_elt_dtor (gpointer p)
 
 	g_queue_free (elt->active);
 	g_queue_free (elt->inactive);
+	g_free (elt->db);
+	g_free (elt->password);
+	g_free (elt->ip);
 	g_free (elt);
 }
 
@@ -299,6 +345,31 @@ rspamd_redis_pool_new_elt (struct rspamd_redis_pool *pool)
 	return elt;
 }
 
+static struct rspamd_redis_pool_elt *
+rspamd_redis_pool_get_elt (struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port)
+{
+	struct rspamd_redis_pool_elt *elt;
+	guint64 key;
+
+	key = rspamd_redis_pool_get_key (db, password, ip, port);
+	elt = g_hash_table_lookup (pool->elts_by_key, &key);
+
+	if (elt == NULL) {
+		/* Need to create a pool */
+		elt = rspamd_redis_pool_new_elt (pool);
+		elt->key = key;
+		elt->db = g_strdup (db);
+		elt->password = g_strdup (password);
+		elt->ip = g_strdup (ip);
+		elt->port = port;
+		g_hash_table_insert (pool->elts_by_key, &elt->key, elt);
+	}
+
+	return elt;
+}
+
 struct rspamd_redis_pool *
 rspamd_redis_pool_init (void)
 {
@@ -323,6 +394,7 @@ rspamd_redis_pool_config (struct rspamd_redis_pool *pool,
 	pool->cfg = cfg;
 	pool->timeout = default_timeout;
 	pool->max_conns = default_max_conns;
+	pool->pipelining = cfg->redis_pipelining;
 }
 
 
@@ -331,7 +403,6 @@ rspamd_redis_pool_connect (struct rspamd_redis_pool *pool,
 		const gchar *db, const gchar *password,
 		const char *ip, int port)
 {
-	guint64 key;
 	struct rspamd_redis_pool_elt *elt;
 	GList *conn_entry;
 	struct rspamd_redis_pool_connection *conn;
@@ -340,42 +411,29 @@ rspamd_redis_pool_connect (struct rspamd_redis_pool *pool,
 	g_assert (pool->ev_base != NULL);
 	g_assert (ip != NULL);
 
-	key = rspamd_redis_pool_get_key (db, password, ip, port);
-	elt = g_hash_table_lookup (pool->elts_by_key, &key);
+	elt = rspamd_redis_pool_get_elt (pool, db, password, ip, port);
 
-	if (elt) {
-		if (g_queue_get_length (elt->inactive) > 0) {
-			conn_entry = g_queue_pop_head_link (elt->inactive);
-			conn = conn_entry->data;
-			g_assert (!conn->active);
-
-			if (conn->ctx->err == REDIS_OK) {
-				event_del (&conn->timeout);
-				conn->active = TRUE;
-				g_queue_push_tail_link (elt->active, conn_entry);
-				msg_debug_rpool ("reused existing connection to %s:%d", ip, port);
-			}
-			else {
-				g_list_free (conn->entry);
-				conn->entry = NULL;
-				REF_RELEASE (conn);
-				conn = rspamd_redis_pool_new_connection (pool, elt,
-						db, password, ip, port);
-			}
+	if (g_queue_get_length (elt->inactive) > 0) {
+		conn_entry = g_queue_pop_head_link (elt->inactive);
+		conn = conn_entry->data;
+		g_assert (!conn->active);
 
+		if (conn->ctx->err == REDIS_OK) {
+			event_del (&conn->timeout);
+			conn->active = TRUE;
+			g_queue_push_tail_link (elt->active, conn_entry);
+			msg_debug_rpool ("reused existing connection to %s:%d", ip, port);
 		}
 		else {
-			/* Need to create connection */
+			g_list_free (conn->entry);
+			conn->entry = NULL;
+			REF_RELEASE (conn);
 			conn = rspamd_redis_pool_new_connection (pool, elt,
 					db, password, ip, port);
 		}
 	}
 	else {
-		/* Need to create a pool */
-		elt = rspamd_redis_pool_new_elt (pool);
-		elt->key = key;
-		g_hash_table_insert (pool->elts_by_key, &elt->key, elt);
-
+		/* Need to create connection */
 		conn = rspamd_redis_pool_new_connection (pool, elt,
 				db, password, ip, port);
 	}
@@ -431,6 +489,192 @@ rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
 	}
 }
 
+static void
+rspamd_redis_pool_pipeline_release (struct rspamd_redis_pool_connection *conn)
+{
+	struct rspamd_redis_pool_elt *elt = conn->elt;
+	struct rspamd_redis_pool_request *req, *tmp;
+
+	if (elt->pipeline == conn) {
+		elt->pipeline = NULL;
+	}
+
+	/* Cancelled requests are called when the connection is freed */
+	DL_FOREACH_SAFE (conn->requests, req, tmp) {
+		DL_DELETE (conn->requests, req);
+		req->conn = NULL;
+	}
+
+	msg_debug_rpool ("release pipelined connection, fatal: %d", conn->fatal);
+	conn->pending = 0;
+	conn->cancelled = 0;
+	rspamd_redis_pool_release_connection (elt->pool, conn->ctx, conn->fatal);
+}
+
+static void
+rspamd_redis_pool_pipeline_reply (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_redis_pool_request *req = priv;
+	struct rspamd_redis_pool_connection *conn = req->conn;
+	gboolean cancelled;
+
+	if (conn == NULL) {
+		/* Connection has been released */
+		g_free (req);
+
+		return;
+	}
+
+	cancelled = (req->cb == NULL);
+
+	if (!cancelled) {
+		req->cb (c, r, req->ud);
+	}
+
+	/* Requests pending are kept while callback is called */
+	DL_DELETE (conn->requests, req);
+	g_free (req);
+	conn->pending --;
+
+	if (cancelled) {
+		conn->cancelled --;
+	}
+
+	if (c->err != REDIS_OK) {
+		conn->fatal = TRUE;
+
+		if (conn->elt->pipeline == conn) {
+			conn->elt->pipeline = NULL;
+		}
+	}
+
+	if (conn->pending == 0 ||
+			(conn->pending == conn->cancelled && conn->elt->pipeline != conn)) {
+		rspamd_redis_pool_pipeline_release (conn);
+	}
+}
+
+gboolean
+rspamd_redis_pool_can_pipeline (struct rspamd_redis_pool *pool,
+		const gchar *cmd)
+{
+	const gchar **pc;
+
+	if (!pool->pipelining || cmd == NULL) {
+		return FALSE;
+	}
+
+	for (pc = pipelined_commands; *pc != NULL; pc ++) {
+		if (g_ascii_strcasecmp (cmd, *pc) == 0) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+struct rspamd_redis_pool_elt*
+rspamd_redis_pool_pipeline (struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port)
+{
+	g_assert (pool != NULL);
+	g_assert (ip != NULL);
+
+	return rspamd_redis_pool_get_elt (pool, db, password, ip, port);
+}
+
+struct rspamd_redis_pool_request*
+rspamd_redis_pool_pipeline_command (struct rspamd_redis_pool_elt *elt,
+		rspamd_redis_pool_cb cb, gpointer ud,
+		gint nargs, const gchar **args, const gsize *arglens)
+{
+	struct rspamd_redis_pool_connection *conn;
+	struct rspamd_redis_pool_request *req;
+	struct redisAsyncContext *ctx;
+
+	g_assert (elt != NULL);
+	g_assert (cb != NULL);
+
+	conn = elt->pipeline;
+
+	if (conn == NULL) {
+		ctx = rspamd_redis_pool_connect (elt->pool, elt->db, elt->password,
+				elt->ip, elt->port);
+
+		if (ctx == NULL) {
+			return NULL;
+		}
+
+		conn = g_hash_table_lookup (elt->pool->elts_by_ctx, ctx);
+		g_assert (conn != NULL);
+
+		if (ctx->err != REDIS_OK) {
+			msg_err_rpool ("cannot connect to redis: %s", ctx->errstr);
+			rspamd_redis_pool_release_connection (elt->pool, ctx, TRUE);
+
+			return NULL;
+		}
+
+		conn->fatal = FALSE;
+		elt->pipeline = conn;
+		msg_debug_rpool ("start pipelining on connection to %s:%d",
+				elt->ip, elt->port);
+	}
+
+	req = g_malloc0 (sizeof (*req));
+	req->conn = conn;
+	req->cb = cb;
+	req->ud = ud;
+
+	if (redisAsyncCommandArgv (conn->ctx, rspamd_redis_pool_pipeline_reply,
+			req, nargs, args, arglens) != REDIS_OK) {
+		msg_info_rpool ("call to redis failed: %s", conn->ctx->errstr);
+		g_free (req);
+		conn->fatal = TRUE;
+		elt->pipeline = NULL;
+
+		if (conn->pending == conn->cancelled) {
+			rspamd_redis_pool_pipeline_release (conn);
+		}
+
+		return NULL;
+	}
+
+	DL_APPEND (conn->requests, req);
+	conn->pending ++;
+
+	return req;
+}
+
+void
+rspamd_redis_pool_pipeline_cancel (struct rspamd_redis_pool_request *req,
+		gboolean is_fatal)
+{
+	struct rspamd_redis_pool_connection *conn = req->conn;
+
+	if (conn == NULL || req->cb == NULL) {
+		return;
+	}
+
+	req->cb = NULL;
+	req->ud = NULL;
+	conn->cancelled ++;
+
+	if (is_fatal) {
+		/* Do not send new commands to this connection */
+		conn->fatal = TRUE;
+
+		if (conn->elt->pipeline == conn) {
+			conn->elt->pipeline = NULL;
+		}
+	}
+
+	if (conn->pending == conn->cancelled && conn->elt->pipeline != conn) {
+		rspamd_redis_pool_pipeline_release (conn);
+	}
+}
 
 void
 rspamd_redis_pool_destroy (struct rspamd_redis_pool *pool)
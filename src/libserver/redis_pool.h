@@ -19,10 +19,15 @@
 #include "config.h"
 
 struct rspamd_redis_pool;
+struct rspamd_redis_pool_elt;
+struct rspamd_redis_pool_request;
 struct rspamd_config;
 struct redisAsyncContext;
 struct event_base;
 
+typedef void (*rspamd_redis_pool_cb) (struct redisAsyncContext *ac,
+		gpointer reply, gpointer ud);
+
 /**
  * Creates new redis pool
  * @return
@@ -61,6 +66,59 @@ struct redisAsyncContext* rspamd_redis_pool_connect (
 void rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
 		struct redisAsyncContext *ctx, gboolean is_fatal);
 
+/**
+ * Returns TRUE if `cmd` can be sent over a pipelined connection shared by
+ * different callers (only known commands that neither block nor change
+ * connection state can)
+ * @param pool
+ * @param cmd
+ * @return
+ */
+gboolean rspamd_redis_pool_can_pipeline (struct rspamd_redis_pool *pool,
+		const gchar *cmd);
+
+/**
+ * Returns pipeline for the specific redis server, commands sent to the same
+ * pipeline within one event loop iteration are written together and share
+ * a single connection
+ * @param pool
+ * @param db
+ * @param password
+ * @param ip
+ * @param port
+ * @return
+ */
+struct rspamd_redis_pool_elt* rspamd_redis_pool_pipeline (
+		struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port);
+
+/**
+ * Sends command to the pipeline, `cb` is called with the reply for this
+ * command only
+ * @param elt
+ * @param cb
+ * @param ud
+ * @param nargs
+ * @param args
+ * @param arglens
+ * @return request that is valid until `cb` is called or NULL on error
+ */
+struct rspamd_redis_pool_request* rspamd_redis_pool_pipeline_command (
+		struct rspamd_redis_pool_elt *elt,
+		rspamd_redis_pool_cb cb, gpointer ud,
+		gint nargs, const gchar **args, const gsize *arglens);
+
+/**
+ * Cancels request, its callback is not called. If `is_fatal` is TRUE then
+ * the connection is not used for new commands and it is closed as soon as
+ * all requests on it are cancelled
+ * @param req
+ * @param is_fatal
+ */
+void rspamd_redis_pool_pipeline_cancel (struct rspamd_redis_pool_request *req,
+		gboolean is_fatal);
+
 /**
  * Stops redis pool and destroys it
  * @param pool
@@ -18,6 +18,7 @@
 
 #include "config.h"
 #include "ucl.h"
+#include "mem_pool.h"
 
 #define RSPAMD_DEFAULT_BACKEND "mmap"
 
@@ -29,6 +30,7 @@ struct rspamd_stat_ctx;
 struct rspamd_token_result;
 struct rspamd_statfile;
 struct rspamd_task;
+struct rspamd_stat_learn_batch;
 
 struct rspamd_stat_backend {
 	const char *name;
@@ -56,6 +58,10 @@ struct rspamd_stat_backend {
 	void (*close)(gpointer ctx);
 
 	gpointer (*load_tokenizer_config)(gpointer runtime, gsize *sz);
+	const gchar* (*learn_destination)(struct rspamd_task *task,
+			gpointer runtime, gpointer ctx);
+	gboolean (*learn_batch)(struct rspamd_stat_ctx *ctx,
+			struct rspamd_stat_learn_batch *batch, gpointer p);
 	gpointer ctx;
 };
 
@@ -93,6 +99,13 @@ struct rspamd_stat_backend {
 				gpointer ctx); \
 		gpointer rspamd_##name##_load_tokenizer_config (gpointer runtime, \
 				gsize *len); \
+		const gchar * rspamd_##name##_learn_destination ( \
+				struct rspamd_task *task, \
+				gpointer runtime, \
+				gpointer ctx); \
+		gboolean rspamd_##name##_learn_batch (struct rspamd_stat_ctx *ctx, \
+				struct rspamd_stat_learn_batch *batch, \
+				gpointer p); \
 		void rspamd_##name##_close (gpointer ctx)
 
 RSPAMD_STAT_BACKEND_DEF(mmaped_file);
@@ -101,4 +114,38 @@ RSPAMD_STAT_BACKEND_DEF(sqlite3);
 RSPAMD_STAT_BACKEND_DEF(redis);
 #endif
 
+struct rspamd_mmaped_file_s;
+
+/**
+ * Opens mmaped statfile, `stcf` can be NULL if the file is not used for
+ * classification
+ */
+struct rspamd_mmaped_file_s * rspamd_mmaped_file_open (rspamd_mempool_t *pool,
+		const gchar *filename, size_t size,
+		struct rspamd_statfile_config *stcf);
+gint rspamd_mmaped_file_close_file (rspamd_mempool_t *pool,
+		struct rspamd_mmaped_file_s *file);
+/* Low level access to tokens of mmaped statfile of any version */
+double rspamd_mmaped_file_get_token (struct rspamd_mmaped_file_s *file,
+		guint64 data);
+void rspamd_mmaped_file_set_token (rspamd_mempool_t *pool,
+		struct rspamd_mmaped_file_s *file, guint64 data, double value);
+guint64 rspamd_mmaped_file_get_used (struct rspamd_mmaped_file_s *file);
+guint64 rspamd_mmaped_file_get_total (struct rspamd_mmaped_file_s *file);
+
+/**
+ * Converts mmaped statfile `src` to the current format and writes it to `dst`.
+ * The new file replaces `dst` when it is complete, so `dst` can be equal
+ * to `src`
+ * @param pool
+ * @param src
+ * @param dst
+ * @param size size of the new file, size of `src` is used if 0
+ * @return 0 on success
+ */
+gint rspamd_mmaped_file_convert (rspamd_mempool_t *pool,
+		const gchar *src,
+		const gchar *dst,
+		gsize size);
+
 #endif /* BACKENDS_H_ */
@@ -18,6 +18,10 @@
 #include "unix-std.h"
 
 #define CHAIN_LENGTH 128
+/* Slots per bucket in version 2 statfiles */
+#define BUCKET_SLOTS 5
+/* Maximum length of cuckoo displacement path */
+#define MAX_KICKS 256
 
 /* Section types */
 #define STATFILE_SECTION_COMMON 1
@@ -55,6 +59,22 @@ struct stat_file_block {
 	double value;                           /**< double value                       */
 };
 
+/**
+ * Bucket of data in version 2 statfile, occupies exactly one cache line.
+ * Each token can be stored in one of two buckets derived from its key
+ */
+struct stat_file_bucket {
+	guint64 keys[BUCKET_SLOTS];             /**< token fingerprints, 0 is free	*/
+	gfloat values[BUCKET_SLOTS];            /**< token counters						*/
+	guint32 unused;                         /**< padding to 64 bytes				*/
+};
+
+G_STATIC_ASSERT (sizeof (struct stat_file_bucket) == 64);
+
+/* Buckets are aligned to cache lines assuming that the map is page aligned */
+#define STATFILE_BUCKETS_OFFSET ((sizeof (struct stat_file_header) + \
+		sizeof (struct stat_file_section) + 63) & ~((gsize)63))
+
 /**
  * Statistic file
  */
@@ -67,7 +87,7 @@ struct stat_file {
 /**
  * Common view of statfile object
  */
-typedef struct {
+typedef struct rspamd_mmaped_file_s {
 #ifdef HAVE_PATH_MAX
 	gchar filename[PATH_MAX];               /**< name of file						*/
 #else
@@ -79,11 +99,14 @@ typedef struct {
 	off_t seek_pos;                         /**< current seek position				*/
 	struct stat_file_section cur_section;   /**< current section					*/
 	size_t len;                             /**< length of file(in bytes)			*/
+	gint version;                           /**< format version (1 or 2)			*/
 	struct rspamd_statfile_config *cf;
 } rspamd_mmaped_file_t;
 
 
-#define RSPAMD_STATFILE_VERSION {'1', '2'}
+#define RSPAMD_STATFILE_VERSION {'2', '0'}
+/* Files of this version are still readable and converted on reindex */
+#define RSPAMD_STATFILE_VERSION_V1 {'1', '2'}
 #define BACKUP_SUFFIX ".old"
 
 static void rspamd_mmaped_file_set_block_common (rspamd_mempool_t *pool,
@@ -223,6 +246,299 @@ rspamd_mmaped_file_set_block (rspamd_mempool_t *pool,
 	rspamd_mmaped_file_set_block_common (pool, file, h1, h2, value);
 }
 
+static inline guint64
+rspamd_mmaped_file_mix (guint64 h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static inline guint64
+rspamd_mmaped_file_token_key (guint64 data)
+{
+	/* Zero key marks a free slot */
+	return data != 0 ? data : 1;
+}
+
+static inline guint64
+rspamd_mmaped_file_primary_bucket (rspamd_mmaped_file_t *file, guint64 key)
+{
+	return key % file->cur_section.length;
+}
+
+static inline guint64
+rspamd_mmaped_file_alt_bucket (rspamd_mmaped_file_t *file, guint64 key,
+		guint64 bucket)
+{
+	guint64 nbuckets = file->cur_section.length, b1, b2;
+
+	b1 = key % nbuckets;
+	b2 = rspamd_mmaped_file_mix (key) % nbuckets;
+
+	if (b2 == b1) {
+		b2 = (b1 + 1) % nbuckets;
+	}
+
+	return bucket == b1 ? b2 : b1;
+}
+
+static inline gboolean
+rspamd_mmaped_file_bucket_lookup (const struct stat_file_bucket *bkt,
+		guint64 key, double *value)
+{
+	guint i;
+
+	for (i = 0; i < BUCKET_SLOTS; i ++) {
+		if (bkt->keys[i] == key) {
+			*value = bkt->values[i];
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static double
+rspamd_mmaped_file_get_slot (rspamd_mmaped_file_t *file, guint64 key)
+{
+	struct stat_file_bucket *buckets;
+	guint64 b1, b2;
+	double value;
+
+	buckets = (struct stat_file_bucket *)((u_char *)file->map + file->seek_pos);
+	b1 = rspamd_mmaped_file_primary_bucket (file, key);
+	b2 = rspamd_mmaped_file_alt_bucket (file, key, b1);
+
+	if (rspamd_mmaped_file_bucket_lookup (&buckets[b1], key, &value) ||
+			rspamd_mmaped_file_bucket_lookup (&buckets[b2], key, &value)) {
+		return value;
+	}
+
+	return 0;
+}
+
+static gboolean
+rspamd_mmaped_file_store_free (struct stat_file_bucket *bkt,
+		guint64 key, gfloat value)
+{
+	guint i;
+
+	for (i = 0; i < BUCKET_SLOTS; i ++) {
+		if (bkt->keys[i] == 0) {
+			bkt->keys[i] = key;
+			bkt->values[i] = value;
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * Moves tokens to their alternative buckets to free a slot for the new one.
+ * If no free slot is found within MAX_KICKS moves, all moves are reverted
+ */
+static gboolean
+rspamd_mmaped_file_displace (rspamd_mmaped_file_t *file,
+		guint64 bucket, guint64 key, gfloat value)
+{
+	struct stat_file_bucket *buckets, *bkt;
+	struct {
+		guint64 bucket;
+		guint slot;
+	} path[MAX_KICKS];
+	guint64 cur_key = key, tmp_key;
+	gfloat cur_value = value, tmp_value;
+	guint n, slot;
+	gint i;
+
+	buckets = (struct stat_file_bucket *)((u_char *)file->map + file->seek_pos);
+
+	for (n = 0; n < MAX_KICKS; n ++) {
+		slot = rspamd_random_uint64_fast () % BUCKET_SLOTS;
+		bkt = &buckets[bucket];
+		tmp_key = bkt->keys[slot];
+		tmp_value = bkt->values[slot];
+		bkt->keys[slot] = cur_key;
+		bkt->values[slot] = cur_value;
+		cur_key = tmp_key;
+		cur_value = tmp_value;
+		path[n].bucket = bucket;
+		path[n].slot = slot;
+
+		bucket = rspamd_mmaped_file_alt_bucket (file, cur_key, bucket);
+
+		if (rspamd_mmaped_file_store_free (&buckets[bucket], cur_key,
+				cur_value)) {
+			return TRUE;
+		}
+	}
+
+	/* Revert path, so the evicted token gets back to its place */
+	for (i = n - 1; i >= 0; i --) {
+		bkt = &buckets[path[i].bucket];
+		tmp_key = bkt->keys[path[i].slot];
+		tmp_value = bkt->values[path[i].slot];
+		bkt->keys[path[i].slot] = cur_key;
+		bkt->values[path[i].slot] = cur_value;
+		cur_key = tmp_key;
+		cur_value = tmp_value;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Returns FALSE if there is no room for a new token
+ */
+static gboolean
+rspamd_mmaped_file_set_slot (rspamd_mmaped_file_t *file,
+		guint64 key, double value)
+{
+	struct stat_file_bucket *buckets, *bkts[2];
+	struct stat_file_header *header;
+	guint64 b1, b2;
+	guint i, j;
+
+	header = (struct stat_file_header *)file->map;
+	buckets = (struct stat_file_bucket *)((u_char *)file->map + file->seek_pos);
+	b1 = rspamd_mmaped_file_primary_bucket (file, key);
+	b2 = rspamd_mmaped_file_alt_bucket (file, key, b1);
+	bkts[0] = &buckets[b1];
+	bkts[1] = &buckets[b2];
+
+	for (j = 0; j < G_N_ELEMENTS (bkts); j ++) {
+		for (i = 0; i < BUCKET_SLOTS; i ++) {
+			if (bkts[j]->keys[i] == key) {
+				if (value == 0) {
+					/* Unlearned token, release its slot */
+					bkts[j]->keys[i] = 0;
+					bkts[j]->values[i] = 0;
+					header->used_blocks --;
+				}
+				else {
+					bkts[j]->values[i] = value;
+				}
+
+				return TRUE;
+			}
+		}
+	}
+
+	if (value == 0) {
+		return TRUE;
+	}
+
+	if (rspamd_mmaped_file_store_free (bkts[0], key, value) ||
+			rspamd_mmaped_file_store_free (bkts[1], key, value) ||
+			rspamd_mmaped_file_displace (file, b1, key, value)) {
+		header->used_blocks ++;
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+double
+rspamd_mmaped_file_get_token (rspamd_mmaped_file_t *file, guint64 data)
+{
+	guint32 h1, h2;
+
+	if (!file->map) {
+		return 0;
+	}
+
+	if (file->version == 1) {
+		memcpy (&h1, (guchar *)&data, sizeof (h1));
+		memcpy (&h2, ((guchar *)&data) + sizeof (h1), sizeof (h2));
+
+		return rspamd_mmaped_file_get_block (file, h1, h2);
+	}
+
+	return rspamd_mmaped_file_get_slot (file,
+			rspamd_mmaped_file_token_key (data));
+}
+
+static void
+rspamd_mmaped_file_locate_token (rspamd_token_t *tok, gconstpointer *locs,
+		gpointer ud)
+{
+	rspamd_mmaped_file_t *file = ud;
+	struct stat_file_bucket *buckets;
+	guint64 key, b1;
+	guint32 h1;
+
+	if (file->version == 1) {
+		/* Chain starts from this block */
+		memcpy (&h1, (guchar *)&tok->data, sizeof (h1));
+		locs[0] = (u_char *)file->map + file->seek_pos +
+				(h1 % file->cur_section.length) * sizeof (struct stat_file_block);
+	}
+	else {
+		buckets = (struct stat_file_bucket *)((u_char *)file->map +
+				file->seek_pos);
+		key = rspamd_mmaped_file_token_key (tok->data);
+		b1 = rspamd_mmaped_file_primary_bucket (file, key);
+		locs[0] = &buckets[b1];
+		locs[1] = &buckets[rspamd_mmaped_file_alt_bucket (file, key, b1)];
+	}
+}
+
+static gdouble
+rspamd_mmaped_file_resolve_token (rspamd_token_t *tok, gconstpointer *locs,
+		gpointer ud)
+{
+	rspamd_mmaped_file_t *file = ud;
+	guint64 key;
+	double value;
+
+	if (file->version == 1) {
+		return rspamd_mmaped_file_get_token (file, tok->data);
+	}
+
+	key = rspamd_mmaped_file_token_key (tok->data);
+
+	if (rspamd_mmaped_file_bucket_lookup (locs[0], key, &value) ||
+			rspamd_mmaped_file_bucket_lookup (locs[1], key, &value)) {
+		return value;
+	}
+
+	return 0;
+}
+
+void
+rspamd_mmaped_file_set_token (rspamd_mempool_t *pool,
+		rspamd_mmaped_file_t *file, guint64 data, double value)
+{
+	struct stat_file_header *header;
+	guint32 h1, h2;
+
+	if (!file->map) {
+		return;
+	}
+
+	if (file->version == 1) {
+		memcpy (&h1, (guchar *)&data, sizeof (h1));
+		memcpy (&h2, ((guchar *)&data) + sizeof (h1), sizeof (h2));
+		rspamd_mmaped_file_set_block_common (pool, file, h1, h2, value);
+	}
+	else if (!rspamd_mmaped_file_set_slot (file,
+			rspamd_mmaped_file_token_key (data), value)) {
+		header = (struct stat_file_header *)file->map;
+		msg_warn_pool ("statfile %s is full, cannot store token: "
+				"%uL of %uL slots are used, statfile size should be increased",
+				file->filename, header->used_blocks, header->total_blocks);
+	}
+}
+
 gboolean
 rspamd_mmaped_file_set_revision (rspamd_mmaped_file_t *file, guint64 rev, time_t time)
 {
@@ -322,6 +638,10 @@ rspamd_mmaped_file_get_total (rspamd_mmaped_file_t *file)
 	/* If total blocks is 0 we have old version of header, so set total blocks correctly */
 	if (header->total_blocks == 0) {
 		header->total_blocks = file->cur_section.length;
+
+		if (file->version != 1) {
+			header->total_blocks *= BUCKET_SLOTS;
+		}
 	}
 
 	return header->total_blocks;
@@ -333,7 +653,8 @@ rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 {
 	struct stat_file *f;
 	gchar *c;
-	static gchar valid_version[] = RSPAMD_STATFILE_VERSION;
+	static gchar valid_version[] = RSPAMD_STATFILE_VERSION,
+			v1_version[] = RSPAMD_STATFILE_VERSION_V1;
 
 
 	if (!file || !file->map) {
@@ -360,7 +681,13 @@ rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 	if (*c == 1 && *(c + 1) == 0) {
 		return -1;
 	}
-	else if (memcmp (c, valid_version, sizeof (valid_version)) != 0) {
+	else if (memcmp (c, valid_version, sizeof (valid_version)) == 0) {
+		file->version = 2;
+	}
+	else if (memcmp (c, v1_version, sizeof (v1_version)) == 0) {
+		file->version = 1;
+	}
+	else {
 		/* Unknown version */
 		msg_info_pool ("file %s has invalid version %c.%c",
 			file->filename,
@@ -372,21 +699,85 @@ rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 	/* Check first section and set new offset */
 	file->cur_section.code = f->section.code;
 	file->cur_section.length = f->section.length;
-	if (file->cur_section.length * sizeof (struct stat_file_block) >
-		file->len) {
-		msg_info_pool ("file %s is truncated: %z, must be %z",
-			file->filename,
-			file->len,
-			file->cur_section.length * sizeof (struct stat_file_block));
-		return -1;
+
+	if (file->version == 1) {
+		if (file->cur_section.length * sizeof (struct stat_file_block) >
+			file->len) {
+			msg_info_pool ("file %s is truncated: %z, must be %z",
+				file->filename,
+				file->len,
+				file->cur_section.length * sizeof (struct stat_file_block));
+			return -1;
+		}
+		file->seek_pos = sizeof (struct stat_file) -
+			sizeof (struct stat_file_block);
+	}
+	else {
+		if (file->cur_section.length == 0 ||
+				STATFILE_BUCKETS_OFFSET + file->cur_section.length *
+				sizeof (struct stat_file_bucket) > file->len) {
+			msg_info_pool ("file %s is truncated: %z, must be %z",
+				file->filename,
+				file->len,
+				STATFILE_BUCKETS_OFFSET + file->cur_section.length *
+				sizeof (struct stat_file_bucket));
+			return -1;
+		}
+		file->seek_pos = STATFILE_BUCKETS_OFFSET;
 	}
-	file->seek_pos = sizeof (struct stat_file) -
-		sizeof (struct stat_file_block);
 
 	return 0;
 }
 
 
+/*
+ * Copies all tokens from `src` to `dst` in the current format, returns
+ * the number of tokens that did not fit in `dst`
+ */
+static guint64
+rspamd_mmaped_file_copy_tokens (rspamd_mmaped_file_t *src,
+		rspamd_mmaped_file_t *dst)
+{
+	struct stat_file_block *block;
+	struct stat_file_bucket *bkt;
+	guint64 i, nelts, data, lost = 0;
+	guint j;
+
+	if (src->version == 1) {
+		block = (struct stat_file_block *)((u_char *)src->map + src->seek_pos);
+		nelts = MIN (src->cur_section.length,
+				(src->len - src->seek_pos) / sizeof (struct stat_file_block));
+
+		for (i = 0; i < nelts; i ++) {
+			if (block[i].hash1 != 0 && block[i].value != 0) {
+				memcpy ((guchar *)&data, &block[i].hash1, sizeof (guint32));
+				memcpy (((guchar *)&data) + sizeof (guint32), &block[i].hash2,
+						sizeof (guint32));
+
+				if (!rspamd_mmaped_file_set_slot (dst,
+						rspamd_mmaped_file_token_key (data), block[i].value)) {
+					lost ++;
+				}
+			}
+		}
+	}
+	else {
+		bkt = (struct stat_file_bucket *)((u_char *)src->map + src->seek_pos);
+
+		for (i = 0; i < src->cur_section.length; i ++) {
+			for (j = 0; j < BUCKET_SLOTS; j ++) {
+				if (bkt[i].keys[j] != 0 &&
+						!rspamd_mmaped_file_set_slot (dst, bkt[i].keys[j],
+								bkt[i].values[j])) {
+					lost ++;
+				}
+			}
+		}
+	}
+
+	return lost;
+}
+
 static rspamd_mmaped_file_t *
 rspamd_mmaped_file_reindex (rspamd_mempool_t *pool,
 		const gchar *filename,
@@ -395,19 +786,17 @@ rspamd_mmaped_file_reindex (rspamd_mempool_t *pool,
 		struct rspamd_statfile_config *stcf)
 {
 	gchar *backup, *lock;
-	gint fd, lock_fd;
+	gint lock_fd;
 	rspamd_mmaped_file_t *new, *old = NULL;
-	u_char *map, *pos;
-	struct stat_file_block *block;
 	struct stat_file_header *header, *nh;
+	guint64 lost;
 	struct timespec sleep_ts = {
 			.tv_sec = 0,
 			.tv_nsec = 1000000
 	};
 
 	if (size <
-		sizeof (struct stat_file_header) + sizeof (struct stat_file_section) +
-		sizeof (block)) {
+		STATFILE_BUCKETS_OFFSET + sizeof (struct stat_file_bucket)) {
 		msg_err_pool ("file %s is too small to carry any statistic: %z",
 			filename,
 			size);
@@ -468,54 +857,30 @@ rspamd_mmaped_file_reindex (rspamd_mempool_t *pool,
 	new = rspamd_mmaped_file_open (pool, filename, size, stcf);
 
 	if (old) {
-		/* Now open new file and start copying */
-		fd = open (backup, O_RDONLY);
-		if (fd == -1 || new == NULL) {
-			if (fd != -1) {
-				close (fd);
-			}
-
-			msg_err_pool ("cannot open file: %s", strerror (errno));
-			rspamd_mmaped_file_close (old);
+		if (new == NULL) {
+			msg_err_pool ("cannot open new file %s", filename);
+			rspamd_mmaped_file_close_file (pool, old);
 			g_free (backup);
-			return NULL;
-		}
-
 
-
-		/* Now start reading blocks from old statfile */
-		if ((map =
-				mmap (NULL, old_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
-			msg_err_pool ("cannot mmap file: %s", strerror (errno));
-			close (fd);
-			rspamd_mmaped_file_close (old);
-			g_free (backup);
 			return NULL;
 		}
 
-		pos = map + (sizeof (struct stat_file) - sizeof (struct stat_file_block));
+		/* Tokens are converted to the current format when copied */
+		lost = rspamd_mmaped_file_copy_tokens (old, new);
 
-		if (pos - map < (gssize)old_size) {
-			while ((gssize)old_size - (pos - map) >= (gssize)sizeof (struct stat_file_block)) {
-				block = (struct stat_file_block *)pos;
-				if (block->hash1 != 0 && block->value != 0) {
-					rspamd_mmaped_file_set_block_common (pool,
-							new, block->hash1,
-							block->hash2, block->value);
-				}
-				pos += sizeof (block);
-			}
+		if (lost > 0) {
+			msg_warn_pool ("statfile %s is full, %uL tokens are lost on "
+					"resizing, statfile size should be increased",
+					filename, lost);
 		}
 
-		header = (struct stat_file_header *)map;
+		header = (struct stat_file_header *)old->map;
 		rspamd_mmaped_file_set_revision (new, header->revision, header->rev_time);
 		nh = new->map;
 		/* Copy tokenizer configuration */
 		memcpy (nh->unused, header->unused, sizeof (header->unused));
 		nh->tokenizer_conf_len = header->tokenizer_conf_len;
 
-		munmap (map, old_size);
-		close (fd);
 		rspamd_mmaped_file_close_file (pool, old);
 	}
 
@@ -649,7 +1014,8 @@ rspamd_mmaped_file_open (rspamd_mempool_t *pool,
 	new_file->pool = pool;
 	rspamd_mmaped_file_preload (new_file);
 
-	g_assert (stcf->clcf != NULL);
+	/* Statfile config is not available when converting files */
+	g_assert (stcf == NULL || stcf->clcf != NULL);
 
 	msg_debug_pool ("opened statfile %s of size %l", filename, (long)size);
 
@@ -674,10 +1040,11 @@ rspamd_mmaped_file_close_file (rspamd_mempool_t *pool,
 	return 0;
 }
 
-gint
-rspamd_mmaped_file_create (const gchar *filename,
+static gint
+rspamd_mmaped_file_create_common (const gchar *filename,
 		size_t size,
-		struct rspamd_statfile_config *stcf,
+		gconstpointer tok_conf,
+		gsize tok_conf_len,
 		rspamd_mempool_t *pool)
 {
 	struct stat_file_header header = {
@@ -691,22 +1058,19 @@ rspamd_mmaped_file_create (const gchar *filename,
 	struct stat_file_section section = {
 		.code = STATFILE_SECTION_COMMON,
 	};
-	struct stat_file_block block = { 0, 0, 0 };
-	struct rspamd_stat_tokenizer *tokenizer;
+	struct stat_file_bucket block;
 	gint fd, lock_fd;
 	guint buflen = 0, nblocks;
 	gchar *buf = NULL, *lock;
+	gchar padding[STATFILE_BUCKETS_OFFSET - sizeof (struct stat_file_header) -
+			sizeof (struct stat_file_section)];
 	struct stat sb;
-	gpointer tok_conf;
-	gsize tok_conf_len;
 	struct timespec sleep_ts = {
 			.tv_sec = 0,
 			.tv_nsec = 1000000
 	};
 
-	if (size <
-		sizeof (struct stat_file_header) + sizeof (struct stat_file_section) +
-		sizeof (block)) {
+	if (size < STATFILE_BUCKETS_OFFSET + sizeof (block)) {
 		msg_err_pool ("file %s is too small to carry any statistic: %z",
 			filename,
 			size);
@@ -740,10 +1104,10 @@ rspamd_mmaped_file_create (const gchar *filename,
 create:
 
 	msg_debug_pool ("create statfile %s of size %l", filename, (long)size);
-	nblocks =
-		(size - sizeof (struct stat_file_header) -
-		sizeof (struct stat_file_section)) / sizeof (struct stat_file_block);
-	header.total_blocks = nblocks;
+	nblocks = (size - STATFILE_BUCKETS_OFFSET) / sizeof (block);
+	header.total_blocks = (guint64)nblocks * BUCKET_SLOTS;
+	memset (&block, 0, sizeof (block));
+	memset (padding, 0, sizeof (padding));
 
 	if ((fd =
 		open (filename, O_RDWR | O_TRUNC | O_CREAT, S_IWUSR | S_IRUSR)) == -1) {
@@ -760,14 +1124,9 @@ create:
 
 	rspamd_fallocate (fd,
 		0,
-		sizeof (header) + sizeof (section) + sizeof (block) * nblocks);
+		STATFILE_BUCKETS_OFFSET + sizeof (block) * nblocks);
 
 	header.create_time = (guint64) time (NULL);
-	g_assert (stcf->clcf != NULL);
-	g_assert (stcf->clcf->tokenizer != NULL);
-	tokenizer = rspamd_stat_get_tokenizer (stcf->clcf->tokenizer->name);
-	g_assert (tokenizer != NULL);
-	tok_conf = tokenizer->get_config (pool, stcf->clcf->tokenizer, &tok_conf_len);
 	header.tokenizer_conf_len = tok_conf_len;
 	g_assert (tok_conf_len < sizeof (header.unused) - sizeof (guint64));
 	memcpy (header.unused, tok_conf, tok_conf_len);
@@ -786,7 +1145,8 @@ create:
 	}
 
 	section.length = (guint64) nblocks;
-	if (write (fd, &section, sizeof (section)) == -1) {
+	if (write (fd, &section, sizeof (section)) == -1 ||
+			write (fd, padding, sizeof (padding)) == -1) {
 		msg_info_pool ("cannot write section header to file %s, error %d, %s",
 			filename,
 			errno,
@@ -858,6 +1218,118 @@ create:
 	return 0;
 }
 
+gint
+rspamd_mmaped_file_create (const gchar *filename,
+		size_t size,
+		struct rspamd_statfile_config *stcf,
+		rspamd_mempool_t *pool)
+{
+	struct rspamd_stat_tokenizer *tokenizer;
+	gpointer tok_conf;
+	gsize tok_conf_len;
+
+	g_assert (stcf->clcf != NULL);
+	g_assert (stcf->clcf->tokenizer != NULL);
+	tokenizer = rspamd_stat_get_tokenizer (stcf->clcf->tokenizer->name);
+	g_assert (tokenizer != NULL);
+	tok_conf = tokenizer->get_config (pool, stcf->clcf->tokenizer, &tok_conf_len);
+
+	return rspamd_mmaped_file_create_common (filename, size, tok_conf,
+			tok_conf_len, pool);
+}
+
+gint
+rspamd_mmaped_file_convert (rspamd_mempool_t *pool,
+		const gchar *src,
+		const gchar *dst,
+		gsize size)
+{
+	rspamd_mmaped_file_t *old, *new;
+	struct stat_file_header *header;
+	struct stat st;
+	gchar *tmp;
+	guint64 lost;
+	gint ret = -1;
+
+	if (stat (src, &st) == -1) {
+		msg_err_pool ("cannot stat file %s: %s", src, strerror (errno));
+
+		return -1;
+	}
+
+	old = rspamd_mmaped_file_open (pool, src, st.st_size, NULL);
+
+	if (old == NULL) {
+		msg_err_pool ("file %s is not a valid statfile", src);
+
+		return -1;
+	}
+
+	if (size == 0) {
+		size = st.st_size;
+	}
+
+	/*
+	 * New file is created aside and renamed over `dst` when it is complete,
+	 * so `dst` can be the same file as `src`
+	 */
+	tmp = g_strconcat (dst, ".new", NULL);
+	header = (struct stat_file_header *)old->map;
+
+	if (rspamd_mmaped_file_create_common (tmp, size, header->unused,
+			header->tokenizer_conf_len, pool) != 0) {
+		rspamd_mmaped_file_close_file (pool, old);
+		g_free (tmp);
+
+		return -1;
+	}
+
+	new = rspamd_mmaped_file_open (pool, tmp, size, NULL);
+
+	if (new == NULL) {
+		rspamd_mmaped_file_close_file (pool, old);
+		unlink (tmp);
+		g_free (tmp);
+
+		return -1;
+	}
+
+	lost = rspamd_mmaped_file_copy_tokens (old, new);
+
+	if (lost > 0) {
+		/* Never replace a statfile with an incomplete copy */
+		msg_err_pool ("cannot convert statfile %s: %uL tokens do not fit in "
+				"%uL slots, statfile size should be increased",
+				src, lost, rspamd_mmaped_file_get_total (new));
+		rspamd_mmaped_file_close_file (pool, new);
+		rspamd_mmaped_file_close_file (pool, old);
+		unlink (tmp);
+		g_free (tmp);
+
+		return -1;
+	}
+
+	rspamd_mmaped_file_set_revision (new, header->revision, header->rev_time);
+	msg_info_pool ("converted statfile %s to %s: %uL of %uL slots are used",
+			src, dst, rspamd_mmaped_file_get_used (new),
+			rspamd_mmaped_file_get_total (new));
+
+	if (msync (new->map, new->len, MS_SYNC) == -1 || fsync (new->fd) == -1 ||
+			rename (tmp, dst) == -1) {
+		msg_err_pool ("cannot store statfile %s: %s", dst, strerror (errno));
+		unlink (tmp);
+	}
+	else {
+		ret = 0;
+	}
+
+	rspamd_mmaped_file_close_file (pool, new);
+	rspamd_mmaped_file_close_file (pool, old);
+	g_free (tmp);
+
+	return ret;
+}
+
 gpointer
 rspamd_mmaped_file_init (struct rspamd_stat_ctx *ctx,
 		struct rspamd_config *cfg, struct rspamd_statfile *st)
@@ -954,18 +1426,23 @@ rspamd_mmaped_file_process_tokens (struct rspamd_task *task, GPtrArray *tokens,
 		gpointer p)
 {
 	rspamd_mmaped_file_t *mf = p;
-	guint32 h1, h2;
 	rspamd_token_t *tok;
 	guint i;
 
 	g_assert (tokens != NULL);
 	g_assert (p != NULL);
 
-	for (i = 0; i < tokens->len; i++) {
-		tok = g_ptr_array_index (tokens, i);
-		memcpy (&h1, (guchar *)&tok->data, sizeof (h1));
-		memcpy (&h2, ((guchar *)&tok->data) + sizeof (h1), sizeof (h2));
-		tok->values[id] = rspamd_mmaped_file_get_block (mf, h1, h2);
+	if (mf->map != NULL) {
+		rspamd_stat_lookup_tokens_batched (tokens, id,
+				rspamd_mmaped_file_locate_token,
+				rspamd_mmaped_file_resolve_token,
+				mf);
+	}
+	else {
+		for (i = 0; i < tokens->len; i++) {
+			tok = g_ptr_array_index (tokens, i);
+			tok->values[id] = 0;
+		}
 	}
 
 	if (mf->cf->is_spam) {
@@ -984,7 +1461,6 @@ rspamd_mmaped_file_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 		gpointer p)
 {
 	rspamd_mmaped_file_t *mf = p;
-	guint32 h1, h2;
 	rspamd_token_t *tok;
 	guint i;
 
@@ -993,9 +1469,7 @@ rspamd_mmaped_file_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 
 	for (i = 0; i < tokens->len; i++) {
 		tok = g_ptr_array_index (tokens, i);
-		memcpy (&h1, (guchar *)&tok->data, sizeof (h1));
-		memcpy (&h2, ((guchar *)&tok->data) + sizeof (h1), sizeof (h2));
-		rspamd_mmaped_file_set_block (task->task_pool, mf, h1, h2,
+		rspamd_mmaped_file_set_token (task->task_pool, mf, tok->data,
 				tok->values[id]);
 	}
 
@@ -1120,3 +1594,41 @@ rspamd_mmaped_file_load_tokenizer_config (gpointer runtime,
 
 	return header->unused;
 }
+
+const gchar *
+rspamd_mmaped_file_learn_destination (struct rspamd_task *task,
+		gpointer runtime, gpointer ctx)
+{
+	/* Statfile is the only destination */
+	return "";
+}
+
+gboolean
+rspamd_mmaped_file_learn_batch (struct rspamd_stat_ctx *ctx,
+		struct rspamd_stat_learn_batch *batch, gpointer p)
+{
+	rspamd_mmaped_file_t *mf = p;
+	struct rspamd_stat_learn_delta *d;
+	gdouble val;
+	guint64 rev = 0;
+	time_t t = 0;
+	guint i;
+
+	if (mf == NULL || mf->map == NULL) {
+		return FALSE;
+	}
+
+	for (i = 0; i < batch->tokens->len; i ++) {
+		d = &g_array_index (batch->tokens, struct rspamd_stat_learn_delta, i);
+		val = rspamd_mmaped_file_get_token (mf, d->token) + d->value;
+		rspamd_mmaped_file_set_token (mf->pool, mf, d->token, MAX (val, 0));
+	}
+
+	rspamd_mmaped_file_get_revision (mf, &rev, &t);
+	rspamd_mmaped_file_set_revision (mf, rev + batch->learns, t);
+
+	msync (mf->map, mf->len, MS_INVALIDATE | MS_ASYNC);
+	batch->fin (batch, TRUE);
+
+	return TRUE;
+}
@@ -17,8 +17,10 @@
 #include "rspamd.h"
 #include "stat_internal.h"
 #include "upstream.h"
+#include "cryptobox.h"
 #include "lua/lua_common.h"
 #include "libserver/mempool_vars_internal.h"
+#include <openssl/evp.h>
 
 #ifdef WITH_HIREDIS
 #include "hiredis.h"
@@ -34,6 +36,91 @@
 #define REDIS_DEFAULT_USERS_OBJECT "%s%l%r"
 #define REDIS_DEFAULT_TIMEOUT 0.5
 #define REDIS_STAT_TIMEOUT 30
+#define REDIS_DEFAULT_CACHE_TTL 10.0
+#define REDIS_DEFAULT_CACHE_MIN_HITS 3
+#define REDIS_CACHE_WAYS 4
+#define REDIS_SCRIPT_CHUNK 1000
+
+/*
+ * Bayes classification script for `server_classify` mode, mirrors
+ * bayes_classify_tokens. KEYS: spam hashes followed by ham hashes,
+ * ARGV: number of spam hashes, tokens and their codes
+ * (weight index * 2 + is_meta, index 8 means unigram).
+ * Returns sums of spam and ham probabilities logarithms, number of processed
+ * and text tokens and total hits
+ */
+static const gchar bayes_classify_script[] =
+		"local nspam = tonumber(ARGV[1])\n"
+		"local n = (#ARGV - 1) / 2\n"
+		"local function fetch(key, res)\n"
+		"  local i = 1\n"
+		"  while i <= n do\n"
+		"    local last = math.min(i + " G_STRINGIFY (REDIS_SCRIPT_CHUNK) " - 1, n)\n"
+		"    local vals = redis.call('HMGET', key, unpack(ARGV, i + 1, last + 1))\n"
+		"    for j = 1, #vals do\n"
+		"      local v = tonumber(vals[j]) or 0\n"
+		"      if v > 0 then res[i + j - 1] = res[i + j - 1] + v end\n"
+		"    end\n"
+		"    i = last + 1\n"
+		"  end\n"
+		"end\n"
+		"local sv, hv, sl, hl = {}, {}, 0, 0\n"
+		"for i = 1, n do sv[i] = 0; hv[i] = 0 end\n"
+		"for k = 1, #KEYS do\n"
+		"  local learns = tonumber(redis.call('HGET', KEYS[k], 'learns')) or 0\n"
+		"  if k <= nspam then\n"
+		"    sl = sl + learns\n"
+		"    fetch(KEYS[k], sv)\n"
+		"  else\n"
+		"    hl = hl + learns\n"
+		"    fetch(KEYS[k], hv)\n"
+		"  end\n"
+		"end\n"
+		"sl, hl = math.max(1, sl), math.max(1, hl)\n"
+		"local sp, hp, processed, text, hits = 0, 0, 0, 0, 0\n"
+		"local ln2 = math.log(2)\n"
+		"for i = 1, n do\n"
+		"  local total = sv[i] + hv[i]\n"
+		"  if total > 0 then\n"
+		"    local code = tonumber(ARGV[n + i + 1])\n"
+		"    local k = math.floor(code / 2)\n"
+		"    local fw = 0\n"
+		"    if k == 8 then fw = 1 elseif k > 0 then fw = k ^ k end\n"
+		"    local sf, hf = sv[i] / sl, hv[i] / hl\n"
+		"    local w = (sf - hf) * (sf - hf) / ((sf + hf) * (sf + hf)) *\n"
+		"      (fw * total) / (4 * (1 + fw * total))\n"
+		"    sp = sp + math.log((w * 0.5 + total * sf / (sf + hf)) / (w + total)) / ln2\n"
+		"    hp = hp + math.log((w * 0.5 + total * hf / (sf + hf)) / (w + total)) / ln2\n"
+		"    processed = processed + 1\n"
+		"    hits = hits + total\n"
+		"    if code % 2 == 0 then text = text + 1 end\n"
+		"  end\n"
+		"end\n"
+		"return {string.format('%.17g', sp), string.format('%.17g', hp),\n"
+		"  tostring(processed), tostring(text), string.format('%d', hits)}\n";
+
+/*
+ * Per worker cache of hot tokens values: set associative table with
+ * frequency based admission, so only tokens that are seen often enough
+ * replace other cached tokens
+ */
+struct rspamd_redis_cache_entry {
+	guint64 token;
+	guint64 obj;                /**< hash of expanded redis object		*/
+	gdouble value;
+	gdouble expire;
+	guint32 hits;
+};
+
+struct rspamd_redis_tokens_cache {
+	struct rspamd_redis_cache_entry *entries;
+	guint8 *freq;               /**< saturated counters of token frequency */
+	guint64 nsets;
+	guint64 nfreq;
+	guint64 increments;
+	gdouble ttl;
+	guint min_hits;
+};
 
 struct redis_stat_ctx {
 	struct rspamd_statfile_config *stcf;
@@ -50,6 +137,13 @@ struct redis_stat_ctx {
 	gboolean enable_signatures;
 	guint expiry;
 	gint cbref_user;
+	struct rspamd_redis_tokens_cache *cache;
+	gboolean server_classify;
+	/* Statfiles classified by the script, spam ones first, NULL if the
+	 * script is run by another statfile of the classifier */
+	GPtrArray *classify_stcfs;
+	guint classify_nspam;
+	gchar script_sha[EVP_MAX_MD_SIZE * 2 + 1];
 };
 
 enum rspamd_redis_connection_state {
@@ -69,7 +163,13 @@ struct redis_stat_runtime {
 	struct rspamd_statfile_config *stcf;
 	gchar *redis_object_expanded;
 	redisAsyncContext *redis;
+	GPtrArray *tokens;          /**< tokens requested from redis			*/
+	rspamd_fstring_t *script_query;
+	gsize script_args_off;      /**< offset of script arguments in query	*/
+	gint script_nargs;
+	guint64 obj_hash;
 	guint64 learned;
+	gdouble start;
 	gint id;
 	gboolean has_event;
 };
@@ -95,6 +195,16 @@ struct rspamd_redis_stat_cbdata {
 	gboolean wanna_die;
 };
 
+/* Used to write batches of the learn queue */
+struct rspamd_redis_batch_cbdata {
+	struct redis_stat_ctx *ctx;
+	struct rspamd_stat_learn_batch *batch;
+	struct upstream *selected;
+	redisAsyncContext *redis;
+	struct event timeout_event;
+	gdouble start;
+};
+
 #define GET_TASK_ELT(task, elt) (task == NULL ? NULL : (task)->elt)
 
 static GQuark
@@ -336,6 +446,165 @@ rspamd_redis_expand_object (const gchar *pattern,
 	return tlen;
 }
 
+static inline guint64
+rspamd_redis_cache_hash (guint64 obj, guint64 token)
+{
+	guint64 h = obj ^ token;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static struct rspamd_redis_tokens_cache *
+rspamd_redis_cache_new (guint64 size, gdouble ttl, guint min_hits)
+{
+	struct rspamd_redis_tokens_cache *cache;
+	guint64 nsets = 1;
+
+	while (nsets * REDIS_CACHE_WAYS < size) {
+		nsets <<= 1;
+	}
+
+	cache = g_malloc0 (sizeof (*cache));
+	cache->nsets = nsets;
+	cache->nfreq = nsets * REDIS_CACHE_WAYS * 4;
+	cache->entries = g_malloc0 (sizeof (*cache->entries) * nsets *
+			REDIS_CACHE_WAYS);
+	cache->freq = g_malloc0 (cache->nfreq);
+	cache->ttl = ttl;
+	cache->min_hits = min_hits;
+
+	return cache;
+}
+
+static void
+rspamd_redis_cache_destroy (struct rspamd_redis_tokens_cache *cache)
+{
+	if (cache) {
+		g_free (cache->entries);
+		g_free (cache->freq);
+		g_free (cache);
+	}
+}
+
+static gboolean
+rspamd_redis_cache_lookup (struct rspamd_redis_tokens_cache *cache,
+		guint64 obj, guint64 token, gdouble now, gdouble *value)
+{
+	struct rspamd_redis_cache_entry *set;
+	guint i;
+
+	set = &cache->entries[(rspamd_redis_cache_hash (obj, token) &
+			(cache->nsets - 1)) * REDIS_CACHE_WAYS];
+
+	for (i = 0; i < REDIS_CACHE_WAYS; i ++) {
+		if (set[i].token == token && set[i].obj == obj &&
+				set[i].expire > now) {
+			set[i].hits ++;
+			*value = set[i].value;
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/* Returns estimated number of times token has been requested from redis */
+static guint
+rspamd_redis_cache_count (struct rspamd_redis_tokens_cache *cache,
+		guint64 h)
+{
+	guint8 *c1, *c2;
+	guint64 i;
+
+	c1 = &cache->freq[h & (cache->nfreq - 1)];
+	c2 = &cache->freq[(h >> 32) & (cache->nfreq - 1)];
+
+	if (*c1 < G_MAXUINT8) {
+		(*c1) ++;
+	}
+	if (*c2 < G_MAXUINT8) {
+		(*c2) ++;
+	}
+
+	/* Age counters, so that tokens that used to be hot are forgotten */
+	if (++cache->increments >= cache->nfreq * 4) {
+		for (i = 0; i < cache->nfreq; i ++) {
+			cache->freq[i] >>= 1;
+		}
+
+		cache->increments = 0;
+	}
+
+	return MIN (*c1, *c2);
+}
+
+static void
+rspamd_redis_cache_insert (struct rspamd_redis_tokens_cache *cache,
+		guint64 obj, guint64 token, gdouble value, gdouble now)
+{
+	struct rspamd_redis_cache_entry *set, *victim = NULL;
+	guint64 h;
+	guint i;
+
+	h = rspamd_redis_cache_hash (obj, token);
+
+	if (rspamd_redis_cache_count (cache, h) < cache->min_hits) {
+		return;
+	}
+
+	set = &cache->entries[(h & (cache->nsets - 1)) * REDIS_CACHE_WAYS];
+
+	for (i = 0; i < REDIS_CACHE_WAYS; i ++) {
+		if ((set[i].token == token && set[i].obj == obj) ||
+				set[i].expire <= now) {
+			victim = &set[i];
+			break;
+		}
+
+		if (victim == NULL || set[i].hits < victim->hits) {
+			victim = &set[i];
+		}
+	}
+
+	if (victim->expire > now && !(victim->token == token && victim->obj == obj)) {
+		/* Decay hits of evicted entries so new hot tokens can get in */
+		for (i = 0; i < REDIS_CACHE_WAYS; i ++) {
+			set[i].hits >>= 1;
+		}
+	}
+
+	victim->token = token;
+	victim->obj = obj;
+	victim->value = value;
+	victim->expire = now + cache->ttl;
+	victim->hits = 0;
+}
+
+static void
+rspamd_redis_cache_remove (struct rspamd_redis_tokens_cache *cache,
+		guint64 obj, guint64 token)
+{
+	struct rspamd_redis_cache_entry *set;
+	guint i;
+
+	set = &cache->entries[(rspamd_redis_cache_hash (obj, token) &
+			(cache->nsets - 1)) * REDIS_CACHE_WAYS];
+
+	for (i = 0; i < REDIS_CACHE_WAYS; i ++) {
+		if (set[i].token == token && set[i].obj == obj) {
+			set[i].expire = 0;
+			set[i].hits = 0;
+		}
+	}
+}
+
 static void
 rspamd_redis_maybe_auth (struct redis_stat_ctx *ctx, redisAsyncContext *redis)
 {
@@ -1058,7 +1327,8 @@ rspamd_redis_connected (redisAsyncContext *c, gpointer r, gpointer priv)
 			rt->learned = val;
 			msg_debug_task ("connected to redis server, tokens learned for %s: %uL",
 					rt->redis_object_expanded, rt->learned);
-			rspamd_upstream_ok (rt->selected);
+			rspamd_upstream_ok_latency (rt->selected,
+					rspamd_get_ticks (FALSE) - rt->start);
 		}
 	}
 	else {
@@ -1067,6 +1337,19 @@ rspamd_redis_connected (redisAsyncContext *c, gpointer r, gpointer priv)
 		rspamd_upstream_fail (rt->selected);
 	}
 
+	if (rt->tokens != NULL && rt->tokens->len == 0) {
+		/* All tokens have been found in cache, nothing else is requested */
+		if (rt->stcf->is_spam) {
+			task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+		}
+		else {
+			task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+		}
+
+		if (rt->has_event) {
+			rspamd_session_remove_event (task->s, rspamd_redis_fin, rt);
+		}
+	}
 }
 
 /* Called when we have received tokens values from redis */
@@ -1079,17 +1362,21 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 	rspamd_token_t *tok;
 	guint i, processed = 0, found = 0;
 	gulong val;
-	gdouble float_val;
+	gdouble float_val, now = 0;
 
 	task = rt->task;
 
+	if (rt->ctx->cache) {
+		now = rspamd_get_ticks (FALSE);
+	}
+
 	if (c->err == 0) {
 		if (r != NULL) {
 			if (reply->type == REDIS_REPLY_ARRAY) {
 
-				if (reply->elements == task->tokens->len) {
+				if (reply->elements == rt->tokens->len) {
 					for (i = 0; i < reply->elements; i ++) {
-						tok = g_ptr_array_index (task->tokens, i);
+						tok = g_ptr_array_index (rt->tokens, i);
 						elt = reply->element[i];
 
 						if (G_UNLIKELY (elt->type == REDIS_REPLY_INTEGER)) {
@@ -1113,6 +1400,12 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 							tok->values[rt->id] = 0;
 						}
 
+						if (rt->ctx->cache) {
+							rspamd_redis_cache_insert (rt->ctx->cache,
+									rt->obj_hash, tok->data,
+									tok->values[rt->id], now);
+						}
+
 						processed ++;
 					}
 
@@ -1127,7 +1420,7 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 					msg_err_task_check ("got invalid length of reply vector from redis: "
 							"%d, expected: %d",
 							(gint)reply->elements,
-							(gint)task->tokens->len);
+							(gint)rt->tokens->len);
 				}
 			}
 			else {
@@ -1137,7 +1430,115 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 
 			msg_debug_task_check ("received tokens for %s: %d processed, %d found",
 					rt->redis_object_expanded, processed, found);
-			rspamd_upstream_ok (rt->selected);
+			rspamd_upstream_ok_latency (rt->selected,
+					rspamd_get_ticks (FALSE) - rt->start);
+		}
+	}
+	else {
+		msg_err_task ("error getting reply from redis server %s: %s",
+				rspamd_upstream_name (rt->selected), c->errstr);
+
+		if (rt->redis) {
+			rspamd_upstream_fail (rt->selected);
+		}
+	}
+
+	if (rt->has_event) {
+		rspamd_session_remove_event (task->s, rspamd_redis_fin, rt);
+	}
+}
+
+/* Called when classification script has returned bayes sums */
+static void
+rspamd_redis_classified (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (priv);
+	redisReply *reply = r;
+	struct rspamd_task *task;
+	struct rspamd_bayes_aggregates *agg;
+	rspamd_fstring_t *query;
+	gchar varbuf[128];
+	gulong val;
+	guint i;
+
+	task = rt->task;
+
+	if (c->err == 0) {
+		if (r != NULL) {
+			if (reply->type == REDIS_REPLY_ERROR &&
+					rt->script_query != NULL &&
+					strncmp (reply->str, "NOSCRIPT", sizeof ("NOSCRIPT") - 1) == 0) {
+				/* Script is not cached by redis yet, so send its body */
+				query = rspamd_fstring_sized_new (sizeof (bayes_classify_script) +
+						rt->script_query->len);
+				rspamd_printf_fstring (&query, ""
+						"*%d\r\n"
+						"$4\r\n"
+						"EVAL\r\n"
+						"$%d\r\n"
+						"%s\r\n",
+						rt->script_nargs,
+						(gint)(sizeof (bayes_classify_script) - 1),
+						bayes_classify_script);
+				query = rspamd_fstring_append (query,
+						rt->script_query->str + rt->script_args_off,
+						rt->script_query->len - rt->script_args_off);
+				rspamd_mempool_add_destructor (task->task_pool,
+						(rspamd_mempool_destruct_t)rspamd_fstring_free, query);
+				rt->script_query = NULL;
+
+				if (redisAsyncFormattedCommand (c, rspamd_redis_classified, rt,
+						query->str, query->len) == REDIS_OK) {
+					return;
+				}
+
+				msg_err_task ("call to redis failed: %s", c->errstr);
+			}
+			else if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 5) {
+				for (i = 0; i < reply->elements; i ++) {
+					if (reply->element[i]->type != REDIS_REPLY_STRING) {
+						break;
+					}
+				}
+
+				if (i == reply->elements) {
+					agg = rspamd_mempool_alloc0 (task->task_pool, sizeof (*agg));
+					agg->spam_prob = strtod (reply->element[0]->str, NULL);
+					agg->ham_prob = strtod (reply->element[1]->str, NULL);
+					rspamd_strtoul (reply->element[2]->str,
+							reply->element[2]->len, &val);
+					agg->processed_tokens = val;
+					rspamd_strtoul (reply->element[3]->str,
+							reply->element[3]->len, &val);
+					agg->text_tokens = val;
+					rspamd_strtoul (reply->element[4]->str,
+							reply->element[4]->len, &val);
+					agg->total_hits = val;
+
+					rspamd_snprintf (varbuf, sizeof (varbuf), "%s_%s",
+							RSPAMD_MEMPOOL_BAYES_AGGREGATES,
+							rt->stcf->clcf->name);
+					rspamd_mempool_set_variable (task->task_pool, varbuf, agg,
+							NULL);
+					task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+
+					msg_debug_task ("received bayes sums for %s: %uL tokens "
+							"processed of %ud sent",
+							rt->redis_object_expanded, agg->processed_tokens,
+							rt->tokens->len);
+					rspamd_upstream_ok_latency (rt->selected,
+							rspamd_get_ticks (FALSE) - rt->start);
+				}
+				else {
+					msg_err_task ("got invalid reply from classify script: "
+							"strings expected");
+				}
+			}
+			else {
+				msg_err_task ("got invalid reply from classify script: %s",
+						reply->type == REDIS_REPLY_ERROR ? reply->str :
+						rspamd_redis_type_to_string (reply->type));
+			}
 		}
 	}
 	else {
@@ -1164,7 +1565,8 @@ rspamd_redis_learned (redisAsyncContext *c, gpointer r, gpointer priv)
 	task = rt->task;
 
 	if (c->err == 0) {
-		rspamd_upstream_ok (rt->selected);
+		rspamd_upstream_ok_latency (rt->selected,
+				rspamd_get_ticks (FALSE) - rt->start);
 	}
 	else {
 		msg_err_task_check ("error getting reply from redis server %s: %s",
@@ -1246,7 +1648,7 @@ rspamd_redis_try_ucl (struct redis_stat_ctx *backend,
 	return TRUE;
 }
 
-static void
+static gboolean
 rspamd_redis_parse_classifier_opts (struct redis_stat_ctx *backend,
 		const ucl_object_t *obj,
 		struct rspamd_config *cfg)
@@ -1342,6 +1744,124 @@ rspamd_redis_parse_classifier_opts (struct redis_stat_ctx *backend,
 	else {
 		backend->expiry = 0;
 	}
+
+	elt = ucl_object_lookup (obj, "server_classify");
+	if (elt) {
+		backend->server_classify = ucl_object_toboolean (elt);
+	}
+	else {
+		backend->server_classify = FALSE;
+	}
+
+	/* Number of hot tokens cached by each worker, disabled by default */
+	elt = ucl_object_lookup (obj, "tokens_cache");
+	if (elt && ucl_object_toint (elt) > 0) {
+		gdouble ttl = REDIS_DEFAULT_CACHE_TTL;
+		guint min_hits = REDIS_DEFAULT_CACHE_MIN_HITS;
+		const ucl_object_t *opt;
+
+		opt = ucl_object_lookup (obj, "tokens_cache_ttl");
+		if (opt) {
+			ttl = ucl_object_todouble (opt);
+		}
+
+		opt = ucl_object_lookup (obj, "tokens_cache_min_hits");
+		if (opt) {
+			if (ucl_object_toint (opt) < 0) {
+				msg_err_config ("tokens_cache_min_hits must not be negative: "
+						"%L", ucl_object_toint (opt));
+
+				return FALSE;
+			}
+
+			min_hits = ucl_object_toint (opt);
+		}
+
+		backend->cache = rspamd_redis_cache_new (ucl_object_toint (elt),
+				ttl, min_hits);
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_redis_init_server_classify (struct redis_stat_ctx *backend,
+		struct rspamd_statfile_config *stf)
+{
+	struct rspamd_statfile_config *cur;
+	guchar digest[EVP_MAX_MD_SIZE];
+	guint dlen = 0;
+	GList *l;
+
+	if (backend->new_schema) {
+		msg_err ("statfile %s: server_classify is not supported with "
+				"new_schema, disable it", stf->symbol);
+		backend->server_classify = FALSE;
+
+		return;
+	}
+
+	if (stf->clcf->classifier && strcmp (stf->clcf->classifier, "bayes") != 0) {
+		msg_err ("statfile %s: server_classify is supported for bayes "
+				"classifier only, disable it", stf->symbol);
+		backend->server_classify = FALSE;
+
+		return;
+	}
+
+	/*
+	 * The first spam statfile classifies tokens of all statfiles, others
+	 * fetch their learns only. Redis objects of other statfiles are expanded
+	 * by the pattern of this statfile
+	 */
+	for (l = stf->clcf->statfiles; l != NULL; l = g_list_next (l)) {
+		cur = l->data;
+
+		if (cur->is_spam) {
+			if (cur != stf) {
+				return;
+			}
+
+			break;
+		}
+	}
+
+	backend->classify_stcfs = g_ptr_array_new ();
+
+	for (l = stf->clcf->statfiles; l != NULL; l = g_list_next (l)) {
+		cur = l->data;
+
+		if (cur->is_spam) {
+			g_ptr_array_add (backend->classify_stcfs, cur);
+		}
+	}
+
+	backend->classify_nspam = backend->classify_stcfs->len;
+
+	for (l = stf->clcf->statfiles; l != NULL; l = g_list_next (l)) {
+		cur = l->data;
+
+		if (!cur->is_spam) {
+			g_ptr_array_add (backend->classify_stcfs, cur);
+		}
+	}
+
+	if (backend->classify_stcfs->len == backend->classify_nspam) {
+		msg_err ("statfile %s: no ham statfile for server_classify, "
+				"disable it", stf->symbol);
+		g_ptr_array_free (backend->classify_stcfs, TRUE);
+		backend->classify_stcfs = NULL;
+		backend->server_classify = FALSE;
+
+		return;
+	}
+
+	/* Redis refers to cached scripts by sha1 of their bodies */
+	EVP_Digest (bayes_classify_script, sizeof (bayes_classify_script) - 1,
+			digest, &dlen, EVP_sha1 (), NULL);
+	rspamd_encode_hex_buf (digest, dlen, backend->script_sha,
+			sizeof (backend->script_sha) - 1);
+	backend->script_sha[dlen * 2] = '\0';
 }
 
 gpointer
@@ -1399,10 +1919,20 @@ rspamd_redis_init (struct rspamd_stat_ctx *ctx,
 		return NULL;
 	}
 
-	rspamd_redis_parse_classifier_opts (backend, st->classifier->cfg->opts, cfg);
+	if (!rspamd_redis_parse_classifier_opts (backend,
+			st->classifier->cfg->opts, cfg)) {
+		msg_err_config ("cannot init redis backend for %s", stf->symbol);
+		g_free (backend);
+		return NULL;
+	}
+
 	stf->clcf->flags |= RSPAMD_FLAG_CLASSIFIER_INCREMENTING_BACKEND;
 	backend->stcf = stf;
 
+	if (backend->server_classify) {
+		rspamd_redis_init_server_classify (backend, stf);
+	}
+
 	st_elt = g_malloc0 (sizeof (*st_elt));
 	st_elt->ev_base = ctx->ev_base;
 	st_elt->ctx = backend;
@@ -1455,7 +1985,10 @@ rspamd_redis_runtime (struct rspamd_task *task,
 	rt = rspamd_mempool_alloc0 (task->task_pool, sizeof (*rt));
 	rspamd_redis_expand_object (ctx->redis_object, ctx, task,
 			&rt->redis_object_expanded);
+	rt->obj_hash = rspamd_cryptobox_fast_hash (rt->redis_object_expanded,
+			strlen (rt->redis_object_expanded), 0);
 	rt->selected = up;
+	rt->start = rspamd_get_ticks (FALSE);
 	rt->task = task;
 	rt->ctx = ctx;
 	rt->stcf = stcf;
@@ -1495,9 +2028,130 @@ rspamd_redis_close (gpointer p)
 		rspamd_upstreams_destroy (ctx->write_servers);
 	}
 
+	if (ctx->classify_stcfs) {
+		g_ptr_array_free (ctx->classify_stcfs, TRUE);
+	}
+
+	rspamd_redis_cache_destroy (ctx->cache);
 	g_free (ctx);
 }
 
+/*
+ * Selects tokens for the classification script skipping meta tokens in the
+ * same way as bayes_classify does
+ */
+static GPtrArray *
+rspamd_redis_script_tokens (struct rspamd_task *task, GPtrArray *tokens)
+{
+	GPtrArray *res;
+	rspamd_token_t *tok;
+	gdouble meta_skip_prob = 0.0;
+	guint i, text_tokens = 0;
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = g_ptr_array_index (tokens, i);
+
+		if (!(tok->flags & RSPAMD_STAT_TOKEN_FLAG_META)) {
+			text_tokens ++;
+		}
+	}
+
+	if (text_tokens <= tokens->len - text_tokens) {
+		meta_skip_prob = 1.0 - (gdouble)text_tokens / tokens->len;
+	}
+
+	res = g_ptr_array_sized_new (tokens->len);
+	rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_ptr_array_free_hard, res);
+
+	if (text_tokens == 0) {
+		/* Bayes skips such messages anyway */
+		return res;
+	}
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = g_ptr_array_index (tokens, i);
+
+		if ((tok->flags & RSPAMD_STAT_TOKEN_FLAG_META) && meta_skip_prob > 0 &&
+				rspamd_random_double_fast () <= meta_skip_prob) {
+			continue;
+		}
+
+		g_ptr_array_add (res, tok);
+	}
+
+	return res;
+}
+
+static gboolean
+rspamd_redis_send_classify_script (struct rspamd_task *task,
+		struct redis_stat_runtime *rt)
+{
+	struct redis_stat_ctx obj_ctx;
+	GPtrArray *stcfs = rt->ctx->classify_stcfs;
+	rspamd_fstring_t *query;
+	rspamd_token_t *tok;
+	gchar *obj, n0[64];
+	guint i, l0, code;
+
+	rt->script_nargs = rt->tokens->len * 2 + stcfs->len + 4;
+	query = rspamd_fstring_sized_new (rt->tokens->len * 32 + 128);
+	rspamd_printf_fstring (&query, ""
+			"*%d\r\n"
+			"$7\r\n"
+			"EVALSHA\r\n"
+			"$%d\r\n"
+			"%s\r\n",
+			rt->script_nargs,
+			(gint)strlen (rt->ctx->script_sha), rt->ctx->script_sha);
+	rt->script_args_off = query->len;
+	l0 = rspamd_snprintf (n0, sizeof (n0), "%ud", stcfs->len);
+	rspamd_printf_fstring (&query, "$%d\r\n%s\r\n", l0, n0);
+
+	/* Objects are expanded in the same way as by statfiles runtimes */
+	memcpy (&obj_ctx, rt->ctx, sizeof (obj_ctx));
+
+	for (i = 0; i < stcfs->len; i ++) {
+		obj_ctx.stcf = g_ptr_array_index (stcfs, i);
+		obj = NULL;
+		rspamd_redis_expand_object (obj_ctx.redis_object, &obj_ctx, task,
+				&obj);
+		rspamd_printf_fstring (&query, "$%d\r\n%s\r\n",
+				(gint)strlen (obj), obj);
+	}
+
+	l0 = rspamd_snprintf (n0, sizeof (n0), "%ud", rt->ctx->classify_nspam);
+	rspamd_printf_fstring (&query, "$%d\r\n%s\r\n", l0, n0);
+
+	for (i = 0; i < rt->tokens->len; i ++) {
+		tok = g_ptr_array_index (rt->tokens, i);
+		l0 = rspamd_snprintf (n0, sizeof (n0), "%uL", tok->data);
+		rspamd_printf_fstring (&query, "$%d\r\n%s\r\n", l0, n0);
+	}
+
+	for (i = 0; i < rt->tokens->len; i ++) {
+		tok = g_ptr_array_index (rt->tokens, i);
+		code = (tok->flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) ?
+				8 : tok->window_idx % 8;
+		code = code * 2 + ((tok->flags & RSPAMD_STAT_TOKEN_FLAG_META) ? 1 : 0);
+		l0 = rspamd_snprintf (n0, sizeof (n0), "%ud", code);
+		rspamd_printf_fstring (&query, "$%d\r\n%s\r\n", l0, n0);
+	}
+
+	rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)rspamd_fstring_free, query);
+	rt->script_query = query;
+
+	if (redisAsyncFormattedCommand (rt->redis, rspamd_redis_classified, rt,
+			query->str, query->len) == REDIS_OK) {
+		return TRUE;
+	}
+
+	msg_err_task ("call to redis failed: %s", rt->redis->errstr);
+
+	return FALSE;
+}
+
 gboolean
 rspamd_redis_process_tokens (struct rspamd_task *task,
 		GPtrArray *tokens,
@@ -1505,7 +2159,10 @@ rspamd_redis_process_tokens (struct rspamd_task *task,
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (p);
 	rspamd_fstring_t *query;
+	rspamd_token_t *tok;
 	struct timeval tv;
+	gdouble now, value;
+	guint i;
 	gint ret;
 
 	if (tokens == NULL || tokens->len == 0 || rt->redis == NULL) {
@@ -1513,6 +2170,42 @@ rspamd_redis_process_tokens (struct rspamd_task *task,
 	}
 
 	rt->id = id;
+	rt->tokens = tokens;
+
+	if (rt->ctx->server_classify) {
+		if (rt->ctx->classify_stcfs) {
+			rt->tokens = rspamd_redis_script_tokens (task, tokens);
+		}
+		else {
+			/* Tokens are classified by the script of the first spam statfile */
+			rt->tokens = g_ptr_array_new ();
+			rspamd_mempool_add_destructor (task->task_pool,
+					rspamd_ptr_array_free_hard, rt->tokens);
+		}
+	}
+	else if (rt->ctx->cache) {
+		/* Only tokens missing in cache are requested from redis */
+		now = rspamd_get_ticks (FALSE);
+		rt->tokens = g_ptr_array_sized_new (tokens->len);
+		rspamd_mempool_add_destructor (task->task_pool,
+				rspamd_ptr_array_free_hard, rt->tokens);
+
+		for (i = 0; i < tokens->len; i ++) {
+			tok = g_ptr_array_index (tokens, i);
+
+			if (rspamd_redis_cache_lookup (rt->ctx->cache, rt->obj_hash,
+					tok->data, now, &value)) {
+				tok->values[id] = value;
+			}
+			else {
+				g_ptr_array_add (rt->tokens, tok);
+			}
+		}
+
+		msg_debug_task ("%ud of %ud tokens for %s are found in cache",
+				tokens->len - rt->tokens->len, tokens->len,
+				rt->redis_object_expanded);
+	}
 
 	if (redisAsyncCommand (rt->redis, rspamd_redis_connected, rt, "HGET %s %s",
 			rt->redis_object_expanded, "learns") == REDIS_OK) {
@@ -1529,7 +2222,16 @@ rspamd_redis_process_tokens (struct rspamd_task *task,
 		double_to_tv (rt->ctx->timeout, &tv);
 		event_add (&rt->timeout_event, &tv);
 
-		query = rspamd_redis_tokens_to_query (task, rt, tokens,
+		if (rt->tokens->len == 0) {
+			/* Processing is finished when learns are received */
+			return TRUE;
+		}
+
+		if (rt->ctx->server_classify) {
+			return rspamd_redis_send_classify_script (task, rt);
+		}
+
+		query = rspamd_redis_tokens_to_query (task, rt, rt->tokens,
 				rt->ctx->new_schema ? "HGET" : "HMGET",
 				rt->redis_object_expanded, FALSE, -1,
 				rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
@@ -1580,6 +2282,7 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 	rspamd_fstring_t *query;
 	const gchar *redis_cmd;
 	rspamd_token_t *tok;
+	guint i;
 	gint ret;
 	goffset off;
 
@@ -1594,6 +2297,7 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 	}
 
 	rt->selected = up;
+	rt->start = rspamd_get_ticks (FALSE);
 
 	addr = rspamd_upstream_addr (up);
 	g_assert (addr != NULL);
@@ -1625,6 +2329,16 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 	}
 
 	rt->id = id;
+
+	if (rt->ctx->cache) {
+		/* Other workers see the new values when their entries expire */
+		for (i = 0; i < tokens->len; i ++) {
+			tok = g_ptr_array_index (tokens, i);
+			rspamd_redis_cache_remove (rt->ctx->cache, rt->obj_hash,
+					tok->data);
+		}
+	}
+
 	query = rspamd_redis_tokens_to_query (task, rt, tokens,
 			redis_cmd, rt->redis_object_expanded, TRUE, id,
 			rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
@@ -1804,4 +2518,263 @@ rspamd_redis_load_tokenizer_config (gpointer runtime,
 	return NULL;
 }
 
+const gchar *
+rspamd_redis_learn_destination (struct rspamd_task *task,
+		gpointer runtime, gpointer ctx)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
+
+	return rt->redis_object_expanded;
+}
+
+static void
+rspamd_redis_batch_timeout (gint fd, short what, gpointer d)
+{
+	struct rspamd_redis_batch_cbdata *cbdata = d;
+	redisAsyncContext *redis;
+
+	msg_err ("connection to redis server %s timed out while writing "
+			"learns of %s", rspamd_upstream_name (cbdata->selected),
+			cbdata->ctx->stcf->symbol);
+	rspamd_upstream_fail (cbdata->selected);
+
+	if (cbdata->redis) {
+		redis = cbdata->redis;
+		cbdata->redis = NULL;
+		/* Calls rspamd_redis_batch_learned */
+		redisAsyncFree (redis);
+	}
+}
+
+/* Called when EXEC of the batch is replied */
+static void
+rspamd_redis_batch_learned (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_batch_cbdata *cbdata = priv;
+	redisReply *reply = r, *elt;
+	redisAsyncContext *redis;
+	gboolean success = FALSE;
+	guint i;
+
+	if (c->err == 0 && reply != NULL && reply->type != REDIS_REPLY_ERROR &&
+			reply->type != REDIS_REPLY_NIL) {
+		rspamd_upstream_ok_latency (cbdata->selected,
+				rspamd_get_ticks (FALSE) - cbdata->start);
+		success = TRUE;
+
+		/* Failed commands do not abort transaction, so check all of them */
+		if (reply->type == REDIS_REPLY_ARRAY) {
+			for (i = 0; i < reply->elements; i ++) {
+				elt = reply->element[i];
+
+				if (elt->type == REDIS_REPLY_ERROR) {
+					msg_err ("cannot write learns of %s to %s: command %ud "
+							"of %ud failed: %s", cbdata->ctx->stcf->symbol,
+							cbdata->batch->dest, i + 1,
+							(guint)reply->elements, elt->str);
+					success = FALSE;
+					break;
+				}
+			}
+		}
+	}
+	else if (cbdata->redis) {
+		msg_err ("error getting reply from redis server %s: %s",
+				rspamd_upstream_name (cbdata->selected),
+				c->err ? c->errstr : "transaction failed");
+		rspamd_upstream_fail (cbdata->selected);
+	}
+
+	if (event_get_base (&cbdata->timeout_event)) {
+		event_del (&cbdata->timeout_event);
+	}
+
+	cbdata->batch->fin (cbdata->batch, success);
+
+	if (cbdata->redis) {
+		redis = cbdata->redis;
+		cbdata->redis = NULL;
+		redisAsyncFree (redis);
+	}
+
+	g_free (cbdata);
+}
+
+gboolean
+rspamd_redis_learn_batch (struct rspamd_stat_ctx *ctx,
+		struct rspamd_stat_learn_batch *batch, gpointer p)
+{
+	struct redis_stat_ctx *backend = REDIS_CTX (p);
+	struct rspamd_redis_batch_cbdata *cbdata;
+	struct rspamd_stat_learn_delta *d;
+	struct upstream *up;
+	rspamd_inet_addr_t *addr;
+	rspamd_fstring_t *query;
+	struct timeval tv;
+	const gchar *redis_cmd;
+	gchar n0[512], n1[64];
+	guint i, l0, l1, prefix_len;
+	guint64 obj_hash;
+	gboolean intvals;
+	gint ret;
+
+	if (backend->write_servers == NULL || ctx->ev_base == NULL) {
+		return FALSE;
+	}
+
+	up = rspamd_upstream_get (backend->write_servers,
+			RSPAMD_UPSTREAM_MASTER_SLAVE,
+			NULL,
+			0);
+
+	if (up == NULL) {
+		msg_err ("no upstreams reachable to write learns of %s",
+				backend->stcf->symbol);
+		return FALSE;
+	}
+
+	addr = rspamd_upstream_addr (up);
+	g_assert (addr != NULL);
+
+	cbdata = g_malloc0 (sizeof (*cbdata));
+	cbdata->ctx = backend;
+	cbdata->batch = batch;
+	cbdata->selected = up;
+	cbdata->start = rspamd_get_ticks (FALSE);
+
+	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
+		cbdata->redis = redisAsyncConnectUnix (
+				rspamd_inet_address_to_string (addr));
+	}
+	else {
+		cbdata->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr));
+	}
+
+	if (cbdata->redis == NULL) {
+		msg_err ("cannot connect redis");
+		g_free (cbdata);
+
+		return FALSE;
+	}
+
+	redisLibeventAttach (cbdata->redis, ctx->ev_base);
+	rspamd_redis_maybe_auth (backend, cbdata->redis);
+
+	intvals = backend->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER;
+	redis_cmd = intvals ? "HINCRBY" : "HINCRBYFLOAT";
+	prefix_len = strlen (batch->dest);
+	obj_hash = rspamd_cryptobox_fast_hash (batch->dest, prefix_len, 0);
+
+	redisAsyncCommand (cbdata->redis, NULL, NULL, "SADD %s_keys %s",
+			backend->stcf->symbol, batch->dest);
+
+	query = rspamd_fstring_sized_new (batch->tokens->len * 64 + 128);
+	rspamd_printf_fstring (&query, "*1\r\n$5\r\nMULTI\r\n");
+
+	for (i = 0; i < batch->tokens->len; i ++) {
+		d = &g_array_index (batch->tokens, struct rspamd_stat_learn_delta, i);
+
+		if (backend->cache) {
+			rspamd_redis_cache_remove (backend->cache, obj_hash, d->token);
+		}
+
+		if (intvals) {
+			l1 = rspamd_snprintf (n1, sizeof (n1), "%L", (gint64)d->value);
+		}
+		else {
+			l1 = rspamd_snprintf (n1, sizeof (n1), "%f", d->value);
+		}
+
+		if (backend->new_schema) {
+			l0 = rspamd_snprintf (n0, sizeof (n0), "%s_%uL",
+					batch->dest, d->token);
+			rspamd_printf_fstring (&query, ""
+							"*4\r\n"
+							"$%d\r\n"
+							"%s\r\n"
+							"$%d\r\n"
+							"%s\r\n"
+							"$1\r\n"
+							"%s\r\n"
+							"$%d\r\n"
+							"%s\r\n",
+					(gint)strlen (redis_cmd), redis_cmd,
+					l0, n0,
+					backend->stcf->is_spam ? "S" : "H",
+					l1, n1);
+
+			if (backend->expiry > 0) {
+				l1 = rspamd_snprintf (n1, sizeof (n1), "%d", backend->expiry);
+				rspamd_printf_fstring (&query, ""
+								"*3\r\n"
+								"$6\r\n"
+								"EXPIRE\r\n"
+								"$%d\r\n"
+								"%s\r\n"
+								"$%d\r\n"
+								"%s\r\n",
+						l0, n0,
+						l1, n1);
+			}
+		}
+		else {
+			l0 = rspamd_snprintf (n0, sizeof (n0), "%uL", d->token);
+			rspamd_printf_fstring (&query, ""
+							"*4\r\n"
+							"$%d\r\n"
+							"%s\r\n"
+							"$%d\r\n"
+							"%s\r\n"
+							"$%d\r\n"
+							"%s\r\n"
+							"$%d\r\n"
+							"%s\r\n",
+					(gint)strlen (redis_cmd), redis_cmd,
+					prefix_len, batch->dest,
+					l0, n0,
+					l1, n1);
+		}
+	}
+
+	l1 = rspamd_snprintf (n1, sizeof (n1), "%L", batch->learns);
+	rspamd_printf_fstring (&query, ""
+			"*4\r\n"
+			"$7\r\n"
+			"HINCRBY\r\n"
+			"$%d\r\n"
+			"%s\r\n"
+			"$6\r\n"
+			"learns\r\n"
+			"$%d\r\n"
+			"%s\r\n",
+			prefix_len, batch->dest,
+			l1, n1);
+
+	ret = redisAsyncFormattedCommand (cbdata->redis, NULL, NULL,
+			query->str, query->len);
+	rspamd_fstring_free (query);
+
+	if (ret == REDIS_OK) {
+		ret = redisAsyncCommand (cbdata->redis, rspamd_redis_batch_learned,
+				cbdata, "EXEC");
+	}
+
+	if (ret != REDIS_OK) {
+		msg_err ("call to redis failed: %s", cbdata->redis->errstr);
+		redisAsyncFree (cbdata->redis);
+		g_free (cbdata);
+
+		return FALSE;
+	}
+
+	event_set (&cbdata->timeout_event, -1, EV_TIMEOUT,
+			rspamd_redis_batch_timeout, cbdata);
+	event_base_set (ctx->ev_base, &cbdata->timeout_event);
+	double_to_tv (backend->timeout, &tv);
+	event_add (&cbdata->timeout_event, &tv);
+
+	return TRUE;
+}
+
 #endif
@@ -25,6 +25,15 @@
 #define SQLITE3_BACKEND_TYPE "sqlite3"
 #define SQLITE3_SCHEMA_VERSION "1"
 #define SQLITE3_DEFAULT "default"
+#define SQLITE3_DEFAULT_CACHE_TTL 10.0
+
+struct rspamd_stat_sqlite3_cache_entry {
+	guint64 token;
+	gint64 user_id;
+	gint64 lang_id;
+	gint64 value;
+	gdouble expire;
+};
 
 struct rspamd_stat_sqlite3_db {
 	sqlite3 *sqlite;
@@ -37,6 +46,12 @@ struct rspamd_stat_sqlite3_db {
 	gboolean enable_languages;
 	gint cbref_user;
 	gint cbref_language;
+	/* Learns are written by the learn queue of classifier */
+	gboolean queued_learns;
+	/* Values of recently read tokens */
+	struct rspamd_stat_sqlite3_cache_entry *cache;
+	guint64 cache_size;
+	gdouble cache_ttl;
 };
 
 struct rspamd_stat_sqlite3_rt {
@@ -86,6 +101,7 @@ enum rspamd_stat_sqlite3_stmt_idx {
 	RSPAMD_STAT_BACKEND_SET_TOKEN,
 	RSPAMD_STAT_BACKEND_INC_LEARNS,
 	RSPAMD_STAT_BACKEND_DEC_LEARNS,
+	RSPAMD_STAT_BACKEND_ADD_LEARNS,
 	RSPAMD_STAT_BACKEND_GET_LEARNS,
 	RSPAMD_STAT_BACKEND_GET_LANGUAGE,
 	RSPAMD_STAT_BACKEND_GET_USER,
@@ -189,6 +205,16 @@ static struct rspamd_sqlite3_prstmt prepared_stmts[RSPAMD_STAT_BACKEND_MAX] =
 		.flags = 0,
 		.ret = ""
 	},
+	[RSPAMD_STAT_BACKEND_ADD_LEARNS] = {
+		.idx = RSPAMD_STAT_BACKEND_ADD_LEARNS,
+		.sql = "UPDATE languages SET learns=MAX(0, learns + ?1) WHERE id=?2;"
+				"UPDATE users SET learns=MAX(0, learns + ?1) WHERE id=?3;",
+		.stmt = NULL,
+		.args = "III",
+		.result = SQLITE_DONE,
+		.flags = 0,
+		.ret = ""
+	},
 	[RSPAMD_STAT_BACKEND_GET_LEARNS] = {
 		.idx = RSPAMD_STAT_BACKEND_GET_LEARNS,
 		.sql = "SELECT SUM(MAX(0, learns)) FROM languages;",
@@ -418,6 +444,54 @@ rspamd_sqlite3_get_language (struct rspamd_stat_sqlite3_db *db,
 	return id;
 }
 
+static inline struct rspamd_stat_sqlite3_cache_entry *
+rspamd_sqlite3_cache_slot (struct rspamd_stat_sqlite3_db *bk,
+		guint64 token, gint64 user_id, gint64 lang_id)
+{
+	guint64 h = token ^ ((guint64)user_id * 0x9E3779B97F4A7C15ULL) ^
+			((guint64)lang_id * 0xC2B2AE3D27D4EB4FULL);
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return &bk->cache[h % bk->cache_size];
+}
+
+static gboolean
+rspamd_sqlite3_cache_lookup (struct rspamd_stat_sqlite3_db *bk,
+		struct rspamd_stat_sqlite3_rt *rt, guint64 token, gdouble now,
+		gint64 *value)
+{
+	struct rspamd_stat_sqlite3_cache_entry *e;
+
+	e = rspamd_sqlite3_cache_slot (bk, token, rt->user_id, rt->lang_id);
+
+	if (e->token == token && e->user_id == rt->user_id &&
+			e->lang_id == rt->lang_id && e->expire > now) {
+		*value = e->value;
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void
+rspamd_sqlite3_cache_insert (struct rspamd_stat_sqlite3_db *bk,
+		struct rspamd_stat_sqlite3_rt *rt, guint64 token, gdouble now,
+		gint64 value)
+{
+	struct rspamd_stat_sqlite3_cache_entry *e;
+
+	e = rspamd_sqlite3_cache_slot (bk, token, rt->user_id, rt->lang_id);
+	e->token = token;
+	e->user_id = rt->user_id;
+	e->lang_id = rt->lang_id;
+	e->value = value;
+	e->expire = now + bk->cache_ttl;
+}
+
 static struct rspamd_stat_sqlite3_db *
 rspamd_sqlite3_opendb (rspamd_mempool_t *pool,
 		struct rspamd_statfile_config *stcf,
@@ -520,7 +594,7 @@ rspamd_sqlite3_init (struct rspamd_stat_ctx *ctx,
 {
 	struct rspamd_classifier_config *clf = st->classifier->cfg;
 	struct rspamd_statfile_config *stf = st->stcf;
-	const ucl_object_t *filenameo, *lang_enabled, *users_enabled;
+	const ucl_object_t *filenameo, *lang_enabled, *users_enabled, *elt;
 	const gchar *filename, *lua_script;
 	struct rspamd_stat_sqlite3_db *bk;
 	GError *err = NULL;
@@ -624,6 +698,35 @@ rspamd_sqlite3_init (struct rspamd_stat_ctx *ctx,
 				stf->symbol);
 	}
 
+	/* `write_behind` is a shortcut for in memory learn queue */
+	elt = ucl_object_lookup (clf->opts, "write_behind");
+
+	if (ucl_object_lookup (clf->opts, "learn_queue") != NULL ||
+			(elt != NULL && ucl_object_todouble (elt) > 0)) {
+		bk->queued_learns = TRUE;
+	}
+
+	elt = ucl_object_lookup (clf->opts, "tokens_cache");
+
+	/*
+	 * Learns written directly store absolute values computed from the cached
+	 * ones, which could be stale, while the learn queue writes increments
+	 */
+	if (elt != NULL && ucl_object_toint (elt) > 0 && !bk->queued_learns) {
+		msg_warn_config ("tokens_cache for %s requires learn_queue or "
+				"write_behind, disable it", stf->symbol);
+	}
+	else if (elt != NULL && ucl_object_toint (elt) > 0) {
+		bk->cache_size = ucl_object_toint (elt);
+		bk->cache = g_malloc0 (bk->cache_size * sizeof (*bk->cache));
+		bk->cache_ttl = SQLITE3_DEFAULT_CACHE_TTL;
+
+		elt = ucl_object_lookup (clf->opts, "tokens_cache_ttl");
+
+		if (elt != NULL && ucl_object_todouble (elt) > 0) {
+			bk->cache_ttl = ucl_object_todouble (elt);
+		}
+	}
 
 	return (gpointer) bk;
 }
@@ -634,6 +737,8 @@ rspamd_sqlite3_close (gpointer p)
 	struct rspamd_stat_sqlite3_db *bk = p;
 
 	if (bk->sqlite) {
+		g_free (bk->cache);
+
 		if (bk->in_transaction) {
 			rspamd_sqlite3_run_prstmt (bk->pool, bk->sqlite, bk->prstmt,
 					RSPAMD_STAT_BACKEND_TRANSACTION_COMMIT);
@@ -673,6 +778,7 @@ rspamd_sqlite3_process_tokens (struct rspamd_task *task,
 	struct rspamd_stat_sqlite3_db *bk;
 	struct rspamd_stat_sqlite3_rt *rt = p;
 	gint64 iv = 0;
+	gdouble now = 0;
 	guint i;
 	rspamd_token_t *tok;
 
@@ -681,6 +787,10 @@ rspamd_sqlite3_process_tokens (struct rspamd_task *task,
 
 	bk = rt->db;
 
+	if (bk && bk->cache) {
+		now = rspamd_get_ticks (FALSE);
+	}
+
 	for (i = 0; i < tokens->len; i ++) {
 		tok = g_ptr_array_index (tokens, i);
 
@@ -714,10 +824,18 @@ rspamd_sqlite3_process_tokens (struct rspamd_task *task,
 			}
 		}
 
-		if (rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
-				RSPAMD_STAT_BACKEND_GET_TOKEN,
+		if (bk->cache && rspamd_sqlite3_cache_lookup (bk, rt, tok->data,
+				now, &iv)) {
+			tok->values[id] = iv;
+		}
+		else if (rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite,
+				bk->prstmt, RSPAMD_STAT_BACKEND_GET_TOKEN,
 				tok->data, rt->user_id, rt->lang_id, &iv) == SQLITE_OK) {
 			tok->values[id] = iv;
+
+			if (bk->cache) {
+				rspamd_sqlite3_cache_insert (bk, rt, tok->data, now, iv);
+			}
 		}
 		else {
 			tok->values[id] = 0.0;
@@ -836,6 +954,11 @@ rspamd_sqlite3_finalize_learn (struct rspamd_task *task, gpointer runtime,
 		bk->in_transaction = FALSE;
 	}
 
+	if (bk->queued_learns) {
+		/* Checkpoint is performed when learn queue is flushed */
+		return;
+	}
+
 #ifdef SQLITE_OPEN_WAL
 #ifdef SQLITE_CHECKPOINT_TRUNCATE
 	mode = SQLITE_CHECKPOINT_TRUNCATE;
@@ -1026,3 +1149,119 @@ rspamd_sqlite3_load_tokenizer_config (gpointer runtime,
 
 	return copied_conf;
 }
+
+const gchar *
+rspamd_sqlite3_learn_destination (struct rspamd_task *task,
+		gpointer runtime, gpointer ctx)
+{
+	struct rspamd_stat_sqlite3_rt *rt = runtime;
+	struct rspamd_stat_sqlite3_db *bk;
+	gchar dest[64];
+
+	g_assert (rt != NULL);
+	bk = rt->db;
+
+	if (bk == NULL) {
+		return NULL;
+	}
+
+	if (rt->user_id == -1) {
+		if (bk->enable_users) {
+			rt->user_id = rspamd_sqlite3_get_user (bk, task, TRUE);
+		}
+		else {
+			rt->user_id = 0;
+		}
+	}
+
+	if (rt->lang_id == -1) {
+		if (bk->enable_languages) {
+			rt->lang_id = rspamd_sqlite3_get_language (bk, task, TRUE);
+		}
+		else {
+			rt->lang_id = 0;
+		}
+	}
+
+	/* Users and languages are inserted now, so ids are stable */
+	rspamd_snprintf (dest, sizeof (dest), "%L:%L", rt->user_id, rt->lang_id);
+
+	return rspamd_mempool_strdup (task->task_pool, dest);
+}
+
+gboolean
+rspamd_sqlite3_learn_batch (struct rspamd_stat_ctx *ctx,
+		struct rspamd_stat_learn_batch *batch, gpointer p)
+{
+	struct rspamd_stat_sqlite3_db *bk = p;
+	struct rspamd_stat_learn_delta *d;
+	struct rspamd_stat_sqlite3_cache_entry *e;
+	rspamd_mempool_t *pool;
+	const gchar *sep;
+	glong user_id, lang_id;
+	gint64 iv;
+	guint j;
+
+	if (bk == NULL) {
+		return FALSE;
+	}
+
+	pool = bk->pool;
+	sep = strchr (batch->dest, ':');
+
+	if (sep == NULL ||
+			!rspamd_strtol (batch->dest, sep - batch->dest, &user_id) ||
+			!rspamd_strtol (sep + 1, strlen (sep + 1), &lang_id)) {
+		msg_err_pool ("invalid learn destination for %s: %s", bk->fname,
+				batch->dest);
+		return FALSE;
+	}
+
+	if (!bk->in_transaction) {
+		rspamd_sqlite3_run_prstmt (pool, bk->sqlite, bk->prstmt,
+				RSPAMD_STAT_BACKEND_TRANSACTION_START_IM);
+		bk->in_transaction = TRUE;
+	}
+
+	for (j = 0; j < batch->tokens->len; j ++) {
+		d = &g_array_index (batch->tokens, struct rspamd_stat_learn_delta, j);
+
+		if (rspamd_sqlite3_run_prstmt (pool, bk->sqlite, bk->prstmt,
+				RSPAMD_STAT_BACKEND_GET_TOKEN,
+				d->token, (gint64)user_id, (gint64)lang_id, &iv) != SQLITE_OK) {
+			iv = 0;
+		}
+
+		iv = MAX (iv + (gint64)d->value, 0);
+
+		if (bk->cache) {
+			e = rspamd_sqlite3_cache_slot (bk, d->token, user_id, lang_id);
+			e->expire = 0;
+		}
+
+		if (rspamd_sqlite3_run_prstmt (pool, bk->sqlite, bk->prstmt,
+				RSPAMD_STAT_BACKEND_SET_TOKEN,
+				d->token, (gint64)user_id, (gint64)lang_id, iv) != SQLITE_OK) {
+			rspamd_sqlite3_run_prstmt (pool, bk->sqlite, bk->prstmt,
+					RSPAMD_STAT_BACKEND_TRANSACTION_ROLLBACK);
+			bk->in_transaction = FALSE;
+
+			return FALSE;
+		}
+	}
+
+	if (batch->learns != 0) {
+		/* Net learns of the whole batch are applied by a single update */
+		rspamd_sqlite3_run_prstmt (pool, bk->sqlite, bk->prstmt,
+				RSPAMD_STAT_BACKEND_ADD_LEARNS,
+				batch->learns, (gint64)lang_id, (gint64)user_id);
+	}
+
+	rspamd_sqlite3_run_prstmt (pool, bk->sqlite, bk->prstmt,
+			RSPAMD_STAT_BACKEND_TRANSACTION_COMMIT);
+	bk->in_transaction = FALSE;
+	rspamd_sqlite3_sync (bk->sqlite, NULL, NULL);
+	batch->fin (batch, TRUE);
+
+	return TRUE;
+}
@@ -19,7 +19,9 @@
 #include "classifiers.h"
 #include "rspamd.h"
 #include "stat_internal.h"
+#include "libserver/mempool_vars_internal.h"
 #include "math.h"
+#include <float.h>
 
 #define msg_err_bayes(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         "bayes", task->task_pool->tag.uid, \
@@ -84,13 +86,22 @@ inv_chi_square (struct rspamd_task *task, gdouble value, gint freedom_deg)
 	 * prob is e ^ x (small value since x is normally less than zero
 	 * So we integrate over degrees of freedom and produce the total result
 	 * from 1.0 (no confidence) to 0.0 (full confidence)
+	 *
+	 * Terms decrease after i > m, so the loop stops when they cannot change
+	 * the sum anymore instead of iterating over all tokens
 	 */
 	for (i = 1; i < freedom_deg; i++) {
 		prob *= m / (gdouble)i;
 		sum += prob;
-		msg_debug_bayes ("prob: %.6f, sum: %.6f", prob, sum);
+
+		if (i > m && prob < sum * DBL_EPSILON) {
+			break;
+		}
 	}
 
+	msg_debug_bayes ("value: %.6f, freedom degrees: %d, sum: %.6f, "
+			"iterations: %d", value, freedom_deg, sum, i);
+
 	return MIN (1.0, sum);
 }
 
@@ -110,136 +121,126 @@ struct bayes_task_closure {
  */
 static const double feature_weight[] = { 0, 1, 4, 27, 256, 3125, 46656, 823543 };
 
-#define PROB_COMBINE(prob, cnt, weight, assumed) (((weight) * (assumed) + (cnt) * (prob)) / ((weight) + (cnt)))
+/* Number of probabilities multiplied before taking logarithm */
+#define BAYES_LOG_BATCH 8
+
 /*
- * In this callback we calculate local probabilities for tokens
+ * Calculates local probabilities for all tokens. Tokens counts are gathered
+ * into contiguous columns, so probabilities are computed by branchless loops
+ * that compiler can vectorise
  */
 static void
-bayes_classify_token (struct rspamd_classifier *ctx,
-		rspamd_token_t *tok, struct bayes_task_closure *cl)
+bayes_classify_tokens (struct rspamd_classifier *ctx,
+		GPtrArray *tokens, struct bayes_task_closure *cl)
 {
-	guint i;
+	guint i, j, n = 0;
 	gint id;
-	guint64 spam_count = 0, ham_count = 0, total_count = 0;
 	struct rspamd_statfile *st;
 	struct rspamd_task *task;
-	const gchar *token_type = "txt";
-	double spam_prob, spam_freq, ham_freq, bayes_spam_prob, bayes_ham_prob,
-		ham_prob, fw, w, norm_sum, norm_sub, val;
+	rspamd_token_t *tok, **toks;
+	gdouble *spam_cnt, *ham_cnt, *fw, *text, *bsp, *bhp, *dst;
+	gdouble val, total, valid, sf, hf, denom, d, ft, w, spam_norm, ham_norm,
+		prod_s, prod_h, processed = 0, text_tokens = 0, hits = 0;
 
 	task = cl->task;
 
-#if 0
-	if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_LUA_META) {
-		/* Ignore lua metatokens for now */
-		return;
-	}
-#endif
-
-	if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_META && cl->meta_skip_prob > 0) {
-		val = rspamd_random_double_fast ();
-
-		if (val <= cl->meta_skip_prob) {
-			if (tok->t1 && tok->t2) {
-				msg_debug_bayes (
-						"token(meta) %uL <%*s:%*s> probabilistically skipped",
-						tok->data,
-						(int) tok->t1->len, tok->t1->begin,
-						(int) tok->t2->len, tok->t2->begin);
-			}
+	toks = g_malloc (tokens->len * sizeof (*toks));
+	spam_cnt = g_malloc0 (tokens->len * 6 * sizeof (gdouble));
+	ham_cnt = spam_cnt + tokens->len;
+	fw = ham_cnt + tokens->len;
+	text = fw + tokens->len;
+	bsp = text + tokens->len;
+	bhp = bsp + tokens->len;
 
-			return;
-		}
-	}
+	for (i = 0; i < tokens->len; i ++) {
+		tok = g_ptr_array_index (tokens, i);
 
-	for (i = 0; i < ctx->statfiles_ids->len; i++) {
-		id = g_array_index (ctx->statfiles_ids, gint, i);
-		st = g_ptr_array_index (ctx->ctx->statfiles, id);
-		g_assert (st != NULL);
-		val = tok->values[id];
+		if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_META && cl->meta_skip_prob > 0) {
+			val = rspamd_random_double_fast ();
 
-		if (val > 0) {
-			if (st->stcf->is_spam) {
-				spam_count += val;
+			if (val <= cl->meta_skip_prob) {
+				continue;
 			}
-			else {
-				ham_count += val;
-			}
-
-			total_count += val;
-			cl->total_hits += val;
 		}
-	}
 
-	/* Probability for this token */
-	if (total_count > 0) {
-		spam_freq = ((double)spam_count / MAX (1., (double) ctx->spam_learns));
-		ham_freq = ((double)ham_count / MAX (1., (double)ctx->ham_learns));
-		spam_prob = spam_freq / (spam_freq + ham_freq);
-		ham_prob = ham_freq / (spam_freq + ham_freq);
+		toks[n] = tok;
 
 		if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
-			fw = 1.0;
+			fw[n] = 1.0;
 		}
 		else {
-			fw = feature_weight[tok->window_idx %
+			fw[n] = feature_weight[tok->window_idx %
 					G_N_ELEMENTS (feature_weight)];
 		}
 
-		norm_sum = (spam_freq + ham_freq) * (spam_freq + ham_freq);
-		norm_sub = (spam_freq - ham_freq) * (spam_freq - ham_freq);
-
-		w = (norm_sub) / (norm_sum) *
-				(fw * total_count) / (4.0 * (1.0 + fw * total_count));
-		bayes_spam_prob = PROB_COMBINE (spam_prob, total_count, w, 0.5);
-		norm_sub = (ham_freq - spam_freq) * (ham_freq - spam_freq);
-		w = (norm_sub) / (norm_sum) *
-				(fw * total_count) / (4.0 * (1.0 + fw * total_count));
-		bayes_ham_prob = PROB_COMBINE (ham_prob, total_count, w, 0.5);
+		text[n] = (tok->flags & RSPAMD_STAT_TOKEN_FLAG_META) ? 0.0 : 1.0;
+		n ++;
+	}
 
-		cl->spam_prob += log2 (bayes_spam_prob);
-		cl->ham_prob += log2 (bayes_ham_prob);
-		cl->processed_tokens ++;
+	/* One column per statfile */
+	for (j = 0; j < ctx->statfiles_ids->len; j++) {
+		id = g_array_index (ctx->statfiles_ids, gint, j);
+		st = g_ptr_array_index (ctx->ctx->statfiles, id);
+		g_assert (st != NULL);
+		dst = st->stcf->is_spam ? spam_cnt : ham_cnt;
 
-		if (!(tok->flags & RSPAMD_STAT_TOKEN_FLAG_META)) {
-			cl->text_tokens ++;
-		}
-		else {
-			token_type = "meta";
+		for (i = 0; i < n; i ++) {
+			val = toks[i]->values[id];
+			dst[i] += val > 0 ? val : 0;
 		}
+	}
 
-		if (tok->t1 && tok->t2) {
-			msg_debug_bayes ("token(%s) %uL <%*s:%*s>: weight: %f, total_count: %L, "
-					"spam_count: %L, ham_count: %L,"
-					"spam_prob: %.3f, ham_prob: %.3f, "
-					"bayes_spam_prob: %.3f, bayes_ham_prob: %.3f, "
-					"current spam prob: %.3f, current ham prob: %.3f",
-					token_type,
-					tok->data,
-					(int) tok->t1->len, tok->t1->begin,
-					(int) tok->t2->len, tok->t2->begin,
-					fw, total_count, spam_count, ham_count,
-					spam_prob, ham_prob,
-					bayes_spam_prob, bayes_ham_prob,
-					cl->spam_prob, cl->ham_prob);
-		}
-		else {
-			msg_debug_bayes ("token(%s) %uL <?:?>: weight: %f, total_count: %L, "
-					"spam_count: %L, ham_count: %L,"
-					"spam_prob: %.3f, ham_prob: %.3f, "
-					"bayes_spam_prob: %.3f, bayes_ham_prob: %.3f, "
-					"current spam prob: %.3f, current ham prob: %.3f",
-					token_type,
-					tok->data,
-					fw, total_count, spam_count, ham_count,
-					spam_prob, ham_prob,
-					bayes_spam_prob, bayes_ham_prob,
-					cl->spam_prob, cl->ham_prob);
+	spam_norm = 1.0 / MAX (1., (double)ctx->spam_learns);
+	ham_norm = 1.0 / MAX (1., (double)ctx->ham_learns);
+
+	/*
+	 * Tokens without hits get probabilities of 1.0, so they do not change
+	 * logarithms sums
+	 */
+	for (i = 0; i < n; i ++) {
+		total = spam_cnt[i] + ham_cnt[i];
+		valid = total > 0 ? 1.0 : 0.0;
+		sf = spam_cnt[i] * spam_norm;
+		hf = ham_cnt[i] * ham_norm;
+		denom = sf + hf + (1.0 - valid);
+		d = (sf - hf) / denom;
+		ft = fw[i] * total;
+		w = d * d * ft / (4.0 * (1.0 + ft));
+		/* Combine with assumed probability 0.5 */
+		bsp[i] = (w * 0.5 + total * sf / denom) / (w + total + (1.0 - valid)) +
+				(1.0 - valid);
+		bhp[i] = (w * 0.5 + total * hf / denom) / (w + total + (1.0 - valid)) +
+				(1.0 - valid);
+		processed += valid;
+		text_tokens += valid * text[i];
+		hits += total;
+	}
+
+	for (i = 0; i < n; i += BAYES_LOG_BATCH) {
+		prod_s = 1.0;
+		prod_h = 1.0;
+
+		for (j = i; j < MIN (i + BAYES_LOG_BATCH, n); j ++) {
+			prod_s *= bsp[j];
+			prod_h *= bhp[j];
 		}
+
+		cl->spam_prob += log2 (prod_s);
+		cl->ham_prob += log2 (prod_h);
 	}
-}
 
+	cl->processed_tokens += processed;
+	cl->text_tokens += text_tokens;
+	cl->total_hits += hits;
+
+	msg_debug_bayes ("%ud tokens selected of %ud, %.0f processed, "
+			"%.0f text tokens, spam prob: %.3f, ham prob: %.3f",
+			n, tokens->len, processed, text_tokens,
+			cl->spam_prob, cl->ham_prob);
 
+	g_free (spam_cnt);
+	g_free (toks);
+}
 
 gboolean
 bayes_init (rspamd_mempool_t *pool, struct rspamd_classifier *cl)
@@ -255,8 +256,9 @@ bayes_classify (struct rspamd_classifier * ctx,
 		struct rspamd_task *task)
 {
 	double final_prob, h, s, *pprob;
-	gchar sumbuf[32];
+	gchar sumbuf[32], varbuf[128];
 	struct rspamd_statfile *st = NULL;
+	struct rspamd_bayes_aggregates *agg;
 	struct bayes_task_closure cl;
 	rspamd_token_t *tok;
 	guint i, text_tokens = 0;
@@ -308,13 +310,23 @@ bayes_classify (struct rspamd_classifier * ctx,
 		cl.meta_skip_prob = 0.0;
 	}
 	else {
-		cl.meta_skip_prob = 1.0 - text_tokens / tokens->len;
+		cl.meta_skip_prob = 1.0 - (gdouble)text_tokens / tokens->len;
 	}
 
-	for (i = 0; i < tokens->len; i ++) {
-		tok = g_ptr_array_index (tokens, i);
-
-		bayes_classify_token (ctx, tok, &cl);
+	rspamd_snprintf (varbuf, sizeof (varbuf), "%s_%s",
+			RSPAMD_MEMPOOL_BAYES_AGGREGATES, ctx->cfg->name);
+	agg = rspamd_mempool_get_variable (task->task_pool, varbuf);
+
+	if (agg != NULL) {
+		/* Backend has already classified tokens */
+		cl.spam_prob = agg->spam_prob;
+		cl.ham_prob = agg->ham_prob;
+		cl.processed_tokens = agg->processed_tokens;
+		cl.text_tokens = agg->text_tokens;
+		cl.total_hits = agg->total_hits;
+	}
+	else {
+		bayes_classify_tokens (ctx, tokens, &cl);
 	}
 
 	h = 1 - inv_chi_square (task, cl.spam_prob, cl.processed_tokens);
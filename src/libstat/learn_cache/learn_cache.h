@@ -60,6 +60,7 @@ struct rspamd_stat_cache {
 		void rspamd_stat_cache_##name##_close (gpointer ctx)
 
 RSPAMD_STAT_CACHE_DEF(sqlite3);
+RSPAMD_STAT_CACHE_DEF(memory);
 #ifdef WITH_HIREDIS
 RSPAMD_STAT_CACHE_DEF(redis);
 #endif
@@ -0,0 +1,396 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Learn cache that keeps digests of learned messages in a fixed size hash
+ * table. The table is mapped from a file shared by all workers if
+ * `shared_file` is set and is private for each worker otherwise.
+ *
+ * Each bucket has a few slots, a new digest replaces the oldest slot in its
+ * bucket. Slots are updated without locking: workers learning at the same
+ * time can overwrite each other's slot or leave a slot with a stale stamp.
+ * Such a digest is then missed and checked by the persistent cache (or
+ * learned again), so races cost a duplicate check rather than a wrong answer
+ * in the normal case, but the cache is a hint and not a strict set.
+ *
+ * Learns are also written to the persistent cache (sqlite3 or redis), which
+ * is checked on misses only if `check_persistent` is enabled. The persistent
+ * cache is configured by its own `persistent` section.
+ */
+#include "config.h"
+#include "learn_cache.h"
+#include "rspamd.h"
+#include "stat_api.h"
+#include "stat_internal.h"
+#include "cryptobox.h"
+#include "ucl.h"
+#include "unix-std.h"
+
+#define MEMORY_CACHE_MAGIC 0x314d4352u /* RCM1 */
+#define MEMORY_CACHE_SLOTS 4
+#define MEMORY_CACHE_DEFAULT_SIZE (1024 * 1024)
+
+struct rspamd_memory_cache_slot {
+	guint64 key;                /**< digest with class in the lowest bit	*/
+	guint64 stamp;              /**< time of the last learn				*/
+};
+
+struct rspamd_memory_cache_hdr {
+	guint32 magic;
+	guint32 slots;
+	guint64 nbuckets;
+};
+
+struct rspamd_memory_cache_ctx {
+	struct rspamd_memory_cache_hdr *hdr;
+	struct rspamd_memory_cache_slot *slots;
+	gsize len;
+	gboolean shared;
+	gdouble max_age;
+	gboolean check_persistent;
+	/* Persistent cache that is written through */
+	struct rspamd_stat_cache *persistent;
+	gpointer persistent_cf;
+};
+
+static guint64
+rspamd_memory_cache_key (struct rspamd_task *task)
+{
+	rspamd_cryptobox_fast_hash_state_t st;
+	rspamd_token_t *tok;
+	const gchar *user;
+	guint64 key;
+	guint i;
+
+	rspamd_cryptobox_fast_hash_init (&st, 0);
+	user = rspamd_mempool_get_variable (task->task_pool, "stat_user");
+
+	/* Use dedicated hash space for per users cache */
+	if (user != NULL) {
+		rspamd_cryptobox_fast_hash_update (&st, user, strlen (user));
+	}
+
+	for (i = 0; i < task->tokens->len; i ++) {
+		tok = g_ptr_array_index (task->tokens, i);
+		rspamd_cryptobox_fast_hash_update (&st, &tok->data,
+				sizeof (tok->data));
+	}
+
+	key = rspamd_cryptobox_fast_hash_final (&st) & ~1ULL;
+
+	/* Zero is an empty slot */
+	return key ? key : 2;
+}
+
+static struct rspamd_memory_cache_slot *
+rspamd_memory_cache_bucket (struct rspamd_memory_cache_ctx *ctx, guint64 key)
+{
+	return &ctx->slots[((key >> 1) % ctx->hdr->nbuckets) * MEMORY_CACHE_SLOTS];
+}
+
+static gpointer
+rspamd_memory_cache_map (struct rspamd_config *cfg, const gchar *path,
+		gsize len, guint64 nbuckets)
+{
+	struct rspamd_memory_cache_hdr *hdr;
+	struct stat st;
+	gpointer map;
+	gint fd;
+
+	if (path == NULL) {
+		map = g_malloc0 (len);
+		hdr = map;
+		hdr->magic = MEMORY_CACHE_MAGIC;
+		hdr->slots = MEMORY_CACHE_SLOTS;
+		hdr->nbuckets = nbuckets;
+
+		return map;
+	}
+
+	fd = rspamd_file_xopen (path, O_RDWR | O_CREAT, 00600, FALSE);
+
+	if (fd == -1) {
+		msg_err_config ("cannot open learn cache %s: %s", path,
+				strerror (errno));
+		return NULL;
+	}
+
+	/* Other workers might initialize the same file */
+	rspamd_file_lock (fd, FALSE);
+
+	if (fstat (fd, &st) == -1 || (st.st_size != (off_t)len &&
+			ftruncate (fd, len) == -1)) {
+		msg_err_config ("cannot resize learn cache %s: %s", path,
+				strerror (errno));
+		rspamd_file_unlock (fd, FALSE);
+		close (fd);
+
+		return NULL;
+	}
+
+	map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (map == MAP_FAILED) {
+		msg_err_config ("cannot mmap learn cache %s: %s", path,
+				strerror (errno));
+		rspamd_file_unlock (fd, FALSE);
+		close (fd);
+
+		return NULL;
+	}
+
+	hdr = map;
+
+	if (hdr->magic != MEMORY_CACHE_MAGIC || hdr->slots != MEMORY_CACHE_SLOTS ||
+			hdr->nbuckets != nbuckets) {
+		msg_info_config ("initialize learn cache %s for %L digests", path,
+				(gint64)(nbuckets * MEMORY_CACHE_SLOTS));
+		memset (map, 0, len);
+		hdr->magic = MEMORY_CACHE_MAGIC;
+		hdr->slots = MEMORY_CACHE_SLOTS;
+		hdr->nbuckets = nbuckets;
+	}
+
+	rspamd_file_unlock (fd, FALSE);
+	close (fd);
+
+	return map;
+}
+
+gpointer
+rspamd_stat_cache_memory_init (struct rspamd_stat_ctx *ctx,
+		struct rspamd_config *cfg,
+		struct rspamd_statfile *st,
+		const ucl_object_t *cf)
+{
+	struct rspamd_memory_cache_ctx *cache_ctx;
+	const ucl_object_t *elt, *persistent_cf = NULL;
+	const gchar *path = NULL, *persistent = NULL;
+	guint64 size = MEMORY_CACHE_DEFAULT_SIZE, nbuckets;
+	gdouble max_age = 0;
+	gboolean check_persistent = FALSE;
+	gpointer map;
+	gsize len;
+	guint i;
+
+	if (cf) {
+		elt = ucl_object_lookup (cf, "size");
+
+		if (elt != NULL && ucl_object_toint (elt) > 0) {
+			size = ucl_object_toint (elt);
+		}
+
+		elt = ucl_object_lookup (cf, "max_age");
+
+		if (elt != NULL) {
+			max_age = ucl_object_todouble (elt);
+		}
+
+		elt = ucl_object_lookup (cf, "shared_file");
+
+		if (elt != NULL) {
+			path = ucl_object_tostring (elt);
+		}
+
+		elt = ucl_object_lookup (cf, "persistent");
+
+		if (elt != NULL) {
+			if (ucl_object_type (elt) == UCL_OBJECT) {
+				/* persistent { type = "sqlite3"; path = "..."; } */
+				persistent_cf = elt;
+				elt = ucl_object_lookup_any (elt, "name", "type", NULL);
+
+				if (elt != NULL) {
+					persistent = ucl_object_tostring (elt);
+				}
+			}
+			else {
+				persistent = ucl_object_tostring (elt);
+			}
+		}
+
+		elt = ucl_object_lookup (cf, "check_persistent");
+
+		if (elt != NULL) {
+			check_persistent = ucl_object_toboolean (elt);
+		}
+	}
+
+	if (persistent == NULL) {
+		/* Learn cache of the backend */
+		persistent = st->classifier->cfg->backend;
+	}
+
+	nbuckets = (size + MEMORY_CACHE_SLOTS - 1) / MEMORY_CACHE_SLOTS;
+	len = sizeof (struct rspamd_memory_cache_hdr) +
+			nbuckets * MEMORY_CACHE_SLOTS *
+			sizeof (struct rspamd_memory_cache_slot);
+	map = rspamd_memory_cache_map (cfg, path, len, nbuckets);
+
+	if (map == NULL) {
+		return NULL;
+	}
+
+	cache_ctx = g_malloc0 (sizeof (*cache_ctx));
+	cache_ctx->hdr = map;
+	cache_ctx->slots = (struct rspamd_memory_cache_slot *)(cache_ctx->hdr + 1);
+	cache_ctx->len = len;
+	cache_ctx->shared = (path != NULL);
+	cache_ctx->max_age = max_age;
+	cache_ctx->check_persistent = check_persistent;
+
+	for (i = 0; persistent != NULL && i < ctx->caches_count; i ++) {
+		if (strcmp (persistent, ctx->caches_subrs[i].name) == 0 &&
+				ctx->caches_subrs[i].init != rspamd_stat_cache_memory_init) {
+			cache_ctx->persistent = &ctx->caches_subrs[i];
+			break;
+		}
+	}
+
+	if (cache_ctx->persistent) {
+		cache_ctx->persistent_cf = cache_ctx->persistent->init (ctx, cfg, st,
+				persistent_cf);
+
+		if (cache_ctx->persistent_cf == NULL) {
+			msg_warn_config ("cannot init persistent learn cache %s, "
+					"use memory only", persistent);
+			cache_ctx->persistent = NULL;
+		}
+	}
+
+	return cache_ctx;
+}
+
+gpointer
+rspamd_stat_cache_memory_runtime (struct rspamd_task *task,
+		gpointer ctx, gboolean learn)
+{
+	if (task->tokens == NULL || task->tokens->len == 0) {
+		return NULL;
+	}
+
+	return ctx;
+}
+
+gint
+rspamd_stat_cache_memory_check (struct rspamd_task *task,
+		gboolean is_spam,
+		gpointer runtime)
+{
+	struct rspamd_memory_cache_ctx *ctx = runtime;
+	struct rspamd_memory_cache_slot *bucket;
+	guint64 key, cur, now;
+	guint i;
+
+	if (ctx == NULL) {
+		return RSPAMD_LEARN_INGORE;
+	}
+
+	key = rspamd_memory_cache_key (task);
+	bucket = rspamd_memory_cache_bucket (ctx, key);
+	now = time (NULL);
+
+	for (i = 0; i < MEMORY_CACHE_SLOTS; i ++) {
+		cur = bucket[i].key;
+
+		if ((cur & ~1ULL) != key) {
+			continue;
+		}
+
+		if (ctx->max_age > 0 && bucket[i].stamp + ctx->max_age < now) {
+			break;
+		}
+
+		if (!!(cur & 1) == !!is_spam) {
+			/* Already learned */
+			return RSPAMD_LEARN_INGORE;
+		}
+
+		/* Need to relearn */
+		return RSPAMD_LEARN_UNLEARN;
+	}
+
+	if (ctx->check_persistent && ctx->persistent) {
+		return ctx->persistent->check (task, is_spam,
+				ctx->persistent->runtime (task, ctx->persistent_cf, FALSE));
+	}
+
+	return RSPAMD_LEARN_OK;
+}
+
+gint
+rspamd_stat_cache_memory_learn (struct rspamd_task *task,
+		gboolean is_spam,
+		gpointer runtime)
+{
+	struct rspamd_memory_cache_ctx *ctx = runtime;
+	struct rspamd_memory_cache_slot *bucket, *sel = NULL;
+	gpointer prt;
+	guint64 key, now;
+	guint i;
+
+	if (ctx == NULL) {
+		return RSPAMD_LEARN_INGORE;
+	}
+
+	key = rspamd_memory_cache_key (task);
+	bucket = rspamd_memory_cache_bucket (ctx, key);
+	now = time (NULL);
+
+	for (i = 0; i < MEMORY_CACHE_SLOTS; i ++) {
+		if ((bucket[i].key & ~1ULL) == key) {
+			sel = &bucket[i];
+			break;
+		}
+
+		/* Replace the oldest slot */
+		if (sel == NULL || bucket[i].stamp < sel->stamp) {
+			sel = &bucket[i];
+		}
+	}
+
+	sel->stamp = now;
+	sel->key = key | (is_spam ? 1 : 0);
+
+	if (ctx->persistent) {
+		prt = ctx->persistent->runtime (task, ctx->persistent_cf, TRUE);
+
+		if (prt != NULL) {
+			ctx->persistent->learn (task, is_spam, prt);
+		}
+	}
+
+	return RSPAMD_LEARN_OK;
+}
+
+void
+rspamd_stat_cache_memory_close (gpointer c)
+{
+	struct rspamd_memory_cache_ctx *ctx = c;
+
+	if (ctx != NULL) {
+		if (ctx->persistent) {
+			ctx->persistent->close (ctx->persistent_cf);
+		}
+
+		if (ctx->shared) {
+			munmap (ctx->hdr, ctx->len);
+		}
+		else {
+			g_free (ctx->hdr);
+		}
+		g_free (ctx);
+	}
+}
@@ -44,6 +44,7 @@ struct rspamd_redis_cache_runtime {
 	struct upstream *selected;
 	struct event timeout_event;
 	redisAsyncContext *redis;
+	gdouble start;
 	gboolean has_event;
 };
 
@@ -144,7 +145,8 @@ rspamd_stat_cache_redis_get (redisAsyncContext *c, gpointer r, gpointer priv)
 			task->flags |= RSPAMD_TASK_FLAG_UNLEARN;
 		}
 
-		rspamd_upstream_ok (rt->selected);
+		rspamd_upstream_ok_latency (rt->selected,
+				rspamd_get_ticks (FALSE) - rt->start);
 	}
 	else {
 		rspamd_upstream_fail (rt->selected);
@@ -166,7 +168,8 @@ rspamd_stat_cache_redis_set (redisAsyncContext *c, gpointer r, gpointer priv)
 
 	if (c->err == 0) {
 		/* XXX: we ignore results here */
-		rspamd_upstream_ok (rt->selected);
+		rspamd_upstream_ok_latency (rt->selected,
+				rspamd_get_ticks (FALSE) - rt->start);
 	}
 	else {
 		rspamd_upstream_fail (rt->selected);
@@ -396,6 +399,7 @@ rspamd_stat_cache_redis_runtime (struct rspamd_task *task,
 	rt->selected = up;
 	rt->task = task;
 	rt->ctx = ctx;
+	rt->start = rspamd_get_ticks (FALSE);
 
 	addr = rspamd_upstream_addr (up);
 	g_assert (addr != NULL);
@@ -465,6 +469,13 @@ rspamd_stat_cache_redis_learn (struct rspamd_task *task,
 	gint flag;
 
 	h = rspamd_mempool_get_variable (task->task_pool, "words_hash");
+
+	if (h == NULL) {
+		/* Cache has not been checked, e.g. when written through */
+		rspamd_stat_cache_redis_generate_id (task);
+		h = rspamd_mempool_get_variable (task->task_pool, "words_hash");
+	}
+
 	g_assert (h != NULL);
 
 	double_to_tv (rt->ctx->timeout, &tv);
@@ -169,17 +169,46 @@ rspamd_stat_cache_sqlite3_runtime (struct rspamd_task *task,
 	return ctx;
 }
 
+static guchar *
+rspamd_stat_cache_sqlite3_digest (struct rspamd_task *task)
+{
+	rspamd_cryptobox_hash_state_t st;
+	rspamd_token_t *tok;
+	guchar *out;
+	gchar *user = NULL;
+	guint i;
+
+	out = rspamd_mempool_alloc (task->task_pool, rspamd_cryptobox_HASHBYTES);
+
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+
+	user = rspamd_mempool_get_variable (task->task_pool, "stat_user");
+	/* Use dedicated hash space for per users cache */
+	if (user != NULL) {
+		rspamd_cryptobox_hash_update (&st, user, strlen (user));
+	}
+
+	for (i = 0; i < task->tokens->len; i ++) {
+		tok = g_ptr_array_index (task->tokens, i);
+		rspamd_cryptobox_hash_update (&st, (guchar *)&tok->data,
+				sizeof (tok->data));
+	}
+
+	rspamd_cryptobox_hash_final (&st, out);
+
+	/* Save hash into variables */
+	rspamd_mempool_set_variable (task->task_pool, "words_hash", out, NULL);
+
+	return out;
+}
+
 gint
 rspamd_stat_cache_sqlite3_check (struct rspamd_task *task,
 		gboolean is_spam,
 		gpointer runtime)
 {
 	struct rspamd_stat_sqlite3_ctx *ctx = runtime;
-	rspamd_cryptobox_hash_state_t st;
-	rspamd_token_t *tok;
 	guchar *out;
-	gchar *user = NULL;
-	guint i;
 	gint rc;
 	gint64 flag;
 
@@ -188,23 +217,7 @@ rspamd_stat_cache_sqlite3_check (struct rspamd_task *task,
 	}
 
 	if (ctx != NULL && ctx->db != NULL) {
-		out = rspamd_mempool_alloc (task->task_pool, rspamd_cryptobox_HASHBYTES);
-
-		rspamd_cryptobox_hash_init (&st, NULL, 0);
-
-		user = rspamd_mempool_get_variable (task->task_pool, "stat_user");
-		/* Use dedicated hash space for per users cache */
-		if (user != NULL) {
-			rspamd_cryptobox_hash_update (&st, user, strlen (user));
-		}
-
-		for (i = 0; i < task->tokens->len; i ++) {
-			tok = g_ptr_array_index (task->tokens, i);
-			rspamd_cryptobox_hash_update (&st, (guchar *)&tok->data,
-					sizeof (tok->data));
-		}
-
-		rspamd_cryptobox_hash_final (&st, out);
+		out = rspamd_stat_cache_sqlite3_digest (task);
 
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
 				RSPAMD_STAT_CACHE_TRANSACTION_START_DEF);
@@ -214,9 +227,6 @@ rspamd_stat_cache_sqlite3_check (struct rspamd_task *task,
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
 				RSPAMD_STAT_CACHE_TRANSACTION_COMMIT);
 
-		/* Save hash into variables */
-		rspamd_mempool_set_variable (task->task_pool, "words_hash", out, NULL);
-
 		if (rc == SQLITE_OK) {
 			/* We have some existing record in the table */
 			if (!!flag == !!is_spam) {
@@ -246,7 +256,12 @@ rspamd_stat_cache_sqlite3_learn (struct rspamd_task *task,
 	h = rspamd_mempool_get_variable (task->task_pool, "words_hash");
 
 	if (h == NULL) {
-		return RSPAMD_LEARN_INGORE;
+		if (ctx == NULL || task->tokens == NULL || task->tokens->len == 0) {
+			return RSPAMD_LEARN_INGORE;
+		}
+
+		/* Cache has not been checked, e.g. when written through */
+		h = rspamd_stat_cache_sqlite3_digest (task);
 	}
 
 	flag = !!is_spam ? 1 : 0;
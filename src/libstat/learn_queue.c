@@ -0,0 +1,755 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Learn queue: tokens increments of learned messages are merged in memory
+ * per statfile destination and written to backends in bulk either on timer
+ * or when the queue grows too large.
+ *
+ * Queued learns can be journaled: each push is appended to the journal
+ * segment of the current flush generation, segment is removed when all
+ * batches of its generation are written by backends. Segments left by
+ * terminated processes are replayed on start, so learns are written at least
+ * once.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "stat_internal.h"
+#include "unix-std.h"
+#include "khash.h"
+
+#define RSPAMD_LEARN_QUEUE_MAX_TOKENS 100000
+#define RSPAMD_LEARN_QUEUE_FLUSH_INTERVAL 5.0
+#define RSPAMD_LEARN_JOURNAL_MAGIC 0x314a4c52 /* RLJ1 */
+
+#define msg_err_learn_queue(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
+        "learnqueue", NULL, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_warn_learn_queue(...)   rspamd_default_log_function (G_LOG_LEVEL_WARNING, \
+        "learnqueue", NULL, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_info_learn_queue(...)   rspamd_default_log_function (G_LOG_LEVEL_INFO, \
+        "learnqueue", NULL, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_debug_learn_queue(...)  rspamd_default_log_function (G_LOG_LEVEL_DEBUG, \
+        "learnqueue", NULL, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+
+KHASH_MAP_INIT_INT64(rspamd_learn_deltas, gdouble);
+
+enum rspamd_learn_queue_durability {
+	RSPAMD_LEARN_QUEUE_MEMORY = 0,
+	RSPAMD_LEARN_QUEUE_JOURNAL,
+	RSPAMD_LEARN_QUEUE_FSYNC,
+};
+
+/* Merged learns of a single statfile destination */
+struct rspamd_learn_queue_dest {
+	struct rspamd_statfile *st;
+	gchar *dest;
+	khash_t(rspamd_learn_deltas) *deltas;
+	gint64 learns;
+};
+
+/* Journal segment of a flush generation */
+struct rspamd_learn_journal {
+	gchar *path;
+	gint fd;
+	guint pending;              /**< batches that are not written yet		*/
+	gboolean detached;          /**< no more records are appended			*/
+	gboolean failed;            /**< keep segment to replay it later		*/
+};
+
+struct rspamd_stat_learn_queue {
+	struct rspamd_stat_ctx *ctx;
+	struct rspamd_classifier *cl;
+	GHashTable *dests;
+	struct rspamd_learn_journal *journal;
+	gchar *journal_prefix;
+	guint journal_gen;
+	enum rspamd_learn_queue_durability durability;
+	guint ntokens;
+	guint max_tokens;
+	gdouble flush_interval;
+	struct event flush_ev;
+	gboolean timer_armed;
+};
+
+/* On disk record, followed by symbol, destination and deltas */
+struct rspamd_learn_journal_record {
+	guint32 magic;
+	gint32 learns;
+	guint32 ntokens;
+	guint16 symlen;
+	guint16 destlen;
+};
+
+static void
+rspamd_learn_queue_dest_free (gpointer p)
+{
+	struct rspamd_learn_queue_dest *qd = p;
+
+	kh_destroy (rspamd_learn_deltas, qd->deltas);
+	g_free (qd->dest);
+	g_free (qd);
+}
+
+static void
+rspamd_learn_journal_release (struct rspamd_learn_journal *j)
+{
+	if (j->failed) {
+		msg_warn_learn_queue ("keep journal %s as some learns have not been "
+				"written", j->path);
+	}
+	else {
+		unlink (j->path);
+	}
+
+	/* Releases lock, so segment could be replayed by another process */
+	close (j->fd);
+	g_free (j->path);
+	g_free (j);
+}
+
+static struct rspamd_learn_journal *
+rspamd_learn_journal_get (struct rspamd_stat_learn_queue *q)
+{
+	struct rspamd_learn_journal *j;
+	gint fd;
+	gchar path[PATH_MAX];
+
+	if (q->journal != NULL) {
+		return q->journal;
+	}
+
+	rspamd_snprintf (path, sizeof (path), "%s.%P.%ud", q->journal_prefix,
+			getpid (), q->journal_gen ++);
+	fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 00600);
+
+	if (fd == -1) {
+		msg_err_learn_queue ("cannot open journal %s: %s", path,
+				strerror (errno));
+
+		return NULL;
+	}
+
+	if (!rspamd_file_lock (fd, TRUE)) {
+		msg_err_learn_queue ("cannot lock journal %s", path);
+		close (fd);
+		unlink (path);
+
+		return NULL;
+	}
+
+	j = g_malloc0 (sizeof (*j));
+	j->fd = fd;
+	j->path = g_strdup (path);
+	q->journal = j;
+
+	return j;
+}
+
+static gboolean
+rspamd_learn_journal_append (struct rspamd_stat_learn_queue *q,
+		struct rspamd_statfile *st, const gchar *dest, gint learns,
+		const struct rspamd_stat_learn_delta *deltas, guint ndeltas,
+		GError **err)
+{
+	struct rspamd_learn_journal *j;
+	struct rspamd_learn_journal_record rec;
+	struct iovec iov[4];
+	gsize total;
+	gssize r;
+
+	j = rspamd_learn_journal_get (q);
+
+	if (j == NULL) {
+		g_set_error (err, rspamd_stat_quark (), 500,
+				"cannot open learn queue journal");
+		return FALSE;
+	}
+
+	memset (&rec, 0, sizeof (rec));
+	rec.magic = RSPAMD_LEARN_JOURNAL_MAGIC;
+	rec.learns = learns;
+	rec.ntokens = ndeltas;
+	rec.symlen = strlen (st->stcf->symbol);
+	rec.destlen = strlen (dest);
+
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof (rec);
+	iov[1].iov_base = (void *)st->stcf->symbol;
+	iov[1].iov_len = rec.symlen;
+	iov[2].iov_base = (void *)dest;
+	iov[2].iov_len = rec.destlen;
+	iov[3].iov_base = (void *)deltas;
+	iov[3].iov_len = ndeltas * sizeof (*deltas);
+	total = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len + iov[3].iov_len;
+
+	r = writev (j->fd, iov, G_N_ELEMENTS (iov));
+
+	if (r == -1 || (gsize)r != total) {
+		g_set_error (err, rspamd_stat_quark (), 500,
+				"cannot write learn queue journal %s: %s", j->path,
+				r == -1 ? strerror (errno) : "short write");
+		/* Partial record is skipped on replay */
+		j->failed = TRUE;
+
+		return FALSE;
+	}
+
+	if (q->durability == RSPAMD_LEARN_QUEUE_FSYNC && fsync (j->fd) == -1) {
+		g_set_error (err, rspamd_stat_quark (), 500,
+				"cannot sync learn queue journal %s: %s", j->path,
+				strerror (errno));
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_learn_queue_timer (gint fd, short what, gpointer d)
+{
+	struct rspamd_stat_learn_queue *q = d;
+
+	q->timer_armed = FALSE;
+	rspamd_stat_learn_queue_flush (q);
+}
+
+static gboolean
+rspamd_learn_queue_add (struct rspamd_stat_learn_queue *q,
+		struct rspamd_statfile *st, const gchar *dest, gint learns,
+		const struct rspamd_stat_learn_delta *deltas, guint ndeltas,
+		GError **err)
+{
+	struct rspamd_learn_queue_dest *qd;
+	struct timeval tv;
+	gchar *key;
+	khiter_t k;
+	gint r;
+	guint i;
+
+	if (q->durability != RSPAMD_LEARN_QUEUE_MEMORY) {
+		if (!rspamd_learn_journal_append (q, st, dest, learns, deltas, ndeltas,
+				err)) {
+			return FALSE;
+		}
+	}
+
+	key = g_strdup_printf ("%d:%s", st->id, dest);
+	qd = g_hash_table_lookup (q->dests, key);
+
+	if (qd == NULL) {
+		qd = g_malloc0 (sizeof (*qd));
+		qd->st = st;
+		qd->dest = g_strdup (dest);
+		qd->deltas = kh_init (rspamd_learn_deltas);
+		g_hash_table_insert (q->dests, key, qd);
+	}
+	else {
+		g_free (key);
+	}
+
+	qd->learns += learns;
+
+	for (i = 0; i < ndeltas; i ++) {
+		k = kh_put (rspamd_learn_deltas, qd->deltas, deltas[i].token, &r);
+
+		if (r != 0) {
+			kh_value (qd->deltas, k) = deltas[i].value;
+			q->ntokens ++;
+		}
+		else {
+			kh_value (qd->deltas, k) += deltas[i].value;
+		}
+	}
+
+	if (q->ntokens >= q->max_tokens) {
+		rspamd_stat_learn_queue_flush (q);
+	}
+	else if (!q->timer_armed && q->ctx->ev_base != NULL) {
+		event_set (&q->flush_ev, -1, EV_TIMEOUT, rspamd_learn_queue_timer, q);
+		event_base_set (q->ctx->ev_base, &q->flush_ev);
+		double_to_tv (q->flush_interval, &tv);
+		event_add (&q->flush_ev, &tv);
+		q->timer_armed = TRUE;
+	}
+
+	return TRUE;
+}
+
+static struct rspamd_statfile *
+rspamd_learn_queue_find_statfile (struct rspamd_stat_learn_queue *q,
+		const gchar *symbol, gsize len)
+{
+	struct rspamd_statfile *st;
+	guint i;
+	gint id;
+
+	for (i = 0; i < q->cl->statfiles_ids->len; i ++) {
+		id = g_array_index (q->cl->statfiles_ids, gint, i);
+		st = g_ptr_array_index (q->ctx->statfiles, id);
+
+		if (strlen (st->stcf->symbol) == len &&
+				memcmp (st->stcf->symbol, symbol, len) == 0) {
+			return st;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_learn_journal_replay_file (struct rspamd_stat_learn_queue *q,
+		const gchar *path)
+{
+	struct rspamd_learn_journal_record rec;
+	struct rspamd_statfile *st;
+	struct stat sb;
+	struct rspamd_stat_learn_delta *deltas;
+	guchar *data = NULL, *p, *end;
+	gchar *dest;
+	guint nrecords = 0;
+	gint fd;
+	gboolean ret = TRUE;
+
+	fd = open (path, O_RDWR);
+
+	if (fd == -1) {
+		return;
+	}
+
+	/* Segment is either active or being replayed by another process */
+	if (!rspamd_file_lock (fd, TRUE)) {
+		close (fd);
+		return;
+	}
+
+	if (fstat (fd, &sb) == -1 || sb.st_nlink == 0) {
+		/* Already replayed and removed */
+		close (fd);
+		return;
+	}
+
+	if (sb.st_size > 0) {
+		data = g_malloc (sb.st_size);
+
+		if (read (fd, data, sb.st_size) != sb.st_size) {
+			msg_err_learn_queue ("cannot read journal %s: %s", path,
+					strerror (errno));
+			g_free (data);
+			close (fd);
+
+			return;
+		}
+	}
+
+	p = data;
+	end = data + sb.st_size;
+
+	while (p != NULL && end - p >= (gssize)sizeof (rec)) {
+		memcpy (&rec, p, sizeof (rec));
+
+		if (rec.magic != RSPAMD_LEARN_JOURNAL_MAGIC ||
+				(gsize)(end - p) < sizeof (rec) + rec.symlen + rec.destlen +
+				rec.ntokens * sizeof (*deltas)) {
+			msg_warn_learn_queue ("journal %s is truncated after %ud records",
+					path, nrecords);
+			break;
+		}
+
+		p += sizeof (rec);
+		st = rspamd_learn_queue_find_statfile (q, (const gchar *)p,
+				rec.symlen);
+		p += rec.symlen;
+		dest = g_malloc (rec.destlen + 1);
+		rspamd_strlcpy (dest, (const gchar *)p, rec.destlen + 1);
+		p += rec.destlen;
+		deltas = g_malloc (rec.ntokens * sizeof (*deltas) + 1);
+		memcpy (deltas, p, rec.ntokens * sizeof (*deltas));
+		p += rec.ntokens * sizeof (*deltas);
+
+		if (st != NULL) {
+			ret = rspamd_learn_queue_add (q, st, dest, rec.learns, deltas,
+					rec.ntokens, NULL);
+		}
+		else {
+			msg_warn_learn_queue ("skip learns of unknown statfile in journal %s",
+					path);
+		}
+
+		g_free (deltas);
+		g_free (dest);
+
+		if (!ret) {
+			/* Keep segment as learns could not be queued */
+			g_free (data);
+			close (fd);
+
+			return;
+		}
+
+		nrecords ++;
+	}
+
+	msg_info_learn_queue ("replayed %ud learn records from journal %s",
+			nrecords, path);
+	unlink (path);
+	close (fd);
+	g_free (data);
+}
+
+static void
+rspamd_learn_journal_replay (struct rspamd_stat_learn_queue *q)
+{
+	gchar *dir, *base, *path;
+	const gchar *name;
+	GDir *d;
+	gsize blen;
+
+	dir = g_path_get_dirname (q->journal_prefix);
+	base = g_path_get_basename (q->journal_prefix);
+	blen = strlen (base);
+	d = g_dir_open (dir, 0, NULL);
+
+	if (d != NULL) {
+		while ((name = g_dir_read_name (d)) != NULL) {
+			if (strncmp (name, base, blen) == 0 && name[blen] == '.') {
+				path = g_build_filename (dir, name, NULL);
+				rspamd_learn_journal_replay_file (q, path);
+				g_free (path);
+			}
+		}
+
+		g_dir_close (d);
+	}
+
+	g_free (dir);
+	g_free (base);
+}
+
+struct rspamd_stat_learn_queue *
+rspamd_stat_learn_queue_new (struct rspamd_stat_ctx *ctx,
+		struct rspamd_classifier *cl,
+		const ucl_object_t *obj)
+{
+	struct rspamd_stat_learn_queue *q;
+	const ucl_object_t *elt;
+	const gchar *durability;
+	struct rspamd_statfile *st;
+	guint i;
+	gint id;
+
+	if (cl->cfg->flags & RSPAMD_FLAG_CLASSIFIER_NO_BACKEND) {
+		msg_err_learn_queue ("classifier %s has no backend, learn queue "
+				"is disabled", cl->cfg->name);
+		return NULL;
+	}
+
+	for (i = 0; i < cl->statfiles_ids->len; i ++) {
+		id = g_array_index (cl->statfiles_ids, gint, i);
+		st = g_ptr_array_index (ctx->statfiles, id);
+
+		if (st->backend->learn_batch == NULL) {
+			msg_err_learn_queue ("backend %s does not support batched learns, "
+					"learn queue is disabled for %s", st->backend->name,
+					cl->cfg->name);
+			return NULL;
+		}
+	}
+
+	q = g_malloc0 (sizeof (*q));
+	q->ctx = ctx;
+	q->cl = cl;
+	q->max_tokens = RSPAMD_LEARN_QUEUE_MAX_TOKENS;
+	q->flush_interval = RSPAMD_LEARN_QUEUE_FLUSH_INTERVAL;
+	q->durability = RSPAMD_LEARN_QUEUE_MEMORY;
+
+	elt = ucl_object_lookup (obj, "max_tokens");
+	if (elt && ucl_object_toint (elt) > 0) {
+		q->max_tokens = ucl_object_toint (elt);
+	}
+
+	elt = ucl_object_lookup (obj, "flush_interval");
+	if (elt && ucl_object_todouble (elt) > 0) {
+		q->flush_interval = ucl_object_todouble (elt);
+	}
+
+	elt = ucl_object_lookup (obj, "durability");
+	if (elt) {
+		durability = ucl_object_tostring (elt);
+
+		if (durability == NULL || strcmp (durability, "memory") == 0) {
+			q->durability = RSPAMD_LEARN_QUEUE_MEMORY;
+		}
+		else if (strcmp (durability, "journal") == 0) {
+			q->durability = RSPAMD_LEARN_QUEUE_JOURNAL;
+		}
+		else if (strcmp (durability, "fsync") == 0) {
+			q->durability = RSPAMD_LEARN_QUEUE_FSYNC;
+		}
+		else {
+			msg_err_learn_queue ("invalid durability for %s: %s, "
+					"learn queue is disabled", cl->cfg->name, durability);
+			g_free (q);
+
+			return NULL;
+		}
+	}
+
+	if (q->durability != RSPAMD_LEARN_QUEUE_MEMORY) {
+		elt = ucl_object_lookup (obj, "journal");
+
+		if (elt == NULL || ucl_object_type (elt) != UCL_STRING) {
+			msg_err_learn_queue ("journal path is required for durable learn "
+					"queue of %s, learn queue is disabled", cl->cfg->name);
+			g_free (q);
+
+			return NULL;
+		}
+
+		q->journal_prefix = g_strdup (ucl_object_tostring (elt));
+	}
+
+	q->dests = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			g_free, rspamd_learn_queue_dest_free);
+
+	/* Tokens values are increments now regardless of backend */
+	cl->cfg->flags |= RSPAMD_FLAG_CLASSIFIER_INCREMENTING_BACKEND;
+
+	if (q->journal_prefix) {
+		rspamd_learn_journal_replay (q);
+	}
+
+	return q;
+}
+
+gboolean
+rspamd_stat_learn_queue_push (struct rspamd_stat_learn_queue *q,
+		struct rspamd_task *task,
+		struct rspamd_statfile *st,
+		gpointer runtime,
+		gint learns,
+		GError **err)
+{
+	struct rspamd_stat_learn_delta *deltas;
+	rspamd_token_t *tok;
+	const gchar *dest;
+	guint i, n = 0;
+	gboolean ret;
+
+	dest = st->backend->learn_destination (task, runtime, st->bkcf);
+
+	if (dest == NULL) {
+		g_set_error (err, rspamd_stat_quark (), 500, "cannot get learn "
+				"destination for %s", st->stcf->symbol);
+		return FALSE;
+	}
+
+	deltas = g_malloc (task->tokens->len * sizeof (*deltas) + 1);
+
+	for (i = 0; i < task->tokens->len; i ++) {
+		tok = g_ptr_array_index (task->tokens, i);
+
+		if (tok->values[st->id] != 0) {
+			deltas[n].token = tok->data;
+			deltas[n].value = tok->values[st->id];
+			n ++;
+		}
+	}
+
+	msg_debug_task ("queue %ud tokens for %s, destination: %s", n,
+			st->stcf->symbol, dest);
+	ret = rspamd_learn_queue_add (q, st, dest, learns, deltas, n, err);
+	g_free (deltas);
+
+	return ret;
+}
+
+gint64
+rspamd_stat_learn_queue_apply (struct rspamd_stat_learn_queue *q,
+		struct rspamd_task *task,
+		struct rspamd_statfile *st,
+		gpointer runtime)
+{
+	struct rspamd_learn_queue_dest *qd;
+	rspamd_token_t *tok;
+	const gchar *dest;
+	gchar *key;
+	khiter_t k;
+	guint i;
+
+	if (g_hash_table_size (q->dests) == 0) {
+		return 0;
+	}
+
+	dest = st->backend->learn_destination (task, runtime, st->bkcf);
+
+	if (dest == NULL) {
+		return 0;
+	}
+
+	key = g_strdup_printf ("%d:%s", st->id, dest);
+	qd = g_hash_table_lookup (q->dests, key);
+	g_free (key);
+
+	if (qd == NULL) {
+		return 0;
+	}
+
+	for (i = 0; i < task->tokens->len; i ++) {
+		tok = g_ptr_array_index (task->tokens, i);
+		k = kh_get (rspamd_learn_deltas, qd->deltas, tok->data);
+
+		if (k != kh_end (qd->deltas)) {
+			tok->values[st->id] = MAX (tok->values[st->id] +
+					kh_value (qd->deltas, k), 0);
+		}
+	}
+
+	return qd->learns;
+}
+
+static void
+rspamd_learn_queue_batch_fin (struct rspamd_stat_learn_batch *batch,
+		gboolean success)
+{
+	struct rspamd_learn_journal *j = batch->ud;
+
+	if (!success) {
+		msg_err_learn_queue ("cannot write %ud tokens to %s (%s)",
+				batch->tokens->len, batch->st->stcf->symbol, batch->dest);
+	}
+
+	if (j != NULL) {
+		if (!success) {
+			j->failed = TRUE;
+		}
+
+		j->pending --;
+
+		if (j->pending == 0 && j->detached) {
+			rspamd_learn_journal_release (j);
+		}
+	}
+
+	g_array_free (batch->tokens, TRUE);
+	g_free ((gchar *)batch->dest);
+	g_free (batch);
+}
+
+void
+rspamd_stat_learn_queue_flush (struct rspamd_stat_learn_queue *q)
+{
+	struct rspamd_learn_queue_dest *qd;
+	struct rspamd_stat_learn_batch *batch;
+	struct rspamd_stat_learn_delta delta;
+	struct rspamd_learn_journal *j;
+	GHashTableIter it;
+	gpointer k, v;
+	khiter_t kit;
+	guint ndests;
+
+	if (q->timer_armed) {
+		event_del (&q->flush_ev);
+		q->timer_armed = FALSE;
+	}
+
+	ndests = g_hash_table_size (q->dests);
+
+	if (ndests == 0) {
+		return;
+	}
+
+	/* New learns go to the next journal segment */
+	j = q->journal;
+	q->journal = NULL;
+
+	if (j != NULL) {
+		/* Prevents release while batches are being sent */
+		j->pending ++;
+	}
+
+	msg_debug_learn_queue ("flush %ud tokens of %ud destinations for %s",
+			q->ntokens, ndests, q->cl->cfg->name);
+	g_hash_table_iter_init (&it, q->dests);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		qd = v;
+		batch = g_malloc0 (sizeof (*batch));
+		batch->st = qd->st;
+		batch->dest = g_strdup (qd->dest);
+		batch->learns = qd->learns;
+		batch->tokens = g_array_sized_new (FALSE, FALSE, sizeof (delta),
+				kh_size (qd->deltas));
+		batch->fin = rspamd_learn_queue_batch_fin;
+		batch->ud = j;
+
+		for (kit = kh_begin (qd->deltas); kit != kh_end (qd->deltas); ++kit) {
+			if (kh_exist (qd->deltas, kit)) {
+				delta.token = kh_key (qd->deltas, kit);
+				delta.value = kh_value (qd->deltas, kit);
+
+				if (delta.value != 0) {
+					g_array_append_val (batch->tokens, delta);
+				}
+			}
+		}
+
+		if (j != NULL) {
+			j->pending ++;
+		}
+
+		if (!qd->st->backend->learn_batch (q->ctx, batch, qd->st->bkcf)) {
+			rspamd_learn_queue_batch_fin (batch, FALSE);
+		}
+	}
+
+	g_hash_table_remove_all (q->dests);
+	q->ntokens = 0;
+
+	if (j != NULL) {
+		j->detached = TRUE;
+		j->pending --;
+
+		if (j->pending == 0) {
+			rspamd_learn_journal_release (j);
+		}
+	}
+}
+
+void
+rspamd_stat_learn_queue_destroy (struct rspamd_stat_learn_queue *q)
+{
+	if (q) {
+		/* Unfinished asynchronous writes keep their journal segments */
+		rspamd_stat_learn_queue_flush (q);
+
+		if (q->journal) {
+			rspamd_learn_journal_release (q->journal);
+		}
+
+		g_hash_table_unref (q->dests);
+		g_free (q->journal_prefix);
+		g_free (q);
+	}
+}
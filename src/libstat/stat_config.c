@@ -65,6 +65,8 @@ static struct rspamd_stat_tokenizer stat_tokenizers[] = {
 		.dec_learns = rspamd_##eltn##_dec_learns, \
 		.get_stat = rspamd_##eltn##_get_stat, \
 		.load_tokenizer_config = rspamd_##eltn##_load_tokenizer_config, \
+		.learn_destination = rspamd_##eltn##_learn_destination, \
+		.learn_batch = rspamd_##eltn##_learn_batch, \
 		.close = rspamd_##eltn##_close \
 	}
 
@@ -87,6 +89,7 @@ static struct rspamd_stat_backend stat_backends[] = {
 
 static struct rspamd_stat_cache stat_caches[] = {
 		RSPAMD_STAT_CACHE_ELT(sqlite3, sqlite3),
+		RSPAMD_STAT_CACHE_ELT(memory, memory),
 #ifdef WITH_HIREDIS
 		RSPAMD_STAT_CACHE_ELT(redis, redis),
 #endif
@@ -101,7 +104,8 @@ rspamd_stat_init (struct rspamd_config *cfg, struct event_base *ev_base)
 	struct rspamd_stat_backend *bk;
 	struct rspamd_statfile *st;
 	struct rspamd_classifier *cl;
-	const ucl_object_t *cache_obj = NULL, *cache_name_obj;
+	const ucl_object_t *cache_obj = NULL, *cache_name_obj, *queue_obj, *elt;
+	ucl_object_t *queue_opts;
 	const gchar *cache_name = NULL;
 	lua_State *L = cfg->lua_state;
 	guint lua_classifiers_cnt = 0, i;
@@ -284,6 +288,34 @@ rspamd_stat_init (struct rspamd_config *cfg, struct event_base *ev_base)
 			curst = curst->next;
 		}
 
+		if (clf->opts && !(clf->flags & RSPAMD_FLAG_CLASSIFIER_NO_BACKEND)) {
+			queue_obj = ucl_object_lookup (clf->opts, "learn_queue");
+
+			if (queue_obj && ucl_object_type (queue_obj) == UCL_OBJECT) {
+				cl->learn_queue = rspamd_stat_learn_queue_new (stat_ctx, cl,
+						queue_obj);
+			}
+			else if ((elt = ucl_object_lookup (clf->opts, "write_behind"))
+					!= NULL && ucl_object_todouble (elt) > 0) {
+				/* Shortcut for learn queue kept in memory */
+				queue_opts = ucl_object_typed_new (UCL_OBJECT);
+				ucl_object_insert_key (queue_opts,
+						ucl_object_fromdouble (ucl_object_todouble (elt)),
+						"flush_interval", 0, false);
+				elt = ucl_object_lookup (clf->opts, "write_behind_tokens");
+
+				if (elt) {
+					ucl_object_insert_key (queue_opts,
+							ucl_object_fromint (ucl_object_toint (elt)),
+							"max_tokens", 0, false);
+				}
+
+				cl->learn_queue = rspamd_stat_learn_queue_new (stat_ctx, cl,
+						queue_opts);
+				ucl_object_unref (queue_opts);
+			}
+		}
+
 		g_ptr_array_add (stat_ctx->classifiers, cl);
 
 		cur = cur->next;
@@ -307,6 +339,9 @@ rspamd_stat_close (void)
 	for (i = 0; i < st_ctx->classifiers->len; i ++) {
 		cl = g_ptr_array_index (st_ctx->classifiers, i);
 
+		/* Write queued learns before backends are closed */
+		rspamd_stat_learn_queue_destroy (cl->learn_queue);
+
 		for (j = 0; j < cl->statfiles_ids->len; j ++) {
 			id = g_array_index (cl->statfiles_ids, gint, j);
 			st = g_ptr_array_index (st_ctx->statfiles, id);
@@ -31,6 +31,8 @@ struct rspamd_statfile_runtime {
 	guint64 total_hits;
 };
 
+struct rspamd_stat_learn_queue;
+
 /* Common classifier structure */
 struct rspamd_classifier {
 	struct rspamd_stat_ctx *ctx;
@@ -41,6 +43,7 @@ struct rspamd_classifier {
 	gulong ham_learns;
 	struct rspamd_classifier_config *cfg;
 	struct rspamd_stat_classifier *subrs;
+	struct rspamd_stat_learn_queue *learn_queue;
 };
 
 struct rspamd_statfile {
@@ -60,6 +63,54 @@ typedef struct token_node_s {
 	gdouble values[];
 } rspamd_token_t;
 
+/* Number of tokens located ahead of the one being resolved */
+#define RSPAMD_STAT_BATCH_SIZE 16
+/* Maximum number of storage locations per token */
+#define RSPAMD_STAT_MAX_LOCS 2
+
+/*
+ * Batched lookups for backends with random memory access: `locate` computes
+ * addresses where token can be stored (unused ones are left NULL), they are
+ * prefetched and then `resolve` is called for the token with its addresses
+ * RSPAMD_STAT_BATCH_SIZE tokens later, so memory loads overlap
+ */
+typedef void (*rspamd_stat_locate_func) (rspamd_token_t *tok,
+		gconstpointer *locs, gpointer ud);
+typedef gdouble (*rspamd_stat_resolve_func) (rspamd_token_t *tok,
+		gconstpointer *locs, gpointer ud);
+
+/*
+ * Bayes sums computed by backend instead of loading tokens values, stored
+ * in task pool variable RSPAMD_MEMPOOL_BAYES_AGGREGATES "_" classifier name
+ */
+struct rspamd_bayes_aggregates {
+	gdouble spam_prob;
+	gdouble ham_prob;
+	guint64 processed_tokens;
+	guint64 text_tokens;
+	guint64 total_hits;
+};
+
+/* Coalesced increment of a single token */
+struct rspamd_stat_learn_delta {
+	guint64 token;
+	gdouble value;
+};
+
+/*
+ * Learns of many messages merged by the learn queue for a single destination
+ * of a statfile. Backend must call `fin` exactly once if `learn_batch`
+ * returns TRUE, batch must not be used after that
+ */
+struct rspamd_stat_learn_batch {
+	struct rspamd_statfile *st;
+	const gchar *dest;          /**< backend specific, e.g. user or object	*/
+	GArray *tokens;             /**< struct rspamd_stat_learn_delta		*/
+	gint64 learns;              /**< learns increment, negative for unlearns */
+	void (*fin) (struct rspamd_stat_learn_batch *batch, gboolean success);
+	gpointer ud;
+};
+
 struct rspamd_stat_async_elt;
 
 typedef void (*rspamd_stat_async_handler)(struct rspamd_stat_async_elt *elt,
@@ -116,6 +167,75 @@ struct rspamd_stat_async_elt* rspamd_stat_ctx_register_async (
 		rspamd_stat_async_handler handler, rspamd_stat_async_cleanup cleanup,
 		gpointer d, gdouble timeout);
 
+/**
+ * Sets values[id] of all tokens using batched lookups
+ * @param tokens
+ * @param id
+ * @param locate
+ * @param resolve
+ * @param ud
+ */
+void rspamd_stat_lookup_tokens_batched (GPtrArray *tokens, gint id,
+		rspamd_stat_locate_func locate,
+		rspamd_stat_resolve_func resolve,
+		gpointer ud);
+
+/**
+ * Creates learn queue for a classifier from `learn_queue` options
+ * @param ctx
+ * @param cl
+ * @param obj
+ * @return queue or NULL if options are invalid
+ */
+struct rspamd_stat_learn_queue * rspamd_stat_learn_queue_new (
+		struct rspamd_stat_ctx *ctx,
+		struct rspamd_classifier *cl,
+		const ucl_object_t *obj);
+
+/**
+ * Adds tokens increments of the task to the queue instead of writing them
+ * to the backend
+ * @param q
+ * @param task
+ * @param st
+ * @param runtime backend runtime of the statfile
+ * @param learns learns increment
+ * @param err
+ * @return
+ */
+gboolean rspamd_stat_learn_queue_push (struct rspamd_stat_learn_queue *q,
+		struct rspamd_task *task,
+		struct rspamd_statfile *st,
+		gpointer runtime,
+		gint learns,
+		GError **err);
+
+/**
+ * Adds queued increments of the task destination to tokens values of the
+ * statfile, so classification sees learns that are not written yet
+ * @param q
+ * @param task
+ * @param st
+ * @param runtime backend runtime of the statfile
+ * @return queued learns increment of the destination
+ */
+gint64 rspamd_stat_learn_queue_apply (struct rspamd_stat_learn_queue *q,
+		struct rspamd_task *task,
+		struct rspamd_statfile *st,
+		gpointer runtime);
+
+/**
+ * Writes all queued learns to the backends
+ * @param q
+ */
+void rspamd_stat_learn_queue_flush (struct rspamd_stat_learn_queue *q);
+
+/**
+ * Flushes and destroys queue
+ * @param q
+ */
+void rspamd_stat_learn_queue_destroy (struct rspamd_stat_learn_queue *q);
+
 static GQuark rspamd_stat_quark (void)
 {
 	return g_quark_from_static_string ("rspamd-statistics");
@@ -429,6 +429,47 @@ rspamd_stat_preprocess (struct rspamd_stat_ctx *st_ctx,
 	}
 }
 
+void
+rspamd_stat_lookup_tokens_batched (GPtrArray *tokens, gint id,
+		rspamd_stat_locate_func locate,
+		rspamd_stat_resolve_func resolve,
+		gpointer ud)
+{
+	gconstpointer locs[RSPAMD_STAT_BATCH_SIZE][RSPAMD_STAT_MAX_LOCS];
+	rspamd_token_t *tok;
+	guint i, j, slot, ahead;
+
+	ahead = MIN (tokens->len, RSPAMD_STAT_BATCH_SIZE);
+
+	for (i = 0; i < ahead; i ++) {
+		tok = g_ptr_array_index (tokens, i);
+		memset (locs[i], 0, sizeof (locs[i]));
+		locate (tok, locs[i], ud);
+
+		for (j = 0; j < RSPAMD_STAT_MAX_LOCS && locs[i][j] != NULL; j ++) {
+			RSPAMD_PREFETCH (locs[i][j]);
+		}
+	}
+
+	for (i = 0; i < tokens->len; i ++) {
+		slot = i % RSPAMD_STAT_BATCH_SIZE;
+		tok = g_ptr_array_index (tokens, i);
+		tok->values[id] = resolve (tok, locs[slot], ud);
+
+		/* Reuse slot for the token RSPAMD_STAT_BATCH_SIZE positions ahead */
+		if (i + RSPAMD_STAT_BATCH_SIZE < tokens->len) {
+			tok = g_ptr_array_index (tokens, i + RSPAMD_STAT_BATCH_SIZE);
+			memset (locs[slot], 0, sizeof (locs[slot]));
+			locate (tok, locs[slot], ud);
+
+			for (j = 0; j < RSPAMD_STAT_MAX_LOCS && locs[slot][j] != NULL;
+					j ++) {
+				RSPAMD_PREFETCH (locs[slot][j]);
+			}
+		}
+	}
+}
+
 static void
 rspamd_stat_backends_process (struct rspamd_stat_ctx *st_ctx,
 		struct rspamd_task *task)
@@ -491,6 +532,7 @@ rspamd_stat_classifiers_process (struct rspamd_stat_ctx *st_ctx,
 	struct rspamd_classifier *cl;
 	struct rspamd_statfile *st;
 	gpointer bk_run;
+	gint64 learns;
 	gboolean skip;
 
 	if (st_ctx->classifiers->len == 0) {
@@ -523,15 +565,19 @@ rspamd_stat_classifiers_process (struct rspamd_stat_ctx *st_ctx,
 		g_assert (st != NULL);
 
 		if (bk_run != NULL) {
+			learns = st->backend->total_learns (task, bk_run, st_ctx);
+
+			if (cl->learn_queue) {
+				/* Learns that are not written yet */
+				learns = MAX (learns + rspamd_stat_learn_queue_apply (
+						cl->learn_queue, task, st, bk_run), 0);
+			}
+
 			if (st->stcf->is_spam) {
-				cl->spam_learns += st->backend->total_learns (task,
-						bk_run,
-						st_ctx);
+				cl->spam_learns += learns;
 			}
 			else {
-				cl->ham_learns += st->backend->total_learns (task,
-						bk_run,
-						st_ctx);
+				cl->ham_learns += learns;
 			}
 		}
 	}
@@ -849,7 +895,7 @@ rspamd_stat_backends_learn (struct rspamd_stat_ctx *st_ctx,
 	struct rspamd_statfile *st;
 	gpointer bk_run;
 	guint i, j;
-	gint id;
+	gint id, learns;
 	gboolean res = FALSE;
 
 	for (i = 0; i < st_ctx->classifiers->len; i ++) {
@@ -887,6 +933,25 @@ rspamd_stat_backends_learn (struct rspamd_stat_ctx *st_ctx,
 				}
 			}
 
+			if (cl->learn_queue) {
+				/* Tokens are written later by the queue */
+				if (!!spam == !!st->stcf->is_spam) {
+					learns = 1;
+				}
+				else {
+					learns = -1;
+				}
+
+				if (!rspamd_stat_learn_queue_push (cl->learn_queue, task, st,
+						bk_run, learns, err)) {
+					res = FALSE;
+					goto end;
+				}
+
+				res = TRUE;
+				continue;
+			}
+
 			if (!st->backend->learn_tokens (task, task->tokens, id, bk_run)) {
 				if (err && *err == NULL) {
 					g_set_error (err, rspamd_stat_quark (), 500, "Cannot push "
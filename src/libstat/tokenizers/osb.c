@@ -252,11 +252,33 @@ rspamd_tokenizer_osb_is_compat (struct rspamd_tokenizer_runtime *rt)
 }
 #endif
 
-struct token_pipe_entry {
-	guint64 h;
-	rspamd_stat_token_t *t;
-};
+/*
+ * Sets data of a pair token the same way as the sequential hashpipe did
+ */
+static inline void
+rspamd_tokenizer_osb_pair (struct rspamd_osb_tokenizer_config *osb_cf,
+		rspamd_token_t *tok, guint64 h0, guint64 hi, guint i)
+{
+	guint32 h1, h2;
+
+	if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) {
+		h1 = ((guint32)h0) * primes[0] + ((guint32)hi) * primes[i << 1];
+		h2 = ((guint32)h0) * primes[1] + ((guint32)hi) * primes[(i << 1) - 1];
+		memcpy ((guchar *)&tok->data, &h1, sizeof (h1));
+		memcpy (((guchar *)&tok->data) + sizeof (h1), &h2, sizeof (h2));
+	}
+	else {
+		tok->data = h0 * primes[0] + hi * primes[i << 1];
+	}
+
+	tok->window_idx = i + 1;
+}
 
+/*
+ * Words are hashed in a single pass first, then all tokens are allocated as
+ * one block and pairs are generated by indexing hashes of non unigram words,
+ * so no hashpipe is shifted and no token is allocated separately
+ */
 gint
 rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		rspamd_mempool_t *pool,
@@ -265,19 +287,25 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		const gchar *prefix,
 		GPtrArray *result)
 {
-	rspamd_token_t *new_tok = NULL;
-	rspamd_stat_token_t *token;
+	rspamd_token_t *new_tok;
+	rspamd_stat_token_t *token, *t1;
 	struct rspamd_osb_tokenizer_config *osb_cf;
-	guint64 cur, seed;
-	struct token_pipe_entry *hashpipe;
-	guint32 h1, h2;
+	guint64 seed, *hashes, h0;
+	guint32 *seq;
+	guchar *tokens_buf;
 	gsize token_size;
-	guint processed = 0, i, w, window_size, token_flags = 0;
+	guint i, w, k, last, window_size, nseq = 0, ntokens = 0, nout = 0,
+		last_flags, base;
+	rspamd_ftok_t ftok;
 
 	if (words == NULL) {
 		return FALSE;
 	}
 
+	if (words->len == 0) {
+		return TRUE;
+	}
+
 	osb_cf = ctx->tkcf;
 	window_size = osb_cf->window_size;
 
@@ -289,108 +317,134 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		seed = osb_cf->seed;
 	}
 
-	hashpipe = g_alloca (window_size * sizeof (hashpipe[0]));
-	for (i = 0; i < window_size; i++) {
-		hashpipe[i].h = 0xfe;
-		hashpipe[i].t = NULL;
-	}
+	hashes = g_malloc (words->len * (sizeof (*hashes) + sizeof (*seq)));
+	seq = (guint32 *)(hashes + words->len);
 
-	token_size = sizeof (rspamd_token_t) +
-			sizeof (gdouble) * ctx->statfiles->len;
-	g_assert (token_size > 0);
+	/* Hash all words, hash type is checked once per message */
+	switch (osb_cf->ht) {
+	case RSPAMD_OSB_HASH_COMPAT:
+		for (w = 0; w < words->len; w ++) {
+			token = &g_array_index (words, rspamd_stat_token_t, w);
+			ftok.begin = token->begin;
+			ftok.len = token->len;
+			hashes[w] = rspamd_fstrhash_lc (&ftok, is_utf);
+		}
+		break;
+	case RSPAMD_OSB_HASH_XXHASH:
+		/* We know that the words are normalized */
+		for (w = 0; w < words->len; w ++) {
+			token = &g_array_index (words, rspamd_stat_token_t, w);
+			hashes[w] = rspamd_cryptobox_fast_hash_specific (
+					RSPAMD_CRYPTOBOX_XXHASH64,
+					token->begin, token->len, osb_cf->seed);
+		}
+		break;
+	default:
+		for (w = 0; w < words->len; w ++) {
+			token = &g_array_index (words, rspamd_stat_token_t, w);
+			rspamd_cryptobox_siphash ((guchar *)&hashes[w], token->begin,
+					token->len, osb_cf->sk);
+
+			if (prefix) {
+				hashes[w] ^= seed;
+			}
+		}
+		break;
+	}
 
+	/* Unigrams are not included in pairs */
 	for (w = 0; w < words->len; w ++) {
 		token = &g_array_index (words, rspamd_stat_token_t, w);
-		token_flags = token->flags;
-
-		if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) {
-			rspamd_ftok_t ftok;
 
-			ftok.begin = token->begin;
-			ftok.len = token->len;
-			cur = rspamd_fstrhash_lc (&ftok, is_utf);
+		if (token->flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
+			ntokens ++;
 		}
 		else {
-			/* We know that the words are normalized */
-			if (osb_cf->ht == RSPAMD_OSB_HASH_XXHASH) {
-				cur = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
-						token->begin, token->len, osb_cf->seed);
-			}
-			else {
-				rspamd_cryptobox_siphash ((guchar *)&cur, token->begin,
-						token->len, osb_cf->sk);
+			seq[nseq ++] = w;
+		}
+	}
 
-				if (prefix) {
-					cur ^= seed;
-				}
-			}
+	if (nseq > window_size) {
+		if (window_size > 1) {
+			ntokens += (nseq - window_size) * (window_size - 1);
 		}
+	}
+	else if (nseq > 1) {
+		ntokens += nseq - 2;
+	}
+
+	if (ntokens == 0) {
+		g_free (hashes);
 
-		if (token_flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
-			new_tok = rspamd_mempool_alloc0 (pool, token_size);
-			new_tok->flags = token_flags;
+		return TRUE;
+	}
+
+	token_size = sizeof (rspamd_token_t) +
+			sizeof (gdouble) * ctx->statfiles->len;
+	tokens_buf = rspamd_mempool_alloc0 (pool, token_size * ntokens);
+	base = result->len;
+	g_ptr_array_set_size (result, base + ntokens);
+
+#define NEXT_TOKEN() (rspamd_token_t *)(tokens_buf + token_size * nout)
+
+	for (w = 0, k = 0; w < words->len; w ++) {
+		token = &g_array_index (words, rspamd_stat_token_t, w);
+
+		if (token->flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
+			new_tok = NEXT_TOKEN ();
+			new_tok->flags = token->flags;
 			new_tok->t1 = token;
 			new_tok->t2 = token;
-			new_tok->data = cur;
+			new_tok->data = hashes[w];
 			new_tok->window_idx = 0;
-			g_ptr_array_add (result, new_tok);
+			g_ptr_array_index (result, base + nout ++) = new_tok;
 
 			continue;
 		}
 
-#define ADD_TOKEN do {\
-    new_tok = rspamd_mempool_alloc0 (pool, token_size); \
-    new_tok->flags = token_flags; \
-    new_tok->t1 = hashpipe[0].t; \
-    new_tok->t2 = hashpipe[i].t; \
-    if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) { \
-        h1 = ((guint32)hashpipe[0].h) * primes[0] + \
-            ((guint32)hashpipe[i].h) * primes[i << 1]; \
-        h2 = ((guint32)hashpipe[0].h) * primes[1] + \
-            ((guint32)hashpipe[i].h) * primes[(i << 1) - 1]; \
-        memcpy((guchar *)&new_tok->data, &h1, sizeof (h1)); \
-        memcpy(((guchar *)&new_tok->data) + sizeof (h1), &h2, sizeof (h2)); \
-    } \
-    else { \
-        new_tok->data = hashpipe[0].h * primes[0] + hashpipe[i].h * primes[i << 1]; \
-    } \
-    new_tok->window_idx = i + 1; \
-    g_ptr_array_add (result, new_tok); \
-  } while(0)
-
-		if (processed < window_size) {
-			/* Just fill a hashpipe */
-			++processed;
-			hashpipe[window_size - processed].h = cur;
-			hashpipe[window_size - processed].t = token;
-		}
-		else {
-			/* Shift hashpipe */
-			for (i = window_size - 1; i > 0; i--) {
-				hashpipe[i] = hashpipe[i - 1];
-			}
-			hashpipe[0].h = cur;
-			hashpipe[0].t = token;
-
-			processed++;
-
-			for (i = 1; i < window_size; i++) {
-				ADD_TOKEN;
+		/* Pairs are emitted only when the window is full */
+		if (k >= window_size) {
+			h0 = hashes[w];
+
+			for (i = 1; i < window_size; i ++) {
+				new_tok = NEXT_TOKEN ();
+				new_tok->flags = token->flags;
+				new_tok->t1 = token;
+				new_tok->t2 = &g_array_index (words, rspamd_stat_token_t,
+						seq[k - i]);
+				rspamd_tokenizer_osb_pair (osb_cf, new_tok, h0,
+						hashes[seq[k - i]], i);
+				g_ptr_array_index (result, base + nout ++) = new_tok;
 			}
 		}
-	}
 
-	if (processed > 1 && processed <= window_size) {
-		processed --;
-		memmove (hashpipe, &hashpipe[window_size - processed],
-				processed * sizeof (hashpipe[0]));
+		k ++;
+	}
 
-		for (i = 1; i < processed; i++) {
-			ADD_TOKEN;
+	if (nseq > 1 && nseq <= window_size) {
+		/* Short text: pairs of the word before the last one */
+		last = nseq - 2;
+		last_flags = g_array_index (words, rspamd_stat_token_t,
+				words->len - 1).flags;
+		t1 = &g_array_index (words, rspamd_stat_token_t, seq[last]);
+		h0 = hashes[seq[last]];
+
+		for (i = 1; i <= last; i ++) {
+			new_tok = NEXT_TOKEN ();
+			new_tok->flags = last_flags;
+			new_tok->t1 = t1;
+			new_tok->t2 = &g_array_index (words, rspamd_stat_token_t,
+					seq[last - i]);
+			rspamd_tokenizer_osb_pair (osb_cf, new_tok, h0,
+					hashes[seq[last - i]], i);
+			g_ptr_array_index (result, base + nout ++) = new_tok;
 		}
 	}
 
-#undef ADD_TOKEN
+#undef NEXT_TOKEN
+
+	g_assert (nout == ntokens);
+	g_free (hashes);
 
 	return TRUE;
 }
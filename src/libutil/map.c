@@ -22,6 +22,7 @@
 #include "http.h"
 #include "http_private.h"
 #include "rspamd.h"
+#include "multipattern.h"
 #include "contrib/zstd/zstd.h"
 
 #ifdef WITH_HYPERSCAN
@@ -50,12 +51,22 @@
 #endif
 
 static const gchar *hash_fill = "1";
+/* Minimum number of prefixes to build radix lookup tables */
+#define MAP_RADIX_COMPILE_MIN_SIZE 1024
+/* Files larger than this are parsed by threads in chunks */
+#define MAP_PARALLEL_MIN_SIZE (16 * 1024 * 1024)
+#define MAP_PARALLEL_CHUNK_SIZE (4 * 1024 * 1024)
+#define MAP_PARALLEL_MAX_THREADS 8
 static void free_http_cbdata_common (struct http_callback_data *cbd, gboolean plan_new);
 static void free_http_cbdata_dtor (gpointer p);
 static void free_http_cbdata (struct http_callback_data *cbd);
 static void rspamd_map_periodic_callback (gint fd, short what, void *ud);
 static void rspamd_map_schedule_periodic (struct rspamd_map *map, gboolean locked,
 		gboolean initial, gboolean errored);
+static gboolean rspamd_map_publish_compiled (struct rspamd_map *map,
+		gpointer data, time_t modified);
+static gboolean rspamd_map_publish_buffer (struct rspamd_map *map,
+		guchar *out, gsize len, time_t modified);
 
 struct rspamd_http_map_cached_cbdata {
 	struct event timeout;
@@ -66,6 +77,27 @@ struct rspamd_http_map_cached_cbdata {
 	time_t last_checked;
 };
 
+/*
+ * Deltas are applied to the current data and published for other processes
+ * as compiled data only
+ */
+static gboolean
+rspamd_map_can_delta (struct rspamd_map *map)
+{
+	return map->delta_callback && map->compile_callback &&
+			map->backends->len == 1 && *map->user_data != NULL &&
+			g_atomic_int_get (&map->cache->available);
+}
+
+static void
+rspamd_map_reset_version (struct http_map_data *data)
+{
+	if (data->version) {
+		rspamd_fstring_free (data->version);
+		data->version = NULL;
+	}
+}
+
 /**
  * Write HTTP request
  */
@@ -111,6 +143,10 @@ write_http_request (struct http_callback_data *cbd)
 							cbd->data->etag->str, cbd->data->etag->len);
 				}
 			}
+			else if (cbd->data->version && rspamd_map_can_delta (map)) {
+				rspamd_http_message_add_header_len (msg, "Map-Version",
+						cbd->data->version->str, cbd->data->version->len);
+			}
 		}
 		else if (cbd->stage == map_load_pubkey) {
 			msg->url = rspamd_fstring_append (msg->url,
@@ -398,31 +434,45 @@ rspamd_http_check_signature (struct rspamd_map *map,
 		struct rspamd_http_message *msg)
 {
 	const rspamd_ftok_t *sig_hdr;
-	guchar *in;
-	size_t dlen;
+	const guchar *sig;
+	guchar *in, *decoded = NULL;
+	size_t dlen, siglen;
+	gboolean ret;
 
 	sig_hdr = rspamd_http_message_find_header (msg, "Signature");
 
 	if (sig_hdr && cbd->pk) {
+		sig = sig_hdr->begin;
+		siglen = sig_hdr->len;
+
+		/* Raw signature can contain line breaks, so hex encoding is allowed */
+		if (siglen == rspamd_cryptobox_signature_bytes (
+				RSPAMD_CRYPTOBOX_MODE_25519) * 2) {
+			decoded = rspamd_decode_hex (sig_hdr->begin, sig_hdr->len);
+
+			if (decoded) {
+				sig = decoded;
+				siglen /= 2;
+			}
+		}
+
 		in = rspamd_shmem_xmap (cbd->shmem_data->shm_name, PROT_READ, &dlen);
 
 		if (in == NULL) {
 			msg_err_map ("cannot read tempfile %s: %s",
 					cbd->shmem_data->shm_name,
 					strerror (errno));
-			return FALSE;
-		}
+			g_free (decoded);
 
-		if (!rspamd_map_check_sig_pk_mem (sig_hdr->begin, sig_hdr->len,
-				map, in,
-				cbd->data_len, cbd->pk)) {
-			munmap (in, dlen);
 			return FALSE;
 		}
 
+		ret = rspamd_map_check_sig_pk_mem (sig, siglen, map, in,
+				cbd->data_len, cbd->pk);
 		munmap (in, dlen);
+		g_free (decoded);
 
-		return TRUE;
+		return ret;
 	}
 
 	return FALSE;
@@ -437,7 +487,8 @@ http_map_finish (struct rspamd_http_connection *conn,
 	struct rspamd_map_backend *bk;
 	struct rspamd_http_map_cached_cbdata *cache_cbd;
 	struct timeval tv;
-	const rspamd_ftok_t *expires_hdr, *etag_hdr;
+	const rspamd_ftok_t *expires_hdr, *etag_hdr, *version_hdr;
+	map_cb_t read_cb;
 	char next_check_date[128];
 	guchar *aux_data, *in = NULL;
 	gsize inlen = 0, dlen = 0;
@@ -461,10 +512,27 @@ http_map_finish (struct rspamd_http_connection *conn,
 			cbd->data->last_checked = msg->date;
 
 			if (msg->last_modified) {
-				cbd->data->last_modified = msg->last_modified;
+				cbd->last_modified = msg->last_modified;
 			}
 			else {
-				cbd->data->last_modified = msg->date;
+				cbd->last_modified = msg->date;
+			}
+
+			version_hdr = rspamd_http_message_find_header (msg, "Map-Delta");
+
+			if (version_hdr) {
+				/* Delta must be based on the version we have */
+				if (cbd->data->version == NULL || !rspamd_map_can_delta (map) ||
+						version_hdr->len != cbd->data->version->len ||
+						memcmp (version_hdr->begin, cbd->data->version->str,
+								version_hdr->len) != 0) {
+					msg_err_map ("%s: unexpected delta for version %T",
+							bk->uri, version_hdr);
+					rspamd_map_reset_version (cbd->data);
+					goto err;
+				}
+
+				cbd->delta = TRUE;
 			}
 
 			/* Maybe we need to check signature ? */
@@ -494,6 +562,13 @@ http_map_finish (struct rspamd_http_connection *conn,
 					}
 				}
 
+				if (cbd->delta) {
+					/* Signature files are for the full map only */
+					msg_err_map ("%s: delta is not signed in headers", bk->uri);
+					rspamd_map_reset_version (cbd->data);
+					goto err;
+				}
+
 				rspamd_http_connection_reset (cbd->conn);
 				write_http_request (cbd);
 				MAP_RELEASE (cbd, "http_callback_data");
@@ -651,29 +726,47 @@ read_data:
 			}
 		}
 
+		rspamd_map_reset_version (cbd->data);
+		version_hdr = rspamd_http_message_find_header (msg, "Map-Version");
+
+		if (version_hdr) {
+			cbd->data->version = rspamd_fstring_new_init (version_hdr->begin,
+					version_hdr->len);
+		}
+
 		MAP_RETAIN (cbd->shmem_data, "shmem_data");
-		cbd->data->gen ++;
-		/*
-		 * We know that a map is in the locked state
-		 */
-		g_atomic_int_set (&map->cache->available, 1);
-		/* Store cached data */
-		rspamd_strlcpy (map->cache->shmem_name, cbd->shmem_data->shm_name,
-				sizeof (map->cache->shmem_name));
-		map->cache->len = cbd->data_len;
-		map->cache->last_modified = cbd->data->last_modified;
-		cache_cbd = g_malloc0 (sizeof (*cache_cbd));
-		cache_cbd->shm = cbd->shmem_data;
-		cache_cbd->map = map;
-		cache_cbd->data = cbd->data;
-		cache_cbd->last_checked = cbd->data->last_checked;
-		cache_cbd->gen = cbd->data->gen;
-		MAP_RETAIN (cache_cbd->shm, "shmem_data");
-
-		event_set (&cache_cbd->timeout, -1, EV_TIMEOUT, rspamd_map_cache_cb,
-				cache_cbd);
-		event_base_set (cbd->ev_base, &cache_cbd->timeout);
-		event_add (&cache_cbd->timeout, &tv);
+
+		if (cbd->delta) {
+			/* Cache is updated when the result is compiled */
+			cbd->periodic->delta_modified = cbd->last_modified;
+			read_cb = map->delta_callback;
+		}
+		else {
+			cbd->data->gen ++;
+			/*
+			 * We know that a map is in the locked state
+			 */
+			g_atomic_int_set (&map->cache->available, 1);
+			/* Store cached data */
+			rspamd_strlcpy (map->cache->shmem_name, cbd->shmem_data->shm_name,
+					sizeof (map->cache->shmem_name));
+			map->cache->len = cbd->data_len;
+			map->cache->last_modified = cbd->last_modified;
+			map->cache->shmem_modified = cbd->last_modified;
+			cache_cbd = g_malloc0 (sizeof (*cache_cbd));
+			cache_cbd->shm = cbd->shmem_data;
+			cache_cbd->map = map;
+			cache_cbd->data = cbd->data;
+			cache_cbd->last_checked = cbd->data->last_checked;
+			cache_cbd->gen = cbd->data->gen;
+			MAP_RETAIN (cache_cbd->shm, "shmem_data");
+
+			event_set (&cache_cbd->timeout, -1, EV_TIMEOUT, rspamd_map_cache_cb,
+					cache_cbd);
+			event_base_set (cbd->ev_base, &cache_cbd->timeout);
+			event_add (&cache_cbd->timeout, &tv);
+			read_cb = map->read_callback;
+		}
 
 		if (map->next_check) {
 			rspamd_http_date_format (next_check_date, sizeof (next_check_date),
@@ -732,22 +825,29 @@ read_data:
 			}
 
 			ZSTD_freeDStream (zstream);
-			msg_info_map ("%s(%s): read map data %z bytes compressed, "
+			msg_info_map ("%s(%s): read map %s %z bytes compressed, "
 					"%z uncompressed, next check at %s",
 					cbd->bk->uri,
 					rspamd_inet_address_to_string_pretty (cbd->addr),
+					cbd->delta ? "delta" : "data",
 					dlen, zout.pos, next_check_date);
-			map->read_callback (out, zout.pos, &cbd->periodic->cbdata, TRUE);
+			read_cb (out, zout.pos, &cbd->periodic->cbdata, TRUE);
 			g_free (out);
 		}
 		else {
-			msg_info_map ("%s(%s): read map data %z bytes, next check at %s",
+			msg_info_map ("%s(%s): read map %s %z bytes, next check at %s",
 					cbd->bk->uri,
 					rspamd_inet_address_to_string_pretty (cbd->addr),
+					cbd->delta ? "delta" : "data",
 					dlen, next_check_date);
-			map->read_callback (in, cbd->data_len, &cbd->periodic->cbdata, TRUE);
+			read_cb (in, cbd->data_len, &cbd->periodic->cbdata, TRUE);
 		}
 
+		/*
+		 * Body is accepted, so it is the version we have now: rejected deltas
+		 * and bad signatures must not make the next request conditional
+		 */
+		cbd->data->last_modified = cbd->last_modified;
 		MAP_RELEASE (cbd->shmem_data, "shmem_data");
 
 		cbd->periodic->cur_backend ++;
@@ -823,6 +923,348 @@ err:
 	return 0;
 }
 
+struct rspamd_map_parse_chunk {
+	gchar *begin;
+	gsize len;
+	struct map_cb_data cbdata;
+};
+
+struct rspamd_map_parse_job {
+	struct rspamd_map *map;
+	struct map_periodic_cbdata *periodic;
+	guchar *bytes;
+	gsize len;
+	struct rspamd_map_parse_chunk *chunks;
+	guint nchunks;
+	pthread_t *threads;
+	guint nthreads;
+	/* Work is taken by threads in order of chunks and then of shards */
+	gint next_chunk;
+	gint next_shard;
+	guint parsed;
+	guint merged;
+	GMutex mtx;
+	GCond cond;
+	gint fds[2];
+	struct event ev;
+	gdouble start;
+};
+
+guint
+rspamd_map_split_lines (const gchar *data, gsize len, guint nchunks,
+		gsize *ends)
+{
+	const gchar *p = data, *end = data + len, *nl;
+	guint i;
+
+	for (i = 0; i < nchunks && p < end; i ++) {
+		if (i == nchunks - 1) {
+			p = end;
+		}
+		else {
+			p = p + len / nchunks;
+
+			if (p >= end || (nl = memchr (p, '\n', end - p)) == NULL) {
+				p = end;
+			}
+			else {
+				p = nl + 1;
+			}
+		}
+
+		ends[i] = p - data;
+	}
+
+	return i;
+}
+
+/*
+ * Threads parse chunks to structures with keys split to one shard per chunk.
+ * When all chunks are parsed, each shard is merged by one thread to the
+ * structure of the first chunk, and the last thread notifies the event loop
+ */
+static gpointer
+rspamd_map_parse_thread (gpointer ud)
+{
+	struct rspamd_map_parse_job *job = ud;
+	struct rspamd_map_parse_chunk *chunk;
+	struct rspamd_map *map = job->map;
+	gpointer dst;
+	gint i, shard;
+	gboolean last;
+
+	while ((i = g_atomic_int_add (&job->next_chunk, 1)) < (gint)job->nchunks) {
+		chunk = &job->chunks[i];
+		map->read_callback (chunk->begin, chunk->len, &chunk->cbdata, TRUE);
+
+		g_mutex_lock (&job->mtx);
+
+		if (++ job->parsed == job->nchunks) {
+			g_cond_broadcast (&job->cond);
+		}
+
+		g_mutex_unlock (&job->mtx);
+	}
+
+	g_mutex_lock (&job->mtx);
+
+	while (job->parsed < job->nchunks) {
+		g_cond_wait (&job->cond, &job->mtx);
+	}
+
+	g_mutex_unlock (&job->mtx);
+
+	while ((shard = g_atomic_int_add (&job->next_shard, 1)) <
+			(gint)job->nchunks) {
+		dst = job->chunks[0].cbdata.cur_data;
+
+		for (i = 1; i < (gint)job->nchunks; i ++) {
+			if (job->chunks[i].cbdata.cur_data) {
+				map->merge_callback (dst, job->chunks[i].cbdata.cur_data,
+						shard);
+			}
+		}
+
+		g_mutex_lock (&job->mtx);
+		last = ++ job->merged == job->nchunks;
+		g_mutex_unlock (&job->mtx);
+
+		if (last && write (job->fds[1], "1", 1) == -1) {
+			/* Event loop would wait forever and we cannot log from a thread */
+			abort ();
+		}
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_map_parse_job_free (struct rspamd_map_parse_job *job)
+{
+	struct rspamd_map *map = job->map;
+	guint i;
+
+	if (job->periodic) {
+		event_del (&job->ev);
+	}
+
+	for (i = 0; i < job->nthreads; i ++) {
+		pthread_join (job->threads[i], NULL);
+	}
+
+	/* Structures of chunks that are not taken are destroyed as old data */
+	for (i = 0; i < job->nchunks; i ++) {
+		if (job->chunks[i].cbdata.cur_data) {
+			job->chunks[i].cbdata.prev_data = job->chunks[i].cbdata.cur_data;
+			job->chunks[i].cbdata.cur_data = NULL;
+			map->fin_callback (&job->chunks[i].cbdata);
+		}
+	}
+
+	g_mutex_clear (&job->mtx);
+	g_cond_clear (&job->cond);
+	close (job->fds[0]);
+	close (job->fds[1]);
+	g_free (job->threads);
+	g_free (job->chunks);
+	g_free (job);
+}
+
+/* Returns NULL if no threads can be started */
+static struct rspamd_map_parse_job *
+rspamd_map_parse_job_start (struct rspamd_map *map, guchar *bytes, gsize len,
+		guint nchunks)
+{
+	struct rspamd_map_parse_job *job;
+	struct rspamd_map_parse_chunk *chunk;
+	gsize *ends;
+	guint i;
+	gint r = 0;
+
+	job = g_malloc0 (sizeof (*job));
+
+	if (pipe (job->fds) == -1) {
+		msg_err_map ("cannot create pipe: %s", strerror (errno));
+		g_free (job);
+
+		return NULL;
+	}
+
+	rspamd_socket_nonblocking (job->fds[0]);
+	g_mutex_init (&job->mtx);
+	g_cond_init (&job->cond);
+	job->map = map;
+	job->bytes = bytes;
+	job->len = len;
+	job->start = rspamd_get_ticks (FALSE);
+
+	ends = g_new (gsize, nchunks);
+	job->nchunks = rspamd_map_split_lines ((const gchar *)bytes, len,
+			nchunks, ends);
+	job->chunks = g_new0 (struct rspamd_map_parse_chunk, job->nchunks);
+
+	for (i = 0; i < job->nchunks; i ++) {
+		chunk = &job->chunks[i];
+		chunk->begin = (gchar *)bytes + (i > 0 ? ends[i - 1] : 0);
+		chunk->len = ends[i] - (chunk->begin - (gchar *)bytes);
+		chunk->cbdata.map = map;
+		chunk->cbdata.nshards = job->nchunks;
+	}
+
+	g_free (ends);
+
+	/* Threads take chunks from the job, so any of them can parse all data */
+	job->threads = g_new (pthread_t, job->nchunks);
+
+	for (i = 0; i < job->nchunks; i ++) {
+		r = pthread_create (&job->threads[job->nthreads], NULL,
+				rspamd_map_parse_thread, job);
+
+		if (r != 0) {
+			break;
+		}
+
+		job->nthreads ++;
+	}
+
+	if (job->nthreads == 0) {
+		msg_err_map ("cannot start parsing threads: %s", strerror (r));
+		rspamd_map_parse_job_free (job);
+
+		return NULL;
+	}
+
+	return job;
+}
+
+gpointer
+rspamd_map_parse_threaded (struct rspamd_map *map, gchar *data, gsize len,
+		guint nchunks)
+{
+	struct rspamd_map_parse_job *job;
+	gpointer res;
+	guint i;
+
+	job = rspamd_map_parse_job_start (map, (guchar *)data, len, nchunks);
+
+	if (job == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < job->nthreads; i ++) {
+		pthread_join (job->threads[i], NULL);
+	}
+
+	job->nthreads = 0;
+	res = job->chunks[0].cbdata.cur_data;
+	job->chunks[0].cbdata.cur_data = NULL;
+	rspamd_map_parse_job_free (job);
+
+	return res;
+}
+
+static void
+rspamd_map_parse_job_dtor (gpointer p)
+{
+	struct rspamd_map_parse_job *job = p;
+	struct map_periodic_cbdata *periodic = job->periodic;
+	guchar *bytes = job->bytes;
+	gsize len = job->len;
+
+	/* Map is destroyed, so wait for threads and drop the result */
+	job->map->dtor = NULL;
+	job->map->dtor_data = NULL;
+	rspamd_map_parse_job_free (job);
+	munmap (bytes, len);
+	MAP_RELEASE (periodic, "periodic");
+}
+
+static void
+rspamd_map_parse_job_cb (gint fd, short what, gpointer ud)
+{
+	struct rspamd_map_parse_job *job = ud;
+	struct map_periodic_cbdata *periodic = job->periodic;
+	struct rspamd_map *map = job->map;
+	guchar *bytes = job->bytes;
+	gsize len = job->len;
+	gchar c;
+
+	if (read (fd, &c, 1) == -1 && errno == EAGAIN) {
+		return;
+	}
+
+	msg_info_map ("parsed %z bytes of map data in %ud chunks by %ud threads "
+			"in %.3f seconds", len, job->nchunks, job->nthreads,
+			rspamd_get_ticks (FALSE) - job->start);
+
+	map->dtor = NULL;
+	map->dtor_data = NULL;
+	periodic->cbdata.cur_data = job->chunks[0].cbdata.cur_data;
+	job->chunks[0].cbdata.cur_data = NULL;
+	rspamd_map_parse_job_free (job);
+	munmap (bytes, len);
+	periodic->parsing = FALSE;
+	/* Switch to the next backend */
+	periodic->cur_backend ++;
+	rspamd_map_periodic_callback (-1, EV_TIMEOUT, periodic);
+	MAP_RELEASE (periodic, "periodic");
+}
+
+/*
+ * Starts parsing of large data in threads, data is unmapped when finished.
+ * Returns FALSE if data should be parsed synchronously
+ */
+static gboolean
+rspamd_map_parse_parallel (struct rspamd_map *map,
+		struct map_periodic_cbdata *periodic, guchar *bytes, gsize len)
+{
+	struct rspamd_map_parse_job *job;
+	struct rspamd_config *cfg = map->cfg;
+	glong ncpu;
+	guint nchunks;
+
+	/* Data of other backends is not sharded, so it cannot be merged */
+	if (map->merge_callback == NULL || len < MAP_PARALLEL_MIN_SIZE ||
+			map->dtor != NULL || periodic->cbdata.cur_data != NULL) {
+		return FALSE;
+	}
+
+	/* Logger is not thread safe, so threads can parse quietly only */
+	if (cfg->log_level >= G_LOG_LEVEL_DEBUG || (cfg->debug_modules &&
+			g_hash_table_lookup (cfg->debug_modules, "map"))) {
+		return FALSE;
+	}
+
+	ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+	nchunks = MIN (len / MAP_PARALLEL_CHUNK_SIZE, MAP_PARALLEL_MAX_THREADS);
+
+	if (ncpu > 0) {
+		nchunks = MIN (nchunks, ncpu);
+	}
+
+	if (nchunks < 2) {
+		return FALSE;
+	}
+
+	job = rspamd_map_parse_job_start (map, bytes, len, nchunks);
+
+	if (job == NULL) {
+		return FALSE;
+	}
+
+	job->periodic = periodic;
+	event_set (&job->ev, job->fds[0], EV_READ | EV_PERSIST,
+			rspamd_map_parse_job_cb, job);
+	event_base_set (map->ev_base, &job->ev);
+	event_add (&job->ev, NULL);
+	MAP_RETAIN (periodic, "periodic");
+	map->dtor = rspamd_map_parse_job_dtor;
+	map->dtor_data = job;
+	periodic->parsing = TRUE;
+
+	return TRUE;
+}
+
 /**
  * Callback for reading data from file
  */
@@ -861,6 +1303,25 @@ read_map_file (struct rspamd_map *map, struct file_map_data *data,
 		}
 	}
 
+	if (len > 0 && map->load_callback && !bk->is_compressed &&
+			map->backends->len == 1 &&
+			map->load_callback (bytes, len, &periodic->cbdata)) {
+		/* Precompiled map is looked up in place, mapping is owned by data */
+		msg_info_map ("%s: mapped compiled map data, %z bytes",
+				data->filename, len);
+
+		return TRUE;
+	}
+
+	if (!bk->is_compressed &&
+			rspamd_map_parse_parallel (map, periodic, bytes, len)) {
+		/* Data is unmapped when parsing is finished */
+		msg_info_map ("%s: parse %z bytes of map data in threads",
+				data->filename, len);
+
+		return TRUE;
+	}
+
 	if (len > 0) {
 		if (bk->is_compressed) {
 			ZSTD_DStream *zstream;
@@ -1014,25 +1475,27 @@ read_map_static (struct rspamd_map *map, struct static_map_data *data,
 	return TRUE;
 }
 
+/*
+ * Called when data is installed and compiled (if needed), map is unlocked here
+ */
 static void
-rspamd_map_periodic_dtor (struct map_periodic_cbdata *periodic)
+rspamd_map_periodic_finish (struct map_periodic_cbdata *periodic,
+		gboolean published)
 {
-	struct rspamd_map *map;
-
-	map = periodic->map;
-	msg_debug_map ("periodic dtor %p", periodic);
-	event_del (&periodic->ev);
-
-	if (periodic->need_modify) {
-		/* We are done */
-		periodic->map->fin_callback (&periodic->cbdata);
+	struct rspamd_map *map = periodic->map;
+	struct rspamd_map_backend *bk;
 
-		if (periodic->cbdata.cur_data) {
-			*periodic->map->user_data = periodic->cbdata.cur_data;
+	if (periodic->delta_modified) {
+		/* Other processes can load the result of delta only compiled */
+		if (published) {
+			map->cache->last_modified = periodic->delta_modified;
+		}
+		else {
+			msg_warn_map ("cannot share map after delta, "
+					"request the full map next time");
+			bk = g_ptr_array_index (map->backends, 0);
+			rspamd_map_reset_version (bk->data.hd);
 		}
-	}
-	else {
-		/* Not modified */
 	}
 
 	if (periodic->locked) {
@@ -1044,41 +1507,241 @@ rspamd_map_periodic_dtor (struct map_periodic_cbdata *periodic)
 	g_free (periodic);
 }
 
-static void
-rspamd_map_schedule_periodic (struct rspamd_map *map,
-		gboolean locked, gboolean initial, gboolean errored)
+/*
+ * Data is compiled by a thread, so the map is kept locked until it is
+ * published: the next update cannot modify or free data being compiled
+ */
+struct rspamd_map_compile_job {
+	struct rspamd_map *map;
+	struct map_periodic_cbdata *periodic;
+	gpointer data;
+	time_t modified;
+	guchar *out;
+	gsize len;
+	pthread_t thread;
+	gint fds[2];
+	struct event ev;
+	gdouble start;
+};
+
+static gpointer
+rspamd_map_compile_thread (gpointer ud)
 {
-	const gdouble error_mult = 20.0, lock_mult = 0.1;
-	gdouble jittered_sec;
-	gdouble timeout;
-	struct map_periodic_cbdata *cbd;
+	struct rspamd_map_compile_job *job = ud;
 
-	if (map->scheduled_check) {
-		/* Do not schedule check if some check is already scheduled */
-		return;
+	job->out = job->map->compile_callback (job->data, &job->len);
+
+	if (write (job->fds[1], "1", 1) == -1) {
+		/* Event loop would wait forever and we cannot log from a thread */
+		abort ();
 	}
 
-	if (map->next_check != 0) {
-		timeout = map->next_check - rspamd_get_calendar_ticks ();
+	return NULL;
+}
 
-		if (timeout < map->poll_timeout) {
-			timeout = map->poll_timeout;
+static void
+rspamd_map_compile_job_free (struct rspamd_map_compile_job *job)
+{
+	event_del (&job->ev);
+	pthread_join (job->thread, NULL);
+	close (job->fds[0]);
+	close (job->fds[1]);
+	g_free (job->out);
+	g_free (job);
+}
 
-			if (errored) {
-				timeout = map->poll_timeout * error_mult;
-			}
-			else if (locked) {
-				timeout = map->poll_timeout * lock_mult;
-			}
+static void
+rspamd_map_compile_job_dtor (gpointer p)
+{
+	struct rspamd_map_compile_job *job = p;
+	struct map_periodic_cbdata *periodic = job->periodic;
+	struct rspamd_map *map = job->map;
 
-			jittered_sec = rspamd_time_jitter (timeout, 0);
-		}
-		else {
-			jittered_sec = rspamd_time_jitter (timeout, map->poll_timeout);
-		}
+	/* Map is destroyed, so wait for the thread and drop the result */
+	map->dtor = NULL;
+	map->dtor_data = NULL;
+	rspamd_map_compile_job_free (job);
 
-		/* Reset till the next usage */
-		map->next_check = 0;
+	if (periodic->locked) {
+		g_atomic_int_set (map->locked, 0);
+	}
+
+	g_free (periodic);
+}
+
+static void
+rspamd_map_compile_job_cb (gint fd, short what, gpointer ud)
+{
+	struct rspamd_map_compile_job *job = ud;
+	struct map_periodic_cbdata *periodic = job->periodic;
+	struct rspamd_map *map = job->map;
+	gboolean published = FALSE;
+	gchar c;
+
+	if (read (fd, &c, 1) == -1 && errno == EAGAIN) {
+		return;
+	}
+
+	map->dtor = NULL;
+	map->dtor_data = NULL;
+	pthread_join (job->thread, NULL);
+	msg_info_map ("compiled map data in %.3f seconds",
+			rspamd_get_ticks (FALSE) - job->start);
+
+	if (job->out) {
+		published = rspamd_map_publish_buffer (map, job->out, job->len,
+				job->modified);
+		job->out = NULL;
+	}
+
+	event_del (&job->ev);
+	close (job->fds[0]);
+	close (job->fds[1]);
+	g_free (job);
+	rspamd_map_periodic_finish (periodic, published);
+}
+
+/*
+ * Starts compilation of data in a thread, periodic is finished when the
+ * result is published. Returns FALSE if data should be compiled synchronously
+ */
+static gboolean
+rspamd_map_compile_async (struct rspamd_map *map,
+		struct map_periodic_cbdata *periodic, gpointer data, time_t modified)
+{
+	struct rspamd_map_compile_job *job;
+	struct rspamd_config *cfg = map->cfg;
+
+	if (map->dtor != NULL || (g_atomic_int_get (&map->cache->compiled_available) &&
+			map->cache->compiled_modified == modified)) {
+		return FALSE;
+	}
+
+	/* Logger is not thread safe, so threads can compile quietly only */
+	if (cfg->log_level >= G_LOG_LEVEL_DEBUG || (cfg->debug_modules &&
+			g_hash_table_lookup (cfg->debug_modules, "map"))) {
+		return FALSE;
+	}
+
+	job = g_malloc0 (sizeof (*job));
+
+	if (pipe (job->fds) == -1) {
+		msg_err_map ("cannot create pipe: %s", strerror (errno));
+		g_free (job);
+
+		return FALSE;
+	}
+
+	rspamd_socket_nonblocking (job->fds[0]);
+	job->map = map;
+	job->periodic = periodic;
+	job->data = data;
+	job->modified = modified;
+	job->start = rspamd_get_ticks (FALSE);
+
+	if (pthread_create (&job->thread, NULL, rspamd_map_compile_thread,
+			job) != 0) {
+		close (job->fds[0]);
+		close (job->fds[1]);
+		g_free (job);
+
+		return FALSE;
+	}
+
+	event_set (&job->ev, job->fds[0], EV_READ | EV_PERSIST,
+			rspamd_map_compile_job_cb, job);
+	event_base_set (map->ev_base, &job->ev);
+	event_add (&job->ev, NULL);
+	map->dtor = rspamd_map_compile_job_dtor;
+	map->dtor_data = job;
+
+	return TRUE;
+}
+
+static void
+rspamd_map_periodic_dtor (struct map_periodic_cbdata *periodic)
+{
+	struct rspamd_map *map;
+	gpointer data;
+	time_t modified = 0;
+
+	map = periodic->map;
+	msg_debug_map ("periodic dtor %p", periodic);
+	event_del (&periodic->ev);
+
+	if (periodic->need_modify) {
+		/* We are done */
+		periodic->map->fin_callback (&periodic->cbdata);
+		data = periodic->cbdata.cur_data;
+
+		if (data) {
+			*periodic->map->user_data = data;
+		}
+
+		if (periodic->delta_modified) {
+			modified = periodic->delta_modified;
+		}
+		else if (map->compile_callback && map->active_http &&
+				data && map->backends->len == 1 &&
+				g_atomic_int_get (&map->cache->available)) {
+			modified = map->cache->last_modified;
+		}
+
+		if (modified != 0) {
+			if (data && periodic->locked &&
+					rspamd_map_compile_async (map, periodic, data, modified)) {
+				/* Periodic is finished by the compile job */
+				return;
+			}
+
+			rspamd_map_periodic_finish (periodic, data &&
+					rspamd_map_publish_compiled (map, data, modified));
+
+			return;
+		}
+	}
+	else {
+		/* Not modified */
+	}
+
+	rspamd_map_periodic_finish (periodic, FALSE);
+}
+
+static void
+rspamd_map_schedule_periodic (struct rspamd_map *map,
+		gboolean locked, gboolean initial, gboolean errored)
+{
+	const gdouble error_mult = 20.0, lock_mult = 0.1;
+	gdouble jittered_sec;
+	gdouble timeout;
+	struct map_periodic_cbdata *cbd;
+
+	if (map->scheduled_check) {
+		/* Do not schedule check if some check is already scheduled */
+		return;
+	}
+
+	if (map->next_check != 0) {
+		timeout = map->next_check - rspamd_get_calendar_ticks ();
+
+		if (timeout < map->poll_timeout) {
+			timeout = map->poll_timeout;
+
+			if (errored) {
+				timeout = map->poll_timeout * error_mult;
+			}
+			else if (locked) {
+				timeout = map->poll_timeout * lock_mult;
+			}
+
+			jittered_sec = rspamd_time_jitter (timeout, 0);
+		}
+		else {
+			jittered_sec = rspamd_time_jitter (timeout, map->poll_timeout);
+		}
+
+		/* Reset till the next usage */
+		map->next_check = 0;
 	}
 	else {
 		timeout = map->poll_timeout;
@@ -1179,6 +1842,144 @@ rspamd_map_dns_callback (struct rdns_reply *reply, void *arg)
 	MAP_RELEASE (cbd, "http_callback_data");
 }
 
+static void
+rspamd_map_unlink_shmem (const gchar *name)
+{
+#ifdef HAVE_SANE_SHMEM
+	shm_unlink (name);
+#else
+	unlink (name);
+#endif
+}
+
+/*
+ * Compiles parsed data and stores it in shared memory for other processes
+ */
+static gboolean
+rspamd_map_publish_compiled (struct rspamd_map *map, gpointer data,
+		time_t modified)
+{
+	guchar *out;
+	gsize len;
+
+	if (g_atomic_int_get (&map->cache->compiled_available) &&
+			map->cache->compiled_modified == modified) {
+		return TRUE;
+	}
+
+	out = map->compile_callback (data, &len);
+
+	if (out == NULL) {
+		return FALSE;
+	}
+
+	return rspamd_map_publish_buffer (map, out, len, modified);
+}
+
+/*
+ * Stores compiled data in shared memory for other processes, frees `out`
+ */
+static gboolean
+rspamd_map_publish_buffer (struct rspamd_map *map, guchar *out, gsize len,
+		time_t modified)
+{
+	gchar name[sizeof (map->cache->compiled_name)];
+	gsize written = 0;
+	gssize r;
+	gint fd;
+
+#ifdef HAVE_SANE_SHMEM
+	rspamd_strlcpy (name, "/rhm.XXXXXXXXXXXXXXXXXXXX", sizeof (name));
+	fd = rspamd_shmem_mkstemp (name);
+#else
+	rspamd_strlcpy (name, "/tmp/rhm.XXXXXXXXXXXXXXXXXXXX", sizeof (name));
+	fd = mkstemp (name);
+#endif
+
+	if (fd == -1) {
+		msg_err_map ("cannot create shared memory for compiled map: %s",
+				strerror (errno));
+		g_free (out);
+
+		return FALSE;
+	}
+
+	while (written < len) {
+		r = write (fd, out + written, len - written);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			msg_err_map ("cannot write compiled map to %s: %s", name,
+					strerror (errno));
+			close (fd);
+			rspamd_map_unlink_shmem (name);
+			g_free (out);
+
+			return FALSE;
+		}
+
+		written += r;
+	}
+
+	close (fd);
+	g_free (out);
+
+	/* Readers check availability and modification time before mapping */
+	if (g_atomic_int_compare_and_exchange (&map->cache->compiled_available,
+			1, 0)) {
+		rspamd_map_unlink_shmem (map->cache->compiled_name);
+	}
+
+	rspamd_strlcpy (map->cache->compiled_name, name,
+			sizeof (map->cache->compiled_name));
+	map->cache->compiled_len = len;
+	map->cache->compiled_modified = modified;
+	g_atomic_int_set (&map->cache->compiled_available, 1);
+
+	msg_info_map ("shared compiled map data of %z bytes", len);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_map_read_compiled (struct rspamd_map *map, struct rspamd_map_backend *bk,
+		struct map_periodic_cbdata *periodic)
+{
+	gsize len;
+	gpointer in;
+
+	if (map->backends->len != 1 ||
+			!g_atomic_int_get (&map->cache->compiled_available) ||
+			map->cache->compiled_modified != map->cache->last_modified) {
+		return FALSE;
+	}
+
+	in = rspamd_shmem_xmap (map->cache->compiled_name, PROT_READ, &len);
+
+	if (in == NULL) {
+		/* Might be replaced concurrently, so just parse data */
+		msg_info_map ("cannot map compiled data from %s: %s",
+				map->cache->compiled_name, strerror (errno));
+		return FALSE;
+	}
+
+	if (len != map->cache->compiled_len ||
+			!map->load_callback (in, len, &periodic->cbdata)) {
+		msg_warn_map ("invalid compiled data in %s, parse map instead",
+				map->cache->compiled_name);
+		munmap (in, len);
+
+		return FALSE;
+	}
+
+	msg_info_map ("%s: read compiled map data cached %z bytes", bk->uri, len);
+
+	return TRUE;
+}
+
 static gboolean
 rspamd_map_read_cached (struct rspamd_map *map, struct rspamd_map_backend *bk,
 		struct map_periodic_cbdata *periodic, const gchar *host)
@@ -1186,6 +1987,16 @@ rspamd_map_read_cached (struct rspamd_map *map, struct rspamd_map_backend *bk,
 	gsize len;
 	gpointer in;
 
+	if (map->load_callback && rspamd_map_read_compiled (map, bk, periodic)) {
+		return TRUE;
+	}
+
+	if (map->cache->shmem_modified != map->cache->last_modified) {
+		/* Deltas have been applied since data was cached */
+		msg_info_map ("%s: cached data is outdated", bk->uri);
+		return FALSE;
+	}
+
 	in = rspamd_shmem_xmap (map->cache->shmem_name, PROT_READ, &len);
 
 	if (in == NULL) {
@@ -1499,6 +2310,11 @@ rspamd_map_file_read_callback (gint fd, short what, void *ud)
 		periodic->errored = TRUE;
 	}
 
+	if (periodic->parsing) {
+		/* Switched to the next backend when parsing is finished */
+		return;
+	}
+
 	/* Switch to the next backend */
 	periodic->cur_backend ++;
 	rspamd_map_periodic_callback (-1, EV_TIMEOUT, periodic);
@@ -1666,6 +2482,11 @@ rspamd_map_remove_all (struct rspamd_config *cfg)
 			unlink (map->cache->shmem_name);
 		}
 
+		if (g_atomic_int_compare_and_exchange (&map->cache->compiled_available,
+				1, 0)) {
+			rspamd_map_unlink_shmem (map->cache->compiled_name);
+		}
+
 		if (map->dtor) {
 			map->dtor (map->dtor_data);
 		}
@@ -1831,6 +2652,10 @@ rspamd_map_backend_dtor (struct rspamd_map_backend *bk)
 				rspamd_fstring_free (bk->data.hd->etag);
 			}
 
+			if (bk->data.hd->version) {
+				rspamd_fstring_free (bk->data.hd->version);
+			}
+
 			g_free (bk->data.hd);
 		}
 		break;
@@ -2023,6 +2848,33 @@ rspamd_map_add (struct rspamd_config *cfg,
 	return map;
 }
 
+void
+rspamd_map_set_shared (struct rspamd_map *map,
+	map_compile_cb_t compile_callback,
+	map_load_cb_t load_callback)
+{
+	g_assert (map != NULL);
+
+	map->compile_callback = compile_callback;
+	map->load_callback = load_callback;
+}
+
+void
+rspamd_map_set_parallel (struct rspamd_map *map, map_merge_cb_t merge_callback)
+{
+	g_assert (map != NULL);
+
+	map->merge_callback = merge_callback;
+}
+
+void
+rspamd_map_set_delta (struct rspamd_map *map, map_cb_t delta_callback)
+{
+	g_assert (map != NULL);
+
+	map->delta_callback = delta_callback;
+}
+
 struct rspamd_map*
 rspamd_map_add_from_ucl (struct rspamd_config *cfg,
 	const ucl_object_t *obj,
@@ -2658,48 +3510,777 @@ rspamd_kv_list_fin (struct map_cb_data *data)
 	}
 }
 
-gchar *
-rspamd_radix_read (
-	gchar * chunk,
-	gint len,
-	struct map_cb_data *data,
-	gboolean final)
+/*
+ * Shared hash is an open addressing table with string offsets, so it can be
+ * mapped to any address:
+ * header | nbuckets elements | strings
+ * Offset 0 in strings is an empty string marking empty buckets
+ */
+#define RSPAMD_SHARED_HASH_MAGIC 0x31485352u /* RSH1 */
+
+struct rspamd_shared_hash_hdr {
+	guint32 magic;
+	guint32 nelts;
+	guint32 nbuckets;
+	guint32 strings_len;
+	guint64 seed;
+};
+
+struct rspamd_shared_hash_elt {
+	guint32 hash;
+	guint32 keylen;
+	guint32 key_off;
+	guint32 value_off;
+};
+
+struct rspamd_hash_map_helper {
+	/* Keys are split by hash to several tables if parsed by threads */
+	GHashTable **htb;
+	guint nshards;
+	/* Compiled data mapped from another process */
+	const struct rspamd_shared_hash_hdr *shared;
+	gsize shared_len;
+};
+
+static struct rspamd_hash_map_helper *
+rspamd_hash_map_helper_new (guint nshards)
 {
-	radix_compressed_t *tree;
-	rspamd_mempool_t *rpool;
-	struct rspamd_map *map = data->map;
+	struct rspamd_hash_map_helper *helper;
+	guint i;
 
-	if (data->cur_data == NULL) {
-		tree = radix_create_compressed ();
-		rpool = radix_get_pool (tree);
-		memcpy (rpool->tag.uid, map->tag, sizeof (rpool->tag.uid));
-		data->cur_data = tree;
+	helper = g_malloc0 (sizeof (*helper));
+	helper->nshards = MAX (nshards, 1);
+	helper->htb = g_new (GHashTable *, helper->nshards);
+
+	for (i = 0; i < helper->nshards; i ++) {
+		helper->htb[i] = g_hash_table_new_full (rspamd_strcase_hash,
+				rspamd_strcase_equal, g_free, g_free);
 	}
-	return rspamd_parse_kv_list (
-			   chunk,
-			   len,
-			   data,
-			   radix_tree_insert_helper,
-			   hash_fill,
-			   final);
+
+	return helper;
 }
 
-void
-rspamd_radix_fin (struct map_cb_data *data)
+static inline GHashTable *
+rspamd_hash_map_shard (struct rspamd_hash_map_helper *helper, const gchar *key)
 {
-	struct rspamd_map *map = data->map;
-
-	if (data->prev_data) {
-		radix_destroy_compressed (data->prev_data);
-	}
-	if (data->cur_data) {
-		msg_info_map ("read radix trie of %z elements: %s",
-				radix_get_size (data->cur_data), radix_get_info (data->cur_data));
+	if (helper->nshards == 1) {
+		return helper->htb[0];
 	}
+
+	return helper->htb[rspamd_strcase_hash (key) % helper->nshards];
 }
 
-enum rspamd_regexp_map_flags {
-	RSPAMD_REGEXP_FLAG_UTF = (1 << 0),
+static guint
+rspamd_hash_map_size (struct rspamd_hash_map_helper *helper)
+{
+	guint i, size = 0;
+
+	for (i = 0; i < helper->nshards; i ++) {
+		size += g_hash_table_size (helper->htb[i]);
+	}
+
+	return size;
+}
+
+static void
+rspamd_hash_map_helper_destroy (struct rspamd_hash_map_helper *helper)
+{
+	guint i;
+
+	if (helper->htb) {
+		for (i = 0; i < helper->nshards; i ++) {
+			g_hash_table_unref (helper->htb[i]);
+		}
+
+		g_free (helper->htb);
+	}
+
+	if (helper->shared) {
+		munmap ((gpointer)helper->shared, helper->shared_len);
+	}
+
+	g_free (helper);
+}
+
+static void
+rspamd_hash_map_insert_helper (gpointer st, gconstpointer key,
+		gconstpointer value)
+{
+	struct rspamd_hash_map_helper *helper = st;
+
+	g_hash_table_replace (rspamd_hash_map_shard (helper, key),
+			g_strdup (key), g_strdup (value));
+}
+
+gchar *
+rspamd_hosts_shared_read (
+	gchar * chunk,
+	gint len,
+	struct map_cb_data *data,
+	gboolean final)
+{
+	if (data->cur_data == NULL) {
+		data->cur_data = rspamd_hash_map_helper_new (data->nshards);
+	}
+
+	return rspamd_parse_kv_list (
+			chunk,
+			len,
+			data,
+			rspamd_hash_map_insert_helper,
+			hash_fill,
+			final);
+}
+
+gchar *
+rspamd_kv_list_shared_read (
+	gchar * chunk,
+	gint len,
+	struct map_cb_data *data,
+	gboolean final)
+{
+	if (data->cur_data == NULL) {
+		data->cur_data = rspamd_hash_map_helper_new (data->nshards);
+	}
+
+	return rspamd_parse_kv_list (
+			chunk,
+			len,
+			data,
+			rspamd_hash_map_insert_helper,
+			"",
+			final);
+}
+
+/*
+ * Delta lines are `+key [value]` to add or replace a key and `-key` to remove
+ * a key, they are applied to the current data in place
+ */
+static void
+rspamd_hash_map_delta_helper (gpointer st, gconstpointer key,
+		gconstpointer value)
+{
+	struct rspamd_hash_map_helper *helper = st;
+	const gchar *k = key;
+
+	if (k[0] == '+' && k[1] != '\0') {
+		g_hash_table_replace (rspamd_hash_map_shard (helper, k + 1),
+				g_strdup (k + 1), g_strdup (value));
+	}
+	else if (k[0] == '-' && k[1] != '\0') {
+		g_hash_table_remove (rspamd_hash_map_shard (helper, k + 1), k + 1);
+	}
+}
+
+static void
+rspamd_hash_map_delta_start (struct map_cb_data *data)
+{
+	struct rspamd_hash_map_helper *prev = data->prev_data, *helper;
+	const struct rspamd_shared_hash_elt *elts, *elt;
+	const gchar *strings;
+	guint32 i;
+
+	if (data->cur_data != NULL) {
+		return;
+	}
+
+	if (prev == NULL) {
+		data->cur_data = rspamd_hash_map_helper_new (1);
+
+		return;
+	}
+
+	if (prev->htb) {
+		/* Modify the current hash, so it must not be destroyed on fin */
+		data->cur_data = prev;
+		data->prev_data = NULL;
+
+		return;
+	}
+
+	/* Mapped data is read only, so copy it once */
+	helper = rspamd_hash_map_helper_new (1);
+	elts = (const struct rspamd_shared_hash_elt *)(prev->shared + 1);
+	strings = (const gchar *)(elts + prev->shared->nbuckets);
+
+	for (i = 0; i < prev->shared->nbuckets; i ++) {
+		elt = &elts[i];
+
+		if (elt->key_off != 0) {
+			g_hash_table_replace (helper->htb[0],
+					g_strndup (strings + elt->key_off, elt->keylen),
+					g_strdup (strings + elt->value_off));
+		}
+	}
+
+	data->cur_data = helper;
+}
+
+gchar *
+rspamd_hosts_shared_delta (
+	gchar * chunk,
+	gint len,
+	struct map_cb_data *data,
+	gboolean final)
+{
+	rspamd_hash_map_delta_start (data);
+
+	return rspamd_parse_kv_list (
+			chunk,
+			len,
+			data,
+			rspamd_hash_map_delta_helper,
+			hash_fill,
+			final);
+}
+
+gchar *
+rspamd_kv_list_shared_delta (
+	gchar * chunk,
+	gint len,
+	struct map_cb_data *data,
+	gboolean final)
+{
+	rspamd_hash_map_delta_start (data);
+
+	return rspamd_parse_kv_list (
+			chunk,
+			len,
+			data,
+			rspamd_hash_map_delta_helper,
+			"",
+			final);
+}
+
+void
+rspamd_hash_map_merge (gpointer dst, gpointer src, guint shard)
+{
+	struct rspamd_hash_map_helper *d = dst, *s = src;
+	GHashTableIter it;
+	gpointer k, v;
+
+	g_assert (d->htb != NULL && s->htb != NULL);
+	g_assert (shard < d->nshards && d->nshards == s->nshards);
+
+	g_hash_table_iter_init (&it, s->htb[shard]);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		g_hash_table_iter_steal (&it);
+		g_hash_table_replace (d->htb[shard], k, v);
+	}
+}
+
+void
+rspamd_hash_map_fin (struct map_cb_data *data)
+{
+	struct rspamd_map *map = data->map;
+	struct rspamd_hash_map_helper *helper;
+
+	if (data->prev_data) {
+		rspamd_hash_map_helper_destroy (data->prev_data);
+	}
+
+	if (data->cur_data) {
+		helper = data->cur_data;
+
+		if (helper->htb) {
+			msg_info_map ("read hash of %d elements",
+					rspamd_hash_map_size (helper));
+		}
+		else {
+			msg_info_map ("mapped shared hash of %d elements",
+					helper->shared->nelts);
+		}
+	}
+}
+
+guchar *
+rspamd_hash_map_compile (gpointer data, gsize *len)
+{
+	struct rspamd_hash_map_helper *helper = data;
+	struct rspamd_shared_hash_hdr *hdr;
+	struct rspamd_shared_hash_elt *elts, *elt;
+	GHashTableIter it;
+	gpointer k, v;
+	gsize strings_len = 1, klen, vlen;
+	guint32 nbuckets = 16, hash, idx, nelts;
+	guint i;
+	gchar *strings;
+	guchar *out;
+
+	if (helper->htb == NULL) {
+		return NULL;
+	}
+
+	nelts = rspamd_hash_map_size (helper);
+
+	/* Load factor is no more than 3/4 */
+	while (nbuckets * 3 < nelts * 4) {
+		nbuckets <<= 1;
+	}
+
+	for (i = 0; i < helper->nshards; i ++) {
+		g_hash_table_iter_init (&it, helper->htb[i]);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			strings_len += strlen (k) + strlen (v) + 2;
+		}
+	}
+
+	if (strings_len > G_MAXUINT32) {
+		return NULL;
+	}
+
+	*len = sizeof (*hdr) + nbuckets * sizeof (*elts) + strings_len;
+	out = g_malloc0 (*len);
+	hdr = (struct rspamd_shared_hash_hdr *)out;
+	elts = (struct rspamd_shared_hash_elt *)(hdr + 1);
+	strings = (gchar *)(elts + nbuckets);
+
+	hdr->magic = RSPAMD_SHARED_HASH_MAGIC;
+	hdr->nelts = nelts;
+	hdr->nbuckets = nbuckets;
+	hdr->strings_len = strings_len;
+	hdr->seed = rspamd_hash_seed ();
+	strings_len = 1;
+
+	for (i = 0; i < helper->nshards; i ++) {
+		g_hash_table_iter_init (&it, helper->htb[i]);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			klen = strlen (k);
+			vlen = strlen (v);
+			hash = rspamd_icase_hash (k, klen, hdr->seed);
+			idx = hash;
+			elt = &elts[idx & (nbuckets - 1)];
+
+			while (elt->key_off != 0) {
+				idx ++;
+				elt = &elts[idx & (nbuckets - 1)];
+			}
+
+			elt->hash = hash;
+			elt->keylen = klen;
+			elt->key_off = strings_len;
+			memcpy (strings + strings_len, k, klen + 1);
+			strings_len += klen + 1;
+			elt->value_off = strings_len;
+			memcpy (strings + strings_len, v, vlen + 1);
+			strings_len += vlen + 1;
+		}
+	}
+
+	return out;
+}
+
+gboolean
+rspamd_hash_map_load (gpointer addr, gsize len, struct map_cb_data *data)
+{
+	struct rspamd_hash_map_helper *helper;
+	const struct rspamd_shared_hash_hdr *hdr = addr;
+	const struct rspamd_shared_hash_elt *elts, *elt;
+	const gchar *strings;
+	guint32 i, nused = 0;
+
+	if (len < sizeof (*hdr) || hdr->magic != RSPAMD_SHARED_HASH_MAGIC ||
+			hdr->nbuckets == 0 || (hdr->nbuckets & (hdr->nbuckets - 1)) != 0 ||
+			len != sizeof (*hdr) + (gsize)hdr->nbuckets *
+					sizeof (struct rspamd_shared_hash_elt) + hdr->strings_len ||
+			hdr->strings_len == 0) {
+		return FALSE;
+	}
+
+	/* Lookups rely on the last string being terminated */
+	if (((const gchar *)addr)[len - 1] != '\0') {
+		return FALSE;
+	}
+
+	if (data->cur_data) {
+		/* Compiled data replaces the whole map only */
+		return FALSE;
+	}
+
+	/*
+	 * Lookups trust offsets and stop probing at an empty bucket, so check
+	 * all of them once here
+	 */
+	elts = (const struct rspamd_shared_hash_elt *)(hdr + 1);
+	strings = (const gchar *)(elts + hdr->nbuckets);
+
+	for (i = 0; i < hdr->nbuckets; i ++) {
+		elt = &elts[i];
+
+		if (elt->key_off == 0) {
+			continue;
+		}
+
+		if ((gsize)elt->key_off + elt->keylen >= hdr->strings_len ||
+				strings[elt->key_off + elt->keylen] != '\0' ||
+				elt->value_off >= hdr->strings_len) {
+			return FALSE;
+		}
+
+		nused ++;
+	}
+
+	if (nused != hdr->nelts || nused == hdr->nbuckets) {
+		return FALSE;
+	}
+
+	helper = g_malloc0 (sizeof (*helper));
+	helper->shared = hdr;
+	helper->shared_len = len;
+	data->cur_data = helper;
+
+	return TRUE;
+}
+
+static GQuark
+rspamd_map_quark (void)
+{
+	return g_quark_from_static_string ("map");
+}
+
+gboolean
+rspamd_hash_map_compile_file (const gchar *src, const gchar *dst,
+		gboolean kv, GError **err)
+{
+	struct rspamd_map map;
+	struct map_cb_data cbdata;
+	gchar tmp[PATH_MAX];
+	guchar *bytes, *out = NULL;
+	gsize len, olen = 0, written = 0;
+	gssize r;
+	gint fd;
+	gboolean ret = FALSE;
+
+	bytes = rspamd_file_xmap (src, PROT_READ, &len, TRUE);
+
+	if (bytes == NULL) {
+		g_set_error (err, rspamd_map_quark (), errno,
+				"cannot open %s: %s", src, strerror (errno));
+		return FALSE;
+	}
+
+	memset (&map, 0, sizeof (map));
+	memset (&cbdata, 0, sizeof (cbdata));
+	rspamd_strlcpy (map.tag, "compile", sizeof (map.tag));
+	map.name = (gchar *)src;
+	cbdata.map = &map;
+
+	if (kv) {
+		rspamd_kv_list_shared_read ((gchar *)bytes, len, &cbdata, TRUE);
+	}
+	else {
+		rspamd_hosts_shared_read ((gchar *)bytes, len, &cbdata, TRUE);
+	}
+
+	munmap (bytes, len);
+
+	if (cbdata.cur_data) {
+		out = rspamd_hash_map_compile (cbdata.cur_data, &olen);
+		rspamd_hash_map_helper_destroy (cbdata.cur_data);
+	}
+
+	if (out == NULL) {
+		g_set_error (err, rspamd_map_quark (), EINVAL,
+				"cannot compile %s: no data or data is too large", src);
+		return FALSE;
+	}
+
+	/* Workers map the file, so it must be replaced atomically */
+	rspamd_snprintf (tmp, sizeof (tmp), "%s.new", dst);
+	fd = rspamd_file_xopen (tmp, O_WRONLY | O_CREAT | O_TRUNC, 00644, TRUE);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_map_quark (), errno,
+				"cannot create %s: %s", tmp, strerror (errno));
+		g_free (out);
+
+		return FALSE;
+	}
+
+	while (written < olen) {
+		r = write (fd, out + written, olen - written);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			break;
+		}
+
+		written += r;
+	}
+
+	if (written != olen || fsync (fd) == -1) {
+		g_set_error (err, rspamd_map_quark (), errno,
+				"cannot write %s: %s", tmp, strerror (errno));
+		unlink (tmp);
+	}
+	else if (rename (tmp, dst) == -1) {
+		g_set_error (err, rspamd_map_quark (), errno,
+				"cannot rename %s to %s: %s", tmp, dst, strerror (errno));
+		unlink (tmp);
+	}
+	else {
+		ret = TRUE;
+	}
+
+	close (fd);
+	g_free (out);
+
+	return ret;
+}
+
+const gchar *
+rspamd_match_hash_map (struct rspamd_hash_map_helper *map, const gchar *key)
+{
+	const struct rspamd_shared_hash_hdr *hdr;
+	const struct rspamd_shared_hash_elt *elts, *elt;
+	const gchar *strings;
+	guint32 hash, idx, i;
+	gsize klen;
+
+	if (map == NULL || key == NULL) {
+		return NULL;
+	}
+
+	if (map->htb) {
+		return g_hash_table_lookup (rspamd_hash_map_shard (map, key), key);
+	}
+
+	hdr = map->shared;
+	elts = (const struct rspamd_shared_hash_elt *)(hdr + 1);
+	strings = (const gchar *)(elts + hdr->nbuckets);
+	klen = strlen (key);
+	hash = rspamd_icase_hash (key, klen, hdr->seed);
+	idx = hash;
+
+	for (i = 0; i < hdr->nbuckets; i ++, idx ++) {
+		elt = &elts[idx & (hdr->nbuckets - 1)];
+
+		if (elt->key_off == 0) {
+			break;
+		}
+
+		/* Offsets are validated by rspamd_hash_map_load */
+		if (elt->hash == hash && elt->keylen == klen &&
+				g_ascii_strncasecmp (strings + elt->key_off, key, klen) == 0) {
+			return strings + elt->value_off;
+		}
+	}
+
+	return NULL;
+}
+
+gchar *
+rspamd_radix_read (
+	gchar * chunk,
+	gint len,
+	struct map_cb_data *data,
+	gboolean final)
+{
+	radix_compressed_t *tree;
+	rspamd_mempool_t *rpool;
+	struct rspamd_map *map = data->map;
+
+	if (data->cur_data == NULL) {
+		tree = radix_create_compressed ();
+		rpool = radix_get_pool (tree);
+		memcpy (rpool->tag.uid, map->tag, sizeof (rpool->tag.uid));
+		data->cur_data = tree;
+	}
+	return rspamd_parse_kv_list (
+			   chunk,
+			   len,
+			   data,
+			   radix_tree_insert_helper,
+			   hash_fill,
+			   final);
+}
+
+void
+rspamd_radix_fin (struct map_cb_data *data)
+{
+	struct rspamd_map *map = data->map;
+	gsize len;
+
+	if (data->prev_data) {
+		radix_destroy_compressed (data->prev_data);
+	}
+	if (data->cur_data) {
+		msg_info_map ("read radix trie of %z elements: %s",
+				radix_get_size (data->cur_data), radix_get_info (data->cur_data));
+
+		/* Lookup tables take at least 256Kb, so they are for large maps only */
+		if (radix_get_size (data->cur_data) >= MAP_RADIX_COMPILE_MIN_SIZE) {
+			len = radix_compile_compressed (data->cur_data);
+
+			if (len > 0) {
+				msg_info_map ("compiled radix lookup tables of %z bytes", len);
+			}
+		}
+	}
+}
+
+/*
+ * Shared radix is a list of prefixes as 16 bytes keys with offsets of values:
+ * header | nprefixes elements | strings
+ * Other processes insert prefixes without parsing of map lines
+ */
+#define RSPAMD_SHARED_RADIX_MAGIC 0x31525352u /* RSR1 */
+
+struct rspamd_shared_radix_hdr {
+	guint32 magic;
+	guint32 nprefixes;
+	guint32 strings_len;
+	guint32 unused;
+};
+
+struct rspamd_shared_radix_elt {
+	guint8 key[16];
+	guint32 bits;
+	guint32 value_off;
+};
+
+struct rspamd_radix_compile_cbdata {
+	GArray *elts;
+	GString *strings;
+	/* Value pointer -> offset, values are shared by prefixes of a line */
+	GHashTable *offsets;
+};
+
+static void
+rspamd_radix_compile_cb (const guint8 *key, gsize bits, uintptr_t value,
+		gpointer ud)
+{
+	struct rspamd_radix_compile_cbdata *cbd = ud;
+	struct rspamd_shared_radix_elt elt;
+	gpointer off;
+
+	if (value == RADIX_NO_VALUE) {
+		return;
+	}
+
+	off = g_hash_table_lookup (cbd->offsets, (gpointer)value);
+
+	if (off == NULL) {
+		off = GSIZE_TO_POINTER (cbd->strings->len);
+		g_string_append_len (cbd->strings, (const gchar *)value,
+				strlen ((const gchar *)value) + 1);
+		g_hash_table_insert (cbd->offsets, (gpointer)value, off);
+	}
+
+	memcpy (elt.key, key, sizeof (elt.key));
+	elt.bits = bits;
+	elt.value_off = GPOINTER_TO_SIZE (off);
+	g_array_append_val (cbd->elts, elt);
+}
+
+guchar *
+rspamd_radix_compile (gpointer data, gsize *len)
+{
+	struct rspamd_radix_compile_cbdata cbd;
+	struct rspamd_shared_radix_hdr hdr;
+	guchar *out = NULL;
+
+	cbd.elts = g_array_sized_new (FALSE, FALSE,
+			sizeof (struct rspamd_shared_radix_elt), radix_get_size (data));
+	/* Offset 0 is never used, so lookup result is unambiguous */
+	cbd.strings = g_string_new_len ("", 1);
+	cbd.offsets = g_hash_table_new (g_direct_hash, g_direct_equal);
+	radix_walk_compressed (data, rspamd_radix_compile_cb, &cbd);
+
+	if (cbd.elts->len > 0 && cbd.strings->len <= G_MAXUINT32) {
+		memset (&hdr, 0, sizeof (hdr));
+		hdr.magic = RSPAMD_SHARED_RADIX_MAGIC;
+		hdr.nprefixes = cbd.elts->len;
+		hdr.strings_len = cbd.strings->len;
+		*len = sizeof (hdr) + cbd.elts->len *
+				sizeof (struct rspamd_shared_radix_elt) + cbd.strings->len;
+		out = g_malloc (*len);
+		memcpy (out, &hdr, sizeof (hdr));
+		memcpy (out + sizeof (hdr), cbd.elts->data,
+				cbd.elts->len * sizeof (struct rspamd_shared_radix_elt));
+		memcpy (out + *len - cbd.strings->len, cbd.strings->str,
+				cbd.strings->len);
+	}
+
+	g_array_free (cbd.elts, TRUE);
+	g_string_free (cbd.strings, TRUE);
+	g_hash_table_unref (cbd.offsets);
+
+	return out;
+}
+
+gboolean
+rspamd_radix_load (gpointer addr, gsize len, struct map_cb_data *data)
+{
+	const struct rspamd_shared_radix_hdr *hdr = addr;
+	const struct rspamd_shared_radix_elt *elts;
+	const gchar *strings;
+	struct rspamd_map *map = data->map;
+	radix_compressed_t *tree;
+	rspamd_mempool_t *rpool;
+	GHashTable *values;
+	gpointer value;
+	guint8 key[16];
+	guint i;
+
+	if (len < sizeof (*hdr) || hdr->magic != RSPAMD_SHARED_RADIX_MAGIC ||
+			hdr->strings_len == 0 ||
+			len != sizeof (*hdr) + (gsize)hdr->nprefixes *
+					sizeof (struct rspamd_shared_radix_elt) + hdr->strings_len) {
+		return FALSE;
+	}
+
+	elts = (const struct rspamd_shared_radix_elt *)(hdr + 1);
+	strings = (const gchar *)(elts + hdr->nprefixes);
+
+	if (strings[hdr->strings_len - 1] != '\0' || data->cur_data) {
+		return FALSE;
+	}
+
+	for (i = 0; i < hdr->nprefixes; i ++) {
+		if (elts[i].bits > sizeof (key) * NBBY ||
+				elts[i].value_off >= hdr->strings_len) {
+			return FALSE;
+		}
+	}
+
+	tree = radix_create_compressed ();
+	rpool = radix_get_pool (tree);
+	memcpy (rpool->tag.uid, map->tag, sizeof (rpool->tag.uid));
+	values = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+	for (i = 0; i < hdr->nprefixes; i ++) {
+		value = g_hash_table_lookup (values,
+				GSIZE_TO_POINTER (elts[i].value_off));
+
+		if (value == NULL) {
+			value = rspamd_mempool_strdup (rpool,
+					strings + elts[i].value_off);
+			g_hash_table_insert (values, GSIZE_TO_POINTER (elts[i].value_off),
+					value);
+		}
+
+		memcpy (key, elts[i].key, sizeof (key));
+		radix_insert_compressed (tree, key, sizeof (key),
+				sizeof (key) * NBBY - elts[i].bits, (uintptr_t)value);
+	}
+
+	g_hash_table_unref (values);
+	/* Everything is copied to the tree */
+	munmap (addr, len);
+	data->cur_data = tree;
+
+	return TRUE;
+}
+
+enum rspamd_regexp_map_flags {
+	RSPAMD_REGEXP_FLAG_UTF = (1 << 0),
 	RSPAMD_REGEXP_FLAG_MULTIPLE = (1 << 1)
 };
 
@@ -2707,7 +4288,13 @@ struct rspamd_regexp_map {
 	struct rspamd_map *map;
 	GPtrArray *regexps;
 	GPtrArray *values;
+	/* Source lines of regexps, kept for compilation of shared maps only */
+	GPtrArray *keys;
 	enum rspamd_regexp_map_flags map_flags;
+	/* Literals required by regexps to select candidates without hyperscan */
+	struct rspamd_multipattern *prefilter;
+	guint *literal_ids;
+	guchar *filtered;
 #ifdef WITH_HYPERSCAN
 	hs_database_t *hs_db;
 	hs_scratch_t *hs_scratch;
@@ -2733,7 +4320,7 @@ rspamd_regexp_map_create (struct rspamd_map *map,
 }
 
 
-static void
+void
 rspamd_regexp_map_destroy (struct rspamd_regexp_map *re_map)
 {
 	rspamd_regexp_t *re;
@@ -2751,6 +4338,20 @@ rspamd_regexp_map_destroy (struct rspamd_regexp_map *re_map)
 	g_ptr_array_free (re_map->regexps, TRUE);
 	g_ptr_array_free (re_map->values, TRUE);
 
+	if (re_map->keys) {
+		for (i = 0; i < re_map->keys->len; i ++) {
+			g_free (g_ptr_array_index (re_map->keys, i));
+		}
+
+		g_ptr_array_free (re_map->keys, TRUE);
+	}
+
+	if (re_map->prefilter) {
+		rspamd_multipattern_destroy (re_map->prefilter);
+		g_free (re_map->literal_ids);
+		g_free (re_map->filtered);
+	}
+
 #ifdef WITH_HYPERSCAN
 	if (re_map->hs_scratch) {
 		hs_free_scratch (re_map->hs_scratch);
@@ -2808,12 +4409,363 @@ rspamd_re_map_insert_helper (gpointer st, gconstpointer key, gconstpointer value
 
 	g_ptr_array_add (re_map->regexps, re);
 	g_ptr_array_add (re_map->values, g_strdup (value));
+
+	if (re_map->keys) {
+		g_ptr_array_add (re_map->keys, g_strdup (key));
+	}
 }
 
-static void
-rspamd_re_map_finalize (struct rspamd_regexp_map *re_map)
+/*
+ * Returns the longest literal that must be present in any match of a pattern
+ * or NULL if there is no such literal. Only the top level of pattern is
+ * examined, alternations disable extraction. For caseless patterns literals
+ * are split on characters that have non ASCII case variants (e.g. the Kelvin
+ * sign matches `k`), as the prefilter folds ASCII case only
+ */
+gchar *
+rspamd_re_map_literal (const gchar *pattern, gboolean caseless, gsize *plen)
+{
+	const gchar *p = pattern, *c;
+	gchar *cur, *best, end;
+	gsize curlen = 0, bestlen = 0, len;
+	gint depth = 0;
+
+	len = strlen (pattern);
+	cur = g_malloc (len + 1);
+	best = g_malloc (len + 1);
+
+#define FLUSH_RUN() do { \
+	if (curlen > bestlen) { \
+		memcpy (best, cur, curlen); \
+		bestlen = curlen; \
+	} \
+	curlen = 0; \
+} while (0)
+#define ADD_CHAR(ch) do { \
+	if (caseless && (((ch) & 0x80) || g_ascii_tolower (ch) == 'k' || \
+			g_ascii_tolower (ch) == 's')) { \
+		FLUSH_RUN (); \
+	} \
+	else { \
+		cur[curlen ++] = (ch); \
+	} \
+} while (0)
+
+	while (*p) {
+		switch (*p) {
+		case '\\':
+			p ++;
+
+			if (*p == '\0') {
+				break;
+			}
+
+			if (*p == 'Q') {
+				/* Everything up to \E is literal */
+				p ++;
+
+				while (*p && !(p[0] == '\\' && p[1] == 'E')) {
+					if (depth == 0) {
+						ADD_CHAR (*p);
+					}
+
+					p ++;
+				}
+
+				if (*p) {
+					p ++;
+				}
+			}
+			else if (*p == 'E') {
+				/* Unpaired \E is ignored */
+			}
+			else if (depth == 0 && !g_ascii_isalnum (*p)) {
+				ADD_CHAR (*p);
+			}
+			else {
+				/* Classes, anchors, codes and references */
+				FLUSH_RUN ();
+
+				if (p[1] == '{' || p[1] == '<' || p[1] == '\'') {
+					end = p[1] == '{' ? '}' : (p[1] == '<' ? '>' : '\'');
+					p += 2;
+
+					while (*p && *p != end) {
+						p ++;
+					}
+
+					if (*p == '\0') {
+						goto out;
+					}
+				}
+				else if (*p == 'x') {
+					if (g_ascii_isxdigit (p[1])) {
+						p ++;
+
+						if (g_ascii_isxdigit (p[1])) {
+							p ++;
+						}
+					}
+				}
+				else if (g_ascii_isdigit (*p) || *p == 'g') {
+					if (*p == 'g' && p[1] == '-') {
+						p ++;
+					}
+
+					while (g_ascii_isdigit (p[1])) {
+						p ++;
+					}
+				}
+				else if ((*p == 'c' || *p == 'p' || *p == 'P') && p[1]) {
+					p ++;
+				}
+			}
+			break;
+		case '[':
+			FLUSH_RUN ();
+			p ++;
+
+			if (*p == '^') {
+				p ++;
+			}
+			if (*p == ']') {
+				p ++;
+			}
+
+			while (*p && *p != ']') {
+				if (*p == '\\' && p[1]) {
+					p ++;
+				}
+				else if (*p == '[' && p[1] == ':') {
+					/* Posix class, e.g. [:alpha:] */
+					c = strstr (p + 2, ":]");
+
+					if (c == NULL) {
+						goto out;
+					}
+
+					p = c + 1;
+				}
+				p ++;
+			}
+
+			if (*p == '\0') {
+				goto out;
+			}
+			break;
+		case '(':
+			FLUSH_RUN ();
+			depth ++;
+
+			if (p[1] == '?') {
+				/* Inline extended mode changes meaning of the whole pattern */
+				for (c = p + 2; g_ascii_isalpha (*c) || *c == '-' || *c == '^';
+						c ++) {
+					if (*c == 'x') {
+						bestlen = 0;
+						goto out;
+					}
+				}
+			}
+			break;
+		case ')':
+			depth --;
+			break;
+		case '|':
+			if (depth == 0) {
+				bestlen = 0;
+				curlen = 0;
+				goto out;
+			}
+			break;
+		case '{':
+			/* Braces that are not a quantifier are literal */
+			for (c = p + 1; g_ascii_isdigit (*c) || *c == ','; c ++);
+
+			if (*c != '}') {
+				if (depth == 0) {
+					ADD_CHAR (*p);
+				}
+				break;
+			}
+			/* FALLTHROUGH */
+		case '?':
+		case '*':
+			/* The previous character is optional, it may be multibyte */
+			while (curlen > 0 && (cur[curlen - 1] & 0xc0) == 0x80) {
+				curlen --;
+			}
+			if (curlen > 0) {
+				curlen --;
+			}
+
+			FLUSH_RUN ();
+
+			if (*p == '{') {
+				p = c;
+			}
+			break;
+		case '+':
+		case '.':
+		case '^':
+		case '$':
+			FLUSH_RUN ();
+			break;
+		default:
+			if (depth == 0) {
+				ADD_CHAR (*p);
+			}
+			break;
+		}
+
+		if (*p) {
+			p ++;
+		}
+	}
+
+	FLUSH_RUN ();
+#undef FLUSH_RUN
+#undef ADD_CHAR
+
+out:
+	g_free (cur);
+
+	if (bestlen == 0) {
+		g_free (best);
+
+		return NULL;
+	}
+
+	*plen = bestlen;
+
+	return best;
+}
+
+void
+rspamd_re_map_build_prefilter (struct rspamd_regexp_map *re_map)
+{
+	struct rspamd_map *map;
+	rspamd_regexp_t *re;
+	GArray *ids;
+	GError *err = NULL;
+	gchar *lit;
+	gsize litlen;
+	gint pcre_flags;
+	gboolean caseless;
+	guint i, nfiltered = 0;
+
+	map = re_map->map;
+
+	if (re_map->regexps->len == 0) {
+		return;
+	}
+
+	re_map->prefilter = rspamd_multipattern_create_sized (
+			re_map->regexps->len, RSPAMD_MULTIPATTERN_ICASE);
+	re_map->filtered = g_malloc0 (re_map->regexps->len);
+	ids = g_array_sized_new (FALSE, FALSE, sizeof (guint),
+			re_map->regexps->len);
+
+	for (i = 0; i < re_map->regexps->len; i ++) {
+		re = g_ptr_array_index (re_map->regexps, i);
+
+		pcre_flags = rspamd_regexp_get_pcre_flags (re);
+
+		/* Whitespaces and comments are not literals in the extended mode */
+		if (pcre_flags & PCRE_FLAG(EXTENDED)) {
+			continue;
+		}
+
+		/* Inline options may enable caseless matching */
+		caseless = (pcre_flags & PCRE_FLAG(CASELESS)) ||
+				strstr (rspamd_regexp_get_pattern (re), "(?") != NULL;
+		lit = rspamd_re_map_literal (rspamd_regexp_get_pattern (re), caseless,
+				&litlen);
+
+		if (lit == NULL) {
+			continue;
+		}
+
+		/* Too short literals are found almost everywhere */
+		if (litlen >= 3) {
+			rspamd_multipattern_add_pattern_len (re_map->prefilter, lit,
+					litlen, RSPAMD_MULTIPATTERN_ICASE);
+			g_array_append_val (ids, i);
+			re_map->filtered[i] = 1;
+			nfiltered ++;
+		}
+
+		g_free (lit);
+	}
+
+	if (nfiltered == 0 ||
+			!rspamd_multipattern_compile (re_map->prefilter, &err)) {
+		if (err) {
+			msg_err_map ("cannot compile literals prefilter: %e", err);
+			g_error_free (err);
+		}
+
+		rspamd_multipattern_destroy (re_map->prefilter);
+		re_map->prefilter = NULL;
+		g_free (re_map->filtered);
+		re_map->filtered = NULL;
+		g_array_free (ids, TRUE);
+
+		return;
+	}
+
+	re_map->literal_ids = (guint *)g_array_free (ids, FALSE);
+	msg_info_map ("use literals prefilter for %ud of %ud regexps",
+			nfiltered, re_map->regexps->len);
+}
+
+static gint
+rspamd_re_map_prefilter_cb (struct rspamd_multipattern *mp,
+		guint strnum,
+		gint match_start,
+		gint match_pos,
+		const gchar *text,
+		gsize len,
+		void *context)
 {
+	struct rspamd_regexp_map *re_map = ((gpointer *)context)[0];
+	guchar *candidates = ((gpointer *)context)[1];
+
+	candidates[re_map->literal_ids[strnum]] = 1;
+
+	return 0;
+}
+
+/*
+ * Returns array where regexps that should be checked are marked, regexps
+ * without literals are always checked
+ */
+static guchar *
+rspamd_re_map_candidates (struct rspamd_regexp_map *re_map,
+		const gchar *in, gsize len)
+{
+	guchar *candidates;
+	gpointer ud[2];
+	guint i;
+
+	candidates = g_malloc (re_map->regexps->len);
+
+	for (i = 0; i < re_map->regexps->len; i ++) {
+		candidates[i] = !re_map->filtered[i];
+	}
+
+	ud[0] = re_map;
+	ud[1] = candidates;
+	rspamd_multipattern_lookup (re_map->prefilter, in, len,
+			rspamd_re_map_prefilter_cb, ud, NULL);
+
+	return candidates;
+}
+
 #ifdef WITH_HYPERSCAN
+static void
+rspamd_re_map_compile_hs (struct rspamd_regexp_map *re_map)
+{
 	guint i;
 	hs_platform_info_t plt;
 	hs_compile_error_t *err;
@@ -2823,6 +4775,18 @@ rspamd_re_map_finalize (struct rspamd_regexp_map *re_map)
 
 	map = re_map->map;
 
+	if (re_map->hs_db) {
+		/* Database is loaded from compiled map data */
+		if (hs_alloc_scratch (re_map->hs_db, &re_map->hs_scratch) != HS_SUCCESS) {
+			msg_err_map ("cannot allocate scratch space for hyperscan");
+			hs_free_database (re_map->hs_db);
+			re_map->hs_db = NULL;
+		}
+		else {
+			return;
+		}
+	}
+
 	if (!(map->cfg->libs_ctx->crypto_ctx->cpu_config & CPUID_SSSE3)) {
 		msg_info_map ("disable hyperscan for map %s, ssse3 instructons are not supported by CPU",
 				map->name);
@@ -2898,7 +4862,21 @@ rspamd_re_map_finalize (struct rspamd_regexp_map *re_map)
 	else {
 		msg_err_map ("regexp map is empty");
 	}
+}
+#endif
+
+static void
+rspamd_re_map_finalize (struct rspamd_regexp_map *re_map)
+{
+#ifdef WITH_HYPERSCAN
+	rspamd_re_map_compile_hs (re_map);
+
+	if (re_map->hs_db && re_map->hs_scratch) {
+		return;
+	}
 #endif
+
+	rspamd_re_map_build_prefilter (re_map);
 }
 
 gchar *
@@ -2912,6 +4890,11 @@ rspamd_regexp_list_read_single (
 
 	if (data->cur_data == NULL) {
 		re_map = rspamd_regexp_map_create (data->map, 0);
+
+		if (data->map->compile_callback) {
+			re_map->keys = g_ptr_array_new ();
+		}
+
 		data->cur_data = re_map;
 	}
 
@@ -2935,6 +4918,11 @@ rspamd_regexp_list_read_multiple (
 
 	if (data->cur_data == NULL) {
 		re_map = rspamd_regexp_map_create (data->map, RSPAMD_REGEXP_FLAG_MULTIPLE);
+
+		if (data->map->compile_callback) {
+			re_map->keys = g_ptr_array_new ();
+		}
+
 		data->cur_data = re_map;
 	}
 
@@ -2964,6 +4952,156 @@ rspamd_regexp_list_fin (struct map_cb_data *data)
 	}
 }
 
+/*
+ * Shared regexp map keeps source lines of regexps and values and the
+ * serialized hyperscan database if any:
+ * header | nre elements | strings | hyperscan database
+ * Other processes still compile regexps by pcre, but hyperscan compilation,
+ * which is the most expensive part, is skipped
+ */
+#define RSPAMD_SHARED_RE_MAGIC 0x31455352u /* RSE1 */
+
+struct rspamd_shared_re_hdr {
+	guint32 magic;
+	guint32 nre;
+	guint32 map_flags;
+	guint32 strings_len;
+	guint64 hs_len;
+};
+
+struct rspamd_shared_re_elt {
+	guint32 key_off;
+	guint32 value_off;
+};
+
+guchar *
+rspamd_regexp_map_compile (gpointer data, gsize *len)
+{
+	struct rspamd_regexp_map *re_map = data;
+	struct rspamd_shared_re_hdr *hdr;
+	struct rspamd_shared_re_elt *elts;
+	gchar *hs_bytes = NULL, *strings;
+	gsize hs_len = 0, strings_len = 0, slen;
+	guchar *out;
+	guint i;
+
+	if (re_map->keys == NULL || re_map->keys->len == 0 ||
+			re_map->keys->len != re_map->values->len) {
+		return NULL;
+	}
+
+	for (i = 0; i < re_map->keys->len; i ++) {
+		strings_len += strlen (g_ptr_array_index (re_map->keys, i)) + 1;
+		strings_len += strlen (g_ptr_array_index (re_map->values, i)) + 1;
+	}
+
+	if (strings_len > G_MAXUINT32) {
+		return NULL;
+	}
+
+#ifdef WITH_HYPERSCAN
+	if (re_map->hs_db && hs_serialize_database (re_map->hs_db, &hs_bytes,
+			&hs_len) != HS_SUCCESS) {
+		hs_bytes = NULL;
+		hs_len = 0;
+	}
+#endif
+
+	*len = sizeof (*hdr) + re_map->keys->len * sizeof (*elts) + strings_len +
+			hs_len;
+	out = g_malloc0 (*len);
+	hdr = (struct rspamd_shared_re_hdr *)out;
+	elts = (struct rspamd_shared_re_elt *)(hdr + 1);
+	strings = (gchar *)(elts + re_map->keys->len);
+	hdr->magic = RSPAMD_SHARED_RE_MAGIC;
+	hdr->nre = re_map->keys->len;
+	hdr->map_flags = re_map->map_flags;
+	hdr->strings_len = strings_len;
+	hdr->hs_len = hs_len;
+	strings_len = 0;
+
+	for (i = 0; i < re_map->keys->len; i ++) {
+		slen = strlen (g_ptr_array_index (re_map->keys, i)) + 1;
+		elts[i].key_off = strings_len;
+		memcpy (strings + strings_len, g_ptr_array_index (re_map->keys, i),
+				slen);
+		strings_len += slen;
+		slen = strlen (g_ptr_array_index (re_map->values, i)) + 1;
+		elts[i].value_off = strings_len;
+		memcpy (strings + strings_len, g_ptr_array_index (re_map->values, i),
+				slen);
+		strings_len += slen;
+	}
+
+	if (hs_bytes) {
+		memcpy (strings + strings_len, hs_bytes, hs_len);
+		/* Allocated by hyperscan allocator which is malloc by default */
+		free (hs_bytes);
+	}
+
+	return out;
+}
+
+gboolean
+rspamd_regexp_map_load (gpointer addr, gsize len, struct map_cb_data *data)
+{
+	const struct rspamd_shared_re_hdr *hdr = addr;
+	const struct rspamd_shared_re_elt *elts;
+	const gchar *strings;
+	struct rspamd_regexp_map *re_map;
+	guint i;
+
+	if (len < sizeof (*hdr) || hdr->magic != RSPAMD_SHARED_RE_MAGIC ||
+			hdr->strings_len == 0 || hdr->hs_len > len ||
+			len != sizeof (*hdr) + (gsize)hdr->nre * sizeof (*elts) +
+					hdr->strings_len + hdr->hs_len) {
+		return FALSE;
+	}
+
+	elts = (const struct rspamd_shared_re_elt *)(hdr + 1);
+	strings = (const gchar *)(elts + hdr->nre);
+
+	if (strings[hdr->strings_len - 1] != '\0' || data->cur_data) {
+		return FALSE;
+	}
+
+	for (i = 0; i < hdr->nre; i ++) {
+		if (elts[i].key_off >= hdr->strings_len ||
+				elts[i].value_off >= hdr->strings_len) {
+			return FALSE;
+		}
+	}
+
+	re_map = rspamd_regexp_map_create (data->map,
+			hdr->map_flags & RSPAMD_REGEXP_FLAG_MULTIPLE);
+
+	for (i = 0; i < hdr->nre; i ++) {
+		rspamd_re_map_insert_helper (re_map, strings + elts[i].key_off,
+				strings + elts[i].value_off);
+	}
+
+	if (re_map->regexps->len != hdr->nre) {
+		/* Regexps ids must match the database */
+		rspamd_regexp_map_destroy (re_map);
+
+		return FALSE;
+	}
+
+#ifdef WITH_HYPERSCAN
+	if (hdr->hs_len > 0 && hs_deserialize_database (
+			strings + hdr->strings_len, hdr->hs_len,
+			&re_map->hs_db) != HS_SUCCESS) {
+		/* Compiled again when map is finished */
+		re_map->hs_db = NULL;
+	}
+#endif
+
+	munmap (addr, len);
+	data->cur_data = re_map;
+
+	return TRUE;
+}
+
 #ifdef WITH_HYPERSCAN
 static int
 rspamd_match_hs_single_handler (unsigned int id, unsigned long long from,
@@ -2987,6 +5125,7 @@ rspamd_match_regexp_map_single (struct rspamd_regexp_map *map,
 	rspamd_regexp_t *re;
 	gint res = 0;
 	gpointer ret = NULL;
+	guchar *candidates = NULL;
 	gboolean validated = FALSE;
 
 	g_assert (in != NULL);
@@ -3024,7 +5163,15 @@ rspamd_match_regexp_map_single (struct rspamd_regexp_map *map,
 
 	if (!res) {
 		/* PCRE version */
+		if (map->prefilter) {
+			candidates = rspamd_re_map_candidates (map, in, len);
+		}
+
 		for (i = 0; i < map->regexps->len; i ++) {
+			if (candidates && !candidates[i]) {
+				continue;
+			}
+
 			re = g_ptr_array_index (map->regexps, i);
 
 			if (rspamd_regexp_search (re, in, len, NULL, NULL, !validated, NULL)) {
@@ -3032,6 +5179,8 @@ rspamd_match_regexp_map_single (struct rspamd_regexp_map *map,
 				break;
 			}
 		}
+
+		g_free (candidates);
 	}
 
 	return ret;
@@ -3067,6 +5216,7 @@ rspamd_match_regexp_map_all (struct rspamd_regexp_map *map,
 	rspamd_regexp_t *re;
 	GPtrArray *ret;
 	gint res = 0;
+	guchar *candidates = NULL;
 	gboolean validated = FALSE;
 
 	g_assert (in != NULL);
@@ -3105,7 +5255,15 @@ rspamd_match_regexp_map_all (struct rspamd_regexp_map *map,
 
 	if (!res) {
 		/* PCRE version */
+		if (map->prefilter) {
+			candidates = rspamd_re_map_candidates (map, in, len);
+		}
+
 		for (i = 0; i < map->regexps->len; i ++) {
+			if (candidates && !candidates[i]) {
+				continue;
+			}
+
 			re = g_ptr_array_index (map->regexps, i);
 
 			if (rspamd_regexp_search (re, in, len, NULL, NULL,
@@ -3113,6 +5271,8 @@ rspamd_match_regexp_map_all (struct rspamd_regexp_map *map,
 				g_ptr_array_add (ret, g_ptr_array_index (map->values, i));
 			}
 		}
+
+		g_free (candidates);
 	}
 
 	if (ret->len > 0) {
@@ -22,6 +22,13 @@ struct map_cb_data;
 typedef gchar * (*map_cb_t)(gchar *chunk, gint len,
 	struct map_cb_data *data, gboolean final);
 typedef void (*map_fin_cb_t)(struct map_cb_data *data);
+/* Serializes parsed data to a position independent buffer allocated by g_malloc */
+typedef guchar * (*map_compile_cb_t)(gpointer data, gsize *len);
+/* Takes ownership of the mapped compiled data of `len` bytes on success */
+typedef gboolean (*map_load_cb_t)(gpointer addr, gsize len,
+	struct map_cb_data *data);
+/* Moves shard `shard` of data parsed from a later chunk `src` to `dst` */
+typedef void (*map_merge_cb_t)(gpointer dst, gpointer src, guint shard);
 
 /**
  * Common map object
@@ -37,6 +44,8 @@ struct map_cb_data {
 	gint state;
 	void *prev_data;
 	void *cur_data;
+	/* Number of shards to split keys to when parsed by threads */
+	guint nshards;
 };
 
 /**
@@ -66,6 +75,35 @@ struct rspamd_map* rspamd_map_add_from_ucl (struct rspamd_config *cfg,
 	map_fin_cb_t fin_callback,
 	void **user_data);
 
+/**
+ * Allows sharing of parsed map data: the process that downloads a map
+ * compiles it to a shared memory segment and other processes map it instead
+ * of parsing the same data again
+ */
+void rspamd_map_set_shared (struct rspamd_map *map,
+	map_compile_cb_t compile_callback,
+	map_load_cb_t load_callback);
+
+/**
+ * Allows incremental updates of HTTP maps: if a server returns `Map-Version`
+ * header, the next request includes it and the server can reply with a delta
+ * marked by `Map-Delta` header. Delta is applied by `delta_callback` to the
+ * current data. Requires shared maps with a single backend. Deltas of signed
+ * maps are signed in `Signature` header (raw or hex encoded)
+ */
+void rspamd_map_set_delta (struct rspamd_map *map, map_cb_t delta_callback);
+
+/**
+ * Allows parsing of large map files by threads: data is split at line
+ * boundaries, chunks are parsed by `read_callback` to separate structures
+ * with keys split to `map_cb_data.nshards` shards by hash. Then each shard is
+ * merged by one thread in order of chunks, so later keys win. Structures of
+ * chunks except the first one are destroyed by `fin_callback` as previous
+ * data. `read_callback` and `merge_callback` must be thread safe
+ */
+void rspamd_map_set_parallel (struct rspamd_map *map,
+	map_merge_cb_t merge_callback);
+
 /**
  * Start watching of maps by adding events to libevent event loop
  */
@@ -93,6 +131,10 @@ gchar * rspamd_radix_read (
 	struct map_cb_data *data,
 	gboolean final);
 void rspamd_radix_fin (struct map_cb_data *data);
+/* Compile and load callbacks to share radix maps, see rspamd_map_set_shared */
+guchar * rspamd_radix_compile (gpointer data, gsize *len);
+gboolean rspamd_radix_load (gpointer addr, gsize len,
+	struct map_cb_data *data);
 
 /**
  * Host list is an ordinal list of hosts or domains
@@ -114,6 +156,63 @@ gchar * rspamd_kv_list_read (
 	gboolean final);
 void rspamd_kv_list_fin (struct map_cb_data *data);
 
+/**
+ * Hash of keys and values that can be shared between processes,
+ * `rspamd_hosts_shared_read` is used for sets and
+ * `rspamd_kv_list_shared_read` for key-value maps
+ */
+struct rspamd_hash_map_helper;
+
+gchar * rspamd_hosts_shared_read (
+	gchar *chunk,
+	gint len,
+	struct map_cb_data *data,
+	gboolean final);
+gchar * rspamd_kv_list_shared_read (
+	gchar *chunk,
+	gint len,
+	struct map_cb_data *data,
+	gboolean final);
+void rspamd_hash_map_fin (struct map_cb_data *data);
+void rspamd_hash_map_merge (gpointer dst, gpointer src, guint shard);
+/* Delta lines are `+key [value]` to add and `-key` to remove keys */
+gchar * rspamd_hosts_shared_delta (
+	gchar *chunk,
+	gint len,
+	struct map_cb_data *data,
+	gboolean final);
+gchar * rspamd_kv_list_shared_delta (
+	gchar *chunk,
+	gint len,
+	struct map_cb_data *data,
+	gboolean final);
+guchar * rspamd_hash_map_compile (gpointer data, gsize *len);
+gboolean rspamd_hash_map_load (gpointer addr, gsize len,
+	struct map_cb_data *data);
+
+/**
+ * Parses text map `src` and writes it to `dst` in the compiled format, that
+ * is mapped by file maps as is. Workers look up compiled files in place, so
+ * such files must be replaced by rename only: truncating or rewriting a
+ * mapped file makes workers crash with SIGBUS
+ * @param src
+ * @param dst
+ * @param kv TRUE for key-value maps, FALSE for sets
+ * @param err
+ * @return
+ */
+gboolean rspamd_hash_map_compile_file (const gchar *src, const gchar *dst,
+	gboolean kv, GError **err);
+
+/**
+ * Returns value for the specified key (case insensitive) or NULL
+ * @param map
+ * @param key
+ * @return
+ */
+const gchar * rspamd_match_hash_map (struct rspamd_hash_map_helper *map,
+	const gchar *key);
+
 /**
  * Regexp list is a list of regular expressions
  */
@@ -130,6 +229,10 @@ gchar * rspamd_regexp_list_read_multiple (
 		struct map_cb_data *data,
 		gboolean final);
 void rspamd_regexp_list_fin (struct map_cb_data *data);
+/* Compile and load callbacks to share regexp maps, see rspamd_map_set_shared */
+guchar * rspamd_regexp_map_compile (gpointer data, gsize *len);
+gboolean rspamd_regexp_map_load (gpointer addr, gsize len,
+	struct map_cb_data *data);
 
 /**
  * FSM for lists parsing (support comments, blank lines and partial replies)
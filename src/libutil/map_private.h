@@ -65,6 +65,8 @@ struct http_map_data {
 	gchar *host;
 	gchar *last_signature;
 	rspamd_fstring_t *etag;
+	/* Version of the loaded data to request deltas from */
+	rspamd_fstring_t *version;
 	time_t last_modified;
 	time_t last_checked;
 	gboolean request_sent;
@@ -99,7 +101,14 @@ struct rspamd_map_cachepoint {
 	gint available;
 	gsize len;
 	time_t last_modified;
+	/* Deltas are not cached, so data might be older than last_modified */
+	time_t shmem_modified;
 	gchar shmem_name[256];
+	/* Compiled data built from the cached data with the same last_modified */
+	gint compiled_available;
+	gsize compiled_len;
+	time_t compiled_modified;
+	gchar compiled_name[256];
 };
 
 struct rspamd_map {
@@ -108,6 +117,10 @@ struct rspamd_map {
 	GPtrArray *backends;
 	map_cb_t read_callback;
 	map_fin_cb_t fin_callback;
+	map_compile_cb_t compile_callback;
+	map_load_cb_t load_callback;
+	map_cb_t delta_callback;
+	map_merge_cb_t merge_callback;
 	void **user_data;
 	struct event_base *ev_base;
 	gchar *description;
@@ -144,6 +157,10 @@ struct map_periodic_cbdata {
 	gboolean need_modify;
 	gboolean errored;
 	gboolean locked;
+	/* Modification time of the applied delta */
+	time_t delta_modified;
+	/* Data of the current backend is parsed by threads */
+	gboolean parsing;
 	guint cur_backend;
 	ref_entry_t ref;
 };
@@ -158,6 +175,9 @@ struct http_callback_data {
 	struct map_periodic_cbdata *periodic;
 	struct rspamd_cryptobox_pubkey *pk;
 	gboolean check;
+	gboolean delta;
+	/* Modification time of the body, applied when the body is accepted */
+	time_t last_modified;
 	struct rspamd_storage_shmem *shmem_data;
 	struct rspamd_storage_shmem *shmem_sig;
 	struct rspamd_storage_shmem *shmem_pubkey;
@@ -172,4 +192,18 @@ struct http_callback_data {
 	ref_entry_t ref;
 };
 
+/* Regexp maps internals, exported for tests */
+gchar *rspamd_re_map_literal (const gchar *pattern, gboolean caseless,
+		gsize *plen);
+void rspamd_re_map_build_prefilter (struct rspamd_regexp_map *re_map);
+void rspamd_regexp_map_destroy (struct rspamd_regexp_map *re_map);
+
+/* Parallel parsing internals, exported for tests */
+/* Splits data to at most `nchunks` parts ending at line boundaries */
+guint rspamd_map_split_lines (const gchar *data, gsize len, guint nchunks,
+		gsize *ends);
+/* Parses data by threads like large map files and waits for the result */
+gpointer rspamd_map_parse_threaded (struct rspamd_map *map, gchar *data,
+		gsize len, guint nchunks);
+
 #endif /* SRC_LIBUTIL_MAP_PRIVATE_H_ */
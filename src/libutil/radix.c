@@ -36,12 +36,99 @@
         G_STRFUNC, \
         __VA_ARGS__)
 
+/*
+ * Compiled lookup tables for IPv4 and IPv6 keys. The first 16 bits of a key
+ * index a direct table, the rest is looked up in a poptrie like multibit trie
+ * with 8 bits stride. Each node has bitmaps of slots pointing to children and
+ * of slots starting runs of equal leaves, so children and leaves of a node are
+ * stored contiguously and indexed by popcount of these bitmaps.
+ */
+#define RADIX_DIRECT_BITS 16
+#define RADIX_DIRECT_SIZE (1u << RADIX_DIRECT_BITS)
+#define RADIX_NODE_FLAG (1u << 31)
+/* Nodes are 72 bytes, so larger tables cost more than 9Mb per process */
+#define RADIX_COMPILED_MAX_NODES (1u << 17)
+
+struct radix_compiled_node {
+	guint64 vector[4];       /**< slots that are children				*/
+	guint64 leafvec[4];      /**< leaf slots that start new runs		*/
+	guint32 base0;           /**< index of the first child				*/
+	guint32 base1;           /**< index of the first leaf				*/
+};
+
+struct radix_compiled_table {
+	guint32 *direct;
+	struct radix_compiled_node *nodes;
+	uintptr_t *leaves;
+	guint nnodes;
+	guint nleaves;
+};
+
 struct radix_tree_compressed {
 	rspamd_mempool_t *pool;
 	size_t size;
 	struct btrie *tree;
+	struct radix_compiled_table *compiled4;
+	/* Equal to compiled4 if there are no prefixes longer than 32 bits */
+	struct radix_compiled_table *compiled6;
 };
 
+static inline guint
+radix_popcount (guint64 v)
+{
+#ifdef __GNUC__
+	return __builtin_popcountll (v);
+#else
+	v = v - ((v >> 1) & 0x5555555555555555ULL);
+	v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+	v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+
+	return (v * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+/* Number of bits set in bitmap up to slot `s` inclusive */
+static inline guint
+radix_popcount_upto (const guint64 *bm, guint s)
+{
+	guint w = s >> 6, cnt = 0, i;
+
+	for (i = 0; i < w; i ++) {
+		cnt += radix_popcount (bm[i]);
+	}
+
+	/* Shift by 64 is undefined, so shift 2 instead of 1 */
+	return cnt + radix_popcount (bm[w] & ((2ULL << (s & 63)) - 1));
+}
+
+static uintptr_t
+radix_compiled_lookup (const struct radix_compiled_table *t,
+		const guint8 *key, gsize keylen)
+{
+	const struct radix_compiled_node *node;
+	guint32 e;
+	guint s;
+	gsize off = RADIX_DIRECT_BITS / NBBY;
+
+	e = t->direct[(key[0] << 8) | key[1]];
+
+	while ((e & RADIX_NODE_FLAG) && off < keylen) {
+		node = &t->nodes[e & ~RADIX_NODE_FLAG];
+		s = key[off ++];
+
+		if (node->vector[s >> 6] & (1ULL << (s & 63))) {
+			e = RADIX_NODE_FLAG | (node->base0 +
+					radix_popcount_upto (node->vector, s) - 1);
+		}
+		else {
+			return t->leaves[node->base1 +
+					radix_popcount_upto (node->leafvec, s) - 1];
+		}
+	}
+
+	return t->leaves[e & ~RADIX_NODE_FLAG];
+}
+
 uintptr_t
 radix_find_compressed (radix_compressed_t * tree, const guint8 *key, gsize keylen)
 {
@@ -49,6 +136,13 @@ radix_find_compressed (radix_compressed_t * tree, const guint8 *key, gsize keyle
 
 	g_assert (tree != NULL);
 
+	if (keylen == 4 && tree->compiled4) {
+		return radix_compiled_lookup (tree->compiled4, key, keylen);
+	}
+	else if (keylen == 16 && tree->compiled6) {
+		return radix_compiled_lookup (tree->compiled6, key, keylen);
+	}
+
 	ret = btrie_lookup (tree->tree, key, keylen * NBBY);
 
 	if (ret == NULL) {
@@ -59,6 +153,339 @@ radix_find_compressed (radix_compressed_t * tree, const guint8 *key, gsize keyle
 }
 
 
+struct radix_compile_prefix {
+	guint8 key[16];
+	guint len;
+	uintptr_t value;
+};
+
+struct radix_compile_ctx {
+	GArray *prefixes;
+	GArray *nodes;
+	GArray *leaves;
+	guint maxbits;
+	guint longest;
+	gboolean overflow;
+};
+
+static void
+radix_compiled_free (struct radix_compiled_table *t)
+{
+	if (t) {
+		g_free (t->direct);
+		g_free (t->nodes);
+		g_free (t->leaves);
+		g_free (t);
+	}
+}
+
+static void
+radix_compiled_drop (radix_compressed_t *tree)
+{
+	if (tree->compiled6 != tree->compiled4) {
+		radix_compiled_free (tree->compiled6);
+	}
+
+	radix_compiled_free (tree->compiled4);
+	tree->compiled4 = NULL;
+	tree->compiled6 = NULL;
+}
+
+static void
+radix_compile_walk_cb (const btrie_oct_t *prefix, unsigned len,
+		const void *data, int post, void *user_data)
+{
+	struct radix_compile_ctx *ctx = user_data;
+	struct radix_compile_prefix pfx;
+
+	if (post) {
+		return;
+	}
+
+	if (len > ctx->longest) {
+		ctx->longest = len;
+	}
+
+	/* Walk is in lexicographical order, so subtries are contiguous */
+	if (len > ctx->maxbits) {
+		return;
+	}
+
+	memset (&pfx, 0, sizeof (pfx));
+	memcpy (pfx.key, prefix, (len + NBBY - 1) / NBBY);
+
+	if (len % NBBY) {
+		pfx.key[len / NBBY] &= (guint8)(0xff << (NBBY - len % NBBY));
+	}
+
+	pfx.len = len;
+	pfx.value = data ? (uintptr_t)data : RADIX_NO_VALUE;
+	g_array_append_val (ctx->prefixes, pfx);
+}
+
+/*
+ * Fills values of `1 << stride` slots that follow `depth` bits of prefixes in
+ * range [lo, hi) and ranges of longer prefixes for each slot
+ */
+static void
+radix_compile_level (struct radix_compile_ctx *ctx, guint depth, guint stride,
+		uintptr_t def, guint lo, guint hi,
+		uintptr_t *vals, guint *clo, guint *chi)
+{
+	struct radix_compile_prefix *p;
+	guint i, j, slot, cnt, nslots = 1u << stride;
+
+	for (i = 0; i < nslots; i ++) {
+		vals[i] = def;
+		clo[i] = 0;
+		chi[i] = 0;
+	}
+
+	for (i = lo; i < hi; i ++) {
+		p = &g_array_index (ctx->prefixes, struct radix_compile_prefix, i);
+
+		if (stride == RADIX_DIRECT_BITS) {
+			slot = (p->key[0] << 8) | p->key[1];
+		}
+		else {
+			slot = p->key[depth / NBBY];
+		}
+
+		if (p->len <= depth + stride) {
+			/* Less specific prefixes come first and are overwritten */
+			cnt = 1u << (depth + stride - p->len);
+
+			for (j = slot; j < slot + cnt; j ++) {
+				vals[j] = p->value;
+			}
+		}
+		else {
+			if (chi[slot] == 0) {
+				clo[slot] = i;
+			}
+
+			chi[slot] = i + 1;
+		}
+	}
+}
+
+static void
+radix_compile_node (struct radix_compile_ctx *ctx, guint idx, guint depth,
+		uintptr_t def, guint lo, guint hi)
+{
+	struct radix_compiled_node node;
+	uintptr_t vals[256], prev = 0;
+	guint clo[256], chi[256], s, child, nchildren = 0;
+	gboolean first = TRUE;
+
+	if (ctx->overflow) {
+		return;
+	}
+
+	radix_compile_level (ctx, depth, NBBY, def, lo, hi, vals, clo, chi);
+	memset (&node, 0, sizeof (node));
+
+	for (s = 0; s < 256; s ++) {
+		if (chi[s] != 0) {
+			node.vector[s >> 6] |= 1ULL << (s & 63);
+			nchildren ++;
+		}
+	}
+
+	if (ctx->nodes->len + nchildren > RADIX_COMPILED_MAX_NODES) {
+		ctx->overflow = TRUE;
+
+		return;
+	}
+
+	node.base0 = ctx->nodes->len;
+	g_array_set_size (ctx->nodes, ctx->nodes->len + nchildren);
+	node.base1 = ctx->leaves->len;
+
+	/* Leaves of a node must be contiguous, so add them before children */
+	for (s = 0; s < 256; s ++) {
+		if (chi[s] == 0 && (first || vals[s] != prev)) {
+			node.leafvec[s >> 6] |= 1ULL << (s & 63);
+			g_array_append_val (ctx->leaves, vals[s]);
+			prev = vals[s];
+			first = FALSE;
+		}
+	}
+
+	g_array_index (ctx->nodes, struct radix_compiled_node, idx) = node;
+	child = node.base0;
+
+	for (s = 0; s < 256; s ++) {
+		if (chi[s] != 0) {
+			radix_compile_node (ctx, child ++, depth + NBBY, vals[s],
+					clo[s], chi[s]);
+		}
+	}
+}
+
+/*
+ * Returns NULL if tables need more than RADIX_COMPILED_MAX_NODES nodes,
+ * `longest` is set to the length of the longest prefix in the trie
+ */
+static struct radix_compiled_table *
+radix_compile_table (radix_compressed_t *tree, guint maxbits, guint *longest)
+{
+	struct radix_compile_ctx ctx;
+	struct radix_compiled_table *t = NULL;
+	uintptr_t *vals, prev = 0;
+	guint *clo, *chi, s, child, nchildren = 0, leaf = 0;
+	guint32 *direct;
+	gboolean first = TRUE;
+
+	ctx.maxbits = maxbits;
+	ctx.longest = 0;
+	ctx.overflow = FALSE;
+	ctx.prefixes = g_array_sized_new (FALSE, FALSE,
+			sizeof (struct radix_compile_prefix), tree->size);
+	btrie_walk (tree->tree, radix_compile_walk_cb, &ctx);
+
+	if (longest) {
+		*longest = ctx.longest;
+	}
+
+	ctx.nodes = g_array_new (FALSE, FALSE, sizeof (struct radix_compiled_node));
+	ctx.leaves = g_array_new (FALSE, FALSE, sizeof (uintptr_t));
+	vals = g_malloc (RADIX_DIRECT_SIZE * sizeof (*vals));
+	clo = g_malloc (RADIX_DIRECT_SIZE * sizeof (*clo));
+	chi = g_malloc (RADIX_DIRECT_SIZE * sizeof (*chi));
+	direct = g_malloc (RADIX_DIRECT_SIZE * sizeof (*direct));
+
+	radix_compile_level (&ctx, 0, RADIX_DIRECT_BITS, RADIX_NO_VALUE,
+			0, ctx.prefixes->len, vals, clo, chi);
+
+	for (s = 0; s < RADIX_DIRECT_SIZE; s ++) {
+		if (chi[s] != 0) {
+			nchildren ++;
+		}
+	}
+
+	g_array_set_size (ctx.nodes, nchildren);
+	child = 0;
+
+	for (s = 0; s < RADIX_DIRECT_SIZE && !ctx.overflow; s ++) {
+		if (chi[s] != 0) {
+			direct[s] = RADIX_NODE_FLAG | child;
+			radix_compile_node (&ctx, child ++, RADIX_DIRECT_BITS, vals[s],
+					clo[s], chi[s]);
+		}
+		else {
+			if (first || vals[s] != prev) {
+				leaf = ctx.leaves->len;
+				g_array_append_val (ctx.leaves, vals[s]);
+				prev = vals[s];
+				first = FALSE;
+			}
+
+			direct[s] = leaf;
+		}
+	}
+
+	if (ctx.overflow) {
+		msg_info_radix ("lookup tables for %ud bits keys need more than %ud "
+				"nodes, use trie", maxbits, RADIX_COMPILED_MAX_NODES);
+		g_array_free (ctx.nodes, TRUE);
+		g_array_free (ctx.leaves, TRUE);
+		g_free (direct);
+	}
+	else {
+		t = g_malloc0 (sizeof (*t));
+		t->direct = direct;
+		t->nnodes = ctx.nodes->len;
+		t->nleaves = ctx.leaves->len;
+		t->nodes = (struct radix_compiled_node *)g_array_free (ctx.nodes, FALSE);
+		t->leaves = (uintptr_t *)g_array_free (ctx.leaves, FALSE);
+	}
+
+	g_array_free (ctx.prefixes, TRUE);
+	g_free (vals);
+	g_free (clo);
+	g_free (chi);
+
+	return t;
+}
+
+struct radix_walk_cbdata {
+	radix_walk_cb_t cb;
+	gpointer ud;
+};
+
+static void
+radix_walk_cb (const btrie_oct_t *prefix, unsigned len,
+		const void *data, int post, void *user_data)
+{
+	struct radix_walk_cbdata *cbd = user_data;
+	guint8 key[16];
+
+	if (post || len > sizeof (key) * NBBY) {
+		return;
+	}
+
+	memset (key, 0, sizeof (key));
+	memcpy (key, prefix, (len + NBBY - 1) / NBBY);
+	cbd->cb (key, len, data ? (uintptr_t)data : RADIX_NO_VALUE, cbd->ud);
+}
+
+void
+radix_walk_compressed (radix_compressed_t *tree, radix_walk_cb_t cb,
+		gpointer ud)
+{
+	struct radix_walk_cbdata cbd;
+
+	g_assert (tree != NULL);
+
+	cbd.cb = cb;
+	cbd.ud = ud;
+	btrie_walk (tree->tree, radix_walk_cb, &cbd);
+}
+
+gsize
+radix_compile_compressed (radix_compressed_t *tree)
+{
+	gsize len = 0;
+	guint longest = 0;
+
+	g_assert (tree != NULL);
+
+	radix_compiled_drop (tree);
+	tree->compiled4 = radix_compile_table (tree, 32, &longest);
+
+	if (tree->compiled4 == NULL) {
+		return 0;
+	}
+
+	len += RADIX_DIRECT_SIZE * sizeof (guint32);
+	len += tree->compiled4->nnodes * sizeof (struct radix_compiled_node);
+	len += tree->compiled4->nleaves * sizeof (uintptr_t);
+
+	if (longest <= 32) {
+		/*
+		 * IPv4 and IPv6 keys share the trie, so without longer prefixes
+		 * IPv6 keys match the same prefixes of their first 32 bits
+		 */
+		tree->compiled6 = tree->compiled4;
+	}
+	else {
+		tree->compiled6 = radix_compile_table (tree, 128, NULL);
+
+		if (tree->compiled6) {
+			len += RADIX_DIRECT_SIZE * sizeof (guint32);
+			len += tree->compiled6->nnodes * sizeof (struct radix_compiled_node);
+			len += tree->compiled6->nleaves * sizeof (uintptr_t);
+		}
+	}
+
+	msg_debug_radix ("compiled lookup tables: %ud/%ud nodes, %z bytes",
+			tree->compiled4->nnodes,
+			tree->compiled6 ? tree->compiled6->nnodes : 0, len);
+
+	return len;
+}
+
 uintptr_t
 radix_insert_compressed (radix_compressed_t * tree,
 	guint8 *key, gsize keylen,
@@ -73,6 +500,11 @@ radix_insert_compressed (radix_compressed_t * tree,
 	g_assert (tree != NULL);
 	g_assert (keybits >= masklen);
 
+	if (tree->compiled4) {
+		/* Tables are rebuilt on the next compilation */
+		radix_compiled_drop (tree);
+	}
+
 	msg_debug_radix ("want insert value %p with mask %z, key: %*xs",
 			(gpointer)value, keybits - masklen, (int)keylen, key);
 
@@ -130,6 +562,7 @@ void
 radix_destroy_compressed (radix_compressed_t *tree)
 {
 	if (tree) {
+		radix_compiled_drop (tree);
 		rspamd_mempool_delete (tree->pool);
 		g_free (tree);
 	}
@@ -59,6 +59,29 @@ uintptr_t radix_find_compressed (radix_compressed_t * tree, const guint8 *key,
 uintptr_t radix_find_compressed_addr (radix_compressed_t *tree,
 		const rspamd_inet_addr_t *addr);
 
+/**
+ * Builds lookup tables for IPv4 and IPv6 keys that are used instead of the trie
+ * until the next insertion. Tables take at least 256Kb, so this is useful for
+ * large trees only. Trees that need too many nodes are left for the trie
+ * @param tree
+ * @return size of tables in bytes or 0 if tables are not built
+ */
+gsize radix_compile_compressed (radix_compressed_t *tree);
+
+typedef void (*radix_walk_cb_t) (const guint8 *key, gsize bits,
+		uintptr_t value, gpointer ud);
+
+/**
+ * Calls `cb` for each prefix stored in the tree in lexicographical order,
+ * `key` is padded by zeroes to 16 bytes. Keys of all lengths share the same
+ * trie, so a prefix should be inserted back as a 16 bytes key
+ * @param tree
+ * @param cb
+ * @param ud
+ */
+void radix_walk_compressed (radix_compressed_t *tree, radix_walk_cb_t cb,
+		gpointer ud);
+
 /**
  * Destroy the complete radix trie
  * @param tree
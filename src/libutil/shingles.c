@@ -341,3 +341,27 @@ gdouble rspamd_shingles_compare (const struct rspamd_shingle *a,
 
 	return (gdouble)common / (gdouble)RSPAMD_SHINGLE_SIZE;
 }
+
+guint
+rspamd_shingles_bands_count (guint band_size)
+{
+	g_assert (band_size > 0);
+
+	return (RSPAMD_SHINGLE_SIZE + band_size - 1) / band_size;
+}
+
+guint64
+rspamd_shingles_band_key (const struct rspamd_shingle *sgl,
+		guint band, guint band_size)
+{
+	guint start, len;
+
+	g_assert (band_size > 0);
+	start = band * band_size;
+	g_assert (start < RSPAMD_SHINGLE_SIZE);
+	len = MIN (band_size, RSPAMD_SHINGLE_SIZE - start);
+
+	/* Band number is used as seed, so equal values in different bands differ */
+	return rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+			&sgl->hashes[start], len * sizeof (sgl->hashes[0]), band);
+}
@@ -84,6 +84,25 @@ struct rspamd_shingle* rspamd_shingles_from_image (guchar *dct,
 gdouble rspamd_shingles_compare (const struct rspamd_shingle *a,
 		const struct rspamd_shingle *b);
 
+/**
+ * Returns number of bands for LSH index with the specified band size
+ * @param band_size number of shingles in a band
+ * @return
+ */
+guint rspamd_shingles_bands_count (guint band_size);
+
+/**
+ * Returns composite key of a band of shingles suitable for LSH index: two
+ * shingles sets share band key if all shingles within this band are equal.
+ * The key is platform independent, so it could be stored persistently
+ * @param sgl shingles
+ * @param band band number
+ * @param band_size number of shingles in a band (the last band might be shorter)
+ * @return composite key
+ */
+guint64 rspamd_shingles_band_key (const struct rspamd_shingle *sgl,
+		guint band, guint band_size);
+
 /**
  * Default filtering function
  */
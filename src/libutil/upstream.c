@@ -21,6 +21,7 @@
 #include "rdns.h"
 #include "cryptobox.h"
 #include "utlist.h"
+#include <math.h>
 
 struct upstream_inet_addr_entry {
 	rspamd_inet_addr_t *addr;
@@ -42,6 +43,12 @@ struct upstream {
 	gchar *name;
 	struct event ev;
 	gdouble last_fail;
+	/* Moving average of request durations */
+	gdouble latency;
+	gdouble latency_updated;
+	/* Decaying number of selected requests not reported yet */
+	gdouble inflight;
+	gdouble inflight_updated;
 	gpointer ud;
 	struct upstream_list *ls;
 	GList *ctx_pos;
@@ -99,6 +106,17 @@ static gdouble default_revive_jitter = 0.4;
 static gdouble default_error_time = 10;
 static gdouble default_dns_timeout = 1.0;
 static guint default_dns_retransmits = 2;
+/* Weight of a new sample in the average latency */
+static const gdouble latency_alpha = 0.3;
+/* Average latency halves in this time, so slow upstreams are checked again */
+static const gdouble latency_decay_time = 10.0;
+/* Latency added for failed requests */
+static const gdouble latency_fail_penalty = 1.0;
+/*
+ * Requests in flight are forgotten with this half-life, so selections that
+ * are never reported as ok or failed do not penalize an upstream forever
+ */
+static const gdouble inflight_decay_time = 5.0;
 
 void
 rspamd_upstreams_library_config (struct rspamd_config *cfg,
@@ -424,6 +442,51 @@ rspamd_upstream_set_inactive (struct upstream_list *ls, struct upstream *up)
 	RSPAMD_UPSTREAM_UNLOCK (ls->lock);
 }
 
+static gdouble
+rspamd_upstream_decayed_latency (struct upstream *up, gdouble now)
+{
+	if (up->latency > 0 && now > up->latency_updated) {
+		return up->latency * exp2 (-(now - up->latency_updated) /
+				latency_decay_time);
+	}
+
+	return up->latency;
+}
+
+static void
+rspamd_upstream_update_latency (struct upstream *up, gdouble latency,
+		gdouble now)
+{
+	gdouble cur = rspamd_upstream_decayed_latency (up, now);
+
+	if (cur > 0) {
+		up->latency = cur + latency_alpha * (latency - cur);
+	}
+	else {
+		up->latency = latency;
+	}
+
+	up->latency_updated = now;
+}
+
+static gdouble
+rspamd_upstream_decayed_inflight (struct upstream *up, gdouble now)
+{
+	if (up->inflight > 0 && now > up->inflight_updated) {
+		return up->inflight * exp2 (-(now - up->inflight_updated) /
+				inflight_decay_time);
+	}
+
+	return up->inflight;
+}
+
+static void
+rspamd_upstream_add_inflight (struct upstream *up, gdouble delta, gdouble now)
+{
+	up->inflight = MAX (rspamd_upstream_decayed_inflight (up, now) + delta, 0);
+	up->inflight_updated = now;
+}
+
 void
 rspamd_upstream_fail (struct upstream *up)
 {
@@ -431,10 +494,18 @@ rspamd_upstream_fail (struct upstream *up)
 	gdouble sec_last, sec_cur;
 	struct upstream_addr_elt *addr_elt;
 
-	if (up->active_idx != -1) {
-		sec_cur = rspamd_get_ticks (FALSE);
+	sec_cur = rspamd_get_ticks (FALSE);
+	RSPAMD_UPSTREAM_LOCK (up->lock);
+	rspamd_upstream_add_inflight (up, -1, sec_cur);
+	RSPAMD_UPSTREAM_UNLOCK (up->lock);
 
+	if (up->active_idx != -1) {
 		RSPAMD_UPSTREAM_LOCK (up->lock);
+		rspamd_upstream_update_latency (up,
+				MAX (rspamd_upstream_decayed_latency (up, sec_cur) * 2,
+						latency_fail_penalty),
+				sec_cur);
+
 		if (up->errors == 0) {
 			/* We have the first error */
 			up->last_fail = sec_cur;
@@ -489,6 +560,8 @@ rspamd_upstream_ok (struct upstream *up)
 	struct upstream_addr_elt *addr_elt;
 
 	RSPAMD_UPSTREAM_LOCK (up->lock);
+	rspamd_upstream_add_inflight (up, -1, rspamd_get_ticks (FALSE));
+
 	if (up->errors > 0 && up->active_idx != -1) {
 		/* We touch upstream if and only if it is active */
 		up->errors = 0;
@@ -502,6 +575,17 @@ rspamd_upstream_ok (struct upstream *up)
 	RSPAMD_UPSTREAM_UNLOCK (up->lock);
 }
 
+void
+rspamd_upstream_ok_latency (struct upstream *up, gdouble latency)
+{
+	RSPAMD_UPSTREAM_LOCK (up->lock);
+	rspamd_upstream_update_latency (up, MAX (latency, 0),
+			rspamd_get_ticks (FALSE));
+	RSPAMD_UPSTREAM_UNLOCK (up->lock);
+
+	rspamd_upstream_ok (up);
+}
+
 void
 rspamd_upstream_set_weight (struct upstream *up, guint weight)
 {
@@ -742,6 +826,12 @@ rspamd_upstreams_parse_line (struct upstream_list *ups,
 		ups->rot_alg = RSPAMD_UPSTREAM_SEQUENTIAL;
 		p += sizeof ("sequential:") - 1;
 	}
+	else if (g_ascii_strncasecmp (p,
+			"latency:",
+			sizeof ("latency:") - 1) == 0) {
+		ups->rot_alg = RSPAMD_UPSTREAM_LATENCY;
+		p += sizeof ("latency:") - 1;
+	}
 
 	while (p < end) {
 		len = strcspn (p, separators);
@@ -894,6 +984,47 @@ rspamd_upstream_get_round_robin (struct upstream_list *ups, gboolean use_cur)
 	return selected;
 }
 
+/*
+ * Power of two choices: compare two random upstreams by their average latency
+ * multiplied by the number of requests in flight, upstreams with no latency
+ * measured are preferred
+ */
+static struct upstream*
+rspamd_upstream_get_latency (struct upstream_list *ups)
+{
+	struct upstream *a, *b, *selected;
+	gdouble now, cost_a, cost_b;
+	guint i, j;
+
+	RSPAMD_UPSTREAM_LOCK (ups->lock);
+
+	if (ups->alive->len == 1) {
+		selected = g_ptr_array_index (ups->alive, 0);
+	}
+	else {
+		i = ottery_rand_range (ups->alive->len - 1);
+		j = ottery_rand_range (ups->alive->len - 2);
+
+		if (j >= i) {
+			j ++;
+		}
+
+		a = g_ptr_array_index (ups->alive, i);
+		b = g_ptr_array_index (ups->alive, j);
+		now = rspamd_get_ticks (FALSE);
+		cost_a = rspamd_upstream_decayed_latency (a, now) *
+				(rspamd_upstream_decayed_inflight (a, now) + 1);
+		cost_b = rspamd_upstream_decayed_latency (b, now) *
+				(rspamd_upstream_decayed_inflight (b, now) + 1);
+		selected = cost_a <= cost_b ? a : b;
+	}
+
+	rspamd_upstream_add_inflight (selected, 1, rspamd_get_ticks (FALSE));
+	RSPAMD_UPSTREAM_UNLOCK (ups->lock);
+
+	return selected;
+}
+
 /*
  * The key idea of this function is obtained from the following paper:
  * A Fast, Minimal Memory, Consistent Hash Algorithm
@@ -973,6 +1104,9 @@ rspamd_upstream_get_common (struct upstream_list *ups,
 	case RSPAMD_UPSTREAM_MASTER_SLAVE:
 		up = rspamd_upstream_get_round_robin (ups, FALSE);
 		break;
+	case RSPAMD_UPSTREAM_LATENCY:
+		up = rspamd_upstream_get_latency (ups);
+		break;
 	case RSPAMD_UPSTREAM_SEQUENTIAL:
 		if (ups->cur_elt >= ups->alive->len) {
 			ups->cur_elt = 0;
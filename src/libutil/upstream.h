@@ -12,6 +12,7 @@ enum rspamd_upstream_rotation {
 	RSPAMD_UPSTREAM_ROUND_ROBIN,
 	RSPAMD_UPSTREAM_MASTER_SLAVE,
 	RSPAMD_UPSTREAM_SEQUENTIAL,
+	RSPAMD_UPSTREAM_LATENCY,
 	RSPAMD_UPSTREAM_UNDEF
 };
 
@@ -62,6 +63,12 @@ void rspamd_upstream_fail (struct upstream *up);
  */
 void rspamd_upstream_ok (struct upstream *up);
 
+/**
+ * Increase upstream successes count and add request duration (in seconds)
+ * to the average latency used by `RSPAMD_UPSTREAM_LATENCY` rotation
+ */
+void rspamd_upstream_ok_latency (struct upstream *up, gdouble latency);
+
 /**
  * Set weight for an upstream
  * @param up
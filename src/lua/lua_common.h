@@ -105,7 +105,7 @@ struct rspamd_lua_map {
 
 	union {
 		struct radix_tree_compressed *radix;
-		GHashTable *hash;
+		struct rspamd_hash_map_helper *hash;
 		struct lua_map_callback_data *cbdata;
 		struct rspamd_regexp_map *re_map;
 	} data;
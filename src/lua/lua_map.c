@@ -136,6 +136,7 @@ lua_config_add_radix_map (lua_State *L)
 			return 1;
 		}
 
+		rspamd_map_set_shared (m, rspamd_radix_compile, rspamd_radix_load);
 		map->map = m;
 		pmap = lua_newuserdata (L, sizeof (void *));
 		*pmap = map;
@@ -279,14 +280,18 @@ lua_config_add_hash_map (lua_State *L)
 		map->type = RSPAMD_LUA_MAP_SET;
 
 		if ((m = rspamd_map_add (cfg, map_line, description,
-				rspamd_hosts_read,
-				rspamd_hosts_fin,
+				rspamd_hosts_shared_read,
+				rspamd_hash_map_fin,
 				(void **)&map->data.hash)) == NULL) {
 			msg_warn_config ("invalid set map %s", map_line);
 			lua_pushnil (L);
 			return 1;
 		}
 
+		rspamd_map_set_shared (m, rspamd_hash_map_compile,
+				rspamd_hash_map_load);
+		rspamd_map_set_delta (m, rspamd_hosts_shared_delta);
+		rspamd_map_set_parallel (m, rspamd_hash_map_merge);
 		map->map = m;
 		pmap = lua_newuserdata (L, sizeof (void *));
 		*pmap = map;
@@ -316,8 +321,8 @@ lua_config_add_kv_map (lua_State *L)
 		map->type = RSPAMD_LUA_MAP_HASH;
 
 		if ((m = rspamd_map_add (cfg, map_line, description,
-				rspamd_kv_list_read,
-				rspamd_kv_list_fin,
+				rspamd_kv_list_shared_read,
+				rspamd_hash_map_fin,
 				(void **)&map->data.hash)) == NULL) {
 			msg_warn_config ("invalid hash map %s", map_line);
 			lua_pushnil (L);
@@ -325,6 +330,10 @@ lua_config_add_kv_map (lua_State *L)
 			return 1;
 		}
 
+		rspamd_map_set_shared (m, rspamd_hash_map_compile,
+				rspamd_hash_map_load);
+		rspamd_map_set_delta (m, rspamd_kv_list_shared_delta);
+		rspamd_map_set_parallel (m, rspamd_hash_map_merge);
 		map->map = m;
 		pmap = lua_newuserdata (L, sizeof (void *));
 		*pmap = map;
@@ -478,14 +487,19 @@ lua_config_add_map (lua_State *L)
 			map->type = RSPAMD_LUA_MAP_SET;
 
 			if ((m = rspamd_map_add_from_ucl (cfg, map_obj, description,
-					rspamd_hosts_read,
-					rspamd_hosts_fin,
+					rspamd_hosts_shared_read,
+					rspamd_hash_map_fin,
 					(void **)&map->data.hash)) == NULL) {
 				lua_pushnil (L);
 				ucl_object_unref (map_obj);
 
 				return 1;
 			}
+
+			rspamd_map_set_shared (m, rspamd_hash_map_compile,
+					rspamd_hash_map_load);
+			rspamd_map_set_delta (m, rspamd_hosts_shared_delta);
+			rspamd_map_set_parallel (m, rspamd_hash_map_merge);
 		}
 		else if (strcmp (type, "map") == 0 || strcmp (type, "hash") == 0) {
 			map = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*map));
@@ -493,14 +507,19 @@ lua_config_add_map (lua_State *L)
 			map->type = RSPAMD_LUA_MAP_HASH;
 
 			if ((m = rspamd_map_add_from_ucl (cfg, map_obj, description,
-					rspamd_kv_list_read,
-					rspamd_kv_list_fin,
+					rspamd_kv_list_shared_read,
+					rspamd_hash_map_fin,
 					(void **)&map->data.hash)) == NULL) {
 				lua_pushnil (L);
 				ucl_object_unref (map_obj);
 
 				return 1;
 			}
+
+			rspamd_map_set_shared (m, rspamd_hash_map_compile,
+					rspamd_hash_map_load);
+			rspamd_map_set_delta (m, rspamd_kv_list_shared_delta);
+			rspamd_map_set_parallel (m, rspamd_hash_map_merge);
 		}
 		else if (strcmp (type, "radix") == 0) {
 			map = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*map));
@@ -516,6 +535,8 @@ lua_config_add_map (lua_State *L)
 
 				return 1;
 			}
+
+			rspamd_map_set_shared (m, rspamd_radix_compile, rspamd_radix_load);
 		}
 		else if (strcmp (type, "regexp") == 0) {
 			map = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*map));
@@ -531,6 +552,9 @@ lua_config_add_map (lua_State *L)
 
 				return 1;
 			}
+
+			rspamd_map_set_shared (m, rspamd_regexp_map_compile,
+					rspamd_regexp_map_load);
 		}
 		else if (strcmp (type, "regexp_multi") == 0) {
 			map = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*map));
@@ -546,6 +570,9 @@ lua_config_add_map (lua_State *L)
 
 				return 1;
 			}
+
+			rspamd_map_set_shared (m, rspamd_regexp_map_compile,
+					rspamd_regexp_map_load);
 		}
 		else {
 			ret = luaL_error (L, "invalid arguments: unknown type '%s'", type);
@@ -670,7 +697,7 @@ lua_map_get_key (lua_State * L)
 			key = lua_map_process_string_key (L, 2, &len);
 
 			if (key && map->data.hash) {
-				ret = g_hash_table_lookup (map->data.hash, key) != NULL;
+				ret = rspamd_match_hash_map (map->data.hash, key) != NULL;
 			}
 		}
 		else if (map->type == RSPAMD_LUA_MAP_REGEXP) {
@@ -716,7 +743,7 @@ lua_map_get_key (lua_State * L)
 			key = lua_map_process_string_key (L, 2, &len);
 
 			if (key && map->data.hash) {
-				value = g_hash_table_lookup (map->data.hash, key);
+				value = rspamd_match_hash_map (map->data.hash, key);
 			}
 
 			if (value) {
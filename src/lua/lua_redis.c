@@ -97,6 +97,7 @@ struct lua_redis_userdata {
 	struct event_base *ev_base;
 	struct rspamd_config *cfg;
 	struct rspamd_redis_pool *pool;
+	struct rspamd_redis_pool_elt *pipeline;
 	gchar *server;
 	gchar *reqline;
 	struct lua_redis_specific_userdata *specific;
@@ -120,6 +121,7 @@ struct lua_redis_specific_userdata {
 	struct lua_redis_userdata *c;
 	struct lua_redis_ctx *ctx;
 	struct lua_redis_specific_userdata *next;
+	struct rspamd_redis_pool_request *req;
 	struct event timeout;
 	guint flags;
 };
@@ -186,6 +188,17 @@ lua_redis_dtor (struct lua_redis_ctx *ctx)
 			ud->ctx = NULL;
 			rspamd_redis_pool_release_connection (ud->pool, ac, is_successful);
 		}
+		else if (ud->pipeline) {
+			LL_FOREACH (ud->specific, cur) {
+				if (cur->req) {
+					/* Reply has not been received */
+					rspamd_redis_pool_pipeline_cancel (cur->req, FALSE);
+					cur->req = NULL;
+				}
+			}
+
+			ud->terminated = 1;
+		}
 
 		LL_FOREACH_SAFE (ud->specific, cur, tmp) {
 			lua_redis_free_args (cur->args, cur->arglens, cur->nargs);
@@ -420,6 +433,19 @@ lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 	REDIS_RELEASE (ctx);
 }
 
+/**
+ * Callback for replies to pipelined commands
+ */
+static void
+lua_redis_pipeline_callback (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct lua_redis_specific_userdata *sp_ud = priv;
+
+	/* Request is freed by the pool after the callback */
+	sp_ud->req = NULL;
+	lua_redis_callback (c, r, priv);
+}
+
 static void
 lua_redis_timeout (int fd, short what, gpointer u)
 {
@@ -435,6 +461,13 @@ lua_redis_timeout (int fd, short what, gpointer u)
 
 	REDIS_RETAIN (ctx);
 	msg_debug ("timeout while querying redis server");
+
+	if (sp_ud->req) {
+		/* New commands, even from the callback, use another connection */
+		rspamd_redis_pool_pipeline_cancel (sp_ud->req, TRUE);
+		sp_ud->req = NULL;
+	}
+
 	lua_redis_push_error ("timeout while connecting the server", ctx, sp_ud, TRUE);
 
 	if (sp_ud->c->ctx) {
@@ -550,8 +583,13 @@ lua_redis_parse_args (lua_State *L, gint idx, const gchar *cmd,
 	*nargs = top;
 }
 
+/*
+ * If `cmd` is not NULL, then it is the only command sent and it can be
+ * pipelined with commands from other tasks
+ */
 static struct lua_redis_ctx *
-rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref)
+rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref,
+		const gchar *cmd)
 {
 	struct lua_redis_ctx *ctx;
 	rspamd_inet_addr_t *ip = NULL;
@@ -699,6 +737,20 @@ rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref)
 		}
 	}
 
+	if (ret && rspamd_redis_pool_can_pipeline (ud->pool, cmd)) {
+		ud->terminated = 0;
+		ud->pipeline = rspamd_redis_pool_pipeline (ud->pool,
+				dbname, password,
+				rspamd_inet_address_to_string (addr->addr),
+				rspamd_inet_address_get_port (addr->addr));
+
+		if (ip) {
+			rspamd_inet_address_free (ip);
+		}
+
+		return ctx;
+	}
+
 	if (ret) {
 		ud->terminated = 0;
 		ud->ctx = rspamd_redis_pool_connect (ud->pool,
@@ -746,6 +798,8 @@ rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref)
  * @param {string} cmd command to be sent to redis
  * @param {table} args numeric array of strings used as redis arguments
  * @param {number} timeout timeout in seconds for request (1.0 by default)
+ * Unless `redis_pipelining` option is disabled, the command is sent over
+ * a connection shared with requests from other tasks
  * @return {boolean} `true` if a request has been scheduled
  */
 static int
@@ -760,7 +814,14 @@ lua_redis_make_request (lua_State *L)
 	gint cbref = -1;
 	gboolean ret = FALSE;
 
-	ctx = rspamd_lua_redis_prepare_connection (L, &cbref);
+	if (lua_istable (L, 1)) {
+		lua_pushstring (L, "cmd");
+		lua_gettable (L, 1);
+		cmd = lua_tostring (L, -1);
+		lua_pop (L, 1);
+	}
+
+	ctx = rspamd_lua_redis_prepare_connection (L, &cbref, cmd);
 
 	if (ctx) {
 		ud = &ctx->d.async;
@@ -769,11 +830,6 @@ lua_redis_make_request (lua_State *L)
 		sp_ud->c = ud;
 		sp_ud->ctx = ctx;
 
-		lua_pushstring (L, "cmd");
-		lua_gettable (L, -2);
-		cmd = lua_tostring (L, -1);
-		lua_pop (L, 1);
-
 		lua_pushstring (L, "timeout");
 		lua_gettable (L, -2);
 		if (lua_type (L, -1) == LUA_TNUMBER) {
@@ -789,12 +845,24 @@ lua_redis_make_request (lua_State *L)
 				&sp_ud->nargs);
 		lua_pop (L, 1);
 		LL_PREPEND (ud->specific, sp_ud);
-		ret = redisAsyncCommandArgv (ud->ctx,
-				lua_redis_callback,
-				sp_ud,
-				sp_ud->nargs,
-				(const gchar **)sp_ud->args,
-				sp_ud->arglens);
+
+		if (ud->pipeline) {
+			sp_ud->req = rspamd_redis_pool_pipeline_command (ud->pipeline,
+					lua_redis_pipeline_callback,
+					sp_ud,
+					sp_ud->nargs,
+					(const gchar **)sp_ud->args,
+					sp_ud->arglens);
+			ret = sp_ud->req != NULL ? REDIS_OK : REDIS_ERR;
+		}
+		else {
+			ret = redisAsyncCommandArgv (ud->ctx,
+					lua_redis_callback,
+					sp_ud,
+					sp_ud->nargs,
+					(const gchar **)sp_ud->args,
+					sp_ud->arglens);
+		}
 
 		if (ret == REDIS_OK) {
 			if (ud->s) {
@@ -818,9 +886,15 @@ lua_redis_make_request (lua_State *L)
 			ret = TRUE;
 		}
 		else {
-			msg_info ("call to redis failed: %s", ud->ctx->errstr);
-			rspamd_redis_pool_release_connection (ud->pool, ud->ctx, TRUE);
-			ud->ctx = NULL;
+			if (ud->ctx) {
+				msg_info ("call to redis failed: %s", ud->ctx->errstr);
+				rspamd_redis_pool_release_connection (ud->pool, ud->ctx, TRUE);
+				ud->ctx = NULL;
+			}
+			else {
+				msg_info ("call to redis failed: cannot send pipelined command");
+			}
+
 			REDIS_RELEASE (ctx);
 			ret = FALSE;
 		}
@@ -996,7 +1070,7 @@ lua_redis_connect (lua_State *L)
 	struct lua_redis_ctx *ctx, **pctx;
 	gdouble timeout = REDIS_DEFAULT_TIMEOUT;
 
-	ctx = rspamd_lua_redis_prepare_connection (L, NULL);
+	ctx = rspamd_lua_redis_prepare_connection (L, NULL, NULL);
 
 	if (ctx) {
 		ud = &ctx->d.async;
@@ -1309,6 +1383,9 @@ lua_redis_exec (lua_State *L)
 
 				nret += 2;
 			}
+
+			/* Connection can be used for the next batch of commands */
+			ctx->cmds_pending = 0;
 		}
 	}
 
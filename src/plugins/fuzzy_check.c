@@ -87,8 +87,10 @@ struct fuzzy_rule {
 	gboolean skip_unknown;
 	gboolean fuzzy_images;
 	gboolean short_text_direct_hash;
+	gboolean batch;
 	gint learn_condition_cb;
 	GHashTable *skip_map;
+	GHashTable *batch_servers;
 };
 
 struct fuzzy_ctx {
@@ -136,6 +138,8 @@ struct fuzzy_client_session {
 	gint state;
 	gint fd;
 	guint retransmits;
+	gboolean batch;
+	gdouble start;
 };
 
 struct fuzzy_learn_session {
@@ -158,6 +162,7 @@ struct fuzzy_learn_session {
 #define FUZZY_CMD_FLAG_REPLIED (1 << 0)
 #define FUZZY_CMD_FLAG_SENT (1 << 1)
 #define FUZZY_CMD_FLAG_IMAGE (1 << 2)
+#define FUZZY_CMD_FLAG_ENCRYPTED (1 << 3)
 
 #define FUZZY_CHECK_FLAG_NOIMAGES (1 << 0)
 #define FUZZY_CHECK_FLAG_NOATTACHMENTS (1 << 1)
@@ -168,6 +173,8 @@ struct fuzzy_cmd_io {
 	guint32 flags;
 	struct rspamd_fuzzy_cmd cmd;
 	struct iovec io;
+	guchar *payload;            /**< plain command inside io, encrypted lazily */
+	gsize payload_len;
 };
 
 static struct fuzzy_ctx *fuzzy_module_ctx = NULL;
@@ -374,7 +381,12 @@ fuzzy_rule_new (const char *default_symbol, rspamd_mempool_t *pool)
 	rspamd_mempool_add_destructor (pool,
 		(rspamd_mempool_destruct_t)g_hash_table_unref,
 		rule->mappings);
+	rule->batch_servers = g_hash_table_new (g_direct_hash, g_direct_equal);
+	rspamd_mempool_add_destructor (pool,
+		(rspamd_mempool_destruct_t)g_hash_table_unref,
+		rule->batch_servers);
 	rule->read_only = FALSE;
+	rule->batch = TRUE;
 
 	return rule;
 }
@@ -525,6 +537,10 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj,
 		rule->fuzzy_images = ucl_obj_toboolean (value);
 	}
 
+	if ((value = ucl_object_lookup (obj, "batch")) != NULL) {
+		rule->batch = ucl_obj_toboolean (value);
+	}
+
 	if ((value = ucl_object_lookup (obj, "algorithm")) != NULL) {
 		rule->algorithm_str = ucl_object_tostring (value);
 
@@ -919,6 +935,15 @@ fuzzy_check_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 			0,
 			NULL,
 			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"fuzzy_check.rule",
+			"Pack commands in a single datagram for servers that support it",
+			"batch",
+			UCL_BOOLEAN,
+			NULL,
+			0,
+			NULL,
+			0);
 	rspamd_rcl_add_doc_by_path (cfg,
 			"fuzzy_check.rule",
 			"Use direct hash for short texts",
@@ -1183,6 +1208,7 @@ fuzzy_preprocess_words (struct rspamd_mime_text_part *part, rspamd_mempool_t *po
 static void
 fuzzy_encrypt_cmd (struct fuzzy_rule *rule,
 		struct rspamd_fuzzy_encrypted_req_hdr *hdr,
+		const guchar *magic,
 		guchar *data, gsize datalen)
 {
 	const guchar *pk;
@@ -1194,7 +1220,7 @@ fuzzy_encrypt_cmd (struct fuzzy_rule *rule,
 
 	/* Encrypt data */
 	memcpy (hdr->magic,
-			fuzzy_encrypted_magic,
+			magic,
 			sizeof (hdr->magic));
 	ottery_rand_bytes (hdr->nonce, sizeof (hdr->nonce));
 	pk = rspamd_keypair_component (rule->local_key,
@@ -1239,7 +1265,6 @@ fuzzy_cmd_stat (struct fuzzy_rule *rule,
 	memcpy (&io->cmd, cmd, sizeof (io->cmd));
 
 	if (rule->peer_key && enccmd) {
-		fuzzy_encrypt_cmd (rule, &enccmd->hdr, (guchar *)cmd, sizeof (*cmd));
 		io->io.iov_base = enccmd;
 		io->io.iov_len = sizeof (*enccmd);
 	}
@@ -1248,6 +1273,9 @@ fuzzy_cmd_stat (struct fuzzy_rule *rule,
 		io->io.iov_len = sizeof (*cmd);
 	}
 
+	io->payload = (guchar *)cmd;
+	io->payload_len = sizeof (*cmd);
+
 	return io;
 }
 
@@ -1296,7 +1324,6 @@ fuzzy_cmd_hash (struct fuzzy_rule *rule,
 	memcpy (&io->cmd, cmd, sizeof (io->cmd));
 
 	if (rule->peer_key && enccmd) {
-		fuzzy_encrypt_cmd (rule, &enccmd->hdr, (guchar *)cmd, sizeof (*cmd));
 		io->io.iov_base = enccmd;
 		io->io.iov_len = sizeof (*enccmd);
 	}
@@ -1305,6 +1332,9 @@ fuzzy_cmd_hash (struct fuzzy_rule *rule,
 		io->io.iov_len = sizeof (*cmd);
 	}
 
+	io->payload = (guchar *)cmd;
+	io->payload_len = sizeof (*cmd);
+
 	return io;
 }
 
@@ -1485,17 +1515,13 @@ fuzzy_cmd_from_text_part (struct rspamd_task *task,
 	io->flags = 0;
 
 
+	/* Commands are encrypted right before sending */
 	if (rule->peer_key) {
-		/* Encrypt data */
 		if (!short_text) {
-			fuzzy_encrypt_cmd (rule, &encshcmd->hdr, (guchar *) shcmd,
-					sizeof (*shcmd));
 			io->io.iov_base = encshcmd;
 			io->io.iov_len = sizeof (*encshcmd);
 		}
 		else {
-			fuzzy_encrypt_cmd (rule, &enccmd->hdr, (guchar *)cmd,
-					sizeof (*cmd));
 			io->io.iov_base = enccmd;
 			io->io.iov_len = sizeof (*enccmd);
 		}
@@ -1511,6 +1537,15 @@ fuzzy_cmd_from_text_part (struct rspamd_task *task,
 		}
 	}
 
+	if (!short_text) {
+		io->payload = (guchar *)shcmd;
+		io->payload_len = sizeof (*shcmd);
+	}
+	else {
+		io->payload = (guchar *)cmd;
+		io->payload_len = sizeof (*cmd);
+	}
+
 	return io;
 }
 
@@ -1596,8 +1631,6 @@ fuzzy_cmd_from_image_part (struct fuzzy_rule *rule,
 	memcpy (&io->cmd, &shcmd->basic, sizeof (io->cmd));
 
 	if (rule->peer_key) {
-		/* Encrypt data */
-		fuzzy_encrypt_cmd (rule, &encshcmd->hdr, (guchar *) shcmd, sizeof (*shcmd));
 		io->io.iov_base = encshcmd;
 		io->io.iov_len = sizeof (*encshcmd);
 	}
@@ -1606,6 +1639,9 @@ fuzzy_cmd_from_image_part (struct fuzzy_rule *rule,
 		io->io.iov_len = sizeof (*shcmd);
 	}
 
+	io->payload = (guchar *)shcmd;
+	io->payload_len = sizeof (*shcmd);
+
 	return io;
 }
 
@@ -1646,7 +1682,6 @@ fuzzy_cmd_from_data_part (struct fuzzy_rule *rule,
 
 	if (rule->peer_key) {
 		g_assert (enccmd != NULL);
-		fuzzy_encrypt_cmd (rule, &enccmd->hdr, (guchar *) cmd, sizeof (*cmd));
 		io->io.iov_base = enccmd;
 		io->io.iov_len = sizeof (*enccmd);
 	}
@@ -1655,6 +1690,9 @@ fuzzy_cmd_from_data_part (struct fuzzy_rule *rule,
 		io->io.iov_len = sizeof (*cmd);
 	}
 
+	io->payload = (guchar *)cmd;
+	io->payload_len = sizeof (*cmd);
+
 	return io;
 }
 
@@ -1678,7 +1716,7 @@ fuzzy_cmd_to_wire (gint fd, struct iovec *io)
 }
 
 static gboolean
-fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v)
+fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v, struct fuzzy_rule *rule)
 {
 	guint i;
 	gboolean all_sent = TRUE, all_replied = TRUE;
@@ -1696,6 +1734,12 @@ fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v)
 		all_replied = FALSE;
 
 		if (!(io->flags & FUZZY_CMD_FLAG_SENT)) {
+			if (rule->peer_key && !(io->flags & FUZZY_CMD_FLAG_ENCRYPTED)) {
+				fuzzy_encrypt_cmd (rule, io->io.iov_base, fuzzy_encrypted_magic,
+						io->payload, io->payload_len);
+				io->flags |= FUZZY_CMD_FLAG_ENCRYPTED;
+			}
+
 			if (!fuzzy_cmd_to_wire (fd, &io->io)) {
 				return FALSE;
 			}
@@ -1715,18 +1759,105 @@ fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v)
 			}
 		}
 
-		return fuzzy_cmd_vector_to_wire (fd, v);
+		return fuzzy_cmd_vector_to_wire (fd, v, rule);
 	}
 
 	return processed;
 }
 
+static gboolean
+fuzzy_cmd_batch_flush (gint fd, struct fuzzy_rule *rule, guchar *buf,
+		gsize len, guint ncmds)
+{
+	struct rspamd_fuzzy_batch_hdr *bhdr;
+	struct iovec iov;
+	gsize hdrlen = 0;
+
+	if (rule->peer_key) {
+		hdrlen = sizeof (struct rspamd_fuzzy_encrypted_req_hdr);
+	}
+
+	bhdr = (struct rspamd_fuzzy_batch_hdr *)(buf + hdrlen);
+	memcpy (bhdr->magic, fuzzy_batch_magic, sizeof (bhdr->magic));
+	bhdr->version = RSPAMD_FUZZY_BATCH_VERSION;
+	bhdr->ncmds = ncmds;
+	bhdr->reserved = 0;
+
+	if (rule->peer_key) {
+		fuzzy_encrypt_cmd (rule, (struct rspamd_fuzzy_encrypted_req_hdr *)buf,
+				fuzzy_encrypted_batch_magic, buf + hdrlen, len - hdrlen);
+	}
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+
+	return fuzzy_cmd_to_wire (fd, &iov);
+}
+
+/*
+ * Packs all unreplied commands into as few datagrams as possible, the whole
+ * batch is encrypted once
+ */
+static gboolean
+fuzzy_cmd_vector_to_wire_batch (gint fd, GPtrArray *v, struct fuzzy_rule *rule)
+{
+	guchar buf[RSPAMD_FUZZY_BATCH_MAX_SIZE];
+	struct fuzzy_cmd_io *io;
+	gsize hdrlen, len, cmdlen;
+	guint i, ncmds = 0;
+
+	hdrlen = sizeof (struct rspamd_fuzzy_batch_hdr);
+
+	if (rule->peer_key) {
+		hdrlen += sizeof (struct rspamd_fuzzy_encrypted_req_hdr);
+	}
+
+	len = hdrlen;
+
+	for (i = 0; i < v->len; i ++) {
+		io = g_ptr_array_index (v, i);
+
+		if (io->flags & FUZZY_CMD_FLAG_REPLIED) {
+			continue;
+		}
+
+		/* Server derives command length from the shingles count */
+		cmdlen = io->cmd.shingles_count > 0 ?
+				sizeof (struct rspamd_fuzzy_shingle_cmd) :
+				sizeof (struct rspamd_fuzzy_cmd);
+		g_assert (cmdlen <= io->payload_len);
+
+		/* Both request and reply must fit in a single datagram */
+		if (len + cmdlen > sizeof (buf) ||
+				ncmds == RSPAMD_FUZZY_BATCH_MAX_CMDS) {
+			if (!fuzzy_cmd_batch_flush (fd, rule, buf, len, ncmds)) {
+				return FALSE;
+			}
+
+			len = hdrlen;
+			ncmds = 0;
+		}
+
+		memcpy (buf + len, io->payload, cmdlen);
+		len += cmdlen;
+		ncmds ++;
+		io->flags |= FUZZY_CMD_FLAG_SENT;
+	}
+
+	if (ncmds > 0) {
+		return fuzzy_cmd_batch_flush (fd, rule, buf, len, ncmds);
+	}
+
+	return FALSE;
+}
+
 /*
  * Read replies one-by-one and remove them from req array
  */
 static const struct rspamd_fuzzy_reply *
 fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
-		struct fuzzy_rule *rule, struct rspamd_fuzzy_cmd **pcmd,
+		struct fuzzy_rule *rule, gboolean encrypted,
+		struct rspamd_fuzzy_cmd **pcmd,
 		struct fuzzy_cmd_io **pio)
 {
 	guchar *p = *pos;
@@ -1737,7 +1868,7 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
 	struct rspamd_fuzzy_encrypted_reply encrep;
 	gboolean found = FALSE;
 
-	if (rule->peer_key) {
+	if (encrypted) {
 		required_size = sizeof (encrep);
 	}
 	else {
@@ -1748,7 +1879,7 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
 		return NULL;
 	}
 
-	if (rule->peer_key) {
+	if (encrypted) {
 		memcpy (&encrep, p, sizeof (encrep));
 		*pos += required_size;
 		*r -= required_size;
@@ -1808,6 +1939,59 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
 	return NULL;
 }
 
+/*
+ * Decrypts and validates batch reply header, leaving `pos` at the first reply
+ */
+static gboolean
+fuzzy_process_batch_reply (guchar **pos, gint *r, struct fuzzy_rule *rule)
+{
+	guchar *p = *pos;
+	gint remain = *r;
+	struct rspamd_fuzzy_encrypted_rep_hdr *ehdr;
+	struct rspamd_fuzzy_batch_hdr *bhdr;
+
+	if (rule->peer_key) {
+		if (remain < (gint)(sizeof (*ehdr) + sizeof (*bhdr))) {
+			return FALSE;
+		}
+
+		ehdr = (struct rspamd_fuzzy_encrypted_rep_hdr *)p;
+		p += sizeof (*ehdr);
+		remain -= sizeof (*ehdr);
+
+		rspamd_keypair_cache_process (fuzzy_module_ctx->keypairs_cache,
+				rule->local_key, rule->peer_key);
+
+		if (!rspamd_cryptobox_decrypt_nm_inplace (p, remain,
+				ehdr->nonce,
+				rspamd_pubkey_get_nm (rule->peer_key),
+				ehdr->mac,
+				rspamd_pubkey_alg (rule->peer_key))) {
+			msg_info ("cannot decrypt batch reply");
+			return FALSE;
+		}
+	}
+
+	if (remain < (gint)sizeof (*bhdr)) {
+		return FALSE;
+	}
+
+	bhdr = (struct rspamd_fuzzy_batch_hdr *)p;
+
+	if (memcmp (bhdr->magic, fuzzy_batch_magic, sizeof (bhdr->magic)) != 0 ||
+			bhdr->version != RSPAMD_FUZZY_BATCH_VERSION ||
+			remain - sizeof (*bhdr) !=
+					bhdr->ncmds * sizeof (struct rspamd_fuzzy_reply)) {
+		msg_info ("invalid batch reply of size %d", *r);
+		return FALSE;
+	}
+
+	*pos = p + sizeof (*bhdr);
+	*r = remain - sizeof (*bhdr);
+
+	return TRUE;
+}
+
 static void
 fuzzy_insert_result (struct fuzzy_client_session *session,
 		const struct rspamd_fuzzy_reply *rep,
@@ -1930,6 +2114,7 @@ fuzzy_check_try_read (struct fuzzy_client_session *session)
 	struct fuzzy_cmd_io *io = NULL;
 	gint r, ret;
 	guchar buf[2048], *p;
+	gboolean encrypted;
 
 	task = session->task;
 
@@ -1943,11 +2128,29 @@ fuzzy_check_try_read (struct fuzzy_client_session *session)
 	}
 	else {
 		p = buf;
+		encrypted = session->rule->peer_key != NULL;
 
 		ret = 0;
 
+		if (session->batch) {
+			if (!fuzzy_process_batch_reply (&p, &r, session->rule)) {
+				return 0;
+			}
+
+			/* Batch is decrypted as a whole */
+			encrypted = FALSE;
+		}
+
 		while ((rep = fuzzy_process_reply (&p, &r,
-				session->commands, session->rule, &cmd, &io)) != NULL) {
+				session->commands, session->rule, encrypted,
+				&cmd, &io)) != NULL) {
+			if (session->rule->batch &&
+					(rep->flags & RSPAMD_FUZZY_REPLY_FLAG_BATCH)) {
+				/* Server supports batches, use them next time */
+				g_hash_table_insert (session->rule->batch_servers,
+						session->server, session->server);
+			}
+
 			if (rep->v1.prob > 0.5) {
 				if (cmd->cmd == FUZZY_CHECK) {
 					fuzzy_insert_result (session, rep, cmd, io, rep->v1.flag);
@@ -2047,8 +2250,6 @@ fuzzy_check_session_is_completed (struct fuzzy_client_session *session)
 	struct fuzzy_cmd_io *io;
 	guint nreplied = 0, i;
 
-	rspamd_upstream_ok (session->server);
-
 	for (i = 0; i < session->commands->len; i++) {
 		io = g_ptr_array_index (session->commands, i);
 
@@ -2058,6 +2259,8 @@ fuzzy_check_session_is_completed (struct fuzzy_client_session *session)
 	}
 
 	if (nreplied == session->commands->len) {
+		rspamd_upstream_ok_latency (session->server,
+				rspamd_get_ticks (FALSE) - session->start);
 		fuzzy_insert_metric_results (session->task, session->results);
 		rspamd_session_remove_event (session->task->s, fuzzy_io_fin, session);
 
@@ -2074,6 +2277,7 @@ fuzzy_check_io_callback (gint fd, short what, void *arg)
 	struct fuzzy_client_session *session = arg;
 	struct rspamd_task *task;
 	struct event_base *ev_base;
+	gboolean sent;
 	gint r;
 
 	enum {
@@ -2101,7 +2305,16 @@ fuzzy_check_io_callback (gint fd, short what, void *arg)
 		}
 	}
 	else if (what & EV_WRITE) {
-		if (!fuzzy_cmd_vector_to_wire (fd, session->commands)) {
+		if (session->batch) {
+			sent = fuzzy_cmd_vector_to_wire_batch (fd, session->commands,
+					session->rule);
+		}
+		else {
+			sent = fuzzy_cmd_vector_to_wire (fd, session->commands,
+					session->rule);
+		}
+
+		if (!sent) {
 			ret = return_error;
 		}
 		else {
@@ -2174,6 +2387,16 @@ fuzzy_check_timer_callback (gint fd, short what, void *arg)
 		rspamd_session_remove_event (session->task->s, fuzzy_io_fin, session);
 	}
 	else {
+		if (session->batch) {
+			/*
+			 * Server might not support batches despite it has advertised
+			 * that, so fall back to separate commands
+			 */
+			session->batch = FALSE;
+			g_hash_table_remove (session->rule->batch_servers,
+					session->server);
+		}
+
 		/* Plan write event */
 		ev_base = event_get_base (&session->ev);
 		event_del (&session->ev);
@@ -2248,7 +2471,8 @@ fuzzy_controller_io_callback (gint fd, short what, void *arg)
 			ret = return_want_more;
 
 			while ((rep = fuzzy_process_reply (&p, &r,
-					session->commands, session->rule, &cmd, &io)) != NULL) {
+					session->commands, session->rule,
+					session->rule->peer_key != NULL, &cmd, &io)) != NULL) {
 				if ((map =
 						g_hash_table_lookup (session->rule->mappings,
 								GINT_TO_POINTER (rep->v1.flag))) == NULL) {
@@ -2347,7 +2571,8 @@ fuzzy_controller_io_callback (gint fd, short what, void *arg)
 	}
 	else if (what & EV_WRITE) {
 			/* Send commands to storage */
-			if (!fuzzy_cmd_vector_to_wire (fd, session->commands)) {
+			if (!fuzzy_cmd_vector_to_wire (fd, session->commands,
+					session->rule)) {
 				if (*(session->err) == NULL) {
 					g_set_error (session->err,
 						g_quark_from_static_string ("fuzzy check"),
@@ -2810,7 +3035,10 @@ register_fuzzy_client_call (struct rspamd_task *task,
 			session->server = selected;
 			session->rule = rule;
 			session->addr = addr;
+			session->start = rspamd_get_ticks (FALSE);
 			session->results = g_ptr_array_sized_new (32);
+			session->batch = rule->batch && commands->len > 1 &&
+					g_hash_table_lookup (rule->batch_servers, selected) != NULL;
 
 			event_set (&session->ev, sock, EV_WRITE, fuzzy_check_io_callback,
 					session);
@@ -31,6 +31,7 @@ extern struct rspamadm_command dkim_keygen_command;
 extern struct rspamadm_command configwizard_command;
 extern struct rspamadm_command corpus_test_command;
 extern struct rspamadm_command rescore_command;
+extern struct rspamadm_command mapcompile_command;
 
 const struct rspamadm_command *commands[] = {
 	&help_command,
@@ -50,6 +51,7 @@ const struct rspamadm_command *commands[] = {
 	&configwizard_command,
 	&corpus_test_command,
 	&rescore_command,
+	&mapcompile_command,
 	NULL
 };
 
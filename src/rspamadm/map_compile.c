@@ -0,0 +1,104 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "rspamd.h"
+#include "map.h"
+
+static gchar *input = NULL;
+static gchar *output = NULL;
+static gboolean kv = FALSE;
+
+static void rspamadm_mapcompile (gint argc, gchar **argv);
+static const char *rspamadm_mapcompile_help (gboolean full_help);
+
+struct rspamadm_command mapcompile_command = {
+		.name = "mapcompile",
+		.flags = 0,
+		.help = rspamadm_mapcompile_help,
+		.run = rspamadm_mapcompile,
+		.lua_subrs = NULL,
+};
+
+static GOptionEntry entries[] = {
+		{"input", 'i', 0, G_OPTION_ARG_FILENAME, &input,
+				"Input map file", NULL},
+		{"output", 'o', 0, G_OPTION_ARG_FILENAME, &output,
+				"Output compiled map", NULL},
+		{"kv", 'k', 0, G_OPTION_ARG_NONE, &kv,
+				"Treat input as a key-value map", NULL},
+		{NULL,     0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+static const char *
+rspamadm_mapcompile_help (gboolean full_help)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Compile set or hash map to the format that is mapped by "
+				"rspamd without parsing\n\n"
+				"Usage: rspamadm mapcompile -i <map> -o <compiled_map>\n"
+				"Where options are:\n\n"
+				"-i: input map file\n"
+				"-o: output compiled map (replaced atomically)\n"
+				"-k: treat input as a key-value map\n\n"
+				"Compiled maps are mapped by workers as is, so replace them "
+				"by rename only (as this command does): copying over or "
+				"truncating a compiled map crashes workers with SIGBUS\n";
+	}
+	else {
+		help_str = "Compile set or hash map for fast loading";
+	}
+
+	return help_str;
+}
+
+static void
+rspamadm_mapcompile (gint argc, gchar **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+
+	context = g_option_context_new (
+			"mapcompile - compiles set or hash map");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd administration utility version "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+	g_option_context_set_ignore_unknown_options (context, TRUE);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	if (input == NULL || output == NULL) {
+		rspamd_fprintf (stderr, "input and output files are required\n");
+		exit (1);
+	}
+
+	if (!rspamd_hash_map_compile_file (input, output, kv, &error)) {
+		rspamd_fprintf (stderr, "%s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	g_option_context_free (context);
+}
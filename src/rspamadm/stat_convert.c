@@ -15,7 +15,13 @@
  */
 #include "config.h"
 #include "rspamadm.h"
+#include "rspamd.h"
 #include "lua/lua_common.h"
+#include "backends/backends.h"
+#include "unix-std.h"
+#include <sys/wait.h>
+
+extern struct rspamd_main *rspamd_main;
 
 static gchar *source_db = NULL;
 static gchar *redis_host = NULL;
@@ -24,6 +30,16 @@ static gchar *cache_db = NULL;
 static gchar *redis_db = NULL;
 static gchar *redis_password = NULL;
 static gboolean reset_previous = FALSE;
+static gchar *mmap_source = NULL;
+static gchar *mmap_output = NULL;
+static gint64 mmap_size = 0;
+static gint jobs = 1;
+
+/* Replies of a whole pipeline are pushed on the lua stack */
+#define STATCONVERT_DEFAULT_BATCH 2000
+#define STATCONVERT_MAX_BATCH 3000
+
+static gint batch = STATCONVERT_DEFAULT_BATCH;
 
 static void rspamadm_statconvert (gint argc, gchar **argv);
 static const char *rspamadm_statconvert_help (gboolean full_help);
@@ -51,6 +67,17 @@ static GOptionEntry entries[] = {
 				"Password to connect to redis", NULL},
 		{"reset", 'r', 0, G_OPTION_ARG_NONE, &reset_previous,
 				"Reset previous data instead of appending values", NULL},
+		{"mmap", 'm', 0, G_OPTION_ARG_FILENAME, &mmap_source,
+				"Input mmaped statfile to convert to the current format", NULL},
+		{"output", 'o', 0, G_OPTION_ARG_FILENAME, &mmap_output,
+				"Output mmaped statfile", NULL},
+		{"size", 'S', 0, G_OPTION_ARG_INT64, &mmap_size,
+				"Size of output mmaped statfile (input size by default)", NULL},
+		{"jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+				"Number of processes converting tokens in parallel", NULL},
+		{"batch", 'b', 0, G_OPTION_ARG_INT, &batch,
+				"Number of tokens sent to redis in one pipeline (max "
+				G_STRINGIFY (STATCONVERT_MAX_BATCH) ")", NULL},
 		{NULL,     0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
 };
 
@@ -70,22 +97,55 @@ rspamadm_statconvert_help (gboolean full_help)
 				"-c: also convert data from the learn cache\n"
 				"-D: output redis database\n"
 				"-p: redis password\n"
-				"-r: reset previous data instead of increasing values\n";
+				"-r: reset previous data instead of increasing values\n"
+				"-j: number of processes converting tokens in parallel\n"
+				"-b: number of tokens sent to redis in one pipeline "
+				"(" G_STRINGIFY (STATCONVERT_DEFAULT_BATCH) " by default, "
+				G_STRINGIFY (STATCONVERT_MAX_BATCH) " max)\n\n"
+				"Usage: rspamadm statconvert -m <statfile> -o <new_statfile>\n"
+				"Where options are:\n\n"
+				"-m: input mmaped statfile\n"
+				"-o: output mmaped statfile in the current format\n"
+				"-S: size of output statfile (input size by default)\n";
 	}
 	else {
-		help_str = "Convert statistics from sqlite3 to redis";
+		help_str = "Convert statistics from sqlite3 to redis or between "
+				"mmaped statfile formats";
 	}
 
 	return help_str;
 }
 
+static gboolean
+rspamadm_statconvert_job (gint argc, gchar **argv, ucl_object_t *obj, gint job)
+{
+	lua_State *L;
+	gboolean ret;
+
+	L = rspamd_lua_init ();
+	rspamd_lua_set_path (L, NULL, NULL);
+
+	ucl_object_replace_key (obj, ucl_object_fromint (job), "job", 0, false);
+	ret = rspamadm_execute_lua_ucl_subr (L,
+			argc,
+			argv,
+			obj,
+			"stat_convert");
+
+	lua_close (L);
+
+	return ret;
+}
+
 static void
 rspamadm_statconvert (gint argc, gchar **argv)
 {
 	GOptionContext *context;
 	GError *error = NULL;
-	lua_State *L;
 	ucl_object_t *obj;
+	pid_t pid;
+	gint i, status, failed = 0;
+	gboolean ret;
 
 	context = g_option_context_new (
 			"statconvert - converts statistics from sqlite3 to redis");
@@ -103,6 +163,27 @@ rspamadm_statconvert (gint argc, gchar **argv)
 		exit (1);
 	}
 
+	if (mmap_source) {
+		if (!mmap_output) {
+			rspamd_fprintf (stderr, "output statfile is missing\n");
+			exit (1);
+		}
+
+		if (mmap_size < 0) {
+			rspamd_fprintf (stderr, "invalid statfile size: %L\n", mmap_size);
+			exit (1);
+		}
+
+		if (rspamd_mmaped_file_convert (rspamd_main->cfg->cfg_pool,
+				mmap_source, mmap_output, mmap_size) != 0) {
+			rspamd_fprintf (stderr, "cannot convert %s to %s\n", mmap_source,
+					mmap_output);
+			exit (1);
+		}
+
+		return;
+	}
+
 	if (!source_db) {
 		rspamd_fprintf (stderr, "source db is missing\n");
 		exit (1);
@@ -116,8 +197,16 @@ rspamadm_statconvert (gint argc, gchar **argv)
 		exit (1);
 	}
 
-	L = rspamd_lua_init ();
-	rspamd_lua_set_path (L, NULL, NULL);
+	if (jobs < 1) {
+		rspamd_fprintf (stderr, "invalid number of jobs: %d\n", jobs);
+		exit (1);
+	}
+
+	if (batch < 1 || batch > STATCONVERT_MAX_BATCH) {
+		rspamd_fprintf (stderr, "invalid batch size: %d, it should be "
+				"from 1 to %d\n", batch, STATCONVERT_MAX_BATCH);
+		exit (1);
+	}
 
 	obj = ucl_object_typed_new (UCL_OBJECT);
 	ucl_object_insert_key (obj, ucl_object_fromstring (source_db),
@@ -144,12 +233,46 @@ rspamadm_statconvert (gint argc, gchar **argv)
 				"redis_db", 0, false);
 	}
 
-	rspamadm_execute_lua_ucl_subr (L,
-			argc,
-			argv,
-			obj,
-			"stat_convert");
+	ucl_object_insert_key (obj, ucl_object_fromint (batch),
+			"batch", 0, false);
+
+	ucl_object_insert_key (obj, ucl_object_fromint (jobs),
+			"jobs", 0, false);
+
+	if (jobs == 1) {
+		ret = rspamadm_statconvert_job (argc, argv, obj, 0);
+		ucl_object_unref (obj);
+
+		if (!ret) {
+			exit (1);
+		}
+
+		return;
+	}
+
+	/* Each job converts its own part of tokens with its own connection */
+	for (i = 0; i < jobs; i ++) {
+		pid = fork ();
+
+		if (pid == 0) {
+			exit (rspamadm_statconvert_job (argc, argv, obj, i) ? 0 : 1);
+		}
+		else if (pid == -1) {
+			rspamd_fprintf (stderr, "cannot fork: %s\n", strerror (errno));
+			failed ++;
+		}
+	}
+
+	while ((pid = wait (&status)) != -1 || errno == EINTR) {
+		if (pid != -1 && (!WIFEXITED (status) || WEXITSTATUS (status) != 0)) {
+			failed ++;
+		}
+	}
 
-	lua_close (L);
 	ucl_object_unref (obj);
+
+	if (failed > 0) {
+		rspamd_fprintf (stderr, "%d conversion jobs have failed\n", failed);
+		exit (1);
+	}
 }
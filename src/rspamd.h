@@ -246,6 +246,9 @@ struct rspamd_stat {
 	guint connections_count;                            /**< total connections count						*/
 	guint control_connections_count;                    /**< connections count to control interface			*/
 	guint messages_learned;                             /**< messages learned								*/
+	guint dns_cache_hits;                               /**< DNS requests answered from cache				*/
+	guint dns_cache_misses;                             /**< DNS requests sent to servers					*/
+	guint dns_coalesced;                                /**< DNS requests waiting for identical ones		*/
 };
 
 /**
@@ -168,6 +168,7 @@ struct rspamd_proxy_backend_connection {
 	const gchar *err;
 	struct rspamd_proxy_session *s;
 	struct timeval *io_tv;
+	gdouble start;
 	gint backend_sock;
 	enum rspamd_backend_flags flags;
 	gint parser_from_ref;
@@ -1301,7 +1302,8 @@ proxy_backend_mirror_finish_handler (struct rspamd_http_connection *conn,
 	}
 
 	msg_info_session ("finished mirror connection to %s", bk_conn->name);
-	rspamd_upstream_ok (bk_conn->up);
+	rspamd_upstream_ok_latency (bk_conn->up,
+			rspamd_get_ticks (FALSE) - bk_conn->start);
 
 	proxy_backend_close_connection (bk_conn);
 	REF_RELEASE (bk_conn->s);
@@ -1337,6 +1339,7 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 
 		bk_conn->up = rspamd_upstream_get (m->u,
 				RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
+		bk_conn->start = rspamd_get_ticks (FALSE);
 		bk_conn->parser_from_ref = m->parser_from_ref;
 		bk_conn->parser_to_ref = m->parser_to_ref;
 
@@ -1538,7 +1541,8 @@ proxy_backend_master_finish_handler (struct rspamd_http_connection *conn,
 		}
 	}
 
-	rspamd_upstream_ok (bk_conn->up);
+	rspamd_upstream_ok_latency (bk_conn->up,
+			rspamd_get_ticks (FALSE) - bk_conn->start);
 
 	if (session->client_milter_conn) {
 		nsession = proxy_session_refresh (session);
@@ -1757,6 +1761,7 @@ retry:
 
 		session->master_conn->up = rspamd_upstream_get (backend->u,
 				RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
+		session->master_conn->start = rspamd_get_ticks (FALSE);
 		session->master_conn->io_tv = &backend->io_tv;
 
 		if (session->master_conn->up == NULL) {
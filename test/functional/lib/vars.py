@@ -15,6 +15,7 @@ PORT_PROXY = 56795
 PORT_CLAM = 56796
 PORT_FPROT = 56797
 PORT_FPROT_DUPLICATE = 56798
+PORT_MAP = 56799
 REDIS_ADDR = u'127.0.0.1'
 REDIS_PORT = 56379
 RSPAMD_GROUP = 'nogroup'
@@ -0,0 +1,21 @@
+local test_map = rspamd_config:add_map ({
+  url = '${MAP_URL}',
+  type = 'set',
+})
+
+rspamd_config:register_symbol({
+  name = 'MAP_DELTA_KEYS',
+  score = 1.0,
+  callback = function()
+    local found = {}
+    for _,k in ipairs({'added.com', 'bogus.com', 'example.com', 'new.com',
+        'rspamd.com'}) do
+      if test_map:get_key(k) then
+        table.insert(found, k)
+      end
+    end
+    if #found > 0 then
+      return true, table.concat(found, ',')
+    end
+  end
+})
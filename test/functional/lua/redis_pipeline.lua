@@ -0,0 +1,84 @@
+local rspamd_redis = require "rspamd_redis"
+
+-- Each task sends a slow script that times out and then several commands
+-- that share the same pipelined connection, replies must reach their callers
+local nrequests = 8
+local ntask = 0
+local redis_host = '${REDIS_ADDR}:${REDIS_PORT}'
+local slow_script = [[
+local t = redis.call('TIME')
+local start = t[1] * 1000000 + t[2]
+repeat
+  t = redis.call('TIME')
+until t[1] * 1000000 + t[2] - start > 300000
+return 'slow'
+]]
+
+rspamd_config:register_symbol({
+  name = 'REDIS_PIPELINE',
+  score = 1.0,
+  callback = function(task)
+    local pending = nrequests + 2
+    local errors = {}
+    ntask = ntask + 1
+    local tag = string.format('task%d', ntask)
+
+    local function finish()
+      pending = pending - 1
+
+      if pending == 0 then
+        if #errors == 0 then
+          task:insert_result('REDIS_PIPELINE', 1.0, 'ok')
+        else
+          task:insert_result('REDIS_PIPELINE', 1.0, errors)
+        end
+      end
+    end
+
+    local function echo(expected)
+      return rspamd_redis.make_request({
+        task = task,
+        host = redis_host,
+        cmd = 'ECHO',
+        args = {expected},
+        timeout = 20.0,
+        callback = function(err, data)
+          if err then
+            table.insert(errors, err)
+          elseif data ~= expected then
+            table.insert(errors, string.format('%s instead of %s',
+                tostring(data), expected))
+          end
+          finish()
+        end
+      })
+    end
+
+    rspamd_redis.make_request({
+      task = task,
+      host = redis_host,
+      cmd = 'EVAL',
+      args = {slow_script, '0'},
+      timeout = 0.1,
+      callback = function(err, data)
+        if not err then
+          table.insert(errors, 'slow script has not timed out')
+        end
+        -- Sent after the timeout, so it goes to a new connection
+        if not echo(tag .. '-after') then
+          table.insert(errors, 'cannot send after timeout')
+          finish()
+        end
+        finish()
+      end
+    })
+
+    -- Queued behind the slow script on the same connection
+    for i = 1, nrequests do
+      if not echo(string.format('%s-%d', tag, i)) then
+        table.insert(errors, 'cannot send ' .. tostring(i))
+        finish()
+      end
+    end
+  end
+})
@@ -0,0 +1,102 @@
+#!/usr/bin/env python
+# Serves a map from a directory:
+#   version - current version, its mtime is Last-Modified
+#   map, map.sig - full map and its signature
+#   delta.<version>, delta.<version>.sig - delta from <version> to the current
+#   delta_base - overrides Map-Delta header to test version mismatch
+
+import binascii
+import email.utils
+import os
+import sys
+try:
+    import BaseHTTPServer as http_server
+except:
+    import http.server as http_server
+
+
+class MapHandler(http_server.BaseHTTPRequestHandler):
+
+    def read_file(self, name):
+        path = os.path.join(self.server.map_dir, name)
+        if not os.path.exists(path):
+            return None
+        with open(path, 'rb') as f:
+            return f.read()
+
+    def reply(self, head):
+        if self.path.endswith('.sig'):
+            sig = self.read_file('map.sig')
+            if sig is None:
+                self.send_error(404)
+                return
+            self.send_response(200)
+            self.send_header('Content-Length', str(len(sig)))
+            self.end_headers()
+            if not head:
+                self.wfile.write(sig)
+            return
+
+        version_file = os.path.join(self.server.map_dir, 'version')
+        version = self.read_file('version').decode().strip()
+        mtime = int(os.stat(version_file).st_mtime)
+        since = self.headers.get('If-Modified-Since')
+
+        if since:
+            since = email.utils.mktime_tz(email.utils.parsedate_tz(since))
+            if since >= mtime:
+                self.send_response(304)
+                self.end_headers()
+                return
+
+        body = self.read_file('map')
+        sig = self.read_file('map.sig')
+        base = None
+        client_version = self.headers.get('Map-Version')
+
+        if client_version:
+            delta = self.read_file('delta.' + client_version)
+            if delta is not None:
+                body = delta
+                sig = self.read_file('delta.' + client_version + '.sig')
+                base = self.read_file('delta_base')
+                base = base.decode().strip() if base else client_version
+
+        self.send_response(200)
+        self.send_header('Last-Modified', email.utils.formatdate(mtime,
+            usegmt=True))
+        self.send_header('Map-Version', version)
+        if base:
+            self.send_header('Map-Delta', base)
+        if sig:
+            self.send_header('Signature',
+                binascii.hexlify(sig).decode())
+        if head:
+            self.send_header('Content-Length', '0')
+            self.end_headers()
+            return
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def do_HEAD(self):
+        self.reply(True)
+
+    def do_GET(self):
+        self.reply(False)
+
+
+if __name__ == "__main__":
+    port = int(sys.argv[1])
+    map_dir = sys.argv[2]
+    pid_file = sys.argv[3]
+
+    pid = os.fork()
+    if pid > 0:
+        sys.exit(0)
+
+    server = http_server.HTTPServer(('127.0.0.1', port), MapHandler)
+    server.map_dir = map_dir
+    with open(pid_file, 'w') as f:
+        f.write(str(os.getpid()))
+    server.serve_forever()
@@ -0,0 +1,81 @@
+#include "config.h"
+#include "rspamd.h"
+#include "tests.h"
+#include "libutil/map_private.h"
+
+#define NKEYS 20000
+
+static void
+check_split (const gchar *data, guint nchunks, guint expected)
+{
+	gsize ends[16], len = strlen (data);
+	guint i, n;
+
+	n = rspamd_map_split_lines (data, len, nchunks, ends);
+	g_assert_cmpuint (n, ==, expected);
+	g_assert_cmpuint (ends[n - 1], ==, len);
+
+	for (i = 0; i < n; i ++) {
+		/* Chunks are not empty and end after a newline or at the end */
+		g_assert (ends[i] > (i > 0 ? ends[i - 1] : 0));
+		g_assert (ends[i] == len || data[ends[i] - 1] == '\n');
+	}
+}
+
+void
+rspamd_map_parse_test_func (void)
+{
+	struct rspamd_map map;
+	struct map_cb_data cbdata;
+	GString *data;
+	gchar key[32], value[32];
+	const gchar *res;
+	gpointer parsed;
+	guint i;
+
+	/* Splitting at line boundaries */
+	check_split ("aa\nbbbb\ncc\nd", 3, 2);
+	check_split ("a\nb\nc\nd\ne\nf\ng\nh\n", 4, 3);
+	/* Long lines are never split, so there may be fewer chunks */
+	check_split ("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\nb\n", 4, 2);
+	check_split ("no newlines at all", 4, 1);
+
+	/* Keys are spread over all chunks and repeated keys are in later ones */
+	data = g_string_new ("dup first\n");
+
+	for (i = 0; i < NKEYS; i ++) {
+		rspamd_printf_gstring (data, "key%ud value%ud\n", i, i);
+
+		if (i == NKEYS / 2) {
+			g_string_append (data, "dup middle\nkey0 middle\n");
+		}
+	}
+
+	g_string_append (data, "dup last");
+
+	memset (&map, 0, sizeof (map));
+	rspamd_strlcpy (map.tag, "test", sizeof (map.tag));
+	map.name = (gchar *)"map_parse_test";
+	map.read_callback = rspamd_kv_list_shared_read;
+	map.fin_callback = rspamd_hash_map_fin;
+	map.merge_callback = rspamd_hash_map_merge;
+
+	parsed = rspamd_map_parse_threaded (&map, data->str, data->len, 4);
+	g_assert (parsed != NULL);
+
+	g_assert_cmpstr (rspamd_match_hash_map (parsed, "dup"), ==, "last");
+	g_assert_cmpstr (rspamd_match_hash_map (parsed, "key0"), ==, "middle");
+
+	for (i = 1; i < NKEYS; i ++) {
+		rspamd_snprintf (key, sizeof (key), "key%ud", i);
+		rspamd_snprintf (value, sizeof (value), "value%ud", i);
+		res = rspamd_match_hash_map (parsed, key);
+		g_assert_cmpstr (res, ==, value);
+	}
+
+	memset (&cbdata, 0, sizeof (cbdata));
+	cbdata.map = &map;
+	cbdata.prev_data = parsed;
+	rspamd_hash_map_fin (&cbdata);
+	g_string_free (data, TRUE);
+}
@@ -134,6 +134,20 @@ rspamd_radix_test_vec (void)
 		t ++;
 	}
 
+	/* Compiled tables must return the same values */
+	radix_compile_compressed (tree);
+	i = 0;
+	t = &test_vec[0];
+	while (t->ip != NULL) {
+		val = radix_find_compressed (tree, t->addr, t->len);
+		g_assert (val == ++i);
+		if (t->nip != NULL) {
+			val = radix_find_compressed (tree, t->naddr, t->len);
+			g_assert (val != i);
+		}
+		t ++;
+	}
+
 	radix_destroy_compressed (tree);
 }
 
@@ -204,6 +218,106 @@ rspamd_btrie_test_vec (void)
 	}
 }
 
+/* Compares lookups in trie and in compiled tables for IPv4 or IPv6 keys */
+static void
+rspamd_radix_test_compiled (gsize keylen, gsize nelts)
+{
+	radix_compressed_t *tree = radix_create_compressed ();
+	const guint masks4[] = {24, 27, 29, 32};
+	guint8 *keys, *lookups, *lookups6;
+	uintptr_t *expected, *expected6;
+	volatile uintptr_t res = 0;
+	gsize i, nlookups = nelts, len;
+	guint mask;
+	gint lc;
+	gdouble ts1, ts2;
+
+	keys = g_malloc (nelts * keylen);
+	ottery_rand_bytes (keys, nelts * keylen);
+
+	for (i = 0; i < nelts; i ++) {
+		if (keylen == 4) {
+			mask = masks4[ottery_rand_range (G_N_ELEMENTS (masks4) - 1)];
+		}
+		else {
+			mask = 32 + ottery_rand_range (32);
+		}
+
+		radix_insert_compressed (tree, keys + i * keylen, keylen,
+				keylen * NBBY - mask, i + 1);
+	}
+
+	/* Half of lookups are for inserted prefixes and half are random */
+	lookups = g_malloc (nlookups * keylen);
+	expected = g_malloc (nlookups * sizeof (*expected));
+	ottery_rand_bytes (lookups, nlookups * keylen);
+
+	for (i = 0; i < nlookups; i += 2) {
+		memcpy (lookups + i * keylen,
+				keys + ottery_rand_range (nelts - 1) * keylen, keylen);
+	}
+
+	for (i = 0; i < nlookups; i ++) {
+		expected[i] = radix_find_compressed (tree, lookups + i * keylen, keylen);
+	}
+
+	/* IPv6 keys of a tree without long prefixes use IPv4 tables */
+	lookups6 = g_malloc (nlookups * 16);
+	expected6 = g_malloc (nlookups * sizeof (*expected6));
+	ottery_rand_bytes (lookups6, nlookups * 16);
+
+	for (i = 0; i < nlookups; i ++) {
+		memcpy (lookups6 + i * 16, lookups + i * keylen, MIN (keylen, 4));
+		expected6[i] = radix_find_compressed (tree, lookups6 + i * 16, 16);
+	}
+
+	msg_info ("trie vs compiled performance (%z elts, %z bytes keys)",
+			nelts, keylen);
+
+	ts1 = rspamd_get_ticks (TRUE);
+	for (lc = 0; lc < lookup_cycles / lookup_divisor; lc ++) {
+		for (i = 0; i < nlookups; i ++) {
+			res += radix_find_compressed (tree, lookups + i * keylen, keylen);
+		}
+	}
+	ts2 = rspamd_get_ticks (TRUE);
+
+	msg_info ("Checked %hz elements in trie in %.0f ticks",
+			nlookups * (lookup_cycles / lookup_divisor), (ts2 - ts1) * 1000.0);
+
+	ts1 = rspamd_get_ticks (TRUE);
+	len = radix_compile_compressed (tree);
+	ts2 = rspamd_get_ticks (TRUE);
+
+	msg_info ("Compiled %z bytes of tables in %.0f ticks", len,
+			(ts2 - ts1) * 1000.0);
+
+	for (i = 0; i < nlookups; i ++) {
+		g_assert (radix_find_compressed (tree, lookups + i * keylen, keylen) ==
+				expected[i]);
+		g_assert (radix_find_compressed (tree, lookups6 + i * 16, 16) ==
+				expected6[i]);
+	}
+
+	ts1 = rspamd_get_ticks (TRUE);
+	for (lc = 0; lc < lookup_cycles / lookup_divisor; lc ++) {
+		for (i = 0; i < nlookups; i ++) {
+			res += radix_find_compressed (tree, lookups + i * keylen, keylen);
+		}
+	}
+	ts2 = rspamd_get_ticks (TRUE);
+
+	msg_info ("Checked %hz elements in compiled tables in %.0f ticks",
+			nlookups * (lookup_cycles / lookup_divisor), (ts2 - ts1) * 1000.0);
+
+	radix_destroy_compressed (tree);
+	g_free (keys);
+	g_free (lookups);
+	g_free (expected);
+	g_free (lookups6);
+	g_free (expected6);
+}
+
 void
 rspamd_radix_test_func (void)
 {
@@ -332,4 +446,7 @@ rspamd_radix_test_func (void)
 	radix_destroy_compressed (comp_tree);
 
 	g_free (addrs);
+
+	rspamd_radix_test_compiled (4, max_elts / lookup_divisor);
+	rspamd_radix_test_compiled (16, max_elts / lookup_divisor);
 }
@@ -0,0 +1,165 @@
+#include "config.h"
+#include "rspamd.h"
+#include "tests.h"
+#include "libutil/map_private.h"
+
+struct literal_case {
+	const gchar *pattern;
+	gboolean caseless;
+	const gchar *literal;
+};
+
+static const struct literal_case literal_cases[] = {
+	/* Alternations */
+	{"abc|def", FALSE, NULL},
+	{"(bar|baz)quux", FALSE, "quux"},
+	{"foo(a|b)", FALSE, "foo"},
+	{"foo(a|b|c)*", FALSE, "foo"},
+	/* Quantifiers after literals */
+	{"hello?", FALSE, "hell"},
+	{"hello*world", FALSE, "world"},
+	{"hello+", FALSE, "hello"},
+	{"hello{0,2}x", FALSE, "hell"},
+	{"abc{x}", FALSE, "abc{x}"},
+	/* Quantifiers after classes */
+	{"[a-z]?abc", FALSE, "abc"},
+	{"[a-z]+abc", FALSE, "abc"},
+	{"[a-z]{2,}abc", FALSE, "abc"},
+	{"[]abc]def", FALSE, "def"},
+	{"[[:alpha:]]xyz", FALSE, "xyz"},
+	/* Quantifiers after groups */
+	{"(abc)?defg", FALSE, "defg"},
+	{"(abcdef)*xyz", FALSE, "xyz"},
+	{"(abcdef)+xyz", FALSE, "xyz"},
+	{"(abcdef){2}xyz", FALSE, "xyz"},
+	/* Escapes */
+	{"abc\\.def", FALSE, "abc.def"},
+	{"abcd\\.?de", FALSE, "abcd"},
+	{"\\d+abcd\\w", FALSE, "abcd"},
+	{"ab\\x{41}cdef", FALSE, "cdef"},
+	{"ab\\x41cdef", FALSE, "cdef"},
+	{"a\\|b", FALSE, "a|b"},
+	{"\\Qa.b*c\\E", FALSE, "a.b*c"},
+	{"x\\Qa|b\\E", FALSE, "xa|b"},
+	{"\\Qabcd\\E?", FALSE, "abc"},
+	/* Options */
+	{"(?x)abc def", FALSE, NULL},
+	{"abcd(?x: d e f)", FALSE, NULL},
+	{"(?i)abcd", TRUE, "abcd"},
+	/* Multibyte characters and caseless matching */
+	{"привет?", FALSE, "приве"},
+	{"kelvin", TRUE, "elvin"},
+	{"skate", TRUE, "ate"},
+	{"приветabc", TRUE, "abc"},
+	{"привет", TRUE, NULL},
+};
+
+static const gchar re_map_data[] =
+		"/hello?/ one\n"
+		"/(bar|baz)quux/ two\n"
+		"/\\Qa.b*c\\E/ three\n"
+		"/kelvin/i four\n"
+		"/привет/iu five\n"
+		"/[[:alpha:]]xyz/ six\n"
+		"/abc{x}/ seven\n"
+		"/^\\d+abcd/ eight\n"
+		"/(?i)other/ nine\n"
+		"/a|b/ ten\n";
+
+static const gchar *re_map_inputs[] = {
+	"hell",
+	"hello",
+	"barquux",
+	"a.b*c",
+	"a.bbbc",
+	"KELVIN",
+	"\xe2\x84\xaa" "elvin",
+	"ПРИВЕТ",
+	"1xyz",
+	"abc{x}",
+	"12abcd",
+	"OTHER",
+	"nothing here",
+	"hellbarquux 1xyz",
+	NULL
+};
+
+static struct rspamd_regexp_map *
+read_re_map (struct rspamd_map *map)
+{
+	struct map_cb_data cbdata;
+	gchar *chunk;
+
+	memset (&cbdata, 0, sizeof (cbdata));
+	cbdata.map = map;
+	chunk = g_strdup (re_map_data);
+	rspamd_regexp_list_read_multiple (chunk, strlen (chunk), &cbdata, TRUE);
+	g_free (chunk);
+	g_assert (cbdata.cur_data != NULL);
+
+	return cbdata.cur_data;
+}
+
+void
+rspamd_re_map_test_func (void)
+{
+	struct rspamd_map map;
+	struct rspamd_regexp_map *plain, *filtered;
+	GPtrArray *r1, *r2;
+	gchar *lit;
+	gsize litlen = 0, len;
+	guint i, j;
+
+	for (i = 0; i < G_N_ELEMENTS (literal_cases); i ++) {
+		lit = rspamd_re_map_literal (literal_cases[i].pattern,
+				literal_cases[i].caseless, &litlen);
+
+		if (literal_cases[i].literal == NULL) {
+			g_assert (lit == NULL);
+		}
+		else {
+			g_assert (lit != NULL);
+			g_assert_cmpuint (litlen, ==, strlen (literal_cases[i].literal));
+			g_assert (memcmp (lit, literal_cases[i].literal, litlen) == 0);
+			g_free (lit);
+		}
+	}
+
+	/* Results must not depend on the prefilter */
+	memset (&map, 0, sizeof (map));
+	rspamd_strlcpy (map.tag, "test", sizeof (map.tag));
+	map.name = (gchar *)"re_map_test";
+	plain = read_re_map (&map);
+	filtered = read_re_map (&map);
+	rspamd_re_map_build_prefilter (filtered);
+
+	for (i = 0; re_map_inputs[i] != NULL; i ++) {
+		len = strlen (re_map_inputs[i]);
+		g_assert_cmpstr (
+				rspamd_match_regexp_map_single (plain, re_map_inputs[i], len),
+				==,
+				rspamd_match_regexp_map_single (filtered, re_map_inputs[i], len));
+
+		r1 = rspamd_match_regexp_map_all (plain, re_map_inputs[i], len);
+		r2 = rspamd_match_regexp_map_all (filtered, re_map_inputs[i], len);
+
+		if (r1 == NULL) {
+			g_assert (r2 == NULL);
+		}
+		else {
+			g_assert (r2 != NULL);
+			g_assert_cmpuint (r1->len, ==, r2->len);
+
+			for (j = 0; j < r1->len; j ++) {
+				g_assert_cmpstr (g_ptr_array_index (r1, j), ==,
+						g_ptr_array_index (r2, j));
+			}
+
+			g_ptr_array_free (r1, TRUE);
+			g_ptr_array_free (r2, TRUE);
+		}
+	}
+
+	rspamd_regexp_map_destroy (plain);
+	rspamd_regexp_map_destroy (filtered);
+}
@@ -180,6 +180,55 @@ static const guint64 expected_fasthash[RSPAMD_SHINGLE_SIZE] = {
 	0x125c12fdba584aed, 0x1c826397afe58763, 0x8bdbe2d43f3eda96, 0x954cda70edf6591f,
 };
 
+static void
+test_bands (guint band_size)
+{
+	struct rspamd_shingle a, b;
+	guint i, j, nbands, matched;
+
+	ottery_rand_bytes (&a, sizeof (a));
+	memcpy (&b, &a, sizeof (b));
+	nbands = rspamd_shingles_bands_count (band_size);
+
+	for (i = 0; i < nbands; i ++) {
+		g_assert (rspamd_shingles_band_key (&a, i, band_size) ==
+				rspamd_shingles_band_key (&b, i, band_size));
+	}
+
+	/* Change all even shingles: only bands of size 1 can survive */
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i += 2) {
+		b.hashes[i] ++;
+	}
+
+	for (i = 0; i < nbands; i ++) {
+		g_assert (rspamd_shingles_band_key (&a, i, band_size) !=
+				rspamd_shingles_band_key (&b, i, band_size) ||
+				band_size == 1);
+	}
+
+	/* Any set with more than half shingles common must share a band of 2 */
+	if (band_size == 2) {
+		for (j = 0; j < 100; j ++) {
+			memcpy (&b, &a, sizeof (b));
+
+			for (i = 0; i < RSPAMD_SHINGLE_SIZE / 2 - 1; i ++) {
+				b.hashes[ottery_rand_range (RSPAMD_SHINGLE_SIZE - 1)] ++;
+			}
+
+			matched = 0;
+
+			for (i = 0; i < nbands; i ++) {
+				if (rspamd_shingles_band_key (&a, i, band_size) ==
+						rspamd_shingles_band_key (&b, i, band_size)) {
+					matched ++;
+				}
+			}
+
+			g_assert (matched > 0);
+		}
+	}
+}
+
 void
 rspamd_shingles_test_func (void)
 {
@@ -241,4 +290,9 @@ rspamd_shingles_test_func (void)
 		test_case (50000, 5, 0.02, alg);
 		test_case (50000, 16, 0.02, alg);
 	}
+
+	test_bands (1);
+	test_bands (2);
+	test_bands (3);
+	test_bands (4);
 }
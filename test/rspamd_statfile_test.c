@@ -2,47 +2,192 @@
 #include "rspamd.h"
 #include "tests.h"
 #include "ottery.h"
+#include "libstat/backends/backends.h"
 
 #define TEST_FILENAME "/tmp/rspamd_test.stat"
 #define HASHES_NUM 256
+/* Big enough for HASHES_NUM tokens in chains of version 1 */
+#define V1_BLOCKS 4096
+/* 59 buckets of version 2 */
+#define SMALL_SIZE 4096
 
-void 
+/* Layout of version 1 statfiles */
+struct v1_header {
+	u_char magic[3];
+	u_char version[2];
+	u_char padding[3];
+	guint64 create_time;
+	guint64 revision;
+	guint64 rev_time;
+	guint64 used_blocks;
+	guint64 total_blocks;
+	guint64 tokenizer_conf_len;
+	u_char unused[231];
+};
+
+struct v1_section {
+	guint64 code;
+	guint64 length;
+};
+
+struct v1_block {
+	guint32 hash1;
+	guint32 hash2;
+	double value;
+};
+
+static void
+create_v1 (const gchar *filename, guint64 nblocks)
+{
+	struct v1_header header;
+	struct v1_section section;
+	struct v1_block block;
+	FILE *f;
+	guint64 i;
+
+	memset (&header, 0, sizeof (header));
+	memcpy (header.magic, "rsd", sizeof (header.magic));
+	header.version[0] = '1';
+	header.version[1] = '2';
+	header.create_time = time (NULL);
+	header.total_blocks = nblocks;
+	section.code = 1;
+	section.length = nblocks;
+	memset (&block, 0, sizeof (block));
+
+	f = fopen (filename, "w");
+	g_assert (f != NULL);
+	g_assert (fwrite (&header, sizeof (header), 1, f) == 1);
+	g_assert (fwrite (&section, sizeof (section), 1, f) == 1);
+
+	for (i = 0; i < nblocks; i ++) {
+		g_assert (fwrite (&block, sizeof (block), 1, f) == 1);
+	}
+
+	fclose (f);
+}
+
+static struct rspamd_mmaped_file_s *
+open_exact (rspamd_mempool_t *pool, const gchar *filename)
+{
+	struct rspamd_mmaped_file_s *mf;
+	struct stat st;
+
+	g_assert (stat (filename, &st) != -1);
+	mf = rspamd_mmaped_file_open (pool, filename, st.st_size, NULL);
+	g_assert (mf != NULL);
+
+	return mf;
+}
+
+static void
+check_tokens (rspamd_mempool_t *pool, const gchar *filename,
+		const guint64 *tokens, guint ntokens)
+{
+	struct rspamd_mmaped_file_s *mf;
+	guint i;
+
+	mf = open_exact (pool, filename);
+	g_assert_cmpuint (rspamd_mmaped_file_get_used (mf), ==, ntokens);
+
+	for (i = 0; i < ntokens; i ++) {
+		g_assert_cmpfloat (rspamd_mmaped_file_get_token (mf, tokens[i]), ==,
+				i + 1);
+	}
+
+	rspamd_mmaped_file_close_file (pool, mf);
+}
+
+void
 rspamd_statfile_test_func ()
 {
-	/*
-	 * XXX: broken, old, need to be rewritten
-	 */
-#if 0
-	statfile_pool_t *pool;
-	rspamd_mempool_t *p;
-	stat_file_t *st;
-	uint32_t random_hashes[HASHES_NUM], i, v;
-	time_t now = time (NULL);
-	
-	p = rspamd_mempool_new (rspamd_mempool_suggest_size ());
-	umask (S_IWGRP | S_IWOTH);
-	pool = statfile_pool_new (p, TRUE);
+	rspamd_mempool_t *pool;
+	struct rspamd_mmaped_file_s *mf;
+	guint64 tokens[HASHES_NUM], *stored, total, used, tok;
+	guint i, nstored, fails;
+	gchar *v1_name, *v2_name, *tmp_name;
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "statfile");
+	v1_name = g_strdup_printf ("%s.%d.v1", TEST_FILENAME, (gint)getpid ());
+	v2_name = g_strdup_printf ("%s.%d.v2", TEST_FILENAME, (gint)getpid ());
+
+	/* Fill version 1 file, zero hash1 means free block there */
+	create_v1 (v1_name, V1_BLOCKS);
+	mf = open_exact (pool, v1_name);
 
 	for (i = 0; i < HASHES_NUM; i ++) {
-		random_hashes[i] = ottery_rand_uint32 ();
+		tokens[i] = ottery_rand_uint64 () | 1;
+		rspamd_mmaped_file_set_token (pool, mf, tokens[i], i + 1);
 	}
 
-	/* Create new file */
-	g_assert (rspamd_mmaped_file_create (pool, TEST_FILENAME, 65535) != -1);
-	g_assert ((st = rspamd_mmaped_file_open (pool, TEST_FILENAME, 65535, FALSE)) != NULL);
-	
-	/* Get and set random blocks */
-	rspamd_mmaped_file_lock_file (pool, st);
-	for (i = 0; i < HASHES_NUM; i ++) {
-		rspamd_mmaped_file_set_block (pool, st, random_hashes[i], random_hashes[i], now, 1.0);
+	rspamd_mmaped_file_close_file (pool, mf);
+	check_tokens (pool, v1_name, tokens, HASHES_NUM);
+
+	/* v1 -> v2 */
+	g_assert (rspamd_mmaped_file_convert (pool, v1_name, v2_name, 0) == 0);
+	check_tokens (pool, v2_name, tokens, HASHES_NUM);
+
+	/* In place conversion must keep the source intact */
+	g_assert (rspamd_mmaped_file_convert (pool, v2_name, v2_name, 0) == 0);
+	check_tokens (pool, v2_name, tokens, HASHES_NUM);
+	tmp_name = g_strconcat (v2_name, ".new", NULL);
+	g_assert (access (tmp_name, F_OK) == -1);
+	g_free (tmp_name);
+
+	/* Fill small file until it is full, stored tokens are never evicted */
+	create_v1 (v1_name, 1);
+	g_assert (rspamd_mmaped_file_convert (pool, v1_name, v2_name,
+			SMALL_SIZE) == 0);
+	mf = open_exact (pool, v2_name);
+	total = rspamd_mmaped_file_get_total (mf);
+	g_assert_cmpuint (total, >, 0);
+	stored = g_malloc (sizeof (*stored) * total);
+	nstored = 0;
+	fails = 0;
+
+	while (fails < 64) {
+		tok = ottery_rand_uint64 ();
+		used = rspamd_mmaped_file_get_used (mf);
+		rspamd_mmaped_file_set_token (pool, mf, tok, nstored + 1);
+
+		if (rspamd_mmaped_file_get_used (mf) > used) {
+			g_assert_cmpuint (nstored, <, total);
+			stored[nstored ++] = tok;
+		}
+		else {
+			g_assert_cmpfloat (rspamd_mmaped_file_get_token (mf, tok), ==, 0);
+			fails ++;
+		}
 	}
-	rspamd_mmaped_file_unlock_file (pool, st);
 
-	for (i = 0; i < HASHES_NUM; i ++) {
-		v = rspamd_mmaped_file_get_block (pool, st, random_hashes[i], random_hashes[i], now);
-		g_assert(v == 1.0);
+	/* Cuckoo displacement should get close to the full table */
+	g_assert_cmpuint (nstored, >=, total * 9 / 10);
+	g_assert_cmpuint (rspamd_mmaped_file_get_used (mf), ==, nstored);
+
+	for (i = 0; i < nstored; i ++) {
+		g_assert_cmpfloat (rspamd_mmaped_file_get_token (mf, stored[i]), ==,
+				i + 1);
 	}
 
-	rspamd_mmaped_file_destroy (pool);
-#endif
+	/* Unlearned token releases its slot */
+	rspamd_mmaped_file_set_token (pool, mf, stored[0], 0);
+	g_assert_cmpuint (rspamd_mmaped_file_get_used (mf), ==, nstored - 1);
+	g_assert_cmpfloat (rspamd_mmaped_file_get_token (mf, stored[0]), ==, 0);
+
+	/* Conversion that cannot keep all tokens fails and keeps the source */
+	g_assert (rspamd_mmaped_file_convert (pool, v2_name, v2_name,
+			SMALL_SIZE / 2) == -1);
+	tmp_name = g_strconcat (v2_name, ".new", NULL);
+	g_assert (access (tmp_name, F_OK) == -1);
+	g_free (tmp_name);
+	g_assert_cmpuint (rspamd_mmaped_file_get_total (mf), ==, total);
+	g_assert_cmpuint (rspamd_mmaped_file_get_used (mf), ==, nstored - 1);
+
+	rspamd_mmaped_file_close_file (pool, mf);
+	unlink (v1_name);
+	unlink (v2_name);
+	g_free (stored);
+	g_free (v1_name);
+	g_free (v2_name);
+	rspamd_mempool_delete (pool);
 }
@@ -52,10 +52,12 @@ main (int argc, char **argv)
 	g_test_add_func ("/rspamd/lua", rspamd_lua_test_func);
 	g_test_add_func ("/rspamd/cryptobox", rspamd_cryptobox_test_func);
 	g_test_add_func ("/rspamd/heap", rspamd_heap_test_func);
+	g_test_add_func ("/rspamd/re_map", rspamd_re_map_test_func);
+	g_test_add_func ("/rspamd/map_parse", rspamd_map_parse_test_func);
+	g_test_add_func ("/rspamd/statfile", rspamd_statfile_test_func);
 
 #if 0
 	g_test_add_func ("/rspamd/url", rspamd_url_test_func);
-	g_test_add_func ("/rspamd/statfile", rspamd_statfile_test_func);
 	g_test_add_func ("/rspamd/aio", rspamd_async_test_func);
 #endif
 	g_test_run ();
@@ -41,6 +41,13 @@ rspamd_upstream_test_method (struct upstream_list *ls,
 	}
 }
 
+static void
+rspamd_upstream_test_latency (struct upstream *up, guint idx, void *ud)
+{
+	rspamd_upstream_ok_latency (up,
+			strcmp (rspamd_upstream_name (up), "kernel.org") == 0 ? 1.0 : 0.01);
+}
+
 static void
 rspamd_upstream_timeout_handler (int fd, short what, void *arg)
 {
@@ -131,6 +138,15 @@ rspamd_upstream_test_func (void)
 	rspamd_upstream_test_method (ls, RSPAMD_UPSTREAM_ROUND_ROBIN, "google.com");
 	rspamd_upstream_test_method (ls, RSPAMD_UPSTREAM_ROUND_ROBIN, "microsoft.com");
 
+	/* Test latency rotation: slow upstream is never compared favourably */
+	rspamd_upstreams_foreach (ls, rspamd_upstream_test_latency, NULL);
+	for (i = 0; i < 1000; i ++) {
+		up = rspamd_upstream_get (ls, RSPAMD_UPSTREAM_LATENCY, NULL, 0);
+		g_assert (up != NULL);
+		g_assert (strcmp (rspamd_upstream_name (up), "kernel.org") != 0);
+		rspamd_upstream_ok_latency (up, 0.01);
+	}
+
 	/* Test stable hashing */
 	nls = rspamd_upstreams_create (cfg->ups_ctx);
 	g_assert (rspamd_upstreams_parse_line (nls, test_upstream_list, 443, NULL));
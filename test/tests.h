@@ -41,4 +41,8 @@ void rspamd_cryptobox_test_func (void);
 
 void rspamd_heap_test_func (void);
 
+void rspamd_re_map_test_func (void);
+
+void rspamd_map_parse_test_func (void);
+
 #endif